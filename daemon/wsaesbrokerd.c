@@ -0,0 +1,551 @@
+/*
+ * wsaesbrokerd -- broker daemon for the wsaes accelerator
+ *
+ * Owns the devices so that many processes can share them: the engine of each
+ * process, with WSAES_BACKEND=broker (see src/wsaes_broker.c), hands its transfers
+ * to the daemon over shared memory instead of using the devices itself; the
+ * protocol is described in include/wsaes_broker.h.
+ *
+ * The main thread takes the transfers waiting on the submission rings of all the
+ * clients and queues each on its device. Every device has a thread that runs all
+ * that is queued on it as one aes256batch_sess() call, which loads each distinct
+ * key once and, on devices with rings, puts the whole batch through them, then
+ * marks the transfers done, waking the clients asleep on them; meanwhile the main
+ * thread gathers the next batch, so the devices go from one batch to the next
+ * without waiting. With nothing left to take the main thread announces that it
+ * sleeps, looks at the rings once more and waits on the clients' doorbells.
+ *
+ * The devices are opened through the device API, so WSAES_BACKEND picks them as for
+ * any other program (kernel or emu).
+ *
+ * usage: wsaesbrokerd [-s socket]
+ *   -s  the socket to listen on, default WSAES_BROKER or WSAES_BROKER_PATH_DEFAULT
+ *
+ * Whoever can connect to the socket can use the devices; the socket is created
+ * with the daemon's umask. The daemon creates WSAES_BROKER_DIR_DEFAULT for the
+ * default socket, which takes root; a daemon run as another user listens on a
+ * socket of its own choosing, e.g. under $XDG_RUNTIME_DIR, and only that user's
+ * processes connect to it. SIGINT or SIGTERM stops the daemon, which then prints
+ * how many transfers it ran in how many batches.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "wsaes_api.h"
+#include "wsaeskern.h"
+#include "wsaes_broker.h"
+
+#define MAXCLIENTS 256
+#define MAXBATCH 512 // transfers queued on a device at most
+
+/* A connected process and its region */
+typedef struct {
+    int sock;
+    int doorbell;
+    int dead;
+    uint8_t *map;
+    struct wsaes_broker_hdr *hdr;
+    uint32_t *sq;
+    struct wsaes_broker_slot *slots;
+    uint8_t *data;
+    uint32_t inflight[WSAES_MAXDEVS];        // transfers taken and not done yet, per device
+    uint8_t chain[WSAES_MAXDEVS][AESIVSIZE]; // where each device's transfers go on from, see WSAES_SLOT_CHAIN
+} client_t;
+
+/* A transfer taken, with copies of what the client can't be trusted to leave alone */
+typedef struct {
+    client_t *c;
+    struct wsaes_broker_slot *slot;
+    int mode;
+    uint8_t key[AESKEYSIZE];
+    uint8_t iv[AESIVSIZE];
+    uint8_t next[AESIVSIZE]; // the device's chain after a decryption or CTR transfer
+    wsaes_iov_t iov;
+} xfer_t;
+
+/* A device, the transfers queued on it and the batch it runs */
+typedef struct {
+    int num;
+    wsaes_session_t *sess;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    xfer_t *queued;
+    int nqueued;
+    xfer_t *batch;
+    wsaes_job_t jobs[MAXBATCH];
+} bdev_t;
+
+static struct wsaes_broker_hello hello;
+static bdev_t devs[WSAES_MAXDEVS];
+static client_t *clients[MAXCLIENTS];
+static int nclients = 0;
+static uint32_t rr = 0; // client the next gathering starts with
+static uint64_t ntransfers = 0, nbatches = 0, nconnects = 0;
+static int kick = -1;   // eventfd a device thread wakes the main thread with when it sleeps
+static int idle = 0;    // the main thread sleeps
+static volatile sig_atomic_t stop = 0;
+
+static void onsignal(int sig)
+{
+    stop = 1;
+}
+
+/* The counter n blocks on, as the device's counter mode goes: the whole 16 bytes, big-endian */
+static void ctradd(uint8_t *ctr, uint32_t n)
+{
+    for (int j=AESIVSIZE-1; j>=0 && 0 != n; j--)
+    {
+        n += ctr[j];
+        ctr[j] = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+/* Hand a slot back to its client, waking it if it sleeps on the slot */
+static void finish(struct wsaes_broker_slot *slot, int32_t status)
+{
+    slot->status = status;
+    if (WSAES_SLOT_WAITING == __atomic_exchange_n(&slot->state, WSAES_SLOT_DONE, __ATOMIC_ACQ_REL))
+        syscall(SYS_futex, &slot->state, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/*
+ * A device's thread: run everything queued on the device as one batch, then hand
+ * the transfers back in the order they were queued, so each client's chain on the
+ * device ends up at its last transfer
+ */
+static void *devmain(void *arg)
+{
+    bdev_t *d = (bdev_t*)arg;
+    xfer_t *t;
+    int n;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&d->lock);
+        while (0 == d->nqueued)
+            pthread_cond_wait(&d->cond, &d->lock);
+        t = d->batch;
+        d->batch = d->queued;
+        d->queued = t;
+        n = d->nqueued;
+        d->nqueued = 0;
+        pthread_mutex_unlock(&d->lock);
+
+        for (int i=0; i<n; i++)
+        {
+            xfer_t *x = &d->batch[i];
+            d->jobs[i] = (wsaes_job_t){ x->mode, x->key, x->iv, &x->iov, 1, 0 };
+        }
+        aes256batch_sess(d->sess, d->jobs, n);
+        for (int i=0; i<n; i++)
+        {
+            xfer_t *x = &d->batch[i];
+            if (0 == d->jobs[i].status)
+            {
+                if (ENCRYPT == x->mode)
+                    memcpy(x->c->chain[d->num], x->iov.out + x->iov.len - AESBLKSIZE, AESBLKSIZE);
+                else
+                    memcpy(x->c->chain[d->num], x->next, AESIVSIZE);
+            }
+            finish(x->slot, d->jobs[i].status);
+            __atomic_sub_fetch(&x->c->inflight[d->num], 1, __ATOMIC_SEQ_CST);
+        }
+        __atomic_add_fetch(&ntransfers, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&nbatches, 1, __ATOMIC_RELAXED);
+        // a transfer held back for its chain may go now
+        if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST))
+            eventfd_write(kick, 1);
+    }
+    return NULL;
+}
+
+
+/*
+ * Take the transfers waiting on the clients' rings and queue them on their devices,
+ * in ring order. A transfer that carries on a device's chain stays on the ring
+ * until the client's transfers before it on the device are done, since it needs
+ * their result
+ */
+static int gather(void)
+{
+    uint32_t mask = hello.nslots - 1;
+    int n = 0;
+
+    for (int k=0; k<nclients; k++)
+    {
+        client_t *c = clients[(rr + k) % nclients];
+        uint32_t head = c->hdr->sq_head, tail = __atomic_load_n(&c->hdr->sq_tail, __ATOMIC_ACQUIRE);
+
+        if (c->dead)
+            continue;
+        if (tail - head > hello.nslots)
+        {
+            fprintf(stderr, "ERROR: client submission ring corrupt, dropping the client\n");
+            c->dead = 1;
+            continue;
+        }
+        for (; head != tail; head++)
+        {
+            uint32_t s = __atomic_load_n(&c->sq[head & mask], __ATOMIC_RELAXED), dev, len, flags;
+            struct wsaes_broker_slot *slot;
+            bdev_t *d;
+            xfer_t *x;
+            int mode;
+
+            if (s >= hello.nslots)
+                continue;
+            slot = &c->slots[s];
+            dev = slot->dev;
+            mode = (int)slot->mode;
+            len = slot->len;
+            flags = slot->flags;
+            if (dev >= hello.ndevs || 0 == len || 0 != len % AESBLKSIZE || len > hello.maxxfer ||
+                !(ENCRYPT == mode || DECRYPT == mode || (CTR == mode && (hello.caps & WSAES_CAP_CTR))))
+            {
+                finish(slot, EINVAL);
+                continue;
+            }
+            if ((flags & WSAES_SLOT_CHAIN) && 0 != __atomic_load_n(&c->inflight[dev], __ATOMIC_SEQ_CST))
+                break;
+
+            d = &devs[dev];
+            pthread_mutex_lock(&d->lock);
+            if (MAXBATCH == d->nqueued)
+            {
+                pthread_mutex_unlock(&d->lock);
+                break;
+            }
+            x = &d->queued[d->nqueued++];
+            x->c = c;
+            x->slot = slot;
+            x->mode = mode;
+            memcpy(x->key, slot->key, AESKEYSIZE);
+            memcpy(x->iv, (flags & WSAES_SLOT_CHAIN) ? c->chain[dev] : slot->iv, AESIVSIZE);
+            x->iov.in = x->iov.out = c->data + (size_t)s * hello.maxxfer;
+            x->iov.len = len;
+
+            // a decryption goes on from its last ciphertext block, which it overwrites in place
+            if (DECRYPT == mode)
+                memcpy(x->next, x->iov.in + len - AESBLKSIZE, AESBLKSIZE);
+            else if (CTR == mode)
+            {
+                memcpy(x->next, x->iv, AESIVSIZE);
+                ctradd(x->next, len / AESBLKSIZE);
+            }
+            __atomic_add_fetch(&c->inflight[dev], 1, __ATOMIC_SEQ_CST);
+            if (1 == d->nqueued)
+                pthread_cond_signal(&d->cond);
+            pthread_mutex_unlock(&d->lock);
+            n++;
+        }
+        __atomic_store_n(&c->hdr->sq_head, head, __ATOMIC_RELEASE);
+    }
+    rr++;
+    return n;
+}
+
+
+/*
+ * Set up a region and a doorbell for a new client and send them to it
+ */
+static void acceptclient(int lsock, int epfd)
+{
+    union { struct cmsghdr h; char buf[CMSG_SPACE(2 * sizeof(int))]; } ctl;
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                          .msg_controllen = sizeof(ctl.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+    int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC), memfd = -1, fds[2];
+    client_t *c = NULL;
+
+    if (sock < 0)
+    {
+        if (EINTR != errno && EAGAIN != errno)
+            perror("ERROR: accept failed");
+        return;
+    }
+    if (MAXCLIENTS == nclients || NULL == (c = calloc(1, sizeof(*c))))
+    {
+        fprintf(stderr, "ERROR: no room for another client\n");
+        goto fail;
+    }
+    c->sock = sock;
+    c->doorbell = -1;
+    c->map = MAP_FAILED;
+    if ((memfd = memfd_create("wsaesbroker", MFD_CLOEXEC)) < 0 || ftruncate(memfd, hello.map_size) < 0 ||
+        MAP_FAILED == (c->map = mmap(NULL, hello.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) ||
+        (c->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        perror("ERROR: could not set up a client's shared memory");
+        goto fail;
+    }
+    c->hdr = (struct wsaes_broker_hdr*)c->map;
+    c->sq = (uint32_t*)(c->map + hello.sq_off);
+    c->slots = (struct wsaes_broker_slot*)(c->map + hello.slot_off);
+    c->data = c->map + hello.data_off;
+
+    fds[0] = memfd;
+    fds[1] = c->doorbell;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello))
+    {
+        perror("ERROR: could not send a client its shared memory");
+        goto fail;
+    }
+    close(memfd);
+
+    ev.data.fd = sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = c->doorbell;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->doorbell, &ev);
+    clients[nclients++] = c;
+    nconnects++;
+    return;
+
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    if (NULL != c && MAP_FAILED != c->map)
+        munmap(c->map, hello.map_size);
+    if (NULL != c && c->doorbell >= 0)
+        close(c->doorbell);
+    free(c);
+    close(sock);
+}
+
+/* Forget the clients that hung up, once the devices are done with their transfers */
+static void dropclients(void)
+{
+    for (int i=0; i<nclients; i++)
+    {
+        client_t *c = clients[i];
+        uint32_t inflight = 0;
+        if (!c->dead)
+            continue;
+        for (uint32_t d=0; d<hello.ndevs; d++)
+            inflight += __atomic_load_n(&c->inflight[d], __ATOMIC_ACQUIRE);
+        if (0 != inflight)
+            continue;
+        close(c->sock);
+        close(c->doorbell);
+        munmap(c->map, hello.map_size);
+        free(c);
+        clients[i--] = clients[--nclients];
+    }
+}
+
+/* Tell the clients and the device threads whether the main thread sleeps */
+static void setsleeping(uint32_t sleeping)
+{
+    __atomic_store_n(&idle, (int)sleeping, __ATOMIC_SEQ_CST);
+    for (int i=0; i<nclients; i++)
+        __atomic_store_n(&clients[i]->hdr->sleeping, sleeping, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Open the devices and fill in what the clients are told about them
+ */
+static int opendevs(void)
+{
+    const char *backend = getenv("WSAES_BACKEND");
+    uint32_t caps = WSAES_CAP_CTR, nslots;
+    int ndevs;
+
+    if (NULL != backend && 0 == strcmp(backend, "broker"))
+    {
+        fprintf(stderr, "ERROR: the broker opens the devices itself, set WSAES_BACKEND to kernel or emu\n");
+        return -1;
+    }
+    if (aes256init() != 0 || (ndevs = aes256devcount()) <= 0)
+        return -1;
+    for (int d=0; d<ndevs; d++)
+    {
+        if (0 != aes256open_dev(&devs[d].sess, d))
+        {
+            fprintf(stderr, "ERROR: could not open device %d\n", d);
+            return -1;
+        }
+        caps &= aes256caps_sess(devs[d].sess);
+        devs[d].num = d;
+        pthread_mutex_init(&devs[d].lock, NULL);
+        pthread_cond_init(&devs[d].cond, NULL);
+        devs[d].queued = calloc(MAXBATCH, sizeof(xfer_t));
+        devs[d].batch = calloc(MAXBATCH, sizeof(xfer_t));
+        if (NULL == devs[d].queued || NULL == devs[d].batch ||
+            0 != pthread_create(&devs[d].thread, NULL, devmain, &devs[d]))
+        {
+            fprintf(stderr, "ERROR: could not start the thread of device %d\n", d);
+            return -1;
+        }
+    }
+
+    // enough slots for every device's queue, so a client never runs out
+    for (nslots = 1; nslots < (uint32_t)ndevs * WSAES_BROKER_QDEPTH; nslots <<= 1)
+        ;
+    hello.version = WSAES_BROKER_VERSION;
+    hello.ndevs = (uint32_t)ndevs;
+    hello.caps = WSAES_CAP_BULK | WSAES_CAP_QUEUE | caps;
+    hello.maxxfer = WSAES_BROKER_XFER;
+    hello.nslots = nslots;
+    hello.sq_off = sizeof(struct wsaes_broker_hdr);
+    hello.slot_off = (hello.sq_off + nslots * sizeof(uint32_t) + 63) & ~63u;
+    hello.data_off = (hello.slot_off + nslots * sizeof(struct wsaes_broker_slot) + 4095) & ~4095u;
+    hello.map_size = hello.data_off + (uint64_t)nslots * hello.maxxfer;
+    return 0;
+}
+
+/* Listen on path, taking it over from a daemon that is gone but not from one still running */
+static int listenon(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ERROR: socket path %s too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (0 == strcmp(path, WSAES_BROKER_PATH_DEFAULT) && mkdir(WSAES_BROKER_DIR_DEFAULT, 0755) < 0 && EEXIST != errno)
+    {
+        perror("ERROR: could not create " WSAES_BROKER_DIR_DEFAULT);
+        return -1;
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("ERROR: could not create the socket");
+        return -1;
+    }
+    if (0 == connect(sock, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "ERROR: a broker is already listening on %s\n", path);
+        close(sock);
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0)
+    {
+        perror("ERROR: could not listen on the socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = getenv("WSAES_BROKER");
+    struct epoll_event ev = { .events = EPOLLIN }, evs[64];
+    struct sigaction sa = { .sa_handler = onsignal };
+    sigset_t block, waitmask;
+    int opt, lsock, epfd, timeout, k;
+
+    if (NULL == path || '\0' == *path)
+        path = WSAES_BROKER_PATH_DEFAULT;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        if ('s' == opt)
+            path = optarg;
+        else
+        {
+            fprintf(stderr, "usage: %s [-s socket]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // the signals only get through while the daemon waits, so none is missed between a check and the wait
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &waitmask);
+    sigdelset(&waitmask, SIGINT);
+    sigdelset(&waitmask, SIGTERM);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if ((kick = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 || (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("ERROR: could not create the daemon's eventfd or epoll instance");
+        return 1;
+    }
+    if (0 != opendevs() || (lsock = listenon(path)) < 0)
+        return 1;
+    ev.data.fd = lsock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev);
+    ev.data.fd = kick;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, kick, &ev);
+
+    while (!stop)
+    {
+        timeout = 0;
+        if (0 == gather())
+        {
+            // announce the sleep, then look once more for transfers submitted, or let go by a device, meanwhile
+            setsleeping(1);
+            if (0 == gather())
+                timeout = -1;
+            else
+                setsleeping(0);
+        }
+
+        k = epoll_pwait(epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout, &waitmask);
+        if (timeout < 0)
+            setsleeping(0);
+        for (int i=0; i<k; i++)
+        {
+            eventfd_t v;
+            if (evs[i].data.fd == lsock)
+            {
+                acceptclient(lsock, epfd);
+                continue;
+            }
+            if (evs[i].data.fd == kick)
+            {
+                eventfd_read(kick, &v);
+                continue;
+            }
+            for (int j=0; j<nclients; j++)
+            {
+                if (evs[i].data.fd == clients[j]->doorbell)
+                    eventfd_read(clients[j]->doorbell, &v);
+                else if (evs[i].data.fd == clients[j]->sock)
+                    clients[j]->dead = 1; // clients never send anything, so this is the hang-up
+            }
+        }
+        dropclients();
+    }
+
+    // the device threads may still be in a batch, so the devices are left to close on exit
+    ntransfers = __atomic_load_n(&ntransfers, __ATOMIC_RELAXED);
+    nbatches = __atomic_load_n(&nbatches, __ATOMIC_RELAXED);
+    printf("wsaesbrokerd: %llu transfers in %llu batches (%.1f per batch) for %llu clients\n",
+           (unsigned long long)ntransfers, (unsigned long long)nbatches,
+           nbatches ? (double)ntransfers / nbatches : 0.0, (unsigned long long)nconnects);
+    unlink(path);
+    return 0;
+}
@@ -5,15 +5,155 @@
 
 /* AES-256 -- returns a status value */
 
-#define AESMAXDATASIZE 1048576 //1MB of data
+#define AESMAXDATASIZE 1048576 //1MB of data, the ring data region; longer inputs are streamed through in chunks
 #define AESBLKSIZE 16
 #define AESIVSIZE 16
 #define AESKEYSIZE 32
+#define AESXTSKEYSIZE 64 // AES-256-XTS: the data key, then the tweak key
+#define WSAES_PIPEDEPTH_DEFAULT 2 // write()/read() transfers kept in flight, see aes256setdepth_sess()
+#define WSAES_MAXDEVS 16 // device instances looked for, /dev/wsaeschar0 to /dev/wsaeschar15
 
-typedef enum { RESET = 0, ENCRYPT, DECRYPT, SET_IV, SET_KEY } ciphermode_t;
+// CTR needs WSAES_CAP_CTR, the last three WSAES_CAP_XTS (see aes256xts_sess())
+typedef enum { RESET = 0, ENCRYPT, DECRYPT, SET_IV, SET_KEY, CTR, SET_TWEAKKEY, XTS_ENCRYPT, XTS_DECRYPT } ciphermode_t;
 
 int32_t aes256init(void);
 int32_t aes256setkey(uint8_t *keyp);
-int32_t aes256setiv(uint8_t *keyp); 
+int32_t aes256setiv(uint8_t *keyp);
 int32_t aes256reset(void);
 int32_t aes256(int mode,uint8_t *inp, uint32_t inlen,uint8_t *outp,uint32_t *outlenp);
+
+/*
+ * Device sessions -- the calls above open and close the device every time they
+ * are invoked. A session opens the device once and reuses the file descriptor for
+ * key, IV, mode and data transfers until it is closed.
+ */
+typedef struct wsaes_session wsaes_session_t;
+
+/*
+ * Boards with several accelerators, or bitstreams with several AES cores, have
+ * one device node per core, /dev/wsaeschar0 upwards; older setups have a single
+ * /dev/wsaeschar, which is device 0. aes256open() opens device 0
+ */
+int32_t aes256devcount(void);
+int32_t aes256open(wsaes_session_t **sessp);
+int32_t aes256open_dev(wsaes_session_t **sessp, int dev);
+int32_t aes256close(wsaes_session_t *sess);
+int32_t aes256setkey_sess(wsaes_session_t *sess, uint8_t *keyp);
+int32_t aes256setiv_sess(wsaes_session_t *sess, uint8_t *ivp);
+int32_t aes256reset_sess(wsaes_session_t *sess);
+int32_t aes256_sess(wsaes_session_t *sess, int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *outlenp);
+int32_t aes256stream_sess(wsaes_session_t *sess, int mode, const uint8_t *inp, size_t inlen, uint8_t *outp); // any length
+
+/*
+ * Threads. The key, IV and mode live on the device, shared by all its sessions, so
+ * every call above and below holds the device for as long as it runs; threads 
+ * may share a session or open their own, and those on different devices never 
+ * wait for each other. A sequence such as set key, set IV, reset, stream is only 
+ * safe from other threads' calls on the device between aes256lock_sess() and 
+ * aes256unlock_sess() (the lock is recursive), or as a single aes256batch_sess()
+ * job, which carries mode, key and IV together. The one-shot calls above open a 
+ * session of their own, so only each call on its own is atomic
+ */
+void aes256lock_sess(wsaes_session_t *sess);
+void aes256unlock_sess(wsaes_session_t *sess);
+
+/* One buffer of a vectored call; out may equal in */
+typedef struct {
+    const uint8_t *in;
+    uint8_t *out;
+    size_t len;
+} wsaes_iov_t;
+
+/* The buffers in order, as one CBC stream; all but a single buffer must be whole blocks */
+int32_t aes256streamv_sess(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov);
+
+/*
+ * Shown the plaintext of a call chunk by chunk, in stream order, while it is still
+ * in cache: the input when encrypting, as each chunk is handed to the device, and
+ * the output when decrypting, as each chunk comes back. E.g. to compute a MAC in
+ * the same pass over the data
+ */
+typedef struct {
+    void (*fn)(void *arg, const uint8_t *data, size_t len);
+    void *arg;
+} wsaes_tap_t;
+
+int32_t aes256streamtap_sess(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov, const wsaes_tap_t *tap);
+/*
+ * Batches of independent jobs, e.g. the records of many flows, each with its own
+ * key and IV. The buffers of a job run as one stream, as in aes256streamv_sess(),
+ * and must be whole blocks. Jobs that share a key run together after a single key
+ * load, and on a device with rings all of them go through the rings in one pass,
+ * every job's IV loaded by its first entry. Jobs without a key run under the key
+ * already selected on the device, before any others. Jobs may run in any order;
+ * each reports its own status. On a device with key slots the batch loads its keys
+ * into a slot of its own, the device's last, and then selects the slot that was
+ * last selected through the session again, so the keys kept in the slots stay as
+ * they were; without slots, a batch with keys replaces the loaded key
+ */
+typedef struct {
+    int mode;               // ENCRYPT, DECRYPT or CTR
+    const uint8_t *key;     // AESKEYSIZE bytes, or NULL for the loaded key
+    const uint8_t *iv;      // AESIVSIZE bytes
+    const wsaes_iov_t *iov;
+    int niov;
+    int32_t status;         // set by the call: 0, or the job's error
+} wsaes_job_t;
+
+int32_t aes256_batch(wsaes_job_t *jobs, int njobs);
+int32_t aes256batch_sess(wsaes_session_t *sess, wsaes_job_t *jobs, int njobs); // 0, or the first failed job's status
+
+uint32_t aes256caps_sess(wsaes_session_t *sess); // WSAES_CAP_* flags (see wsaeskern.h), 0 on older bitstreams
+uint32_t aes256setdepth_sess(wsaes_session_t *sess, uint32_t depth); // transfers in flight, 1 = none ahead
+uint32_t aes256maxxfer_sess(wsaes_session_t *sess); // largest bulk transfer in bytes, 0 without WSAES_CAP_BULK
+uint32_t aes256setchunk_sess(wsaes_session_t *sess, uint32_t chunk); // largest transfer used, 0 = the device's
+
+/*
+ * Devices with key slots (WSAES_CAP_KEYSLOTS) keep several expanded keys, so going
+ * back to a key loaded earlier is one ioctl instead of a key upload. The slots 
+ * belong to the device, not the session, so callers sharing a device must agree 
+ * on who uses which slot. One slot is kept for batches (see aes256batch_sess()),
+ * so there is one fewer than the device has, and none on a device with only one
+ */
+uint32_t aes256keyslots_sess(wsaes_session_t *sess); // 0 without WSAES_CAP_KEYSLOTS
+int32_t aes256setkeyslot_sess(wsaes_session_t *sess, uint32_t slot, uint8_t *keyp); // load and select slot
+int32_t aes256usekeyslot_sess(wsaes_session_t *sess, uint32_t slot); // select a slot loaded earlier
+
+/*
+ * AES-256-XTS over a run of nsectors consecutive sectors of sectorsize bytes each
+ * (a multiple of the block size, at most aes256maxxfer_sess()), for block-device 
+ * encryption, in one device transaction. mode is ENCRYPT or DECRYPT. The tweak of
+ * a sector is its number as a 16-byte little-endian value, as with dm-crypt's 
+ * plain64 IVs; aes256xtstweak_sess() starts from any 16-byte tweak instead, which 
+ * also goes up by one per sector. The data key is set with aes256setkey_sess(),
+ * the tweak key with aes256settweakkey_sess()
+ */
+int32_t aes256settweakkey_sess(wsaes_session_t *sess, uint8_t *keyp);
+int32_t aes256xts_sess(wsaes_session_t *sess, int mode, uint64_t sector, uint32_t sectorsize,
+                       const uint8_t *inp, uint8_t *outp, size_t nsectors);
+int32_t aes256xtstweak_sess(wsaes_session_t *sess, int mode, const uint8_t *tweak, uint32_t sectorsize,
+                            const uint8_t *inp, uint8_t *outp, size_t nsectors);
+
+/* Number of device syscalls issued since load (or the last reset), by type */
+typedef struct {
+    uint64_t open;
+    uint64_t close;
+    uint64_t ioctl;
+    uint64_t write;
+    uint64_t read;
+} aes256syscalls_t;
+
+void aes256getsyscalls(aes256syscalls_t *cntp);
+void aes256resetsyscalls(void);
+
+/*
+ * Trace ring: while on, every stage of every request (engine cipher call, device
+ * lock, syscall, ring copy and wait) is timestamped into a lock-free ring, which
+ * aes256tracedump() writes out as Chrome trace events (JSON) for offline flame
+ * charts. The last WSAES_TRACE_ENTRIES records (default below) are kept.
+ * WSAES_TRACE=<file> in the environment traces the whole process into <file>.
+ * The same stages are USDT probes, see wsaes_trace.h
+ */
+#define WSAES_TRACE_ENTRIES_DEFAULT 65536
+int32_t aes256trace(int on);
+int32_t aes256tracedump(const char *path);
@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * Device backends for wsaes_api.c. The API always speaks the char-device
+ * protocol of wsaeskern.h (mode ioctls, then write()/read() of key, IV and data);
+ * a backend supplies the syscalls that protocol runs on.
+ *
+ * The backend is picked at run time from the WSAES_BACKEND environment variable:
+ *   kernel  -- /dev/wsaeschar, i.e. the real accelerator (default)
+ *   emu     -- an in-process software model of the device, see wsaes_emu.c
+ *   broker  -- the devices of the broker daemon, shared with other processes,
+ *              see wsaes_broker.c
+ */
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+    const char *name;
+    int (*access)(const char *path);
+    int (*open)(const char *path, int flags);
+    int (*close)(int fd);
+    int (*ioctl)(int fd, unsigned long req, unsigned long arg);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    void *(*mmap)(int fd, size_t len);  // shared mapping of the device's rings, MAP_FAILED on error
+    int (*munmap)(int fd, void *addr, size_t len);
+} wsaes_backend_t;
+
+extern const wsaes_backend_t wsaes_kernel_backend;
+extern const wsaes_backend_t wsaes_emu_backend;
+extern const wsaes_backend_t wsaes_broker_backend;
@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+ * Protocol between the broker daemon (daemon/wsaesbrokerd.c), which owns the
+ * devices, and the broker backend of the device API (src/wsaes_broker.c), which
+ * the engine of every client process talks to instead of /dev/wsaeschar.
+ *
+ * A client connects to the broker's UNIX socket and receives a wsaes_broker_hello,
+ * with two descriptors attached (SCM_RIGHTS): a shared memory region of its own and
+ * an eventfd, the doorbell. The region holds a header, a submission ring of slot
+ * numbers and nslots slots, each a descriptor and maxxfer bytes of data:
+ *
+ *   hdr | sq[nslots] | slot[nslots] | data[nslots * maxxfer]
+ *
+ * Every transfer is self-contained: the client fills a free slot with the mode, the
+ * key, the IV and the data, and adds its number to the submission ring, which has a
+ * single producer (the client) and a single consumer (the broker) and takes no lock.
+ * The broker processes the data in place, sets the slot's status and marks it done;
+ * the client sleeps on the slot's state word with a futex meanwhile. The broker
+ * only needs the doorbell when it sleeps itself, which it announces in the header.
+ *
+ * Since every transfer carries its key and IV, clients can't see or disturb each
+ * other's device state. The broker itself sees every key, so a client only takes a
+ * region from a broker running as root or as its own user (SO_PEERCRED), and the
+ * default socket lives in a directory only root can create files in.
+ */
+#include <stdint.h>
+
+#include "wsaes_api.h"
+
+#define WSAES_BROKER_DIR_DEFAULT "/run/wsaesbroker" // created by the daemon, owned by root
+#define WSAES_BROKER_PATH_DEFAULT WSAES_BROKER_DIR_DEFAULT "/wsaesbroker.sock" // WSAES_BROKER overrides
+#define WSAES_BROKER_VERSION 1
+#define WSAES_BROKER_XFER 65536 // data bytes of a slot
+#define WSAES_BROKER_QDEPTH 8   // transfers a client keeps queued per device
+
+/* Sent by the broker to every client that connects */
+struct wsaes_broker_hello {
+    uint32_t version;  // WSAES_BROKER_VERSION
+    uint32_t ndevs;    // devices the broker owns, device numbers 0 to ndevs-1
+    uint32_t caps;     // WSAES_CAP_* offered to the client: BULK, QUEUE, and CTR if every device has it
+    uint32_t maxxfer;  // data bytes of a slot
+    uint32_t nslots;   // slots and submission ring entries, a power of two
+    uint32_t sq_off;   // offsets into the region
+    uint32_t slot_off;
+    uint32_t data_off;
+    uint64_t map_size;
+};
+
+/* Slot states, the futex word the client sleeps on */
+#define WSAES_SLOT_QUEUED  0
+#define WSAES_SLOT_WAITING 1 // queued, and the client is asleep on it
+#define WSAES_SLOT_DONE    2
+
+#define WSAES_SLOT_CHAIN 0x1 // carry on from the previous transfer of the device instead of loading iv
+
+/* A transfer */
+struct wsaes_broker_slot {
+    uint32_t state;
+    uint32_t dev;
+    uint32_t mode;     // ENCRYPT, DECRYPT or CTR
+    uint32_t flags;
+    uint32_t len;      // whole blocks, at most maxxfer
+    int32_t status;    // set by the broker: 0, or the transfer's error
+    uint8_t key[AESKEYSIZE];
+    uint8_t iv[AESIVSIZE];
+};
+
+/* Ring indices are free-running, and each sits on a cache line of its own */
+struct wsaes_broker_hdr {
+    uint32_t sq_head;  // written by the broker
+    uint8_t pad0[60];
+    uint32_t sq_tail;  // written by the client
+    uint8_t pad1[60];
+    uint32_t sleeping; // the broker waits on the doorbell, written by the broker
+    uint8_t pad2[60];
+};
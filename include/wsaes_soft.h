@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * Software AES-256, used by the engine for payloads too small to be worth a
+ * device round trip, and for requests that overflow a busy device. Uses the
+ * AES-NI instructions when the CPU has them, and OpenSSL's EVP ciphers otherwise.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#include "wsaes_api.h"
+
+#define AES256ROUNDS 14
+
+/*
+ * Expanded encryption and decryption key schedules. Without AES-NI they are held
+ * by OpenSSL cipher contexts, keyed once and kept with the key, which carry state
+ * between calls: a key is used by one thread at a time
+ */
+typedef struct {
+    int aesni; // schedules are in the AES-NI layout below
+    union {
+        struct { EVP_CIPHER_CTX *cbc[2], *ecb[2]; } ossl; // indexed by enc, padding off
+        struct { uint8_t enc[AES256ROUNDS+1][16], dec[AES256ROUNDS+1][16]; } ni;
+    } ks;
+} wsaes_softkey_t;
+
+/*
+ * Expand key into k, which starts out zeroed or holds an earlier key; -1 if the
+ * OpenSSL contexts couldn't be set up. wsaes_soft_freekey() releases k again
+ */
+int32_t wsaes_soft_setkey(wsaes_softkey_t *k, const uint8_t *key);
+void wsaes_soft_freekey(wsaes_softkey_t *k); // and wipes it, leaving it zeroed
+
+/* CBC over len bytes (a multiple of 16), updating iv to the last ciphertext block */
+void wsaes_soft_cbc(const wsaes_softkey_t *k, int enc, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len);
+
+/* One stream of wsaes_soft_cbc_multi(): a CBC chain over the buffers of iov, whole blocks each */
+typedef struct {
+    const wsaes_softkey_t *k;
+    int enc;
+    uint8_t *iv;            // updated to the last ciphertext block
+    const wsaes_iov_t *iov;
+    int niov;
+} wsaes_softstream_t;
+
+#define WSAES_SOFT_LANES 8 // encryption streams wsaes_soft_cbc_multi() interleaves
+
+/*
+ * CBC over n independent streams, each with its own key and IV. Encrypting a CBC
+ * stream is serial, one block waiting for the last, so with AES-NI up to
+ * WSAES_SOFT_LANES encryptions run side by side, a block of each at a time, the
+ * way OpenSSL's multi-block TLS code does it; decryptions already keep several
+ * blocks of one stream in flight and run one after the other
+ */
+void wsaes_soft_cbc_multi(const wsaes_softstream_t *s, int n);
+
+/* CTR over len bytes (a multiple of 16), advancing the 128-bit big-endian counter ctr past them */
+void wsaes_soft_ctr(const wsaes_softkey_t *k, uint8_t *ctr, const uint8_t *in, uint8_t *out, size_t len);
+
+/*
+ * XTS over one data unit of len bytes (at least 16, with ciphertext stealing for a
+ * partial last block): k is the data key, tk the tweak key, tweak the unit's tweak
+ */
+void wsaes_soft_xts(const wsaes_softkey_t *k, const wsaes_softkey_t *tk, int enc, const uint8_t *tweak,
+                    const uint8_t *in, uint8_t *out, size_t len);
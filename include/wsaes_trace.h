@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * Stage tracing for the device API and the engine. Every stage of a request, from
+ * do_cipher down to the single syscalls, is bracketed by WSAES_TRACE_BEGIN() and
+ * WSAES_TRACE_END(), which
+ *   - fire the USDT probes wsaes:<stage>__begin and wsaes:<stage>__end with one
+ *     argument (see the stages below), for perf, bpftrace or systemtap. They are
+ *     only built in when <sys/sdt.h> is there (systemtap-sdt-dev), and cost a nop
+ *     each until a tracer attaches
+ *   - record a timestamp into the trace ring while it is on, see aes256trace()
+ */
+#include <stdint.h>
+
+#if defined(__has_include) && !defined(WSAES_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WSAES_SDT 1
+#endif
+#endif
+
+/*
+ * The stages, and the argument of their probes (begin, end):
+ *   cipher     do_cipher of any engine cipher (bytes, status)
+ *   initkey    init_key of any engine cipher (enc, status)
+ *   schedwait  a request queued on the scheduler until it ran (bytes, status)
+ *   devlock    waiting for the engine's device lock (device, device)
+ *   takedevice loading a context's key and IV into the device (context, 1 if done)
+ *   soft       the engine's software AES, below SW_THRESHOLD (bytes, bytes)
+ *   request    a device API call holding the device (mode, or SET_KEY, SET_IV... for
+ *              the register calls, or the jobs of a batch; status)
+ *   lock       waiting for the API's device lock (device, device)
+ *   open, close, ioctl, write, read
+ *              the device syscalls (bytes or ioctl request, return value); a read
+ *              without rings includes waiting for the device
+ *   copyin, copyout
+ *              copies between the caller's buffers and the ring data region (bytes, bytes)
+ *   ringwait   waiting for the device to complete ring entries (entries in flight, status)
+ */
+typedef enum {
+    WSAES_TRACE_cipher = 0, WSAES_TRACE_initkey, WSAES_TRACE_schedwait, WSAES_TRACE_devlock,
+    WSAES_TRACE_takedevice, WSAES_TRACE_soft, WSAES_TRACE_request, WSAES_TRACE_lock, WSAES_TRACE_open,
+    WSAES_TRACE_close, WSAES_TRACE_ioctl, WSAES_TRACE_write, WSAES_TRACE_read, WSAES_TRACE_copyin,
+    WSAES_TRACE_copyout, WSAES_TRACE_ringwait, WSAES_TRACE_NSTAGES
+} wsaes_tracestage_t;
+
+extern int wsaes_tracing; // the trace ring is on
+
+void wsaes_tracerec(wsaes_tracestage_t stage, int begin, uint64_t arg);
+
+#ifdef WSAES_SDT
+#define WSAES_PROBE(name, arg) DTRACE_PROBE1(wsaes, name, arg)
+#else
+#define WSAES_PROBE(name, arg) do { } while (0)
+#endif
+
+#define WSAES_TRACE_BEGIN(stage, arg) do { \
+        WSAES_PROBE(stage##__begin, (uint64_t)(arg)); \
+        if (__atomic_load_n(&wsaes_tracing, __ATOMIC_RELAXED)) \
+            wsaes_tracerec(WSAES_TRACE_##stage, 1, (uint64_t)(arg)); \
+    } while (0)
+
+#define WSAES_TRACE_END(stage, arg) do { \
+        WSAES_PROBE(stage##__end, (uint64_t)(arg)); \
+        if (__atomic_load_n(&wsaes_tracing, __ATOMIC_RELAXED)) \
+            wsaes_tracerec(WSAES_TRACE_##stage, 0, (uint64_t)(arg)); \
+    } while (0)
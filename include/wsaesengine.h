@@ -0,0 +1,213 @@
+#pragma once
+
+/*
+ * Control commands understood by the wsaes engine, for use with ENGINE_ctrl()
+ * once the engine has been loaded
+ */
+#include <openssl/engine.h>
+#include <stdint.h>
+
+#include "wsaes_api.h"
+
+/*
+ * Device key/IV load counters, see WSAES_CMD_GET_KEY_STATS. On devices with key
+ * slots (WSAES_CAP_KEYSLOTS) the engine keeps the keys of recent contexts loaded,
+ * evicting the least recently used; keyloads counts the misses of that cache and
+ * keyloads_avoided its hits
+ */
+typedef struct {
+    uint64_t keyloads;          // keys uploaded to the device
+    uint64_t keyloads_avoided;  // context switches on the device that found their key loaded
+    uint64_t ivloads;           // IVs uploaded to the device
+    uint64_t keyslot_switches;  // of those, the ones that had to select another key slot
+    uint64_t keyslot_evictions; // key uploads that replaced another key
+} wsaes_keystats_t;
+
+/* ENGINE_ctrl(e, WSAES_CMD_GET_KEY_STATS, 0, wsaes_keystats_t *stats, NULL) */
+#define WSAES_CMD_GET_KEY_STATS ENGINE_CMD_BASE
+
+/*
+ * do_cipher calls on fewer bytes than this are run in software instead of on
+ * the device; 0 sends everything to the device. 
+ * ENGINE_ctrl_cmd(e, "SW_THRESHOLD", bytes, NULL, NULL, 0)
+ */
+#define WSAES_CMD_SW_THRESHOLD (ENGINE_CMD_BASE + 1)
+#define WSAES_SW_THRESHOLD_DEFAULT 4096
+
+/* Per-device counters, see WSAES_CMD_GET_DEV_STATS */
+typedef struct {
+    uint64_t bytes;    // processed on the device
+    uint64_t requests; // do_cipher calls run on the device
+    uint64_t busy_ns;  // time the device was held for them
+    uint64_t contexts; // contexts currently placed on the device
+} wsaes_devstat_t;
+
+typedef struct {
+    uint32_t ndevs;       // devices in use
+    uint64_t elapsed_ns;  // since the engine was initialised; busy_ns / elapsed_ns is a device's utilization
+    wsaes_devstat_t dev[WSAES_MAXDEVS];
+} wsaes_devstats_t;
+
+/* 
+ * Each context is placed on one device (AES core) for its lifetime, the one with
+ * the fewest bytes in flight when the context is first keyed.
+ * ENGINE_ctrl(e, WSAES_CMD_GET_DEV_STATS, 0, wsaes_devstats_t *stats, NULL)
+ */
+#define WSAES_CMD_GET_DEV_STATS (ENGINE_CMD_BASE + 2)
+
+/*
+ * On devices that queue write()/read() transfers, how many are kept in flight;
+ * 1 waits for each transfer before sending the next (default WSAES_PIPEDEPTH_DEFAULT).
+ * ENGINE_ctrl_cmd(e, "PIPELINE_DEPTH", depth, NULL, NULL, 0)
+ */
+#define WSAES_CMD_PIPELINE_DEPTH (ENGINE_CMD_BASE + 3)
+
+/*
+ * Coalescing scheduler. With SCHEDULER set to 1, device requests from threads 
+ * outside ASYNC_JOBs are queued for a submitter thread per device instead of each
+ * thread taking the device in turn. The submitter waits up to SCHED_LATENCY_US 
+ * from the oldest queued request for others to join it, then runs them grouped 
+ * by key, one device transaction and one key selection per key. Stitched-cipher
+ * records, whose MAC is computed as they stream, take the device themselves. Set
+ * both while no other thread is using the engine.
+ * ENGINE_ctrl_cmd(e, "SCHEDULER", 1, NULL, NULL, 0)
+ * ENGINE_ctrl_cmd(e, "SCHED_LATENCY_US", us, NULL, NULL, 0)
+ */
+#define WSAES_CMD_SCHEDULER (ENGINE_CMD_BASE + 4)
+#define WSAES_CMD_SCHED_LATENCY (ENGINE_CMD_BASE + 5)
+#define WSAES_SCHED_LATENCY_DEFAULT 0 // coalesce only what queues while the device is busy
+
+/* Scheduler counters, see WSAES_CMD_GET_SCHED_STATS */
+typedef struct {
+    uint64_t requests;    // run by the schedulers
+    uint64_t batches;     // they were run in; requests / batches is the mean batch size
+    uint64_t maxbatch;
+    uint64_t keygroups;   // distinct keys per batch, summed: key selections
+    uint64_t depth_sum;   // queue depth each request found, itself included, summed
+    uint64_t maxdepth;
+    uint64_t wait_ns;     // time from queueing to the start of the batch, summed: added latency
+    uint64_t maxwait_ns;
+    uint64_t overflow_requests; // of the requests, run in software with SW_OVERFLOW
+    uint64_t overflow_bytes;
+} wsaes_schedstats_t;
+
+/* ENGINE_ctrl(e, WSAES_CMD_GET_SCHED_STATS, 0, wsaes_schedstats_t *stats, NULL), summed over the devices */
+#define WSAES_CMD_GET_SCHED_STATS (ENGINE_CMD_BASE + 6)
+
+/*
+ * Latency histogram: bucket[i] counts the calls that took from 2^i to 2^(i+1)-1 ns
+ * (bucket[0] also those under 1 ns, the last bucket everything longer)
+ */
+#define WSAES_HISTBUCKETS 40
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;     // sum_ns / count is the mean
+    uint64_t bucket[WSAES_HISTBUCKETS];
+} wsaes_hist_t;
+
+/* Performance counters, see WSAES_CMD_GET_PERF_STATS */
+typedef struct {
+    uint64_t enc_ops;    // do_cipher calls encrypting, all ciphers
+    uint64_t enc_bytes;
+    uint64_t dec_ops;    // and decrypting
+    uint64_t dec_bytes;
+    uint64_t sw_ops;     // of those, run in software: below SW_THRESHOLD, or with no device for them
+    uint64_t sw_bytes;
+    uint64_t key_inits;  // init_key calls with a new key
+    uint64_t dev_errors; // device requests that failed
+    wsaes_hist_t init_key;
+    wsaes_hist_t do_cipher;
+} wsaes_perfstats_t;
+
+/*
+ * The counters are kept per thread and summed when read, so counting costs no 
+ * shared cache line; the device key and IV loads are in WSAES_CMD_GET_KEY_STATS.
+ * ENGINE_ctrl(e, WSAES_CMD_GET_PERF_STATS, 0, wsaes_perfstats_t *stats, NULL)
+ */
+#define WSAES_CMD_GET_PERF_STATS (ENGINE_CMD_BASE + 7)
+
+/*
+ * Zero the performance, key, device and scheduler counters, and restart the 
+ * utilization clock. Counts made while it runs may survive it.
+ * ENGINE_ctrl_cmd(e, "RESET_STATS", 0, NULL, NULL, 0), or -post RESET_STATS
+ */
+#define WSAES_CMD_RESET_STATS (ENGINE_CMD_BASE + 8)
+
+/*
+ * All the counters as text, one "name value" per line, or as one JSON object, 
+ * e.g. for a server's metrics endpoint. Returns 0 if the snapshot didn't fit in
+ * len bytes; it is NUL-terminated either way.
+ * ENGINE_ctrl(e, WSAES_CMD_GET_STATS_TEXT, (long)len, char *buf, NULL)
+ */
+#define WSAES_CMD_GET_STATS_TEXT (ENGINE_CMD_BASE + 9)
+#define WSAES_CMD_GET_STATS_JSON (ENGINE_CMD_BASE + 10)
+
+/*
+ * What the engine counts: 0 nothing, 1 the counters of wsaes_perfstats_t but not
+ * the histograms, which take two clock reads per call, 2 everything.
+ * ENGINE_ctrl_cmd(e, "STATS", level, NULL, NULL, 0)
+ */
+#define WSAES_CMD_STATS (ENGINE_CMD_BASE + 11)
+#define WSAES_STATS_DEFAULT 2
+
+/*
+ * Trace ring, see aes256trace() and wsaes_trace.h: TRACE 1 starts recording the
+ * stages of every request (cipher call, locks, key loads, syscalls, ring copies
+ * and waits), TRACE_DUMP writes what the ring holds to a file as Chrome trace
+ * events. ENGINE_ctrl_cmd(e, "TRACE", 1, NULL, NULL, 0),
+ * ENGINE_ctrl_cmd_string(e, "TRACE_DUMP", "/tmp/wsaes.json", 0), or -post
+ */
+#define WSAES_CMD_TRACE (ENGINE_CMD_BASE + 12)
+#define WSAES_CMD_TRACE_DUMP (ENGINE_CMD_BASE + 13)
+
+/*
+ * Largest device transfer used, in bytes; 0 (the default) uses the device's own
+ * largest, see aes256setchunk_sess(). 
+ * ENGINE_ctrl_cmd(e, "CHUNK_SIZE", bytes, NULL, NULL, 0)
+ */
+#define WSAES_CMD_CHUNK_SIZE (ENGINE_CMD_BASE + 14)
+
+/*
+ * Calibration of SW_THRESHOLD, PIPELINE_DEPTH and CHUNK_SIZE for the device, the
+ * driver and the CPU at hand. It measures device and software throughput across
+ * payload sizes on device 0 (about 0.1 s) and applies what it finds to every device.
+ *   AUTOTUNE 1  tune when the engine is initialised (now, if it already is), from 
+ *               TUNE_CACHE if that file was written for the same devices
+ *   AUTOTUNE 2  calibrate now whatever the cache holds, and rewrite it
+ *   AUTOTUNE 0  don't tune at init (the default); the values in use stay
+ * Calibrating uses device 0 as no context can, so do it while no other thread is
+ * using the engine. ENGINE_ctrl_cmd(e, "AUTOTUNE", 1, NULL, NULL, 0), or -pre
+ */
+#define WSAES_CMD_AUTOTUNE (ENGINE_CMD_BASE + 15)
+
+/* File the calibration is kept in between process starts, "" for none (the default) */
+#define WSAES_CMD_TUNE_CACHE (ENGINE_CMD_BASE + 16)
+
+/* Tuning parameters in use, see WSAES_CMD_GET_TUNING */
+#define WSAES_TUNE_NONE 0       // not tuned: defaults, or as set by the ctrl commands
+#define WSAES_TUNE_CALIBRATED 1 // measured
+#define WSAES_TUNE_CACHED 2     // read from TUNE_CACHE
+typedef struct {
+    uint64_t sw_threshold;   // SW_THRESHOLD; UINT64_MAX if the device was slower at every size
+    uint32_t pipeline_depth; // PIPELINE_DEPTH
+    uint32_t chunk;          // CHUNK_SIZE, 0 for the device's largest transfer
+    uint32_t source;         // how the last tuning got them, WSAES_TUNE_*
+    uint64_t calibrate_ns;   // how long the last calibration took
+} wsaes_tuning_t;
+
+/*
+ * ENGINE_ctrl(e, WSAES_CMD_GET_TUNING, 0, wsaes_tuning_t *tuning, NULL); also part
+ * of the GET_STATS_TEXT/JSON snapshots
+ */
+#define WSAES_CMD_GET_TUNING (ENGINE_CMD_BASE + 17)
+
+/*
+ * Software overflow behind the scheduler (needs SCHEDULER 1). With SW_OVERFLOW 1,
+ * a batch of requests that queued while the device was busy is split between the
+ * device and the CPU in proportion to the throughput each has shown, and the
+ * CPU's share runs on the thread of one of its requests with multi-buffer
+ * AES-CBC, several independent streams interleaved on one core, while the device
+ * runs the rest. For a while after a device request fails, whole batches run in
+ * software. ENGINE_ctrl_cmd(e, "SW_OVERFLOW", 1, NULL, NULL, 0)
+ */
+#define WSAES_CMD_SW_OVERFLOW (ENGINE_CMD_BASE + 18)
@@ -17,6 +17,7 @@
 #define CHARDEV_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 
 
@@ -43,5 +44,126 @@
  */
 #define IOCTL_SET_MODE _IOR(MAJOR_NUM, 0, char) /* Set the message of the device driver */
 #define IOCTL_GET_MODE _IOR(MAJOR_NUM, 1, char) /* Get the message of the device driver */
+
+/* Device capabilities, filled in by IOCTL_GET_CAPS. Drivers for older bitstreams
+ * don't implement this ioctl (it fails with ENOTTY) and process exactly one 
+ * 16-byte block per write()/read() pair. */
+#define WSAES_CAP_BULK 0x1 /* write() takes up to maxxfer bytes of blocks, read() returns them processed */
+
+struct wsaes_caps {
+    __u32 flags;   /* WSAES_CAP_* */
+    __u32 maxxfer; /* largest bulk transfer in bytes, a multiple of the block size */
+};
+
+#define IOCTL_GET_CAPS _IOR(MAJOR_NUM, 2, struct wsaes_caps) /* Get the device capabilities */
+
+/* 
+ * Submission/completion rings (WSAES_CAP_RING). IOCTL_RING_SETUP sizes the rings
+ * and a pinned, DMA-able data region, which are then mapped into the process with
+ * mmap(fd, offset 0, map_size). The host copies data into the region, posts one 
+ * wsaes_sqe per chunk and reaps a wsaes_cqe per sqe; the device processes each 
+ * chunk in place. Key, IV and RESET still go through the mode ioctls, and chunks
+ * without WSAES_SQE_IV continue the CBC chain of the previous one.
+ *
+ * The host only produces sq_tail and cq_head, the device only sq_head and cq_tail;
+ * all four are free-running and masked on use. The device sleeps once it has
+ * drained the submission ring, and is woken by IOCTL_RING_DOORBELL. So no wakeup 
+ * is lost, the host publishes sq_tail, issues a full barrier and then reads 
+ * sq_head, ringing the doorbell if the ring was empty before its entries; the 
+ * device publishes sq_head, issues a full barrier and reads sq_tail again before 
+ * sleeping. IOCTL_RING_WAIT blocks until the completion ring is non-empty.
+ */
+#define WSAES_CAP_RING 0x2
+
+struct wsaes_ring_setup {
+    __u32 sq_entries; /* in: requested, a power of two; out: granted */
+    __u32 cq_entries; /* out: at least sq_entries */
+    __u32 data_size;  /* in: requested; out: granted */
+    __u32 sq_off;     /* out: offsets of the parts within the mapping */
+    __u32 cq_off;
+    __u32 data_off;
+    __u32 map_size;   /* out: bytes to mmap */
+};
+
+/* At offset 0 of the mapping */
+struct wsaes_ring_hdr {
+    __u32 sq_head;
+    __u32 sq_tail;
+    __u32 cq_head;
+    __u32 cq_tail;
+    __u32 sq_mask;
+    __u32 cq_mask;
+};
+
+#define WSAES_SQE_IV 0x1 /* load iv before processing the chunk */
+
+struct wsaes_sqe {
+    __u32 offset;   /* of the chunk in the data region */
+    __u32 length;   /* bytes, a multiple of the block size, at most maxxfer */
+    __u32 mode;     /* ENCRYPT, DECRYPT, CTR, XTS_ENCRYPT or XTS_DECRYPT */
+    __u32 flags;    /* WSAES_SQE_* */
+    __u64 cookie;   /* returned in the completion, identifies the request */
+    __u8 iv[16];
+};
+
+struct wsaes_cqe {
+    __u64 cookie;
+    __s32 status;   /* 0, or a negative errno */
+    __u32 length;   /* bytes processed */
+};
+
+#define IOCTL_RING_SETUP _IOWR(MAJOR_NUM, 3, struct wsaes_ring_setup) /* Create the rings and data region */
+#define IOCTL_RING_DOORBELL _IO(MAJOR_NUM, 4) /* New entries on an empty submission ring */
+#define IOCTL_RING_WAIT _IO(MAJOR_NUM, 5) /* Block until the completion ring is non-empty */
+
+/*
+ * Queued transfers (WSAES_CAP_QUEUE, with WSAES_CAP_BULK). write() hands a bulk
+ * transfer to the device and returns without waiting for it to be processed, 
+ * failing with EBUSY if IOCTL_GET_QDEPTH transfers are already outstanding. The 
+ * device processes them in order, continuing the CBC chain, and read() blocks 
+ * until the oldest outstanding transfer has been processed, then returns it. So
+ * a host with two or more transfers in flight keeps the device busy while it 
+ * moves data. RESET waits for the device to go idle and discards any transfers
+ * that were not read back.
+ */
+#define WSAES_CAP_QUEUE 0x4
+
+#define IOCTL_GET_QDEPTH _IOR(MAJOR_NUM, 6, __u32) /* Largest number of outstanding transfers */
+
+/*
+ * AES-256-CTR (WSAES_CAP_CTR, with WSAES_CAP_BULK). In mode CTR, written or posted
+ * blocks are XORed with the encryption of a counter block, which is loaded like 
+ * the IV and incremented as a 128-bit big-endian number after every block. It 
+ * carries on across writes and ring entries as the CBC chain does. CTR encryption
+ * and decryption are the same operation.
+ */
+#define WSAES_CAP_CTR 0x8
+
+/*
+ * AES-256-XTS (WSAES_CAP_XTS, with WSAES_CAP_BULK), as IEEE 1619 for data units 
+ * of whole blocks. Mode SET_TWEAKKEY loads the second (tweak) key the way SET_KEY
+ * loads the data key, and IOCTL_SET_SECTOR the sector (data unit) size, a multiple
+ * of the block size of at most maxxfer bytes. In modes XTS_ENCRYPT and XTS_DECRYPT
+ * every write or ring entry is a whole number of sectors. The tweak of the first
+ * sector is loaded like the IV, and goes up by one, as a 128-bit little-endian 
+ * number, from each sector to the next, across writes and ring entries.
+ */
+#define WSAES_CAP_XTS 0x10
+
+#define IOCTL_SET_SECTOR _IO(MAJOR_NUM, 7) /* Set the sector size, in bytes, to arg */
+
+/*
+ * Key slots (WSAES_CAP_KEYSLOTS). The device keeps IOCTL_GET_KEYSLOTS data keys,
+ * each already expanded into its key schedule. IOCTL_SET_KEYSLOT selects slot arg,
+ * whose key then processes the data, without being written or expanded again; a 
+ * SET_KEY write loads the selected slot. Data in a slot that was never loaded
+ * fails with EINVAL. Like the single key of devices without slots, the slots and
+ * the selection are shared by every descriptor open on the device. The XTS tweak
+ * key is not slotted.
+ */
+#define WSAES_CAP_KEYSLOTS 0x20
+
+#define IOCTL_GET_KEYSLOTS _IOR(MAJOR_NUM, 8, __u32) /* Number of key slots */
+#define IOCTL_SET_KEYSLOT _IO(MAJOR_NUM, 9) /* Select key slot arg */
  
 #endif
@@ -13,63 +13,927 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "wsaes_api.h"
 #include "wsaeskern.h"
+#include "wsaes_backend.h"
+#include "wsaes_trace.h"
+
+static const char *devicefname = "/dev/wsaeschar"; // with the device number appended, or alone for a single device
+static int singledev = 0; // only the unnumbered devicefname exists
+static int devscanned = 0; // singledev is valid
+
+/*
+ * The key, IV, mode and data registers belong to the device, not to a session, so
+ * every call that uses them holds the device's lock until it is done: a thread's
+ * SET_KEY can't land between another thread's ENCRYPT transfers. The locks are 
+ * recursive, so aes256lock_sess() can hold a device across several calls
+ */
+static pthread_mutex_t devlocks[WSAES_MAXDEVS];
+static pthread_once_t devlocks_once = PTHREAD_ONCE_INIT;
+
+#define RINGENTRIES 64 // submission ring size requested from the device
+#define RINGSPIN 2000  // polls of the completion ring before blocking in IOCTL_RING_WAIT
+
+/* Open device handle, see aes256open() */
+struct wsaes_session {
+    int fd;
+    int dev;                // device number, whose lock the session's calls take
+    struct wsaes_caps caps; // zeroed if the driver predates IOCTL_GET_CAPS
+    uint32_t qdepth;        // transfers the device queues, if caps.flags has WSAES_CAP_QUEUE
+    uint32_t depth;         // transfers kept in flight, see aes256setdepth_sess()
+    uint32_t chunk;         // largest transfer used, 0 for caps.maxxfer, see aes256setchunk_sess()
+    uint32_t sectorsize;    // XTS sector size last loaded with IOCTL_SET_SECTOR, 0 if none
+    uint32_t keyslots;      // key slots on the device, if caps.flags has WSAES_CAP_KEYSLOTS; the last is runbatch()'s
+    uint32_t slot;          // key slot last selected through the session, UINT32_MAX if none
+
+    // submission/completion rings, if caps.flags has WSAES_CAP_RING
+    struct wsaes_ring_setup ring;
+    void *map;
+    struct wsaes_ring_hdr *hdr;
+    struct wsaes_sqe *sq;
+    struct wsaes_cqe *cq;
+    uint8_t *data;
+};
+
+static aes256syscalls_t syscalls;
+
+
+/*
+ * The real device, through its kernel module
+ */
+static int kernel_access(const char *path)
+{
+    return access(path, F_OK);
+}
+
+static int kernel_open(const char *path, int flags)
+{
+    return open(path, flags);
+}
+
+static int kernel_ioctl(int fd, unsigned long req, unsigned long arg)
+{
+    return ioctl(fd, req, arg);
+}
+
+static void *kernel_mmap(int fd, size_t len)
+{
+    return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+static int kernel_munmap(int fd, void *addr, size_t len)
+{
+    return munmap(addr, len);
+}
+
+const wsaes_backend_t wsaes_kernel_backend = {
+    "kernel", kernel_access, kernel_open, close, kernel_ioctl, write, read, kernel_mmap, kernel_munmap
+};
+
+
+/*
+ * Pick the backend named by WSAES_BACKEND (see wsaes_backend.h)
+ */
+static const wsaes_backend_t *backend = NULL;
+
+static const wsaes_backend_t *getbackend(void)
+{
+    const wsaes_backend_t *b = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+    const char *name;
+
+    if (NULL != b)
+        return b;
+
+    name = getenv("WSAES_BACKEND");
+    if (NULL != name && 0 == strcmp(name, wsaes_emu_backend.name))
+        b = &wsaes_emu_backend;
+    else if (NULL != name && 0 == strcmp(name, wsaes_broker_backend.name))
+        b = &wsaes_broker_backend;
+    else
+    {
+        if (NULL != name && 0 != strcmp(name, wsaes_kernel_backend.name))
+            fprintf(stderr, "WARNING: unknown WSAES_BACKEND \"%s\", using the kernel device\n", name);
+        b = &wsaes_kernel_backend;
+    }
+    // threads racing here all pick the same backend
+    __atomic_store_n(&backend, b, __ATOMIC_RELEASE);
+    return b;
+}
+
+
+/*
+ * Thin wrappers around the device syscalls, so that the number of calls made
+ * per operation can be measured and each call traced
+ */
+static int dev_open(const char *path)
+{
+    int ret;
+
+    __atomic_add_fetch(&syscalls.open, 1, __ATOMIC_RELAXED);
+    WSAES_TRACE_BEGIN(open, 0);
+    ret = getbackend()->open(path, O_RDWR);
+    WSAES_TRACE_END(open, ret);
+    return ret;
+}
+
+static int dev_close(int fd)
+{
+    int ret;
+
+    __atomic_add_fetch(&syscalls.close, 1, __ATOMIC_RELAXED);
+    WSAES_TRACE_BEGIN(close, 0);
+    ret = getbackend()->close(fd);
+    WSAES_TRACE_END(close, ret);
+    return ret;
+}
+
+static int dev_ioctl(int fd, unsigned long req, unsigned long arg)
+{
+    int ret;
+
+    __atomic_add_fetch(&syscalls.ioctl, 1, __ATOMIC_RELAXED);
+    WSAES_TRACE_BEGIN(ioctl, req);
+    ret = getbackend()->ioctl(fd, req, arg);
+    WSAES_TRACE_END(ioctl, ret);
+    return ret;
+}
+
+static ssize_t dev_write(int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+
+    __atomic_add_fetch(&syscalls.write, 1, __ATOMIC_RELAXED);
+    WSAES_TRACE_BEGIN(write, len);
+    ret = getbackend()->write(fd, buf, len);
+    WSAES_TRACE_END(write, ret);
+    return ret;
+}
+
+static ssize_t dev_read(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    __atomic_add_fetch(&syscalls.read, 1, __ATOMIC_RELAXED);
+    WSAES_TRACE_BEGIN(read, len);
+    ret = getbackend()->read(fd, buf, len);
+    WSAES_TRACE_END(read, ret);
+    return ret;
+}
+
+/*
+ * Path of device number dev
+ */
+static void devpath(int dev, char *buf, size_t len)
+{
+    if (!__atomic_load_n(&devscanned, __ATOMIC_ACQUIRE))
+        aes256devcount();
+    if (__atomic_load_n(&singledev, __ATOMIC_RELAXED))
+        snprintf(buf, len, "%s", devicefname);
+    else
+        snprintf(buf, len, "%s%d", devicefname, dev);
+}
+
+
+/*
+ * Number of devices present: the numbered nodes from 0 up to the first missing 
+ * one, or 1 if there is only the unnumbered node
+ */
+int32_t aes256devcount(void)
+{
+    char path[64];
+    int n;
+
+    for (n=0; n<WSAES_MAXDEVS; n++)
+    {
+        snprintf(path, sizeof(path), "%s%d", devicefname, n);
+        if (getbackend()->access(path) < 0)
+            break;
+    }
+    __atomic_store_n(&singledev, (0 == n && getbackend()->access(devicefname) != -1), __ATOMIC_RELAXED);
+    __atomic_store_n(&devscanned, 1, __ATOMIC_RELEASE);
+    return __atomic_load_n(&singledev, __ATOMIC_RELAXED) ? 1 : n;
+}
+
+
+/*
+ *
+ */
+int32_t aes256init(void)
+{
+    //printf("Checking for kernel module...\n");
+    if( aes256devcount() > 0 ) 
+    {
+        //printf("Found device!\n");
+        return 0;
+    } 
+    else 
+    {
+        fprintf(stderr, "ERROR: Couldn't find device %s or %s0\n", devicefname, devicefname);
+        return -1; 
+    }
+}
+
+
+/*
+ * Create the session's submission/completion rings and map them, see wsaeskern.h
+ */
+static int ringsetup(wsaes_session_t *sess)
+{
+    struct wsaes_ring_setup *r = &sess->ring;
+
+    memset(r, 0, sizeof(*r));
+    r->sq_entries = RINGENTRIES;
+    r->data_size = AESMAXDATASIZE;
+    if (dev_ioctl(sess->fd, IOCTL_RING_SETUP, (unsigned long)r) < 0)
+        return -1;
+    if (0 == r->sq_entries || r->cq_entries < r->sq_entries || r->data_size < AESBLKSIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sess->map = getbackend()->mmap(sess->fd, r->map_size);
+    if (MAP_FAILED == sess->map)
+        return -1;
+    sess->hdr = (struct wsaes_ring_hdr*)sess->map;
+    sess->sq = (struct wsaes_sqe*)((uint8_t*)sess->map + r->sq_off);
+    sess->cq = (struct wsaes_cqe*)((uint8_t*)sess->map + r->cq_off);
+    sess->data = (uint8_t*)sess->map + r->data_off;
+    return 0;
+}
+
+
+/*
+ * Open a session on the device, setting up rings for it if userings is set and
+ * the device has them
+ */
+static int32_t opensess(wsaes_session_t **sessp, int dev, int userings)
+{
+    wsaes_session_t *sess;
+    char path[64];
+
+    sess = malloc(sizeof(*sess));
+    if (NULL == sess)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device session\n");
+        return -1;
+    }
+
+    // Open the device with read/write access
+    sess->dev = dev;
+    devpath(dev, path, sizeof(path));
+    sess->fd = dev_open(path);
+    if (sess->fd < 0){
+        perror("ERROR: Failed to open the device...");
+        free(sess);
+        return errno;
+    }
+
+    // Older bitstreams don't know IOCTL_GET_CAPS, in which case only per-block transfers are used
+    if (dev_ioctl(sess->fd, IOCTL_GET_CAPS, (unsigned long)&sess->caps) < 0)
+        memset(&sess->caps, 0, sizeof(sess->caps));
+    if (sess->caps.maxxfer < AESBLKSIZE)
+        sess->caps.flags &= ~WSAES_CAP_BULK;
+    sess->caps.maxxfer -= sess->caps.maxxfer % AESBLKSIZE;
+    if (!(sess->caps.flags & WSAES_CAP_BULK))
+        sess->caps.flags &= ~WSAES_CAP_XTS; // sectors go as bulk transfers
+
+    // queued transfers are bulk transfers
+    sess->depth = WSAES_PIPEDEPTH_DEFAULT;
+    sess->chunk = 0;
+    sess->sectorsize = 0;
+    if (!(sess->caps.flags & WSAES_CAP_BULK) || dev_ioctl(sess->fd, IOCTL_GET_QDEPTH, (unsigned long)&sess->qdepth) < 0)
+        sess->qdepth = 0;
+    if (sess->qdepth < 2)
+        sess->caps.flags &= ~WSAES_CAP_QUEUE;
+    // batches keep the last slot to themselves, so a single slot is no more than the key register
+    if (!(sess->caps.flags & WSAES_CAP_KEYSLOTS) ||
+        dev_ioctl(sess->fd, IOCTL_GET_KEYSLOTS, (unsigned long)&sess->keyslots) < 0 || sess->keyslots < 2)
+    {
+        sess->caps.flags &= ~WSAES_CAP_KEYSLOTS;
+        sess->keyslots = 0;
+    }
+    sess->slot = UINT32_MAX;
+
+    // the rings carry bulk-sized chunks, so they are only used alongside bulk transfers
+    sess->map = NULL;
+    if (!userings || !(sess->caps.flags & WSAES_CAP_BULK))
+        sess->caps.flags &= ~WSAES_CAP_RING;
+    if ((sess->caps.flags & WSAES_CAP_RING) && 0 != ringsetup(sess))
+    {
+        perror("WARNING: Failed to set up the device rings, using write()/read()");
+        sess->caps.flags &= ~WSAES_CAP_RING;
+        sess->map = NULL;
+    }
+
+    *sessp = sess;
+    return 0;
+}
+
+
+/*
+ * Open a session on the device. The session must be released with aes256close()
+ */
+int32_t aes256open(wsaes_session_t **sessp)
+{
+    return opensess(sessp, 0, 1);
+}
+
+int32_t aes256open_dev(wsaes_session_t **sessp, int dev)
+{
+    if (dev < 0 || dev >= WSAES_MAXDEVS)
+    {
+        fprintf(stderr, "ERROR: invalid device number %d\n", dev);
+        return -1;
+    }
+    return opensess(sessp, dev, 1);
+}
+
+
+/*
+ * Close a session opened by aes256open() and free it
+ */
+int32_t aes256close(wsaes_session_t *sess)
+{
+    int32_t ret = 0;
+
+    if (NULL == sess)
+        return 0;
+
+    if (NULL != sess->map)
+        getbackend()->munmap(sess->fd, sess->map, sess->ring.map_size);
+    if(dev_close(sess->fd)<0)
+    {
+        perror("ERROR: Error closing file");
+        ret = errno;
+    }
+    free(sess);
+    return ret;
+}
 
-static const char *devicefname = "/dev/wsaeschar";
 
 /*
  *
  */
-int32_t aes256init(void)
+static int32_t loadkey(wsaes_session_t *sess, const uint8_t *keyp)
+{
+    int ret = 0;
+
+    //printf("setting key\n");
+    ret = dev_ioctl(sess->fd, IOCTL_SET_MODE, SET_KEY); // switch mode 
+    if (ret < 0) {
+        perror("ERROR: Failed to set mode.");
+        return errno;
+    }
+    ret = dev_write(sess->fd, keyp, AESKEYSIZE); // write key 
+    if (ret < 0) {
+        perror("ERROR: Failed to write KEY to the device.");
+        return errno;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Key slots, see WSAES_CAP_KEYSLOTS: aes256setkeyslot_sess() loads a key into a
+ * slot and selects it, aes256usekeyslot_sess() selects a slot loaded earlier. The
+ * device's last slot is not among them: runbatch() loads the keys of a batch there
+ */
+uint32_t aes256keyslots_sess(wsaes_session_t *sess)
+{
+    return sess->keyslots ? sess->keyslots - 1 : 0;
+}
+
+static int32_t setslot(wsaes_session_t *sess, uint32_t slot)
+{
+    if (dev_ioctl(sess->fd, IOCTL_SET_KEYSLOT, slot) < 0) {
+        perror("ERROR: Failed to select the key slot.");
+        return errno;
+    }
+    return 0;
+}
+
+static int32_t selectslot(wsaes_session_t *sess, uint32_t slot)
+{
+    int32_t ret;
+
+    if (slot >= aes256keyslots_sess(sess))
+    {
+        fprintf(stderr, "ERROR: invalid key slot %u, the device has %u\n", slot, aes256keyslots_sess(sess));
+        return -1;
+    }
+    if (0 == (ret = setslot(sess, slot)))
+        sess->slot = slot;
+    return ret;
+}
+
+
+
+/*
+ * The second AES-256-XTS key, which encrypts the tweaks
+ */
+static int32_t loadtweakkey(wsaes_session_t *sess, const uint8_t *keyp)
+{
+    if (!(sess->caps.flags & WSAES_CAP_XTS))
+    {
+        fprintf(stderr, "ERROR: the device doesn't support XTS\n");
+        return -1;
+    }
+    if (dev_ioctl(sess->fd, IOCTL_SET_MODE, SET_TWEAKKEY) < 0) {
+        perror("ERROR: Failed to set mode.");
+        return errno;
+    }
+    if (dev_write(sess->fd, keyp, AESKEYSIZE) < 0) {
+        perror("ERROR: Failed to write the tweak key to the device.");
+        return errno;
+    }
+    return 0;
+}
+
+
+/*
+ *
+ */
+static int32_t loadiv(wsaes_session_t *sess, const uint8_t *ivp)
+{
+    int ret = 0;
+
+    //printf("setting IV\n");
+    ret = dev_ioctl(sess->fd, IOCTL_SET_MODE, SET_IV); // switch mode 
+    if (ret < 0) {
+        perror("ERROR: Failed to set mode.");
+        return errno;
+    }
+    ret = dev_write(sess->fd, ivp, AESIVSIZE); // write IV
+    if (ret < 0) {
+        perror("ERROR: Failed to write IV to the device.");
+        return errno;
+    }
+
+    return 0;
+}
+
+
+/*
+ *
+ */
+static int32_t resetdev(wsaes_session_t *sess)
+{
+    int ret = 0;
+
+    // Reset block 
+    ret = dev_ioctl(sess->fd, IOCTL_SET_MODE, RESET); 
+    if (ret < 0) {
+        perror("ERROR: failed to reset AES block... \n");
+        return errno;
+    }
+
+    return 0;
+}
+
+
+/*
+ *
+ */
+uint32_t aes256caps_sess(wsaes_session_t *sess)
+{
+    return sess->caps.flags;
+}
+
+
+/*
+ * Set how many write()/read() transfers are kept in flight on a device that 
+ * queues them. Returns the depth in effect, which the device may limit. Under
+ * the device lock, so a transfer in progress on another thread sees one depth
+ */
+uint32_t aes256setdepth_sess(wsaes_session_t *sess, uint32_t depth)
+{
+    uint32_t ret;
+
+    aes256lock_sess(sess);
+    sess->depth = (depth > 0) ? depth : 1;
+    ret = (sess->caps.flags & WSAES_CAP_QUEUE) && sess->depth > sess->qdepth ? sess->qdepth : sess->depth;
+    aes256unlock_sess(sess);
+    return ret;
+}
+
+
+/*
+ *
+ */
+uint32_t aes256maxxfer_sess(wsaes_session_t *sess)
+{
+    return (sess->caps.flags & WSAES_CAP_BULK) ? sess->caps.maxxfer : 0;
+}
+
+
+/*
+ * Smaller transfers than the device takes can pay off when the device overlaps
+ * them: on a queue or the rings, the next chunk moves while the last one is 
+ * processed. Whole blocks; XTS transfers are still at least one sector
+ */
+uint32_t aes256setchunk_sess(wsaes_session_t *sess, uint32_t chunk)
+{
+    uint32_t ret;
+
+    chunk -= chunk % AESBLKSIZE;
+    aes256lock_sess(sess);
+    sess->chunk = (0 == chunk || chunk >= sess->caps.maxxfer) ? 0 : chunk;
+    ret = (0 == sess->chunk) ? sess->caps.maxxfer : sess->chunk;
+    aes256unlock_sess(sess);
+    return ret;
+}
+
+
+/*
+ * What every transfer in mode is made of: whole sectors in the XTS modes, whole
+ * blocks otherwise
+ */
+static uint32_t xferunit(wsaes_session_t *sess, int mode)
+{
+    return (XTS_ENCRYPT == mode || XTS_DECRYPT == mode) ? sess->sectorsize : AESBLKSIZE;
+}
+
+/* Largest transfer in mode, maxxfer (or the chunk size, if smaller) cut down to whole units */
+static uint32_t maxchunk(wsaes_session_t *sess, int mode)
+{
+    uint32_t unit = xferunit(sess, mode), max = (0 != sess->chunk) ? sess->chunk : sess->caps.maxxfer;
+
+    if (max < unit)
+        max = unit;
+    return max - max % unit;
+}
+
+
+/*
+ * Show the tap n bytes of plaintext, see wsaes_tap_t
+ */
+static void tapdata(const wsaes_tap_t *tap, const uint8_t *data, size_t n)
+{
+    if (NULL != tap && n > 0)
+        tap->fn(tap->arg, data, n);
+}
+
+
+/*
+ * Transfer len bytes of whole blocks through the device in as few write()/read()
+ * pairs as the device allows (at most caps.maxxfer bytes each)
+ */
+static int32_t bulkxfer(wsaes_session_t *sess, int mode, const uint8_t *inp, uint8_t *outp, size_t len,
+                        const wsaes_tap_t *tap)
+{
+    uint32_t chunk, max = maxchunk(sess, mode);
+    ssize_t ret;
+
+    for (size_t i=0; i<len; i+=chunk)
+    {
+        chunk = (len - i < max) ? len - i : max;
+
+        // the device may accept (and return) fewer bytes than asked for
+        for (uint32_t done=0; done<chunk; done+=ret)
+        {
+            ret = dev_write(sess->fd, &(inp[i+done]), chunk-done);
+            if (ret <= 0) {
+                perror("ERROR: Failed to write data to the AES block... ");
+                return (ret < 0) ? errno : -1;
+            }
+        }
+        if (ENCRYPT == mode)
+            tapdata(tap, &(inp[i]), chunk);
+        for (uint32_t done=0; done<chunk; done+=ret)
+        {
+            ret = dev_read(sess->fd, &(outp[i+done]), chunk-done);
+            if (ret <= 0){
+                perror("Failed to read data back from the AES block... ");
+                return (ret < 0) ? errno : -1;
+            }
+        }
+        if (DECRYPT == mode)
+            tapdata(tap, &(outp[i]), chunk);
+    }
+    return 0;
+}
+
+
+/*
+ * Transfer the whole blocks of the buffers in iov through a device that queues 
+ * transfers, with up to depth of them written ahead of the one being read back,
+ * so the device processes one chunk while the host moves the next ones. Chunks
+ * don't span buffers. On failure, transfers may be left queued on the device; 
+ * the next RESET discards them
+ */
+static int32_t pipexfer(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov, uint32_t depth,
+                        const wsaes_tap_t *tap)
+{
+    size_t woff = 0, roff = 0, whole;
+    uint32_t chunk, inflight = 0, max = maxchunk(sess, mode);
+    int wi = 0, ri = 0;
+    ssize_t ret;
+
+    while (ri < niov)
+    {
+        while (wi < niov && inflight < depth)
+        {
+            whole = iov[wi].len - iov[wi].len % AESBLKSIZE;
+            if (woff == whole)
+            {
+                wi++;
+                woff = 0;
+                continue;
+            }
+            chunk = (whole - woff < max) ? whole - woff : max;
+            ret = dev_write(sess->fd, iov[wi].in + woff, chunk);
+            if (ret != chunk) {
+                perror("ERROR: Failed to queue data on the AES block... ");
+                return (ret < 0) ? errno : -1;
+            }
+            if (ENCRYPT == mode)
+                tapdata(tap, iov[wi].in + woff, chunk);
+            woff += chunk;
+            inflight++;
+        }
+
+        whole = iov[ri].len - iov[ri].len % AESBLKSIZE;
+        if (roff == whole)
+        {
+            ri++;
+            roff = 0;
+            continue;
+        }
+
+        // the device returns the oldest transfer, possibly over several reads
+        chunk = (whole - roff < max) ? whole - roff : max;
+        for (uint32_t done=0; done<chunk; done+=ret)
+        {
+            ret = dev_read(sess->fd, iov[ri].out + roff + done, chunk - done);
+            if (ret <= 0){
+                perror("Failed to read data back from the AES block... ");
+                return (ret < 0) ? errno : -1;
+            }
+        }
+        if (DECRYPT == mode)
+            tapdata(tap, iov[ri].out + roff, chunk);
+        roff += chunk;
+        inflight--;
+    }
+    return 0;
+}
+
+
+/*
+ * Copy n bytes between buf and the buffers of iov, taken as one stream, starting
+ * at offset pos of the stream: from the inputs into buf, or from buf to the outputs
+ */
+static void iovcopy(const wsaes_iov_t *iov, size_t pos, uint8_t *buf, size_t n, int tooutput)
+{
+    size_t k, len = n;
+
+    if (tooutput)
+        WSAES_TRACE_BEGIN(copyout, n);
+    else
+        WSAES_TRACE_BEGIN(copyin, n);
+    for (; pos >= iov->len; iov++)
+        pos -= iov->len;
+    for (; n > 0; iov++, pos = 0)
+    {
+        k = (iov->len - pos < n) ? iov->len - pos : n;
+        if (tooutput)
+            memcpy(iov->out + pos, buf, k);
+        else
+            memcpy(buf, iov->in + pos, k);
+        buf += k;
+        n -= k;
+    }
+    if (tooutput)
+        WSAES_TRACE_END(copyout, len);
+    else
+        WSAES_TRACE_END(copyin, len);
+}
+
+
+/*
+ * Show the tap n bytes of the stream of iov from offset pos: the inputs when 
+ * encrypting, the outputs when decrypting
+ */
+static void iovtap(const wsaes_tap_t *tap, int mode, const wsaes_iov_t *iov, size_t pos, size_t n)
+{
+    size_t k;
+
+    if (NULL == tap)
+        return;
+    for (; pos >= iov->len; iov++)
+        pos -= iov->len;
+    for (; n > 0; iov++, pos = 0)
+    {
+        k = (iov->len - pos < n) ? iov->len - pos : n;
+        tapdata(tap, (ENCRYPT == mode) ? iov->in + pos : iov->out + pos, k);
+        n -= k;
+    }
+}
+
+
+/*
+ * Publish submission entries [oldtail, newtail), ringing the doorbell if the 
+ * device may have gone to sleep on an empty ring
+ */
+static int ringsubmit(wsaes_session_t *sess, uint32_t oldtail, uint32_t newtail)
+{
+    struct wsaes_ring_hdr *hdr = sess->hdr;
+
+    __atomic_store_n(&hdr->sq_tail, newtail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->sq_head, __ATOMIC_ACQUIRE) == oldtail)
+        return dev_ioctl(sess->fd, IOCTL_RING_DOORBELL, 0);
+    return 0;
+}
+
+
+/*
+ * Wait until the completion ring has entries, and return its tail through *tailp.
+ * Returns -1 if waiting for them failed
+ */
+static int ringwait(wsaes_session_t *sess, uint32_t *tailp, uint32_t inflight)
+{
+    struct wsaes_ring_hdr *hdr = sess->hdr;
+    uint32_t head = hdr->cq_head;
+
+    WSAES_TRACE_BEGIN(ringwait, inflight);
+    for (int spin=0; head == (*tailp = __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE)); spin++)
+    {
+        if (spin >= RINGSPIN && dev_ioctl(sess->fd, IOCTL_RING_WAIT, 0) < 0 && EINTR != errno)
+        {
+            WSAES_TRACE_END(ringwait, -1);
+            return -1;
+        }
+    }
+    WSAES_TRACE_END(ringwait, 0);
+    return 0;
+}
+
+
+/*
+ * One stream of ringrun(): the buffers of iov, len bytes of whole blocks in all,
+ * as if they were one
+ */
+typedef struct {
+    int mode;
+    const wsaes_iov_t *iov;
+    size_t len;
+    const uint8_t *iv;      // loaded by the stream's first entry, if not NULL
+    const wsaes_tap_t *tap;
+    size_t reaped;          // bytes back from the device
+    int32_t status;         // 0, or the error that stopped the stream
+} ringstream_t;
+
+/*
+ * Run streams through the rings one after the other, in as few calls as possible.
+ * The data region is split into slots of at most caps.maxxfer bytes (and at least
+ * two slots), and every chunk is posted as soon as it has been copied into its
+ * slot, so the device works on one chunk while the next is copied in and finished
+ * ones are copied out. The device carries the CBC chain from one entry to the 
+ * next, as it does across write() calls, until an entry loads an IV, and completes
+ * entries in order, so an entry's slot follows from its number (its cookie).
+ * A stream's IV goes in its first entry, saving the mode ioctl and write of 
+ * aes256setiv_sess(). A failed chunk stops its stream, but the entries already in
+ * flight are still reaped. Returns 0, or the first stream's error.
+ * If the doorbell or the wait fails, entries may be left behind on the rings, 
+ * so the session stops using them and falls back to write()/read()
+ */
+static int32_t ringrun(wsaes_session_t *sess, ringstream_t *st, int nst)
 {
-    //printf("Checking for kernel module...\n");
-    if( access( devicefname, F_OK ) != -1 ) 
+    struct wsaes_ring_hdr *hdr = sess->hdr;
+    uint32_t region = sess->ring.data_size - sess->ring.data_size % AESBLKSIZE;
+    uint32_t unit = xferunit(sess, st[0].mode), slotsize, nslots, inflight = 0, chunk, tail, off;
+    struct { int s; size_t pos; } slotmap[RINGENTRIES]; // stream and offset of the chunk in each slot
+    uint64_t seq = 0;
+    size_t pos = 0;
+    int cur = 0, err = 0;
+
+    slotsize = (region / 2 < maxchunk(sess, st[0].mode)) ? region / 2 : maxchunk(sess, st[0].mode);
+    slotsize -= slotsize % unit;
+    if (slotsize < unit)
+        slotsize = unit;
+    nslots = region / slotsize;
+    if (nslots > sess->ring.sq_entries)
+        nslots = sess->ring.sq_entries;
+    if (nslots > sess->ring.cq_entries)
+        nslots = sess->ring.cq_entries;
+    if (nslots > RINGENTRIES)
+        nslots = RINGENTRIES;
+
+    for (;;)
     {
-        //printf("Found device!\n");
-        return 0;
-    } 
-    else 
+        while (cur < nst && inflight < nslots)
+        {
+            ringstream_t *t = &st[cur];
+            struct wsaes_sqe *sqe;
+            if (0 != t->status || pos == t->len)
+            {
+                cur++;
+                pos = 0;
+                continue;
+            }
+            chunk = (t->len - pos < slotsize) ? t->len - pos : slotsize;
+            off = (seq % nslots) * slotsize;
+            iovcopy(t->iov, pos, sess->data + off, chunk, 0);
+
+            tail = hdr->sq_tail;
+            sqe = &sess->sq[tail & hdr->sq_mask];
+            sqe->offset = off;
+            sqe->length = chunk;
+            sqe->mode = t->mode;
+            sqe->flags = 0;
+            sqe->cookie = seq;
+            if (NULL != t->iv && 0 == pos)
+            {
+                sqe->flags = WSAES_SQE_IV;
+                memcpy(sqe->iv, t->iv, AESIVSIZE);
+            }
+            slotmap[seq % nslots].s = cur;
+            slotmap[seq % nslots].pos = pos;
+            if (0 != ringsubmit(sess, tail, tail + 1))
+                goto ringfailed;
+            if (ENCRYPT == t->mode)
+                iovtap(t->tap, t->mode, t->iov, pos, chunk);
+            pos += chunk;
+            seq++;
+            inflight++;
+        }
+        if (0 == inflight)
+            break;
+
+        if (ringwait(sess, &tail, inflight) < 0)
+            goto ringfailed;
+        for (uint32_t head = hdr->cq_head; head != tail; head++, inflight--)
+        {
+            struct wsaes_cqe *cqe = &sess->cq[head & hdr->cq_mask];
+            uint32_t slot = cqe->cookie % nslots;
+            ringstream_t *t = &st[slotmap[slot].s];
+            if (0 != cqe->status && 0 == t->status)
+            {
+                t->status = -cqe->status;
+                fprintf(stderr, "ERROR: Device failed to process data: %s\n", strerror(t->status));
+            }
+            if (0 == t->status)
+            {
+                iovcopy(t->iov, slotmap[slot].pos, sess->data + slot * slotsize, cqe->length, 1);
+                if (DECRYPT == t->mode)
+                    iovtap(t->tap, t->mode, t->iov, slotmap[slot].pos, cqe->length);
+                t->reaped += cqe->length;
+            }
+        }
+        __atomic_store_n(&hdr->cq_head, tail, __ATOMIC_RELEASE);
+    }
+    for (int k=0; k<nst && 0 == err; k++)
+        err = st[k].status;
+    return err;
+
+ringfailed:
+    err = errno;
+    perror("ERROR: Device ring failed, falling back to write()/read()");
+    sess->caps.flags &= ~WSAES_CAP_RING;
+    for (int k=0; k<nst; k++)
     {
-        fprintf(stderr, "ERROR: Couldn't find device %s\n", devicefname);
-        return -1; 
+        if (0 == st[k].status && st[k].reaped < st[k].len)
+            st[k].status = err;
     }
+    return err;
 }
 
 
 /*
- *
+ * Stream the buffers of iov, len bytes of whole blocks in all, through the rings
+ * as if they were one, see ringrun()
  */
-int32_t aes256setkey(uint8_t *keyp)
+static int32_t ringxfer(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, size_t len, const uint8_t *iv,
+                        const wsaes_tap_t *tap)
 {
-    int fd, ret = 0;
-    
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
-    }
+    ringstream_t st = { mode, iov, len, iv, tap, 0, 0 };
 
-    //printf("setting key\n");
-    ret = ioctl(fd, IOCTL_SET_MODE, SET_KEY); // switch mode 
-    if (ret < 0) {
-        perror("ERROR: Failed to set mode.");
-        return errno;
-    }
-    ret = write(fd, keyp, AESKEYSIZE); // write key 
-    if (ret < 0) {
-        perror("ERROR: Failed to write KEY to the device.");
-        return errno;
-    }
+    return ringrun(sess, &st, 1);
+}
 
-    // close and exit
-    if(close(fd)<0)
-        perror("ERROR: Error closing file");
 
-    return 0;
+/*
+ * One-shot versions of the session calls: each of these opens its own session on
+ * the device (without rings, which would not outlive the call) and closes it 
+ * again before returning
+ */
+int32_t aes256setkey(uint8_t *keyp)
+{
+    wsaes_session_t *sess;
+    int32_t ret;
+
+    if (0 != (ret = opensess(&sess, 0, 0)))
+        return ret;
+    ret = aes256setkey_sess(sess, keyp);
+    aes256close(sess);
+    return ret;
 }
 
 
@@ -78,31 +942,14 @@ int32_t aes256setkey(uint8_t *keyp)
  */
 int32_t aes256setiv(uint8_t *ivp)
 {
-    int fd, ret = 0;
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
-    }
-
-    //printf("setting IV\n");
-    ret = ioctl(fd, IOCTL_SET_MODE, SET_IV); // switch mode 
-    if (ret < 0) {
-        perror("ERROR: Failed to set mode.");
-        return errno;
-    }
-    ret = write(fd, ivp, AESIVSIZE); // write IV
-    if (ret < 0) {
-        perror("ERROR: Failed to write IV to the device.");
-        return errno;
-    }
-    
-    // close and exit
-    if(close(fd)<0)
-        perror("ERROR: Error closing file");
+    wsaes_session_t *sess;
+    int32_t ret;
 
-    return 0;
+    if (0 != (ret = opensess(&sess, 0, 0)))
+        return ret;
+    ret = aes256setiv_sess(sess, ivp);
+    aes256close(sess);
+    return ret;
 }
 
 
@@ -111,26 +958,47 @@ int32_t aes256setiv(uint8_t *ivp)
  */
 int32_t aes256reset(void)
 {
-    int fd, ret = 0;
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
-    }
+    wsaes_session_t *sess;
+    int32_t ret;
 
-    // Reset block 
-    ret = ioctl(fd, IOCTL_SET_MODE, RESET); 
-    if (ret < 0) {
-        perror("ERROR: failed to reset AES block... \n");
-        return errno;
-    }
+    if (0 != (ret = opensess(&sess, 0, 0)))
+        return ret;
+    ret = aes256reset_sess(sess);
+    aes256close(sess);
+    return ret;
+}
 
-    // close and exit
-    if(close(fd)<0)
-        perror("ERROR: Error closing file");
 
-    return 0;
+/*
+ *
+ */
+int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp)
+{
+    wsaes_session_t *sess;
+    int32_t ret, cret;
+
+    if (0 != (ret = opensess(&sess, 0, 0)))
+        return ret;
+    ret = aes256_sess(sess, mode, inp, inlen, outp, lenp);
+    cret = aes256close(sess);
+    return (0 != ret) ? ret : cret;
+}
+
+
+/*
+ * Unlike the other one-shot calls this one sets up rings: a batch is usually big
+ * enough that one pass through them saves more syscalls than mapping them costs
+ */
+int32_t aes256_batch(wsaes_job_t *jobs, int njobs)
+{
+    wsaes_session_t *sess;
+    int32_t ret, cret;
+
+    if (0 != (ret = opensess(&sess, 0, 1)))
+        return ret;
+    ret = aes256batch_sess(sess, jobs, njobs);
+    cret = aes256close(sess);
+    return (0 != ret) ? ret : cret;
 }
 
 
@@ -138,31 +1006,76 @@ int32_t aes256reset(void)
 /*
  * 
  */
-int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp) 
+int32_t aes256_sess(wsaes_session_t *sess, int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp) 
+{
+    int32_t ret = aes256stream_sess(sess, mode, inp, inlen, outp);
+
+    if (0 == ret)
+        *lenp = inlen;
+    return ret;
+}
+
+
+/*
+ * Inputs of any length are streamed through the device in chunks it can take,
+ * see ringxfer() and bulkxfer(); the device carries the CBC chain across them
+ */
+int32_t aes256stream_sess(wsaes_session_t *sess, int mode, const uint8_t *inp, size_t inlen, uint8_t *outp)
+{
+    wsaes_iov_t iov = { inp, outp, inlen };
+
+    return aes256streamv_sess(sess, mode, &iov, 1);
+}
+
+
+/*
+ * Several buffers in one device transaction, chained as if they were one: on a
+ * device with rings, they are packed together into the ring's chunks
+ */
+int32_t aes256streamv_sess(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov)
+{
+    return aes256streamtap_sess(sess, mode, iov, niov, NULL);
+}
+
+
+/*
+ * Stream the buffers of iov through the device in mode, first loading iv (if not 
+ * NULL) as for aes256setiv_sess() and resetting the device
+ */
+static int32_t streamxfer(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov, const uint8_t *iv,
+                          const wsaes_tap_t *tap)
 {
-    int32_t fd, ret;
+    uint32_t unit = AESBLKSIZE;
+    size_t inlen = 0;
+    int32_t ret;
 
-    // check bounds against max length 
-    if (inlen > AESMAXDATASIZE)
+    if (XTS_ENCRYPT == mode || XTS_DECRYPT == mode)
     {
-        fprintf(stderr, "ERROR: Provided data length (%d) too large, must be less than %d bytes\n",
-                inlen, AESMAXDATASIZE);
-        return -1;
+        if (!(sess->caps.flags & WSAES_CAP_XTS) || 0 == sess->sectorsize)
+        {
+            fprintf(stderr, "ERROR: XTS needs a device that supports it, and a sector size\n");
+            return -1;
+        }
+        unit = sess->sectorsize;
+    }
+    for (int k=0; k<niov; k++)
+    {
+        // only a single buffer may end in a partial block, and XTS takes whole sectors
+        if ((niov > 1 || AESBLKSIZE != unit) && 0 != iov[k].len % unit)
+        {
+            fprintf(stderr, "ERROR: Provided data length (%zu) of buffer %d is not a multiple of %u bytes\n",
+                    iov[k].len, k, unit);
+            return -1;
+        }
+        inlen += iov[k].len;
     }
-    else if (0 >= inlen)
+    if (0 == inlen)
     {
-        fprintf(stderr, "ERROR: Provided data length (%d) too small, must be at least 1 bytes\n",
+        fprintf(stderr, "ERROR: Provided data length (%zu) too small, must be at least 1 bytes\n",
                 inlen);
         return -1;
     }
 
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
-    }
-
     //// Reset block 
     //ret = ioctl(fd, IOCTL_SET_MODE, RESET); 
     //if (ret < 0) {
@@ -170,15 +1083,25 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
     //    return errno;
     //}
 
-    // Set mode to ENCRYPT/DECRYPT
-    if (mode != ENCRYPT && mode != DECRYPT)
+    // whole blocks go through the rings when the device has them, with the mode in each descriptor
+    int ring = (sess->caps.flags & WSAES_CAP_RING) && 0 == inlen % AESBLKSIZE && sess->ring.data_size >= unit;
+
+    // Set mode to ENCRYPT/DECRYPT/CTR/XTS_ENCRYPT/XTS_DECRYPT
+    if (mode != ENCRYPT && mode != DECRYPT && mode != CTR && mode != XTS_ENCRYPT && mode != XTS_DECRYPT)
     {
-        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
+        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT, DECRYPT, CTR or XTS\n");
         return -1;
     }
-    else
+    else if (CTR == mode && (!(sess->caps.flags & WSAES_CAP_CTR) || 0 != inlen % AESBLKSIZE))
+    {
+        fprintf(stderr, "ERROR: CTR needs a device that supports it, and whole blocks\n");
+        return -1;
+    }
+    else if (!ring)
     {
-        ret = ioctl(fd, IOCTL_SET_MODE, (ciphermode_t)mode); 
+        if (NULL != iv && (0 != (ret = loadiv(sess, iv)) || 0 != (ret = resetdev(sess))))
+            return ret;
+        ret = dev_ioctl(sess->fd, IOCTL_SET_MODE, (ciphermode_t)mode); 
         if (ret < 0) {
             perror("ERROR: failed to set mode, ioctl returns errno \n");
             return errno;
@@ -215,26 +1138,55 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
 //        *lenp = inlen;
 //        orignumbytes = inlen;
 //    }
-    *lenp = inlen;
-    // initialize output memory to all zeros
-    memset((void*)outp, 0, inlen);
    
+    // RING/BULK TRANSFER: bitstreams that support it take all complete blocks in large chunks
+    int bulk = ring || (sess->caps.flags & WSAES_CAP_BULK);
+    if (ring)
+        ret = ringxfer(sess, mode, iov, inlen, iv, tap);
+    else if ((sess->caps.flags & WSAES_CAP_QUEUE) && sess->depth > 1 && (niov > 1 || inlen > maxchunk(sess, mode)))
+        ret = pipexfer(sess, mode, iov, niov, (sess->depth < sess->qdepth) ? sess->depth : sess->qdepth, tap);
+    else
+    {
+        ret = 0;
+        for (int k=0; bulk && 0==ret && k<niov; k++)
+            ret = bulkxfer(sess, mode, iov[k].in, iov[k].out, iov[k].len - iov[k].len % AESBLKSIZE, tap);
+    }
+    if (0 != ret)
+        return ret;
+
     // MAIN DATA SENDING LOOP: 
-    // send each complete 16-byte block of data to the LKM for processing and read back the result
-    for (int i=0; i<inlen; i+=AESBLKSIZE)
+    // send each remaining 16-byte block of data to the LKM for processing and read back the result
+    for (int k=0; k<niov; k++)
     {
-        // send 16 byte block from caller to AES block
-        ret = write(fd, &(inp[i]), AESBLKSIZE); 
-        if (ret < 0) {
-            perror("ERROR: Failed to write data to the AES block... ");   
-            return errno;                                                      
-        }
+        const uint8_t *inp = iov[k].in;
+        uint8_t *outp = iov[k].out;
+        for (size_t i=(bulk ? iov[k].len - iov[k].len % AESBLKSIZE : 0); i<iov[k].len; i+=AESBLKSIZE)
+        {
+            size_t n = (iov[k].len - i < AESBLKSIZE) ? iov[k].len - i : AESBLKSIZE;
+            uint8_t part[AESBLKSIZE] = { 0 };
+            // a partial last block goes through part, zero-padded, so nothing past the caller's buffers is touched
+            const uint8_t *blkin = (AESBLKSIZE == n) ? &(inp[i]) : memcpy(part, &(inp[i]), n);
+            uint8_t *blkout = (AESBLKSIZE == n) ? &(outp[i]) : part;
 
-        // read back processed 16 byte block into caller memory from AES block
-        ret = read(fd, &(outp[i]), AESBLKSIZE);
-        if (ret < 0){
-            perror("Failed to read data back from the AES block... ");
-            return errno;
+            // send 16 byte block from caller to AES block
+            ret = dev_write(sess->fd, blkin, AESBLKSIZE); 
+            if (ret < 0) {
+                perror("ERROR: Failed to write data to the AES block... ");   
+                return errno;                                                      
+            }
+            if (ENCRYPT == mode)
+                tapdata(tap, &(inp[i]), n);
+
+            // read back processed 16 byte block into caller memory from AES block
+            ret = dev_read(sess->fd, blkout, AESBLKSIZE);
+            if (ret < 0){
+                perror("Failed to read data back from the AES block... ");
+                return errno;
+            }
+            if (blkout == part)
+                memcpy(&(outp[i]), part, n);
+            if (DECRYPT == mode)
+                tapdata(tap, &(outp[i]), n);
         }
     }    
 
@@ -242,26 +1194,382 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
 //    if (mode == ENCRYPT)
 //    {
 //        // send final padded block
-//        ret = write(fd, lastblock, AESBLKSIZE); 
+//        ret = dev_write(sess->fd, lastblock, AESBLKSIZE); 
 //        if (ret < 0) {
 //            perror("ERROR: Failed to write data to the AES block... ");   
 //            return errno;                                                      
 //        }
 //        // read back processed final padded block
-//        ret = read(fd, &(outp[orignumbytes]), AESBLKSIZE);
+//        ret = dev_read(sess->fd, &(outp[orignumbytes]), AESBLKSIZE);
 //        if (ret < 0){
 //            perror("Failed to read data back from the AES block... ");
 //            return errno;
 //        }
 //    }
 
-    // close and exit
-    if(close(fd)<0)
+    return 0;
+}
+
+
+
+/* aes256streamv_sess() showing tap (if not NULL) the plaintext as it goes */
+static int32_t streamtap(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov, const wsaes_tap_t *tap)
+{
+    if (XTS_ENCRYPT == mode || XTS_DECRYPT == mode)
+    {
+        fprintf(stderr, "ERROR: XTS runs through aes256xts_sess()\n");
+        return -1;
+    }
+    return streamxfer(sess, mode, iov, niov, NULL, tap);
+}
+
+/*
+ * A run of XTS sectors in one transaction. On a device with rings the sector 
+ * size ioctl is the only call besides the ring's own: the first ring entry loads 
+ * the starting tweak
+ */
+static int32_t xtsrun(wsaes_session_t *sess, int mode, const uint8_t *tweak, uint32_t sectorsize,
+                      const uint8_t *inp, uint8_t *outp, size_t nsectors)
+{
+    wsaes_iov_t iov = { inp, outp, nsectors * sectorsize };
+
+    if (!(sess->caps.flags & WSAES_CAP_XTS))
+    {
+        fprintf(stderr, "ERROR: the device doesn't support XTS\n");
+        return -1;
+    }
+    if (mode != ENCRYPT && mode != DECRYPT)
     {
-        perror("aes256: Error closing file");
+        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
+        return -1;
+    }
+    if (0 == sectorsize || 0 != sectorsize % AESBLKSIZE || sectorsize > sess->caps.maxxfer || 0 == nsectors)
+    {
+        fprintf(stderr, "ERROR: invalid sector size (%u) or count (%zu)\n", sectorsize, nsectors);
+        return -1;
+    }
+
+    // the sector size is device state like the key, which other sessions may have changed since
+    sess->sectorsize = 0;
+    if (dev_ioctl(sess->fd, IOCTL_SET_SECTOR, sectorsize) < 0)
+    {
+        perror("ERROR: failed to set the sector size");
         return errno;
     }
+    sess->sectorsize = sectorsize;
+    return streamxfer(sess, (ENCRYPT == mode) ? XTS_ENCRYPT : XTS_DECRYPT, &iov, 1, tweak, NULL);
+}
 
-    return 0;
+
+/*
+ * XTS from sector number sector, whose tweak is the number in little-endian order
+ */
+int32_t aes256xts_sess(wsaes_session_t *sess, int mode, uint64_t sector, uint32_t sectorsize,
+                       const uint8_t *inp, uint8_t *outp, size_t nsectors)
+{
+    uint8_t tweak[AESIVSIZE] = { 0 };
+
+    for (int i=0; i<8; i++)
+        tweak[i] = (uint8_t)(sector >> (8 * i));
+    return aes256xtstweak_sess(sess, mode, tweak, sectorsize, inp, outp, nsectors);
+}
+
+
+/* Whether jobs a and b run under the same key; a NULL key is the one loaded */
+static int samekey(const uint8_t *a, const uint8_t *b)
+{
+    return (NULL == a || NULL == b) ? a == b : 0 == memcmp(a, b, AESKEYSIZE);
+}
+
+/*
+ * Order jobs by key, those under the loaded key first, and by position among jobs
+ * with the same key
+ */
+static int jobcmp(const void *a, const void *b)
+{
+    const wsaes_job_t *x = *(const wsaes_job_t* const*)a, *y = *(const wsaes_job_t* const*)b;
+    int c;
+
+    if (NULL == x->key || NULL == y->key)
+        c = (NULL != x->key) - (NULL != y->key);
+    else
+        c = memcmp(x->key, y->key, AESKEYSIZE);
+    if (0 != c)
+        return c;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Whether job can run: a data mode the device has, an IV, and whole blocks */
+static int jobvalid(wsaes_session_t *sess, const wsaes_job_t *job, size_t *lenp)
+{
+    size_t len = 0;
+
+    if ((ENCRYPT != job->mode && DECRYPT != job->mode && CTR != job->mode) ||
+        (CTR == job->mode && !(sess->caps.flags & WSAES_CAP_CTR)) ||
+        NULL == job->iv || NULL == job->iov || job->niov < 1)
+        return 0;
+    for (int k=0; k<job->niov; k++)
+    {
+        if (0 != job->iov[k].len % AESBLKSIZE)
+            return 0;
+        len += job->iov[k].len;
+    }
+    *lenp = len;
+    return len > 0;
+}
+
+
+/*
+ * Jobs are grouped by key, so each distinct key is loaded once. On a device with
+ * rings, a group is a single pass through them (see ringrun()); otherwise every 
+ * job loads its IV and streams through write()/read() on its own. On a device
+ * with key slots the keys go into the last slot, which no caller is given, and
+ * the slot selected through the session before is selected again after them
+ */
+static int32_t runbatch(wsaes_session_t *sess, wsaes_job_t *jobs, int njobs)
+{
+    wsaes_job_t **order;
+    ringstream_t *st;
+    size_t *lens;
+    int32_t ret = 0;
+    int n = 0, end, scratch = 0;
+
+    if (njobs <= 0)
+        return 0;
+    order = malloc(njobs * sizeof(*order));
+    st = malloc(njobs * sizeof(*st));
+    lens = malloc(njobs * sizeof(*lens));
+    if (NULL == order || NULL == st || NULL == lens)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate a batch of %d jobs\n", njobs);
+        free(order);
+        free(st);
+        free(lens);
+        return -1;
+    }
+    for (int j=0; j<njobs; j++)
+    {
+        jobs[j].status = 0;
+        if (jobvalid(sess, &jobs[j], &lens[j]))
+            order[n++] = &jobs[j];
+        else
+        {
+            fprintf(stderr, "ERROR: invalid batch job %d: it needs a mode the device has, an IV and whole blocks\n",
+                    j);
+            jobs[j].status = -1;
+        }
+    }
+    qsort(order, n, sizeof(*order), jobcmp);
+
+    for (int g=0; g<n; g=end)
+    {
+        int32_t keyret;
+        for (end=g+1; end<n && samekey(order[end]->key, order[g]->key); end++)
+            ;
+        if (NULL != order[g]->key)
+        {
+            // jobs without a key sort first, so they have run under the slot selected before
+            keyret = 0;
+            if (!scratch && (sess->caps.flags & WSAES_CAP_KEYSLOTS))
+            {
+                scratch = 1;
+                keyret = setslot(sess, sess->keyslots - 1);
+            }
+            if (0 == keyret)
+                keyret = loadkey(sess, order[g]->key);
+            if (0 != keyret)
+            {
+                for (int k=g; k<end; k++)
+                    order[k]->status = keyret;
+                continue;
+            }
+        }
+
+        if (sess->caps.flags & WSAES_CAP_RING)
+        {
+            for (int k=g; k<end; k++)
+                st[k - g] = (ringstream_t){ order[k]->mode, order[k]->iov, lens[order[k] - jobs], order[k]->iv,
+                                            NULL, 0, 0 };
+            ringrun(sess, st, end - g);
+            for (int k=g; k<end; k++)
+                order[k]->status = st[k - g].status;
+        }
+        else
+        {
+            for (int k=g; k<end; k++)
+                order[k]->status = streamxfer(sess, order[k]->mode, order[k]->iov, order[k]->niov, order[k]->iv,
+                                              NULL);
+        }
+    }
+
+    if (scratch && UINT32_MAX != sess->slot)
+        ret = setslot(sess, sess->slot);
+    for (int j=0; j<njobs && 0 == ret; j++)
+        ret = jobs[j].status;
+    free(order);
+    free(st);
+    free(lens);
+    return ret;
+}
+
+
+/*
+ * The calls that use the device's registers, each holding the device for its whole
+ * length; see devlocks
+ */
+static void devlocks_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for (int i=0; i<WSAES_MAXDEVS; i++)
+        pthread_mutex_init(&devlocks[i], &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void aes256lock_sess(wsaes_session_t *sess)
+{
+    pthread_once(&devlocks_once, devlocks_init);
+    WSAES_TRACE_BEGIN(lock, sess->dev);
+    pthread_mutex_lock(&devlocks[sess->dev]);
+    WSAES_TRACE_END(lock, sess->dev);
+}
+
+void aes256unlock_sess(wsaes_session_t *sess)
+{
+    pthread_mutex_unlock(&devlocks[sess->dev]);
+}
+
+int32_t aes256setkey_sess(wsaes_session_t *sess, uint8_t *keyp)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, SET_KEY);
+    aes256lock_sess(sess);
+    ret = loadkey(sess, keyp);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256usekeyslot_sess(wsaes_session_t *sess, uint32_t slot)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, SET_KEY);
+    aes256lock_sess(sess);
+    ret = selectslot(sess, slot);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256setkeyslot_sess(wsaes_session_t *sess, uint32_t slot, uint8_t *keyp)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, SET_KEY);
+    aes256lock_sess(sess);
+    if (0 == (ret = selectslot(sess, slot)))
+        ret = loadkey(sess, keyp);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
 }
 
+int32_t aes256settweakkey_sess(wsaes_session_t *sess, uint8_t *keyp)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, SET_TWEAKKEY);
+    aes256lock_sess(sess);
+    ret = loadtweakkey(sess, keyp);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256setiv_sess(wsaes_session_t *sess, uint8_t *ivp)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, SET_IV);
+    aes256lock_sess(sess);
+    ret = loadiv(sess, ivp);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256reset_sess(wsaes_session_t *sess)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, RESET);
+    aes256lock_sess(sess);
+    ret = resetdev(sess);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256streamtap_sess(wsaes_session_t *sess, int mode, const wsaes_iov_t *iov, int niov, const wsaes_tap_t *tap)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, mode);
+    aes256lock_sess(sess);
+    ret = streamtap(sess, mode, iov, niov, tap);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+int32_t aes256xtstweak_sess(wsaes_session_t *sess, int mode, const uint8_t *tweak, uint32_t sectorsize,
+                            const uint8_t *inp, uint8_t *outp, size_t nsectors)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, mode);
+    aes256lock_sess(sess);
+    ret = xtsrun(sess, mode, tweak, sectorsize, inp, outp, nsectors);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+/* Every job carries its own key, IV and mode, so a batch is atomic however many threads share the device */
+int32_t aes256batch_sess(wsaes_session_t *sess, wsaes_job_t *jobs, int njobs)
+{
+    int32_t ret;
+
+    WSAES_TRACE_BEGIN(request, njobs);
+    aes256lock_sess(sess);
+    ret = runbatch(sess, jobs, njobs);
+    aes256unlock_sess(sess);
+    WSAES_TRACE_END(request, ret);
+    return ret;
+}
+
+
+/*
+ * Syscall counters
+ */
+void aes256getsyscalls(aes256syscalls_t *cntp)
+{
+    cntp->open = __atomic_load_n(&syscalls.open, __ATOMIC_RELAXED);
+    cntp->close = __atomic_load_n(&syscalls.close, __ATOMIC_RELAXED);
+    cntp->ioctl = __atomic_load_n(&syscalls.ioctl, __ATOMIC_RELAXED);
+    cntp->write = __atomic_load_n(&syscalls.write, __ATOMIC_RELAXED);
+    cntp->read = __atomic_load_n(&syscalls.read, __ATOMIC_RELAXED);
+}
+
+void aes256resetsyscalls(void)
+{
+    __atomic_store_n(&syscalls.open, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&syscalls.close, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&syscalls.ioctl, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&syscalls.write, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&syscalls.read, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,543 @@
+/*
+ * Broker backend of the device API
+ *
+ * With WSAES_BACKEND=broker the API doesn't open the devices itself: every transfer
+ * goes to the broker daemon (daemon/wsaesbrokerd.c), which owns the devices and
+ * batches the transfers of all its clients, over the shared memory described in
+ * wsaes_broker.h. The daemon's socket is WSAES_BROKER in the environment, or
+ * WSAES_BROKER_PATH_DEFAULT; the backend connects on first use, and again in a
+ * child after fork(), since the rings of a connection have a single producer.
+ * Every key goes through the broker, so the backend only takes a region from a
+ * broker that runs as root or as the same user as the process.
+ *
+ * Towards the API the backend is a device that queues bulk transfers
+ * (WSAES_CAP_QUEUE), like the emulator, and does counter mode if the broker's
+ * devices do. The key, IV and mode registers live here, per process and device,
+ * and each transfer carries them to the broker, so every process sees registers of
+ * its own. The CBC chain a transfer starts from is worked out here as well, except
+ * after an encryption that hasn't been read back yet; such a transfer goes with
+ * WSAES_SLOT_CHAIN and the broker carries the chain on.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "wsaes_api.h"
+#include "wsaeskern.h"
+#include "wsaes_backend.h"
+#include "wsaes_broker.h"
+
+#define BROKER_MAXFDS 1024
+#define BROKER_FDBASE 2000 // clear of the emulator's descriptors
+#define BROKER_WAIT_NS 100000000 // how long a wait sleeps before checking that the broker is still there
+
+/* Registers and queued transfers of a device, as this process sees it */
+typedef struct {
+    pthread_mutex_t lock;
+    ciphermode_t mode;
+    uint8_t key[AESKEYSIZE];
+    int keyset;
+    uint8_t iv[AESIVSIZE];
+    uint8_t chain[AESIVSIZE]; // where the next transfer starts from, if chainknown
+    int chainknown;
+    uint32_t q[WSAES_BROKER_QDEPTH]; // slots of the queued transfers, free-running counts of those read back
+    uint32_t qhead, qtail;           // and written
+    uint32_t qoff;                   // bytes of the oldest one already read back
+} broker_dev_t;
+
+/* The connection, the free slots and the descriptors, under broker_lock */
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t broker_pid = 0; // the process that is connected, 0 if none
+static int broker_sock = -1;
+static int broker_doorbell = -1;
+static int broker_warned = 0;
+static struct wsaes_broker_hello broker_hello;
+static uint8_t *broker_map = NULL;
+static struct wsaes_broker_hdr *broker_hdr;
+static uint32_t *broker_sq;
+static struct wsaes_broker_slot *broker_slots;
+static uint8_t *broker_data;
+static uint32_t *broker_free;
+static uint32_t broker_nfree;
+static broker_dev_t broker_devs[WSAES_MAXDEVS];
+static uint8_t broker_fds[BROKER_MAXFDS]; // device number + 1 of each open descriptor, 0 if closed
+
+/* Drop the connection, called with broker_lock held */
+static void broker_disconnect(void)
+{
+    if (NULL != broker_map)
+        munmap(broker_map, broker_hello.map_size);
+    if (broker_sock >= 0)
+        close(broker_sock);
+    if (broker_doorbell >= 0)
+        close(broker_doorbell);
+    free(broker_free);
+    broker_map = NULL;
+    broker_free = NULL;
+    broker_sock = broker_doorbell = -1;
+    broker_pid = 0;
+}
+
+/*
+ * Connect to the broker, unless this process already is. Called with broker_lock
+ * held; the connection of the parent of a fork is dropped, along with its descriptors
+ */
+static int broker_connect(void)
+{
+    const char *path = getenv("WSAES_BROKER");
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    union { struct cmsghdr h; char buf[CMSG_SPACE(2 * sizeof(int))]; } ctl;
+    struct iovec iov = { &broker_hello, sizeof(broker_hello) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                          .msg_controllen = sizeof(ctl.buf) };
+    struct cmsghdr *cmsg;
+    struct ucred peer;
+    socklen_t peerlen = sizeof(peer);
+    int fds[2] = { -1, -1 };
+    ssize_t n;
+
+    if (getpid() == broker_pid)
+        return 0;
+    broker_disconnect();
+    memset(broker_fds, 0, sizeof(broker_fds));
+
+    if (NULL == path || '\0' == *path)
+        path = WSAES_BROKER_PATH_DEFAULT;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        goto fail;
+    }
+    strcpy(addr.sun_path, path);
+    if ((broker_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(broker_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockopt(broker_sock, SOL_SOCKET, SO_PEERCRED, &peer, &peerlen) < 0)
+        goto fail;
+    // whoever listens gets the keys: only root or this process's own user will do
+    if (0 != peer.uid && geteuid() != peer.uid)
+    {
+        if (!broker_warned)
+            fprintf(stderr, "ERROR: the wsaes broker at %s runs as uid %u, neither root nor this user\n", path,
+                    (unsigned)peer.uid);
+        broker_warned = 1;
+        errno = EPERM;
+        goto fail;
+    }
+    n = recvmsg(broker_sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type &&
+        CMSG_LEN(sizeof(fds)) == cmsg->cmsg_len)
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (n != sizeof(broker_hello) || fds[0] < 0 || WSAES_BROKER_VERSION != broker_hello.version ||
+        0 == broker_hello.nslots || 0 != (broker_hello.nslots & (broker_hello.nslots - 1)) ||
+        broker_hello.ndevs > WSAES_MAXDEVS || broker_hello.maxxfer < AESBLKSIZE)
+    {
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        errno = (n < 0) ? errno : EPROTO;
+        goto fail;
+    }
+    broker_doorbell = fds[1];
+    broker_map = mmap(NULL, broker_hello.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    broker_free = malloc(broker_hello.nslots * sizeof(*broker_free));
+    if (MAP_FAILED == broker_map || NULL == broker_free)
+    {
+        if (MAP_FAILED == broker_map)
+            broker_map = NULL;
+        goto fail;
+    }
+    broker_hdr = (struct wsaes_broker_hdr*)broker_map;
+    broker_sq = (uint32_t*)(broker_map + broker_hello.sq_off);
+    broker_slots = (struct wsaes_broker_slot*)(broker_map + broker_hello.slot_off);
+    broker_data = broker_map + broker_hello.data_off;
+    for (broker_nfree=0; broker_nfree<broker_hello.nslots; broker_nfree++)
+        broker_free[broker_nfree] = broker_nfree;
+    for (int i=0; i<WSAES_MAXDEVS; i++)
+    {
+        memset(&broker_devs[i], 0, sizeof(broker_devs[i]));
+        pthread_mutex_init(&broker_devs[i].lock, NULL);
+        broker_devs[i].chainknown = 1; // the IV register starts out zero
+    }
+    broker_pid = getpid();
+    return 0;
+
+fail:
+    if (!broker_warned)
+        fprintf(stderr, "ERROR: could not connect to the wsaes broker at %s: %s\n", path, strerror(errno));
+    broker_warned = 1;
+    broker_disconnect();
+    return -1;
+}
+
+/* Device number of a device path, -1 if the broker has no such device. Called connected */
+static int broker_devnum(const char *path)
+{
+    const char *name = "/dev/wsaeschar";
+    size_t len = strlen(name);
+    char *end;
+    long n;
+
+    if (0 != strncmp(path, name, len))
+        return -1;
+    if ('\0' == path[len])
+        return 0;
+    n = strtol(path + len, &end, 10);
+    return ('\0' == *end && end != path + len && n >= 0 && n < broker_hello.ndevs) ? (int)n : -1;
+}
+
+/* Device an open descriptor belongs to, NULL if fd isn't open in this process */
+static broker_dev_t *broker_getdev(int fd)
+{
+    int dev = 0;
+
+    fd -= BROKER_FDBASE;
+    if (fd < 0 || fd >= BROKER_MAXFDS)
+        return NULL;
+    pthread_mutex_lock(&broker_lock);
+    if (getpid() == broker_pid)
+        dev = broker_fds[fd];
+    pthread_mutex_unlock(&broker_lock);
+    return (0 == dev) ? NULL : &broker_devs[dev - 1];
+}
+
+/* The counter n blocks on, as the device's counter mode goes: the whole 16 bytes, big-endian */
+static void broker_ctradd(uint8_t *ctr, uint32_t n)
+{
+    for (int j=AESIVSIZE-1; j>=0 && 0 != n; j--)
+    {
+        n += ctr[j];
+        ctr[j] = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+/* Whether the broker closed its end of the connection, the only way the socket becomes readable */
+static int broker_gone(void)
+{
+    struct pollfd p = { broker_sock, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+/* Wait until the broker is done with a slot */
+static int broker_wait(struct wsaes_broker_slot *s)
+{
+    struct timespec ts = { 0, BROKER_WAIT_NS };
+    uint32_t state;
+
+    while (WSAES_SLOT_DONE != (state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE)))
+    {
+        // announce the sleep, unless the broker finished first
+        if (WSAES_SLOT_QUEUED == state &&
+            !__atomic_compare_exchange_n(&s->state, &state, WSAES_SLOT_WAITING, 0, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_ACQUIRE))
+            continue;
+        if (syscall(SYS_futex, &s->state, FUTEX_WAIT, WSAES_SLOT_WAITING, &ts, NULL, 0) < 0 &&
+            ETIMEDOUT == errno && broker_gone())
+        {
+            fprintf(stderr, "ERROR: the wsaes broker has gone away\n");
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Hand a filled slot to the broker, ringing the doorbell if it sleeps */
+static void broker_submit(uint32_t slot)
+{
+    static const uint64_t one = 1;
+    uint32_t tail;
+
+    pthread_mutex_lock(&broker_lock);
+    tail = broker_hdr->sq_tail;
+    broker_sq[tail & (broker_hello.nslots - 1)] = slot;
+    // pairs with the broker announcing its sleep and then looking at the ring once more
+    __atomic_store_n(&broker_hdr->sq_tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&broker_hdr->sleeping, __ATOMIC_SEQ_CST) && write(broker_doorbell, &one, sizeof(one)) < 0)
+        perror("WARNING: could not ring the wsaes broker's doorbell");
+    pthread_mutex_unlock(&broker_lock);
+}
+
+/* Give the oldest queued transfer of a device back to the free slots. Called with the device locked */
+static void broker_pop(broker_dev_t *dev)
+{
+    pthread_mutex_lock(&broker_lock);
+    broker_free[broker_nfree++] = dev->q[dev->qhead % WSAES_BROKER_QDEPTH];
+    pthread_mutex_unlock(&broker_lock);
+    dev->qhead++;
+    dev->qoff = 0;
+}
+
+
+static int broker_access(const char *path)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&broker_lock);
+    if (0 == broker_connect())
+    {
+        if (broker_devnum(path) >= 0)
+            ret = 0;
+        else
+            errno = ENOENT;
+    }
+    pthread_mutex_unlock(&broker_lock);
+    return ret;
+}
+
+static int broker_open(const char *path, int flags)
+{
+    int dev, fd = -1;
+
+    pthread_mutex_lock(&broker_lock);
+    if (0 == broker_connect())
+    {
+        if ((dev = broker_devnum(path)) < 0)
+            errno = ENOENT;
+        else
+        {
+            for (fd=0; fd<BROKER_MAXFDS && 0 != broker_fds[fd]; fd++)
+                ;
+            if (BROKER_MAXFDS == fd)
+            {
+                errno = EMFILE;
+                fd = -1;
+            }
+            else
+                broker_fds[fd] = (uint8_t)(dev + 1);
+        }
+    }
+    pthread_mutex_unlock(&broker_lock);
+    return (fd < 0) ? -1 : BROKER_FDBASE + fd;
+}
+
+/* Transfers still queued stay with the device, as on the hardware, until the next RESET */
+static int broker_close(int fd)
+{
+    if (NULL == broker_getdev(fd))
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&broker_lock);
+    broker_fds[fd - BROKER_FDBASE] = 0;
+    pthread_mutex_unlock(&broker_lock);
+    return 0;
+}
+
+static int broker_ioctl(int fd, unsigned long req, unsigned long arg)
+{
+    broker_dev_t *dev = broker_getdev(fd);
+    int ret = 0;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    switch (req)
+    {
+        case IOCTL_SET_MODE:
+            if (arg > SET_KEY && !(CTR == arg && (broker_hello.caps & WSAES_CAP_CTR)))
+            {
+                errno = EINVAL;
+                ret = -1;
+                break;
+            }
+            dev->mode = (ciphermode_t)arg;
+            if (RESET == dev->mode)
+            {
+                // discard the queued transfers, once the broker is done with their slots
+                while (dev->qhead != dev->qtail)
+                {
+                    if (0 != broker_wait(&broker_slots[dev->q[dev->qhead % WSAES_BROKER_QDEPTH]]))
+                        break;
+                    broker_pop(dev);
+                }
+                memcpy(dev->chain, dev->iv, AESIVSIZE);
+                dev->chainknown = 1;
+            }
+            break;
+        case IOCTL_GET_MODE:
+            *(char*)arg = (char)dev->mode;
+            break;
+        case IOCTL_GET_CAPS:
+            ((struct wsaes_caps*)arg)->flags = broker_hello.caps;
+            ((struct wsaes_caps*)arg)->maxxfer = broker_hello.maxxfer;
+            break;
+        case IOCTL_GET_QDEPTH:
+            *(__u32*)arg = WSAES_BROKER_QDEPTH;
+            break;
+        default:
+            errno = ENOTTY; // no rings, sectors or key slots through the broker
+            ret = -1;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static ssize_t broker_write(int fd, const void *buf, size_t len)
+{
+    broker_dev_t *dev = broker_getdev(fd);
+    struct wsaes_broker_slot *s;
+    uint32_t slot;
+    ssize_t ret = -1;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    switch (dev->mode)
+    {
+        case SET_KEY:
+            if (AESKEYSIZE != len)
+                goto inval;
+            memcpy(dev->key, buf, AESKEYSIZE);
+            dev->keyset = 1;
+            ret = len;
+            break;
+        case SET_IV:
+            if (AESIVSIZE != len)
+                goto inval;
+            memcpy(dev->iv, buf, AESIVSIZE);
+            memcpy(dev->chain, buf, AESIVSIZE);
+            dev->chainknown = 1;
+            ret = len;
+            break;
+        case ENCRYPT:
+        case DECRYPT:
+        case CTR:
+            if (0 == len || 0 != len % AESBLKSIZE || len > broker_hello.maxxfer || !dev->keyset)
+                goto inval;
+            pthread_mutex_lock(&broker_lock);
+            if (dev->qtail - dev->qhead == WSAES_BROKER_QDEPTH || 0 == broker_nfree)
+            {
+                pthread_mutex_unlock(&broker_lock);
+                errno = EBUSY; // the queue is full of transfers not read back yet
+                break;
+            }
+            slot = broker_free[--broker_nfree];
+            pthread_mutex_unlock(&broker_lock);
+
+            s = &broker_slots[slot];
+            s->state = WSAES_SLOT_QUEUED;
+            s->dev = (uint32_t)(dev - broker_devs);
+            s->mode = dev->mode;
+            s->flags = dev->chainknown ? 0 : WSAES_SLOT_CHAIN;
+            s->len = (uint32_t)len;
+            s->status = 0;
+            memcpy(s->key, dev->key, AESKEYSIZE);
+            memcpy(s->iv, dev->chain, AESIVSIZE);
+            memcpy(broker_data + (size_t)slot * broker_hello.maxxfer, buf, len);
+
+            // the next transfer goes on from the last ciphertext block, or the counter past this one
+            if (DECRYPT == dev->mode)
+            {
+                memcpy(dev->chain, (const uint8_t*)buf + len - AESBLKSIZE, AESBLKSIZE);
+                dev->chainknown = 1;
+            }
+            else if (CTR == dev->mode)
+                broker_ctradd(dev->chain, (uint32_t)(len / AESBLKSIZE));
+            else
+                dev->chainknown = 0; // until this one is read back
+            dev->q[dev->qtail++ % WSAES_BROKER_QDEPTH] = slot;
+            broker_submit(slot);
+            ret = len;
+            break;
+        default:
+            goto inval;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+inval:
+    pthread_mutex_unlock(&dev->lock);
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t broker_read(int fd, void *buf, size_t len)
+{
+    broker_dev_t *dev = broker_getdev(fd);
+    struct wsaes_broker_slot *s;
+    const uint8_t *data;
+    ssize_t ret = 0;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    if (dev->qhead != dev->qtail)
+    {
+        // the oldest queued transfer, once the broker is done with it
+        s = &broker_slots[dev->q[dev->qhead % WSAES_BROKER_QDEPTH]];
+        data = broker_data + (size_t)(s - broker_slots) * broker_hello.maxxfer;
+        if (0 != broker_wait(s))
+            ret = -1;
+        else if (0 != s->status)
+        {
+            broker_pop(dev);
+            errno = EIO;
+            ret = -1;
+        }
+        else
+        {
+            if (len > s->len - dev->qoff)
+                len = s->len - dev->qoff;
+            memcpy(buf, data + dev->qoff, len);
+            dev->qoff += len;
+            ret = len;
+            if (dev->qoff == s->len)
+            {
+                // the chain after the newest encryption is its last block
+                if (ENCRYPT == s->mode && dev->qhead + 1 == dev->qtail)
+                {
+                    memcpy(dev->chain, data + s->len - AESBLKSIZE, AESBLKSIZE);
+                    dev->chainknown = 1;
+                }
+                broker_pop(dev);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static void *broker_mmap(int fd, size_t len)
+{
+    errno = EINVAL;
+    return MAP_FAILED;
+}
+
+static int broker_munmap(int fd, void *addr, size_t len)
+{
+    return 0;
+}
+
+const wsaes_backend_t wsaes_broker_backend = {
+    "broker", broker_access, broker_open, broker_close, broker_ioctl, broker_write, broker_read, broker_mmap,
+    broker_munmap
+};
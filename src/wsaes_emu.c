@@ -0,0 +1,884 @@
+/*
+ * Software model of the wsaes accelerator
+ *
+ * Implements the /dev/wsaeschar protocol from wsaeskern.h in-process, so the
+ * API, the engine, the tests and the benchmarks can run on a machine without a
+ * ZYNQ board (WSAES_BACKEND=emu). Like the hardware, each modelled device has a
+ * single IV, mode and key (or set of key slots) shared by every descriptor open
+ * on it, and really does the AES-256-CBC (or CTR, or XTS) work (with wsaes_soft.c).
+ * Devices work independently of each other, and appear as /dev/wsaeschar0 upwards
+ * (device 0 also as /dev/wsaeschar).
+ *
+ * The timing and failure behaviour is set from the environment:
+ *   WSAES_EMU_LATENCY_US  fixed cost of every ioctl/write/read, in us (default 5)
+ *   WSAES_EMU_MBPS        device processing rate in MB/s, 0 = unlimited (default 200)
+ *   WSAES_EMU_FAIL_EVERY  fail every Nth data write/read with EIO, 0 = never (default 0)
+ *   WSAES_EMU_BULK        advertise bulk transfers (WSAES_CAP_BULK), 0 models an
+ *                         older bitstream (default 1)
+ *   WSAES_EMU_MAXXFER     largest bulk transfer in bytes (default 65536)
+ *   WSAES_EMU_RING        advertise submission/completion rings (WSAES_CAP_RING),
+ *                         which need bulk transfers (default 1)
+ *   WSAES_EMU_DEVICES     number of devices (default 1)
+ *   WSAES_EMU_QDEPTH      outstanding bulk transfers the device queues 
+ *                         (WSAES_CAP_QUEUE), 0 = process them inside write() (default 8)
+ *   WSAES_EMU_CTR         advertise AES-256-CTR (WSAES_CAP_CTR), which needs bulk
+ *                         transfers (default 1)
+ *   WSAES_EMU_XTS         advertise AES-256-XTS (WSAES_CAP_XTS), which needs bulk
+ *                         transfers (default 1)
+ *   WSAES_EMU_KEYSLOTS    key slots (WSAES_CAP_KEYSLOTS), which need bulk transfers,
+ *                         0 = a single key register (default 16)
+ *   WSAES_EMU_SHARED      1 = the devices are shared by all the processes that set it:
+ *                         they process one transfer at a time between them, under a
+ *                         lock file per device in /tmp, though each process still
+ *                         has registers of its own (default 0)
+ *
+ * The rings of a descriptor are plain memory handed out by the backend's mmap,
+ * and are worked through by a thread of their own, which sleeps whenever the 
+ * submission ring is drained until the host rings the doorbell. Queued transfers
+ * are likewise processed by a thread per device.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "wsaes_api.h"
+#include "wsaeskern.h"
+#include "wsaes_backend.h"
+#include "wsaes_soft.h"
+
+#define EMU_MAXFDS 1024
+#define EMU_FDBASE 1000 // keep emulated descriptors clear of small real ones in error messages
+#define EMU_MAXRING 4096 // largest submission ring
+#define EMU_MAXDATA (16 * 1048576) // largest ring data region
+#define EMU_PAGE 4096
+
+/* Model parameters */
+typedef struct {
+    uint64_t latency_ns;
+    uint64_t mbps;
+    uint64_t fail_every;
+    int bulk;
+    uint32_t maxxfer;
+    int ring;
+    int ndevs;
+    uint32_t qdepth;
+    int ctr;
+    int xts;
+    uint32_t keyslots;
+    int shared;
+} emu_model_t;
+
+/* A queued bulk transfer, see WSAES_CAP_QUEUE */
+typedef struct {
+    uint8_t *buf;    // maxxfer bytes, processed in place
+    uint32_t len;
+    uint32_t off;    // bytes already read back
+    ciphermode_t mode;
+    uint32_t slot;   // key slot selected when it was written
+} emu_xfer_t;
+
+/* Device state, which the hardware shares between all open descriptors */
+typedef struct {
+    pthread_mutex_t lock;
+    ciphermode_t mode;
+    wsaes_softkey_t *keys;    // expanded key of each slot, a single one without WSAES_CAP_KEYSLOTS
+    uint8_t *keyset;          // whether each slot has been loaded
+    uint32_t slot;            // selected slot
+    wsaes_softkey_t tweakkey; // XTS
+    uint32_t sectorsize;      // XTS, 0 until set
+    uint8_t iv[AESIVSIZE];    // IV register
+    uint8_t chain[AESIVSIZE]; // CBC chaining value (CTR: counter, XTS: sector tweak) of the block in progress
+    uint8_t *outbuf;          // processed data waiting to be read
+    uint32_t outlen;
+    uint32_t outoff;
+    uint64_t datacalls;       // data writes/reads, for failure injection
+    pthread_mutex_t busylock; // WSAES_EMU_SHARED: processing, within the process
+    int busyfd;               // and the lock file, across processes
+
+    // queued transfers: free-running counts of those read back, processed and written
+    emu_xfer_t *q;
+    uint32_t qhead, qdone, qtail;
+    pthread_cond_t qcond;     // signalled when a transfer is queued or processed
+    pthread_t qthread;
+} emu_dev_t;
+
+/* Submission/completion rings of one descriptor, laid out in mem as described by setup */
+typedef struct {
+    struct wsaes_ring_setup setup;
+    uint8_t *mem;
+    struct wsaes_ring_hdr *hdr;
+    struct wsaes_sqe *sq;
+    struct wsaes_cqe *cq;
+    uint8_t *data;
+    emu_dev_t *dev;                // device the descriptor is open on
+    pthread_t thread;              // the device side, see emu_ring_main()
+    pthread_mutex_t lock;
+    pthread_cond_t doorbell_cond;  // the ring thread sleeps here while the submission ring is empty
+    pthread_cond_t complete_cond;  // IOCTL_RING_WAIT sleeps here while the completion ring is empty
+    int doorbell;
+    int stop;
+} emu_ring_t;
+
+static pthread_once_t emu_once = PTHREAD_ONCE_INIT;
+static emu_model_t emu_model;
+static emu_dev_t emu_devs[WSAES_MAXDEVS];
+static pthread_mutex_t emu_fdlock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t emu_fds[EMU_MAXFDS]; // device number + 1 of each open descriptor, 0 if closed
+static emu_ring_t *emu_rings[EMU_MAXFDS];
+
+static void *emu_queue_main(void *arg);
+
+static uint64_t envnum(const char *name, uint64_t dflt)
+{
+    const char *v = getenv(name);
+    return (NULL != v && '\0' != *v) ? strtoull(v, NULL, 0) : dflt;
+}
+
+static void emu_setup(void)
+{
+    emu_model.latency_ns = envnum("WSAES_EMU_LATENCY_US", 5) * 1000;
+    emu_model.mbps = envnum("WSAES_EMU_MBPS", 200);
+    emu_model.fail_every = envnum("WSAES_EMU_FAIL_EVERY", 0);
+    emu_model.bulk = (int)envnum("WSAES_EMU_BULK", 1);
+    emu_model.maxxfer = (uint32_t)envnum("WSAES_EMU_MAXXFER", 65536);
+    emu_model.ring = emu_model.bulk && 0 != envnum("WSAES_EMU_RING", 1);
+    emu_model.ndevs = (int)envnum("WSAES_EMU_DEVICES", 1);
+    emu_model.qdepth = emu_model.bulk ? (uint32_t)envnum("WSAES_EMU_QDEPTH", 8) : 0;
+    emu_model.ctr = emu_model.bulk && 0 != envnum("WSAES_EMU_CTR", 1);
+    emu_model.xts = emu_model.bulk && 0 != envnum("WSAES_EMU_XTS", 1);
+    emu_model.keyslots = emu_model.bulk ? (uint32_t)envnum("WSAES_EMU_KEYSLOTS", 16) : 0;
+    emu_model.shared = (int)envnum("WSAES_EMU_SHARED", 0);
+    if (emu_model.ndevs < 1)
+        emu_model.ndevs = 1;
+    if (emu_model.ndevs > WSAES_MAXDEVS)
+        emu_model.ndevs = WSAES_MAXDEVS;
+    emu_model.maxxfer -= emu_model.maxxfer % AESBLKSIZE;
+    if (emu_model.maxxfer < AESBLKSIZE)
+        emu_model.maxxfer = AESBLKSIZE;
+
+    for (int i=0; i<emu_model.ndevs; i++)
+    {
+        pthread_mutex_init(&emu_devs[i].lock, NULL);
+        emu_devs[i].outbuf = malloc(emu_model.maxxfer);
+        emu_devs[i].keys = calloc(emu_model.keyslots ? emu_model.keyslots : 1, sizeof(wsaes_softkey_t));
+        emu_devs[i].keyset = calloc(emu_model.keyslots ? emu_model.keyslots : 1, 1);
+        if (NULL == emu_devs[i].outbuf || NULL == emu_devs[i].keys || NULL == emu_devs[i].keyset)
+        {
+            fprintf(stderr, "ERROR: emulator could not allocate its %u byte transfer buffer or key slots\n",
+                    emu_model.maxxfer);
+            abort();
+        }
+        emu_devs[i].busyfd = -1;
+        if (emu_model.shared)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/tmp/wsaes_emu.%u.%d.lock", (unsigned)getuid(), i);
+            pthread_mutex_init(&emu_devs[i].busylock, NULL);
+            if ((emu_devs[i].busyfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+                perror("WARNING: emulator could not open its lock file, the device isn't shared");
+        }
+        if (0 == emu_model.qdepth)
+            continue;
+        pthread_cond_init(&emu_devs[i].qcond, NULL);
+        emu_devs[i].q = calloc(emu_model.qdepth, sizeof(emu_xfer_t));
+        for (uint32_t j=0; NULL != emu_devs[i].q && j<emu_model.qdepth; j++)
+        {
+            if (NULL == (emu_devs[i].q[j].buf = malloc(emu_model.maxxfer)))
+            {
+                free(emu_devs[i].q);
+                emu_devs[i].q = NULL;
+            }
+        }
+        if (NULL == emu_devs[i].q || 0 != pthread_create(&emu_devs[i].qthread, NULL, emu_queue_main, &emu_devs[i]))
+        {
+            fprintf(stderr, "ERROR: emulator could not set up its transfer queue\n");
+            abort();
+        }
+    }
+}
+
+/*
+ * Wait for ns nanoseconds. Short waits spin, since sleeps overshoot by tens of us;
+ * longer ones sleep until shortly before the deadline and spin the rest
+ */
+static void emu_delay(uint64_t ns)
+{
+    struct timespec now, end;
+
+    if (0 == ns)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += (end.tv_nsec + ns) / 1000000000;
+    end.tv_nsec = (end.tv_nsec + ns) % 1000000000;
+
+    if (ns > 50000)
+    {
+        struct timespec wake = end;
+        if (wake.tv_nsec >= 20000)
+            wake.tv_nsec -= 20000;
+        else
+        {
+            wake.tv_sec--;
+            wake.tv_nsec += 1000000000 - 20000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    }
+    do
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+}
+
+/* Time the device spends processing len bytes */
+static uint64_t emu_busy_ns(size_t len)
+{
+    return (0 == emu_model.mbps) ? 0 : (uint64_t)len * 1000 / emu_model.mbps;
+}
+
+/*
+ * WSAES_EMU_SHARED: take the device from other threads and processes for the 
+ * processing of a transfer, the software AES included, and give it back
+ */
+static void emu_claim(emu_dev_t *dev)
+{
+    if (dev->busyfd < 0)
+        return;
+    pthread_mutex_lock(&dev->busylock);
+    flock(dev->busyfd, LOCK_EX);
+}
+
+static void emu_release(emu_dev_t *dev)
+{
+    if (dev->busyfd < 0)
+        return;
+    flock(dev->busyfd, LOCK_UN);
+    pthread_mutex_unlock(&dev->busylock);
+}
+
+/* Whether the device does mode, i.e. processes data in it */
+static int emu_datamode(ciphermode_t mode)
+{
+    return ENCRYPT == mode || DECRYPT == mode || (CTR == mode && emu_model.ctr) ||
+           ((XTS_ENCRYPT == mode || XTS_DECRYPT == mode) && emu_model.xts);
+}
+
+/* Whether len bytes are a valid transfer in mode: whole blocks, or whole sectors for XTS */
+static int emu_validlen(emu_dev_t *dev, ciphermode_t mode, uint32_t len)
+{
+    if (XTS_ENCRYPT == mode || XTS_DECRYPT == mode)
+        return 0 != dev->sectorsize && 0 == len % dev->sectorsize;
+    return 0 == len % AESBLKSIZE;
+}
+
+/* 
+ * Process len bytes of blocks in mode with the key in slot, carrying on the device's
+ * chain. Called with the device locked
+ */
+static void emu_cipher(emu_dev_t *dev, uint32_t slot, ciphermode_t mode, const uint8_t *in, uint8_t *out,
+                       uint32_t len)
+{
+    if (CTR == mode)
+        wsaes_soft_ctr(&dev->keys[slot], dev->chain, in, out, len);
+    else if (XTS_ENCRYPT == mode || XTS_DECRYPT == mode)
+    {
+        // a sector at a time, its tweak one up (little-endian) from the previous sector's
+        for (uint32_t off=0; off<len; off+=dev->sectorsize)
+        {
+            wsaes_soft_xts(&dev->keys[slot], &dev->tweakkey, XTS_ENCRYPT == mode, dev->chain, in + off,
+                           out + off, dev->sectorsize);
+            for (int j=0; j<AESIVSIZE && 0 == ++dev->chain[j]; j++)
+                ;
+        }
+    }
+    else
+        wsaes_soft_cbc(&dev->keys[slot], ENCRYPT == mode, dev->chain, in, out, len);
+}
+
+/* Device an open descriptor belongs to, NULL if fd isn't open */
+static emu_dev_t *emu_getdev(int fd)
+{
+    int dev;
+    fd -= EMU_FDBASE;
+    if (fd < 0 || fd >= EMU_MAXFDS)
+        return NULL;
+    pthread_mutex_lock(&emu_fdlock);
+    dev = emu_fds[fd];
+    pthread_mutex_unlock(&emu_fdlock);
+    return (0 == dev) ? NULL : &emu_devs[dev - 1];
+}
+
+/* Device number of a device path, -1 if there is no such device */
+static int emu_devnum(const char *path)
+{
+    const char *name = "/dev/wsaeschar";
+    size_t len = strlen(name);
+    char *end;
+    long n;
+
+    if (0 != strncmp(path, name, len))
+        return -1;
+    if ('\0' == path[len])
+        return 0;
+    n = strtol(path + len, &end, 10);
+    return ('\0' == *end && end != path + len && n >= 0 && n < emu_model.ndevs) ? (int)n : -1;
+}
+
+/* Injected failure on every fail_every-th data transfer. Called with the device locked */
+static int emu_inject_failure(emu_dev_t *dev)
+{
+    if (0 == emu_model.fail_every || 0 != ++dev->datacalls % emu_model.fail_every)
+        return 0;
+    dev->outlen = dev->outoff = 0;
+    errno = EIO;
+    return 1;
+}
+
+
+static emu_ring_t *emu_getring(int fd)
+{
+    emu_ring_t *r;
+    pthread_mutex_lock(&emu_fdlock);
+    r = emu_rings[fd - EMU_FDBASE];
+    pthread_mutex_unlock(&emu_fdlock);
+    return r;
+}
+
+
+/*
+ * Process one submission entry in place in the data region and post its completion
+ */
+static void emu_ring_process(emu_ring_t *r, const struct wsaes_sqe *sqe)
+{
+    emu_dev_t *dev = r->dev;
+    struct wsaes_ring_hdr *hdr = r->hdr;
+    struct wsaes_cqe *cqe = &r->cq[hdr->cq_tail & hdr->cq_mask];
+    uint32_t off = sqe->offset, len = sqe->length;
+    int status = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    if (0 == len || !emu_validlen(dev, sqe->mode, len) || len > emu_model.maxxfer || off > r->setup.data_size ||
+        len > r->setup.data_size - off || !emu_datamode(sqe->mode) || !dev->keyset[dev->slot])
+        status = -EINVAL;
+    else if (emu_inject_failure(dev))
+        status = -EIO;
+    else
+    {
+        if (sqe->flags & WSAES_SQE_IV)
+            memcpy(dev->chain, sqe->iv, AESIVSIZE);
+        emu_claim(dev);
+        emu_cipher(dev, dev->slot, sqe->mode, r->data + off, r->data + off, len);
+        emu_delay(emu_busy_ns(len));
+        emu_release(dev);
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    cqe->cookie = sqe->cookie;
+    cqe->status = status;
+    cqe->length = (0 == status) ? len : 0;
+
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&hdr->cq_tail, hdr->cq_tail + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->complete_cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* The device side of a ring: work through submissions in order, sleeping when there are none */
+static void *emu_ring_main(void *arg)
+{
+    emu_ring_t *r = (emu_ring_t*)arg;
+    struct wsaes_ring_hdr *hdr = r->hdr;
+    uint32_t head = 0;
+    int stop = 0;
+
+    while (!stop)
+    {
+        // sq_head was published (and fenced) after the previous entry, so a host that
+        // saw it still behind its new sq_tail is seen here, and one that didn't rang the doorbell
+        if (head == __atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&r->lock);
+            while (!r->doorbell && !r->stop)
+                pthread_cond_wait(&r->doorbell_cond, &r->lock);
+            r->doorbell = 0;
+            stop = r->stop;
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        emu_ring_process(r, &r->sq[head & hdr->sq_mask]);
+        __atomic_store_n(&hdr->sq_head, ++head, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static int emu_ring_setup(int fd, struct wsaes_ring_setup *setup)
+{
+    emu_ring_t *r;
+    uint32_t entries = 1, hdrsize;
+
+    if (NULL != emu_getring(fd))
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    if (NULL == (r = calloc(1, sizeof(*r))))
+        return -1;
+
+    while (entries < setup->sq_entries && entries < EMU_MAXRING)
+        entries <<= 1;
+    setup->sq_entries = setup->cq_entries = entries;
+    if (setup->data_size < emu_model.maxxfer)
+        setup->data_size = emu_model.maxxfer;
+    if (setup->data_size > EMU_MAXDATA)
+        setup->data_size = EMU_MAXDATA;
+    setup->data_size -= setup->data_size % AESBLKSIZE;
+
+    hdrsize = (sizeof(struct wsaes_ring_hdr) + 63) & ~63;
+    setup->sq_off = hdrsize;
+    setup->cq_off = setup->sq_off + entries * sizeof(struct wsaes_sqe);
+    setup->data_off = (setup->cq_off + entries * sizeof(struct wsaes_cqe) + EMU_PAGE - 1) & ~(EMU_PAGE - 1);
+    setup->map_size = (setup->data_off + setup->data_size + EMU_PAGE - 1) & ~(EMU_PAGE - 1);
+
+    if (0 != posix_memalign((void**)&r->mem, EMU_PAGE, setup->map_size))
+    {
+        free(r);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(r->mem, 0, setup->map_size);
+    r->setup = *setup;
+    r->hdr = (struct wsaes_ring_hdr*)r->mem;
+    r->sq = (struct wsaes_sqe*)(r->mem + setup->sq_off);
+    r->cq = (struct wsaes_cqe*)(r->mem + setup->cq_off);
+    r->data = r->mem + setup->data_off;
+    r->dev = emu_getdev(fd);
+    r->hdr->sq_mask = r->hdr->cq_mask = entries - 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->doorbell_cond, NULL);
+    pthread_cond_init(&r->complete_cond, NULL);
+
+    if (0 != pthread_create(&r->thread, NULL, emu_ring_main, r))
+    {
+        free(r->mem);
+        free(r);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_lock(&emu_fdlock);
+    emu_rings[fd - EMU_FDBASE] = r;
+    pthread_mutex_unlock(&emu_fdlock);
+    return 0;
+}
+
+static void emu_ring_free(emu_ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->doorbell_cond);
+    pthread_cond_broadcast(&r->complete_cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->doorbell_cond);
+    pthread_cond_destroy(&r->complete_cond);
+    free(r->mem);
+    free(r);
+}
+
+/* IOCTL_RING_DOORBELL and IOCTL_RING_WAIT, which don't touch the shared device state */
+static int emu_ring_ioctl(int fd, unsigned long req)
+{
+    emu_ring_t *r = emu_getring(fd);
+
+    if (NULL == r)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (IOCTL_RING_DOORBELL == req)
+    {
+        r->doorbell = 1;
+        pthread_cond_signal(&r->doorbell_cond);
+    }
+    else
+    {
+        while (r->hdr->cq_head == __atomic_load_n(&r->hdr->cq_tail, __ATOMIC_ACQUIRE) && !r->stop)
+            pthread_cond_wait(&r->complete_cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+
+/*
+ * The device side of queued transfers: process them in order, sleeping when there
+ * are none. Like the hardware, the device is busy for the transfer's processing 
+ * time without holding up the host, which can meanwhile queue or read back others
+ */
+static void *emu_queue_main(void *arg)
+{
+    emu_dev_t *dev = (emu_dev_t*)arg;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;)
+    {
+        emu_xfer_t *x;
+        while (dev->qdone == dev->qtail)
+            pthread_cond_wait(&dev->qcond, &dev->lock);
+        x = &dev->q[dev->qdone % emu_model.qdepth];
+        emu_claim(dev);
+        emu_cipher(dev, x->slot, x->mode, x->buf, x->buf, x->len);
+        pthread_mutex_unlock(&dev->lock);
+
+        emu_delay(emu_busy_ns(x->len));
+        emu_release(dev);
+
+        pthread_mutex_lock(&dev->lock);
+        dev->qdone++;
+        pthread_cond_broadcast(&dev->qcond);
+    }
+    return NULL;
+}
+
+
+/*
+ * Backend entry points
+ */
+static int emu_access(const char *path)
+{
+    pthread_once(&emu_once, emu_setup);
+    if (emu_devnum(path) < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+static int emu_open(const char *path, int flags)
+{
+    int dev;
+
+    pthread_once(&emu_once, emu_setup);
+    if ((dev = emu_devnum(path)) < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&emu_fdlock);
+    for (int i=0; i<EMU_MAXFDS; i++)
+    {
+        if (!emu_fds[i])
+        {
+            emu_fds[i] = dev + 1;
+            pthread_mutex_unlock(&emu_fdlock);
+            return EMU_FDBASE + i;
+        }
+    }
+    pthread_mutex_unlock(&emu_fdlock);
+    errno = EMFILE;
+    return -1;
+}
+
+static int emu_close(int fd)
+{
+    emu_ring_t *r;
+
+    if (NULL == emu_getdev(fd))
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&emu_fdlock);
+    r = emu_rings[fd - EMU_FDBASE];
+    emu_rings[fd - EMU_FDBASE] = NULL;
+    emu_fds[fd - EMU_FDBASE] = 0;
+    pthread_mutex_unlock(&emu_fdlock);
+
+    if (NULL != r)
+        emu_ring_free(r);
+    return 0;
+}
+
+static int emu_ioctl(int fd, unsigned long req, unsigned long arg)
+{
+    emu_dev_t *dev = emu_getdev(fd);
+    int ret = 0;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    emu_delay(emu_model.latency_ns);
+
+    switch (req)
+    {
+        case IOCTL_RING_SETUP:
+            if (!emu_model.ring)
+            {
+                errno = ENOTTY;
+                return -1;
+            }
+            return emu_ring_setup(fd, (struct wsaes_ring_setup*)arg);
+        case IOCTL_RING_DOORBELL:
+        case IOCTL_RING_WAIT:
+            return emu_ring_ioctl(fd, req);
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    switch (req)
+    {
+        case IOCTL_SET_MODE:
+            if (arg > SET_KEY && !(CTR == arg && emu_model.ctr) &&
+                !(arg >= SET_TWEAKKEY && arg <= XTS_DECRYPT && emu_model.xts))
+            {
+                errno = EINVAL;
+                ret = -1;
+                break;
+            }
+            dev->mode = (ciphermode_t)arg;
+            if (RESET == dev->mode)
+            {
+                while (dev->qdone != dev->qtail)
+                    pthread_cond_wait(&dev->qcond, &dev->lock);
+                dev->qhead = dev->qtail;
+                memcpy(dev->chain, dev->iv, AESIVSIZE);
+                dev->outlen = dev->outoff = 0;
+            }
+            break;
+        case IOCTL_GET_MODE:
+            *(char*)arg = (char)dev->mode;
+            break;
+        case IOCTL_SET_SECTOR:
+            if (!emu_model.xts || 0 == arg || 0 != arg % AESBLKSIZE || arg > emu_model.maxxfer)
+            {
+                errno = emu_model.xts ? EINVAL : ENOTTY;
+                ret = -1;
+                break;
+            }
+            dev->sectorsize = (uint32_t)arg;
+            break;
+        case IOCTL_SET_KEYSLOT:
+            if (0 == emu_model.keyslots || arg >= emu_model.keyslots)
+            {
+                errno = emu_model.keyslots ? EINVAL : ENOTTY;
+                ret = -1;
+                break;
+            }
+            dev->slot = (uint32_t)arg;
+            break;
+        case IOCTL_GET_KEYSLOTS:
+            if (0 == emu_model.keyslots)
+            {
+                errno = ENOTTY;
+                ret = -1;
+                break;
+            }
+            *(__u32*)arg = emu_model.keyslots;
+            break;
+        case IOCTL_GET_CAPS:
+            if (!emu_model.bulk)
+            {
+                errno = ENOTTY; // older bitstreams don't know this ioctl
+                ret = -1;
+                break;
+            }
+            ((struct wsaes_caps*)arg)->flags = WSAES_CAP_BULK | (emu_model.ring ? WSAES_CAP_RING : 0) |
+                                               (emu_model.qdepth ? WSAES_CAP_QUEUE : 0) |
+                                               (emu_model.ctr ? WSAES_CAP_CTR : 0) |
+                                               (emu_model.xts ? WSAES_CAP_XTS : 0) |
+                                               (emu_model.keyslots ? WSAES_CAP_KEYSLOTS : 0);
+            ((struct wsaes_caps*)arg)->maxxfer = emu_model.maxxfer;
+            break;
+        case IOCTL_GET_QDEPTH:
+            if (0 == emu_model.qdepth)
+            {
+                errno = ENOTTY;
+                ret = -1;
+                break;
+            }
+            *(__u32*)arg = emu_model.qdepth;
+            break;
+        default:
+            errno = ENOTTY;
+            ret = -1;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static ssize_t emu_write(int fd, const void *buf, size_t len)
+{
+    emu_dev_t *dev = emu_getdev(fd);
+    size_t maxlen = emu_model.bulk ? emu_model.maxxfer : AESBLKSIZE;
+    ssize_t ret = -1;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    emu_delay(emu_model.latency_ns);
+
+    pthread_mutex_lock(&dev->lock);
+    switch (dev->mode)
+    {
+        case SET_KEY:
+            if (AESKEYSIZE != len)
+                goto inval;
+            if (0 != wsaes_soft_setkey(&dev->keys[dev->slot], buf))
+            {
+                errno = ENOMEM;
+                break;
+            }
+            dev->keyset[dev->slot] = 1;
+            ret = len;
+            break;
+        case SET_TWEAKKEY:
+            if (AESKEYSIZE != len)
+                goto inval;
+            if (0 != wsaes_soft_setkey(&dev->tweakkey, buf))
+            {
+                errno = ENOMEM;
+                break;
+            }
+            ret = len;
+            break;
+        case SET_IV:
+            if (AESIVSIZE != len)
+                goto inval;
+            memcpy(dev->iv, buf, AESIVSIZE);
+            memcpy(dev->chain, buf, AESIVSIZE);
+            ret = len;
+            break;
+        case ENCRYPT:
+        case DECRYPT:
+        case CTR:
+        case XTS_ENCRYPT:
+        case XTS_DECRYPT:
+            if (0 == len || !emu_validlen(dev, dev->mode, len) || len > maxlen || !dev->keyset[dev->slot])
+                goto inval;
+            if (emu_model.qdepth)
+            {
+                emu_xfer_t *x = &dev->q[dev->qtail % emu_model.qdepth];
+                if (dev->qtail - dev->qhead == emu_model.qdepth)
+                    errno = EBUSY; // the queue is full of transfers not read back yet
+                else if (!emu_inject_failure(dev))
+                {
+                    memcpy(x->buf, buf, len);
+                    x->len = len;
+                    x->off = 0;
+                    x->mode = dev->mode;
+                    x->slot = dev->slot;
+                    dev->qtail++;
+                    pthread_cond_broadcast(&dev->qcond);
+                    ret = len;
+                }
+                break;
+            }
+            if (dev->outlen - dev->outoff + len > emu_model.maxxfer)
+            {
+                errno = EBUSY; // previous results haven't been read back
+                break;
+            }
+            if (emu_inject_failure(dev))
+                break;
+            if (dev->outoff == dev->outlen)
+                dev->outlen = dev->outoff = 0;
+            else if (dev->outlen + len > emu_model.maxxfer)
+            {
+                memmove(dev->outbuf, dev->outbuf + dev->outoff, dev->outlen - dev->outoff);
+                dev->outlen -= dev->outoff;
+                dev->outoff = 0;
+            }
+            emu_claim(dev);
+            emu_cipher(dev, dev->slot, dev->mode, buf, dev->outbuf + dev->outlen, len);
+            dev->outlen += len;
+            emu_delay(emu_busy_ns(len));
+            emu_release(dev);
+            ret = len;
+            break;
+        default:
+            goto inval;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+inval:
+    pthread_mutex_unlock(&dev->lock);
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t emu_read(int fd, void *buf, size_t len)
+{
+    emu_dev_t *dev = emu_getdev(fd);
+    ssize_t ret = -1;
+
+    if (NULL == dev)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    emu_delay(emu_model.latency_ns);
+
+    pthread_mutex_lock(&dev->lock);
+    if (emu_model.qdepth && dev->qhead != dev->qtail)
+    {
+        // the oldest queued transfer, once the device is done with it
+        emu_xfer_t *x = &dev->q[dev->qhead % emu_model.qdepth];
+        while (dev->qdone == dev->qhead)
+            pthread_cond_wait(&dev->qcond, &dev->lock);
+        if (!emu_inject_failure(dev))
+        {
+            if (len > x->len - x->off)
+                len = x->len - x->off;
+            memcpy(buf, x->buf + x->off, len);
+            if ((x->off += len) == x->len)
+                dev->qhead++;
+            ret = len;
+        }
+    }
+    else if (!emu_inject_failure(dev))
+    {
+        if (len > dev->outlen - dev->outoff)
+            len = dev->outlen - dev->outoff;
+        memcpy(buf, dev->outbuf + dev->outoff, len);
+        dev->outoff += len;
+        ret = len;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+/* The rings are already in process memory, so mapping them just hands them out */
+static void *emu_mmap(int fd, size_t len)
+{
+    emu_ring_t *r;
+
+    if (NULL == emu_getdev(fd) || NULL == (r = emu_getring(fd)) || len > r->setup.map_size)
+    {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    return r->mem;
+}
+
+static int emu_munmap(int fd, void *addr, size_t len)
+{
+    return 0;
+}
+
+const wsaes_backend_t wsaes_emu_backend = {
+    "emu", emu_access, emu_open, emu_close, emu_ioctl, emu_write, emu_read, emu_mmap, emu_munmap
+};
@@ -0,0 +1,565 @@
+/*
+ * Software AES-256-CBC, AES-256-CTR and AES-256-XTS for the wsaes engine
+ *
+ * On x86 CPUs with AES-NI the key schedule and the block loops below run on the
+ * AES instructions directly; everywhere else (including the Cortex-A9 on the
+ * ZYNQ-7000, which has no crypto extensions) OpenSSL's EVP ciphers are used,
+ * and so are they for every stream of a multi-buffer call.
+ * The AES-NI code is compiled with function-level target attributes, so no
+ * special compiler flags are needed and the library still runs on CPUs
+ * without AES-NI. Build with -DWSAES_NO_AESNI to use the EVP path on x86 too.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#include "wsaes_api.h"
+#include "wsaes_soft.h"
+
+#define WSAES_XTSBATCH 16 // XTS blocks whose tweaks are computed at a time
+#define WSAES_CTRBATCH 16 // CTR keystream blocks the EVP path computes at a time
+#define WSAES_EVPCHUNK (1 << 30) // most bytes handed to one EVP call, which takes an int
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(WSAES_NO_AESNI)
+#define WSAES_HAVE_AESNI 1
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+/* One step of the AES-256 key expansion: fold t (the keygenassist word) into k */
+static inline AESNI_TARGET __m128i aesni_expand(__m128i k, __m128i t)
+{
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+// even round keys use RotWord+SubWord+rcon of the previous key, odd ones SubWord only
+#define AESNI_EVEN(rk, i, rcon) \
+    rk[i] = aesni_expand(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+#define AESNI_ODD(rk, i) \
+    rk[i] = aesni_expand(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], 0), 0xaa))
+
+static AESNI_TARGET void aesni_setkey(wsaes_softkey_t *k, const uint8_t *key)
+{
+    __m128i rk[AES256ROUNDS+1];
+
+    rk[0] = _mm_loadu_si128((const __m128i*)key);
+    rk[1] = _mm_loadu_si128((const __m128i*)(key + 16));
+    AESNI_EVEN(rk, 2, 0x01); AESNI_ODD(rk, 3);
+    AESNI_EVEN(rk, 4, 0x02); AESNI_ODD(rk, 5);
+    AESNI_EVEN(rk, 6, 0x04); AESNI_ODD(rk, 7);
+    AESNI_EVEN(rk, 8, 0x08); AESNI_ODD(rk, 9);
+    AESNI_EVEN(rk, 10, 0x10); AESNI_ODD(rk, 11);
+    AESNI_EVEN(rk, 12, 0x20); AESNI_ODD(rk, 13);
+    AESNI_EVEN(rk, 14, 0x40);
+
+    // the decryption schedule is the reversed encryption schedule, with InvMixColumns on the inner rounds
+    for (int i=0; i<=AES256ROUNDS; i++)
+    {
+        _mm_storeu_si128((__m128i*)k->ks.ni.enc[i], rk[i]);
+        _mm_storeu_si128((__m128i*)k->ks.ni.dec[AES256ROUNDS-i],
+                         (i == 0 || i == AES256ROUNDS) ? rk[i] : _mm_aesimc_si128(rk[i]));
+    }
+}
+
+static AESNI_TARGET void aesni_cbc_encrypt(const wsaes_softkey_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i rk[AES256ROUNDS+1], x;
+
+    for (int i=0; i<=AES256ROUNDS; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)k->ks.ni.enc[i]);
+
+    x = _mm_loadu_si128((const __m128i*)iv);
+    for (size_t off=0; off<len; off+=AESBLKSIZE)
+    {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i*)(in + off)));
+        x = _mm_xor_si128(x, rk[0]);
+        for (int r=1; r<AES256ROUNDS; r++)
+            x = _mm_aesenc_si128(x, rk[r]);
+        x = _mm_aesenclast_si128(x, rk[AES256ROUNDS]);
+        _mm_storeu_si128((__m128i*)(out + off), x);
+    }
+    _mm_storeu_si128((__m128i*)iv, x);
+}
+
+/* CBC decryption has no dependency between blocks, so four are kept in flight at once */
+static AESNI_TARGET void aesni_cbc_decrypt(const wsaes_softkey_t *k, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i rk[AES256ROUNDS+1], prev, c[4], x[4];
+    size_t off = 0;
+
+    for (int i=0; i<=AES256ROUNDS; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)k->ks.ni.dec[i]);
+
+    prev = _mm_loadu_si128((const __m128i*)iv);
+    for (; off + 4*AESBLKSIZE <= len; off += 4*AESBLKSIZE)
+    {
+        for (int j=0; j<4; j++)
+        {
+            c[j] = _mm_loadu_si128((const __m128i*)(in + off + j*AESBLKSIZE));
+            x[j] = _mm_xor_si128(c[j], rk[0]);
+        }
+        for (int r=1; r<AES256ROUNDS; r++)
+            for (int j=0; j<4; j++)
+                x[j] = _mm_aesdec_si128(x[j], rk[r]);
+        for (int j=0; j<4; j++)
+        {
+            x[j] = _mm_aesdeclast_si128(x[j], rk[AES256ROUNDS]);
+            _mm_storeu_si128((__m128i*)(out + off + j*AESBLKSIZE), _mm_xor_si128(x[j], prev));
+            prev = c[j];
+        }
+    }
+    for (; off < len; off += AESBLKSIZE)
+    {
+        c[0] = _mm_loadu_si128((const __m128i*)(in + off));
+        x[0] = _mm_xor_si128(c[0], rk[0]);
+        for (int r=1; r<AES256ROUNDS; r++)
+            x[0] = _mm_aesdec_si128(x[0], rk[r]);
+        x[0] = _mm_aesdeclast_si128(x[0], rk[AES256ROUNDS]);
+        _mm_storeu_si128((__m128i*)(out + off), _mm_xor_si128(x[0], prev));
+        prev = c[0];
+    }
+    _mm_storeu_si128((__m128i*)iv, prev);
+}
+
+/* An encryption stream in a lane of aesni_cbc_multi() */
+typedef struct {
+    const wsaes_softstream_t *s;
+    const uint8_t *key; // its encryption schedule
+    int iov;            // the buffer being encrypted
+    size_t off;         // and the offset in it
+} aesni_lane_t;
+
+/*
+ * Encrypt nb blocks in each of nl lanes, x holding each lane's chain. The lanes'
+ * blocks don't depend on each other, so their AES instructions overlap. Inlined
+ * with nl a constant, the loops over the lanes unroll and the chains stay in
+ * registers, which is where the gain is: a round is an instruction or two
+ */
+#define AESNI_UNROLL _Pragma("GCC unroll 8")
+static inline __attribute__((always_inline)) AESNI_TARGET void aesni_lanes(const aesni_lane_t *lane, __m128i *x,
+                                                                          const int nl, size_t nb)
+{
+    const uint8_t *in[WSAES_SOFT_LANES], *key[WSAES_SOFT_LANES];
+    uint8_t *out[WSAES_SOFT_LANES];
+    __m128i v[WSAES_SOFT_LANES];
+
+    AESNI_UNROLL
+    for (int j=0; j<nl; j++)
+    {
+        in[j] = lane[j].s->iov[lane[j].iov].in + lane[j].off;
+        out[j] = lane[j].s->iov[lane[j].iov].out + lane[j].off;
+        key[j] = lane[j].key;
+        v[j] = x[j];
+    }
+    for (size_t off=0; off<nb*AESBLKSIZE; off+=AESBLKSIZE)
+    {
+        AESNI_UNROLL
+        for (int j=0; j<nl; j++)
+            v[j] = _mm_xor_si128(_mm_xor_si128(v[j], _mm_loadu_si128((const __m128i*)(in[j] + off))),
+                                 _mm_loadu_si128((const __m128i*)key[j]));
+        for (int r=1; r<AES256ROUNDS; r++)
+        {
+            AESNI_UNROLL
+            for (int j=0; j<nl; j++)
+                v[j] = _mm_aesenc_si128(v[j], _mm_loadu_si128((const __m128i*)(key[j] + r*16)));
+        }
+        AESNI_UNROLL
+        for (int j=0; j<nl; j++)
+        {
+            v[j] = _mm_aesenclast_si128(v[j], _mm_loadu_si128((const __m128i*)(key[j] + AES256ROUNDS*16)));
+            _mm_storeu_si128((__m128i*)(out[j] + off), v[j]);
+        }
+    }
+    AESNI_UNROLL
+    for (int j=0; j<nl; j++)
+        x[j] = v[j];
+}
+
+/*
+ * Multi-buffer CBC encryption of the streams of s that are encryptions with AES-NI
+ * schedules: each of WSAES_SOFT_LANES lanes takes a stream, all of them advance by
+ * as many blocks as the lane nearest the end of its buffer has left, and a lane
+ * whose stream is done takes the next one
+ */
+static AESNI_TARGET void aesni_cbc_multi(const wsaes_softstream_t *s, int n)
+{
+    aesni_lane_t lane[WSAES_SOFT_LANES];
+    __m128i x[WSAES_SOFT_LANES];
+    int nl = 0, next = 0;
+    size_t nb;
+
+    for (;;)
+    {
+        for (; nl < WSAES_SOFT_LANES && next < n; next++)
+        {
+            const wsaes_softstream_t *t = &s[next];
+            int i = 0;
+
+            while (i < t->niov && 0 == t->iov[i].len)
+                i++;
+            if (!t->enc || !t->k->aesni || i == t->niov)
+                continue;
+            lane[nl] = (aesni_lane_t){ t, t->k->ks.ni.enc[0], i, 0 };
+            x[nl++] = _mm_loadu_si128((const __m128i*)t->iv);
+        }
+        if (0 == nl)
+            return;
+
+        nb = SIZE_MAX;
+        for (int j=0; j<nl; j++)
+            if ((lane[j].s->iov[lane[j].iov].len - lane[j].off) / AESBLKSIZE < nb)
+                nb = (lane[j].s->iov[lane[j].iov].len - lane[j].off) / AESBLKSIZE;
+        switch (nl)
+        {
+            case 1: aesni_lanes(lane, x, 1, nb); break;
+            case 2: aesni_lanes(lane, x, 2, nb); break;
+            case 3: aesni_lanes(lane, x, 3, nb); break;
+            case 4: aesni_lanes(lane, x, 4, nb); break;
+            case 5: aesni_lanes(lane, x, 5, nb); break;
+            case 6: aesni_lanes(lane, x, 6, nb); break;
+            case 7: aesni_lanes(lane, x, 7, nb); break;
+            default: aesni_lanes(lane, x, WSAES_SOFT_LANES, nb); break;
+        }
+
+        // lanes at the end of a buffer go on to the next one with data, or give their stream back
+        for (int j=0; j<nl; )
+        {
+            aesni_lane_t *l = &lane[j];
+
+            l->off += nb * AESBLKSIZE;
+            if (l->off < l->s->iov[l->iov].len)
+            {
+                j++;
+                continue;
+            }
+            l->off = 0;
+            while (++l->iov < l->s->niov && 0 == l->s->iov[l->iov].len)
+                ;
+            if (l->iov < l->s->niov)
+            {
+                j++;
+                continue;
+            }
+            _mm_storeu_si128((__m128i*)l->s->iv, x[j]);
+            lane[j] = lane[--nl];
+            x[j] = x[nl];
+        }
+    }
+}
+
+/* Counter blocks are independent too, so CTR also keeps four blocks in flight */
+static AESNI_TARGET void aesni_ctr(const wsaes_softkey_t *k, uint8_t *ctr, const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i rk[AES256ROUNDS+1], x[4];
+    uint64_t hi, lo;
+    size_t off = 0, n;
+
+    memcpy(&hi, ctr, 8);
+    memcpy(&lo, ctr + 8, 8);
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+
+    for (int i=0; i<=AES256ROUNDS; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)k->ks.ni.enc[i]);
+
+    for (; off < len; off += n * AESBLKSIZE)
+    {
+        n = (len - off >= 4*AESBLKSIZE) ? 4 : (len - off) / AESBLKSIZE;
+        for (size_t j=0; j<n; j++)
+        {
+            x[j] = _mm_xor_si128(_mm_set_epi64x(__builtin_bswap64(lo), __builtin_bswap64(hi)), rk[0]);
+            hi += (0 == ++lo);
+        }
+        for (int r=1; r<AES256ROUNDS; r++)
+            for (size_t j=0; j<n; j++)
+                x[j] = _mm_aesenc_si128(x[j], rk[r]);
+        for (size_t j=0; j<n; j++)
+        {
+            x[j] = _mm_aesenclast_si128(x[j], rk[AES256ROUNDS]);
+            x[j] = _mm_xor_si128(x[j], _mm_loadu_si128((const __m128i*)(in + off + j*AESBLKSIZE)));
+            _mm_storeu_si128((__m128i*)(out + off + j*AESBLKSIZE), x[j]);
+        }
+    }
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+    memcpy(ctr, &hi, 8);
+    memcpy(ctr + 8, &lo, 8);
+}
+
+/* Independent blocks (XTS, after the tweaks are applied), four at a time */
+static AESNI_TARGET void aesni_ecb(const wsaes_softkey_t *k, int enc, const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i rk[AES256ROUNDS+1], x[4];
+    size_t off = 0, n;
+
+    for (int i=0; i<=AES256ROUNDS; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)(enc ? k->ks.ni.enc[i] : k->ks.ni.dec[i]));
+
+    for (; off < len; off += n * AESBLKSIZE)
+    {
+        n = (len - off >= 4*AESBLKSIZE) ? 4 : (len - off) / AESBLKSIZE;
+        for (size_t j=0; j<n; j++)
+            x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + off + j*AESBLKSIZE)), rk[0]);
+        for (int r=1; r<AES256ROUNDS; r++)
+            for (size_t j=0; j<n; j++)
+                x[j] = enc ? _mm_aesenc_si128(x[j], rk[r]) : _mm_aesdec_si128(x[j], rk[r]);
+        for (size_t j=0; j<n; j++)
+        {
+            x[j] = enc ? _mm_aesenclast_si128(x[j], rk[AES256ROUNDS]) : _mm_aesdeclast_si128(x[j], rk[AES256ROUNDS]);
+            _mm_storeu_si128((__m128i*)(out + off + j*AESBLKSIZE), x[j]);
+        }
+    }
+}
+#endif
+
+
+/* Run len bytes (whole blocks) through ctx, an EVP context with padding off */
+static void evp_update(EVP_CIPHER_CTX *ctx, const uint8_t *in, uint8_t *out, size_t len)
+{
+    int outl;
+
+    for (size_t off=0, n; off<len; off+=n)
+    {
+        n = (len - off < WSAES_EVPCHUNK) ? len - off : WSAES_EVPCHUNK;
+        EVP_CipherUpdate(ctx, out + off, &outl, in + off, (int)n);
+    }
+}
+
+
+/*
+ * Expand key into both schedules, see wsaes_soft.h. The EVP contexts of an earlier
+ * key are keyed again rather than reallocated
+ */
+int32_t wsaes_soft_setkey(wsaes_softkey_t *k, const uint8_t *key)
+{
+#ifdef WSAES_HAVE_AESNI
+    if (__builtin_cpu_supports("aes"))
+    {
+        k->aesni = 1;
+        aesni_setkey(k, key);
+        return 0;
+    }
+#endif
+    k->aesni = 0;
+    for (int enc=0; enc<2; enc++)
+    {
+        EVP_CIPHER_CTX **cbc = &k->ks.ossl.cbc[enc], **ecb = &k->ks.ossl.ecb[enc];
+
+        if ((NULL == *cbc && NULL == (*cbc = EVP_CIPHER_CTX_new())) ||
+            (NULL == *ecb && NULL == (*ecb = EVP_CIPHER_CTX_new())) ||
+            1 != EVP_CipherInit_ex(*cbc, EVP_aes_256_cbc(), NULL, key, NULL, enc) ||
+            1 != EVP_CipherInit_ex(*ecb, EVP_aes_256_ecb(), NULL, key, NULL, enc))
+        {
+            fprintf(stderr, "ERROR: could not set up the software AES-256 key schedules\n");
+            wsaes_soft_freekey(k);
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_padding(*cbc, 0);
+        EVP_CIPHER_CTX_set_padding(*ecb, 0);
+    }
+    return 0;
+}
+
+
+/*
+ * Release the EVP contexts of k, if any, and wipe it
+ */
+void wsaes_soft_freekey(wsaes_softkey_t *k)
+{
+    if (!k->aesni)
+    {
+        for (int enc=0; enc<2; enc++)
+        {
+            EVP_CIPHER_CTX_free(k->ks.ossl.cbc[enc]);
+            EVP_CIPHER_CTX_free(k->ks.ossl.ecb[enc]);
+        }
+    }
+    OPENSSL_cleanse(k, sizeof(*k));
+}
+
+
+/*
+ * CBC encrypt/decrypt len bytes, which must be a multiple of the block size
+ */
+void wsaes_soft_cbc(const wsaes_softkey_t *k, int enc, uint8_t *iv, const uint8_t *in, uint8_t *out, size_t len)
+{
+    EVP_CIPHER_CTX *ctx;
+    uint8_t last[AESBLKSIZE];
+
+#ifdef WSAES_HAVE_AESNI
+    if (k->aesni)
+    {
+        if (enc)
+            aesni_cbc_encrypt(k, iv, in, out, len);
+        else
+            aesni_cbc_decrypt(k, iv, in, out, len);
+        return;
+    }
+#endif
+    if (0 == len)
+        return;
+    // the context keeps its key; only the IV is set, and the chain is taken back out of the data
+    ctx = k->ks.ossl.cbc[enc ? 1 : 0];
+    if (!enc)
+        memcpy(last, in + len - AESBLKSIZE, AESBLKSIZE); // in and out may be the same
+    EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1);
+    evp_update(ctx, in, out, len);
+    memcpy(iv, enc ? out + len - AESBLKSIZE : last, AESBLKSIZE);
+}
+
+
+/*
+ * CBC over n independent streams, see wsaes_soft.h
+ */
+void wsaes_soft_cbc_multi(const wsaes_softstream_t *s, int n)
+{
+#ifdef WSAES_HAVE_AESNI
+    int multi = 0;
+#endif
+
+    for (int i=0; i<n; i++)
+    {
+#ifdef WSAES_HAVE_AESNI
+        if (s[i].enc && s[i].k->aesni)
+        {
+            multi = 1;
+            continue;
+        }
+#endif
+        for (int b=0; b<s[i].niov; b++)
+            wsaes_soft_cbc(s[i].k, s[i].enc, s[i].iv, s[i].iov[b].in, s[i].iov[b].out, s[i].iov[b].len);
+    }
+#ifdef WSAES_HAVE_AESNI
+    if (multi)
+        aesni_cbc_multi(s, n);
+#endif
+}
+
+
+/*
+ * CTR encrypt/decrypt len bytes, which must be a multiple of the block size
+ */
+void wsaes_soft_ctr(const wsaes_softkey_t *k, uint8_t *ctr, const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t ks[WSAES_CTRBATCH * AESBLKSIZE];
+    size_t n;
+
+#ifdef WSAES_HAVE_AESNI
+    if (k->aesni)
+    {
+        aesni_ctr(k, ctr, in, out, len);
+        return;
+    }
+#endif
+    // a batch of counter blocks goes through ECB at once
+    for (size_t off=0; off<len; off+=n)
+    {
+        n = (len - off < sizeof(ks)) ? len - off : sizeof(ks);
+        for (size_t b=0; b<n; b+=AESBLKSIZE)
+        {
+            memcpy(ks + b, ctr, AESBLKSIZE);
+            for (int j=AESBLKSIZE-1; j>=0 && 0 == ++ctr[j]; j--)
+                ;
+        }
+        evp_update(k->ks.ossl.ecb[1], ks, ks, n);
+        for (size_t j=0; j<n; j++)
+            out[off + j] = in[off + j] ^ ks[j];
+    }
+}
+
+
+/*
+ * Encrypt or decrypt the len bytes (whole blocks) of in one block at a time
+ */
+static void soft_ecb(const wsaes_softkey_t *k, int enc, const uint8_t *in, uint8_t *out, size_t len)
+{
+#ifdef WSAES_HAVE_AESNI
+    if (k->aesni)
+    {
+        aesni_ecb(k, enc, in, out, len);
+        return;
+    }
+#endif
+    evp_update(k->ks.ossl.ecb[enc ? 1 : 0], in, out, len);
+}
+
+/* out = a ^ b, one block */
+static void xorblk(uint8_t *out, const uint8_t *a, const uint8_t *b)
+{
+    for (int j=0; j<AESBLKSIZE; j++)
+        out[j] = a[j] ^ b[j];
+}
+
+/* Multiply the tweak t by x in GF(2^128), with IEEE 1619's little-endian byte order */
+static void xts_double(uint8_t *t)
+{
+    uint8_t carry = 0, next;
+
+    for (int j=0; j<AESBLKSIZE; j++)
+    {
+        next = t[j] >> 7;
+        t[j] = (uint8_t)(t[j] << 1) | carry;
+        carry = next;
+    }
+    if (carry)
+        t[0] ^= 0x87;
+}
+
+
+/*
+ * XTS encrypt/decrypt one data unit of len bytes (at least one block). The tweaks 
+ * of a batch of blocks are computed first, so the blocks between them go through
+ * the AES rounds together. A partial last block is handled by ciphertext stealing
+ */
+void wsaes_soft_xts(const wsaes_softkey_t *k, const wsaes_softkey_t *tk, int enc, const uint8_t *tweak,
+                    const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t t[WSAES_XTSBATCH][AESBLKSIZE], cur[AESBLKSIZE], next[AESBLKSIZE], x[AESBLKSIZE], part[AESBLKSIZE];
+    size_t tail = len % AESBLKSIZE, full = len / AESBLKSIZE - (tail ? 1 : 0), n;
+    const uint8_t *first, *second;
+
+    if (len < AESBLKSIZE)
+        return;
+    soft_ecb(tk, 1, tweak, cur, AESBLKSIZE);
+    for (size_t b=0; b<full; b+=n)
+    {
+        n = (full - b < WSAES_XTSBATCH) ? full - b : WSAES_XTSBATCH;
+        for (size_t j=0; j<n; j++)
+        {
+            memcpy(t[j], cur, AESBLKSIZE);
+            xts_double(cur);
+            xorblk(out + (b + j) * AESBLKSIZE, in + (b + j) * AESBLKSIZE, t[j]);
+        }
+        soft_ecb(k, enc, out + b * AESBLKSIZE, out + b * AESBLKSIZE, n * AESBLKSIZE);
+        for (size_t j=0; j<n; j++)
+            xorblk(out + (b + j) * AESBLKSIZE, out + (b + j) * AESBLKSIZE, t[j]);
+    }
+    if (0 == tail)
+        return;
+
+    // ciphertext stealing: the last whole block and the partial one take the next two tweaks,
+    // in the opposite order when decrypting
+    in += full * AESBLKSIZE;
+    out += full * AESBLKSIZE;
+    memcpy(next, cur, AESBLKSIZE);
+    xts_double(next);
+    first = enc ? cur : next;
+    second = enc ? next : cur;
+    memcpy(part, in + AESBLKSIZE, tail);
+
+    xorblk(x, in, first);
+    soft_ecb(k, enc, x, x, AESBLKSIZE);
+    xorblk(x, x, first);
+
+    // the head of the processed block becomes the partial output, its rest fills up the partial input
+    memcpy(part + tail, x + tail, AESBLKSIZE - tail);
+    memcpy(out + AESBLKSIZE, x, tail);
+    xorblk(part, part, second);
+    soft_ecb(k, enc, part, part, AESBLKSIZE);
+    xorblk(out, part, second);
+}
@@ -0,0 +1,196 @@
+/*
+ * Trace ring for the wsaes device API and engine
+ *
+ * While the ring is on, every WSAES_TRACE_BEGIN()/WSAES_TRACE_END() of
+ * wsaes_trace.h records the stage, a timestamp, the thread and the request it
+ * belongs to (a request is everything between a thread's outermost begin and its
+ * end) into one fixed-size ring shared by all threads. A record claims its entry
+ * with a single atomic add and takes no lock, and the oldest records are
+ * overwritten once the ring is full. aes256tracedump() writes what the ring
+ * holds as Chrome trace events (JSON), which chrome://tracing, Perfetto and
+ * speedscope show as per-thread flame charts of the stages.
+ *
+ * With WSAES_TRACE=<file> in the environment the ring is on from the moment the
+ * library is loaded and dumped to <file> when it is unloaded or the process
+ * exits; WSAES_TRACE_ENTRIES sets the ring size (rounded up to a power of two).
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "wsaes_api.h"
+#include "wsaes_trace.h"
+
+typedef struct {
+    uint64_t seq;   // the record's number + 1, 0 while it is being written
+    uint64_t ts_ns;
+    uint64_t req;
+    uint64_t arg;
+    uint32_t tid;
+    uint16_t stage;
+    uint16_t begin;
+} wsaes_traceent_t;
+
+static const char *stagenames[WSAES_TRACE_NSTAGES] = {
+    "cipher", "initkey", "schedwait", "devlock", "takedevice", "soft", "request", "lock", "open", "close",
+    "ioctl", "write", "read", "copyin", "copyout", "ringwait",
+};
+
+int wsaes_tracing = 0;
+static wsaes_traceent_t *traceents = NULL; // never freed once allocated, records may still be landing
+static uint64_t tracemask;
+static uint64_t tracehead = 0;  // records made so far
+static uint64_t tracereqs = 0;  // requests numbered so far
+static uint32_t tracegen = 0;   // times the ring was turned on
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t tracens(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void wsaes_tracerec(wsaes_tracestage_t stage, int begin, uint64_t arg)
+{
+    static __thread uint32_t tid = 0;
+    static __thread uint32_t gen = 0;
+    static __thread uint64_t req = 0;
+    static __thread int depth = 0;
+    wsaes_traceent_t *ring = __atomic_load_n(&traceents, __ATOMIC_ACQUIRE), *e;
+    uint32_t curgen = __atomic_load_n(&tracegen, __ATOMIC_RELAXED);
+    uint64_t ts = tracens(), n;
+
+    if (NULL == ring)
+        return;
+    if (0 == tid)
+        tid = (uint32_t)syscall(SYS_gettid);
+    // a request that was open when the ring was last turned off is over
+    if (gen != curgen)
+    {
+        gen = curgen;
+        depth = 0;
+    }
+    if (begin && 0 == depth++)
+        req = __atomic_add_fetch(&tracereqs, 1, __ATOMIC_RELAXED);
+    else if (!begin && depth > 0)
+        depth--;
+
+    n = __atomic_fetch_add(&tracehead, 1, __ATOMIC_RELAXED);
+    e = &ring[n & tracemask];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->ts_ns = ts;
+    e->req = req;
+    e->arg = arg;
+    e->tid = tid;
+    e->stage = (uint16_t)stage;
+    e->begin = (uint16_t)begin;
+    __atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Turn the trace ring on or off. The first time it is turned on it is allocated,
+ * with WSAES_TRACE_ENTRIES entries (default WSAES_TRACE_ENTRIES_DEFAULT)
+ */
+int32_t aes256trace(int on)
+{
+    const char *v = getenv("WSAES_TRACE_ENTRIES");
+    uint64_t n = WSAES_TRACE_ENTRIES_DEFAULT;
+    wsaes_traceent_t *ring;
+
+    pthread_mutex_lock(&tracelock);
+    if (on && NULL == traceents)
+    {
+        if (NULL != v && strtoull(v, NULL, 0) > 0)
+            n = strtoull(v, NULL, 0);
+        for (tracemask = 1; tracemask < n; tracemask <<= 1)
+            ;
+        if (NULL == (ring = calloc(tracemask, sizeof(*ring))))
+        {
+            fprintf(stderr, "ERROR: could not allocate a trace ring of %llu entries\n",
+                    (unsigned long long)tracemask);
+            pthread_mutex_unlock(&tracelock);
+            return ENOMEM;
+        }
+        tracemask--;
+        __atomic_store_n(&traceents, ring, __ATOMIC_RELEASE);
+    }
+    if (on && !wsaes_tracing)
+        __atomic_add_fetch(&tracegen, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&wsaes_tracing, on ? 1 : 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tracelock);
+    return 0;
+}
+
+
+/*
+ * Write the records in the ring to path as Chrome trace events, oldest first.
+ * Records still being made while it runs are left out
+ */
+int32_t aes256tracedump(const char *path)
+{
+    wsaes_traceent_t *ring = __atomic_load_n(&traceents, __ATOMIC_ACQUIRE), e;
+    uint64_t head = __atomic_load_n(&tracehead, __ATOMIC_ACQUIRE), t0 = 0, n, seq;
+    int first = 1, pid = (int)getpid();
+    FILE *f = fopen(path, "w");
+
+    if (NULL == f)
+    {
+        perror("ERROR: could not open the trace file");
+        return errno;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    for (n = (NULL != ring && head > tracemask + 1) ? head - tracemask - 1 : 0; NULL != ring && n < head; n++)
+    {
+        wsaes_traceent_t *p = &ring[n & tracemask];
+        seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        e = *p;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // overwritten by a newer record, or still being written
+        if (seq != n + 1 || __atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq || e.stage >= WSAES_TRACE_NSTAGES)
+            continue;
+        if (first)
+            t0 = e.ts_ns;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"wsaes\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"req\":%llu,\"arg\":%llu}}", first ? "" : ",", stagenames[e.stage], e.begin ? "B" : "E",
+                (e.ts_ns >= t0) ? (e.ts_ns - t0) / 1e3 : -((t0 - e.ts_ns) / 1e3), pid, e.tid,
+                (unsigned long long)e.req, (unsigned long long)e.arg);
+        first = 0;
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    if (0 != fclose(f))
+    {
+        perror("ERROR: could not write the trace file");
+        return errno;
+    }
+    return 0;
+}
+
+
+/* WSAES_TRACE=<file>: trace from load to unload */
+__attribute__((constructor)) static void wsaes_traceload(void)
+{
+    const char *path = getenv("WSAES_TRACE");
+
+    if (NULL != path && '\0' != path[0])
+        aes256trace(1);
+}
+
+__attribute__((destructor)) static void wsaes_traceunload(void)
+{
+    const char *path = getenv("WSAES_TRACE");
+
+    if (NULL != path && '\0' != path[0] && NULL != traceents)
+    {
+        aes256trace(0);
+        aes256tracedump(path);
+    }
+}
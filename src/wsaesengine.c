@@ -11,148 +11,2358 @@
  * Author: Brett Nicholas
  */
 #include <openssl/engine.h>
+#include <openssl/sha.h>
+#include <openssl/tls1.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
 #include "wsaes_api.h"
 #include "wsaeskern.h"
+#include "wsaesengine.h"
+#include "wsaes_soft.h"
+#include "wsaes_trace.h"
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#include <openssl/async.h>
+#include <sys/eventfd.h>
+#define WSAES_ASYNC 1
+#define WSAES_PIPELINE 1 // EVP_CIPH_FLAG_PIPELINE and its ctrls
+#else
+// OpenSSL 1.0.2 has no accessors, the EVP_CIPHER_CTX fields are public
+#define EVP_CIPHER_CTX_get_cipher_data(ctx) ((ctx)->cipher_data)
+#define EVP_CIPHER_CTX_iv_noconst(ctx) ((ctx)->iv)
+#endif
 
 // Turn off this annoying warning that we don't care about 
 #pragma GCC diagnostic ignored "-Wsizeof-pointer-memaccess"
 
-// TODO we need to sort out proper return values
-#define FAIL -1
-#define SUCCESS 1
+// OpenSSL treats any non-zero return from init, do_cipher and bind as success
+#define FAIL 0
+#define SUCCESS 1
+
+static const char *engine_id = "wsaes";
+static const char *engine_name = "A test engine for the ws aescbc hardware encryption module, on the Xilinx ZYNQ7000";
+static int wsaes_nids[] = {NID_aes_256_cbc, NID_aes_256_cbc_hmac_sha256, NID_aes_256_ctr, NID_aes_256_xts};
+
+/*
+ * Per-context cipher state. OpenSSL allocates one of these as the cipher_data of
+ * every EVP_CIPHER_CTX that uses the engine (see ctx_size below)
+ */
+typedef struct {
+    uint8_t key[AESKEYSIZE];  // cipher key
+    uint8_t iv[AESIVSIZE];    // working IV, i.e. the last ciphertext block processed
+    int enc;                  // 1 to encrypt, 0 to decrypt
+    int keyset;               // key has been provided
+    int softkeyset;           // sk has been expanded from key
+    wsaes_softkey_t sk;       // key schedules for the software path
+    uint64_t id;              // unique per init_key, identifies the device owner
+    struct wsaes_device *dev; // device the context runs on, NULL until it is first keyed
+    uint32_t keyslot;         // handle of the key on dev: the slot it was last found in,
+    uint64_t keygen;          // valid while the slot still holds that load (0 = none)
+#ifdef WSAES_PIPELINE
+    // records for the next do_cipher, from the EVP_CTRL_SET_PIPELINE_* ctrls
+    int numpipes;
+    unsigned char **pipeout;
+    const unsigned char **pipein;
+    const size_t *pipelens;
+#endif
+} wsaes_cipher_ctx_t;
+
+/*
+ * AES-256-CBC-HMAC-SHA256, the "stitched" cipher libssl uses for TLS CBC suites
+ * with SHA-256 MACs in place of separate cipher and HMAC passes over each record.
+ * The ctrls and record layout follow OpenSSL's own (e_aes_cbc_hmac_sha256.c). The
+ * AES part runs exactly as for AES-256-CBC, and the MAC is computed from the 
+ * plaintext as it goes to or comes back from the device (see wsaes_tap_t)
+ */
+typedef struct {
+    wsaes_cipher_ctx_t aes;      // must be first: the AES-256-CBC functions run on it
+    SHA256_CTX head;             // inner HMAC state after the MAC key
+    SHA256_CTX tail;             // outer HMAC state after the MAC key
+    SHA256_CTX md;               // the MAC being computed
+    size_t payload_length;       // set by EVP_CTRL_AEAD_TLS1_AAD for the next do_cipher
+    int tlsver;                  // protocol version from the record header
+    uint8_t aad[EVP_AEAD_TLS1_AAD_LEN]; // record header, when decrypting
+    size_t pos, macfrom, macto;  // stream offset seen by the tap, and the range the MAC covers
+} wsaes_hmac_ctx_t;
+
+/*
+ * AES-256-CTR. The working IV is the counter block of the next whole block, and 
+ * a partial block at the end of a call leaves the rest of its keystream for the 
+ * next one
+ */
+typedef struct {
+    wsaes_cipher_ctx_t aes;      // must be first: the AES-256-CBC functions run on it
+    uint8_t ecount[AESBLKSIZE];  // keystream of the last partial block
+    unsigned int num;            // bytes of ecount used, 0 if none are left
+} wsaes_ctr_ctx_t;
+
+#define WSAES_CTRSPLIT 65536 // shortest CTR range given a device of its own, see wsaes_ctrcipher()
+
+/*
+ * AES-256-XTS. As with OpenSSL's own XTS, every do_cipher call is one data unit
+ * (e.g. a disk sector) whose tweak is the IV, which the call leaves as it is. The
+ * first half of the key is the data key, and runs as for AES-256-CBC; the second
+ * half encrypts the tweaks
+ */
+typedef struct {
+    wsaes_cipher_ctx_t aes;      // must be first: the AES-256-CBC functions run on it
+    uint8_t tweakkey[AESKEYSIZE];
+    int tweaksoftkeyset;         // tsk has been expanded from tweakkey
+    wsaes_softkey_t tsk;         // tweak key schedules for the software path
+} wsaes_xts_ctx_t;
+
+#define WSAES_NO_PAYLOAD ((size_t)-1) // not a TLS record
+#define WSAES_TAPCHUNK 4096          // software path: bytes ciphered and MACed at a time, while in L1
+
+#define WSAES_MAXPIPES 32 // SSL_MAX_PIPELINES
+#ifdef WSAES_PIPELINE
+#define WSAES_NUMPIPES(c) ((c)->numpipes)
+#else
+#define WSAES_NUMPIPES(c) 0
+#endif
+
+#ifdef WSAES_ASYNC
+typedef struct wsaes_asyncreq wsaes_asyncreq_t;
+#endif
+
+#define WSAES_MAXKEYSLOTS 64 // key slots used per device, however many it has
+
+#define WSAES_NSHARDS 64 // counter shards, see wsaes_shard(); more threads than this share one more
+
+#define WSAES_SCHEDBATCH 64               // most requests the scheduler runs in one batch
+#define WSAES_SCHEDBYTES AESMAXDATASIZE   // and most bytes, once reached the batch goes without waiting
+#define WSAES_SCHED_SOFT 2                // wsaes_schedreq_t.done: run the software group it leads
+#define WSAES_OVDECAY 3                   // SW_OVERFLOW rates keep 1 - 1/2^WSAES_OVDECAY of the past each time
+#define WSAES_OVDOWN_NS 100000000ULL      // SW_OVERFLOW: a device that failed gets no requests for this long
+
+/*
+ * A request to a device's scheduler, see wsaes_schedmain(). It lives on the stack
+ * of the thread that made it, which sleeps until the submitter marks it done
+ */
+typedef struct wsaes_schedreq {
+    struct wsaes_schedreq *next;   // the request queued after this one
+    wsaes_cipher_ctx_t *c;
+    ciphermode_t mode;
+    const wsaes_iov_t *iov;
+    int niov;
+    size_t inl;
+    uint32_t depth;                // requests queued when it was, itself included
+    uint64_t queuedns;
+    int status;                    // wsaes_devcipher() result
+    int done;                      // under the device's schedlock: 1, or WSAES_SCHED_SOFT
+    struct wsaes_schedreq *softnext; // the next request of its software group, see wsaes_schedsoft()
+} wsaes_schedreq_t;
+
+/*
+ * A key loaded on a device, in one of its key slots (the only one on devices 
+ * without WSAES_CAP_KEYSLOTS)
+ */
+typedef struct {
+    uint8_t key[AESKEYSIZE];
+    uint64_t gen;                  // unique number of the load, 0 if the slot is empty
+    uint64_t lastuse;              // device key clock at the last use, for LRU eviction
+} wsaes_keyslot_t;
+
+/*
+ * Each device holds a single IV and one key per key slot. Rather than programming
+ * them in every init_key, the context that last used a device is its owner, and a
+ * context only reloads its IV (and selects or uploads its key, unless it is the 
+ * selected one) when it takes the device over from another owner. All of this is
+ * under the device's lock. A context keeps the CBC chain on one device for its 
+ * whole life, see wsaes_pickdevice().
+ */
+typedef struct wsaes_device {
+    wsaes_session_t *sess;         // held open from wsaes_init() until wsaes_finish()
+    pthread_mutex_t lock;
+    uint64_t owner;                // id of the owning context, 0 if none
+    wsaes_keyslot_t slots[WSAES_MAXKEYSLOTS]; // keys loaded on the device, see wsaes_loadkey()
+    uint32_t nslots;               // slots used, 1 without WSAES_CAP_KEYSLOTS
+    uint32_t curslot;              // slot selected on the device, nslots if unknown
+    uint64_t keyclock;             // key uses, for LRU eviction
+    wsaes_keystats_t keystats;
+    wsaes_devstat_t stat;          // utilization, see WSAES_CMD_GET_DEV_STATS
+    uint64_t outstanding;          // bytes handed to the device and not back yet, for placement
+    int ctr;                       // the device runs AES-256-CTR (WSAES_CAP_CTR)
+    uint32_t xtsmax;               // largest XTS data unit the device takes, 0 without WSAES_CAP_XTS
+    uint8_t tweakkey[AESKEYSIZE];  // XTS tweak key loaded on the device
+    int tweakkeyvalid;             // tweakkey is valid
+    // coalescing scheduler, see wsaes_schedmain(): a lock-free MPSC queue of requests
+    wsaes_schedreq_t *schedhead;   // consumer end, only touched by the submitter thread
+    wsaes_schedreq_t *schedtail;   // producer end, swapped in by every thread that queues
+    wsaes_schedreq_t schedstub;    // queued whenever the queue would otherwise run empty
+    uint32_t schedqueued;          // requests queued and not taken yet
+    int schedidle;                 // the submitter is going to sleep on schedcond
+    pthread_mutex_t schedlock;
+    pthread_cond_t schedcond;      // wakes the submitter
+    pthread_cond_t scheddonecond;  // a batch is done
+    pthread_t schedthread;
+    int schedrunning;              // submitter started, requests go through it
+    int schedstop;                 // submitter should exit once the queue is empty
+    wsaes_schedstats_t schedstats; // under schedlock
+    // SW_OVERFLOW, see wsaes_schedsplit(): device and software throughput as decaying sums
+    uint64_t ovdevbytes, ovdevns;  // submitter only
+    uint64_t ovsoftbytes, ovsoftns; // under schedlock
+    uint64_t ovdownuntil;          // no requests go to the device before this, after a failure
+#ifdef WSAES_ASYNC
+    // requests from paused ASYNC_JOBs and CTR ranges, served by a worker thread per device
+    pthread_mutex_t asynclock;
+    pthread_cond_t asynccond;
+    pthread_cond_t asyncdonecond;  // a request is done, for waiters that aren't ASYNC_JOBs
+    wsaes_asyncreq_t *asynchead, *asynctail;
+    pthread_t asyncthread;
+    int asyncrunning;              // worker thread started
+    int asyncstop;                 // worker should exit once the queue is empty
+#endif
+} wsaes_device_t;
+
+static wsaes_device_t wsaes_devs[WSAES_MAXDEVS];
+static int wsaes_ndevs = 0;                // devices opened by wsaes_init()
+static int wsaes_nctrdevs = 0;             // those of them that run CTR
+static pthread_mutex_t wsaes_ctxlock = PTHREAD_MUTEX_INITIALIZER; // context ids and placement
+static uint64_t wsaes_nextid = 0;          // last context id handed out
+static uint64_t wsaes_keygen = 0;          // last key load number handed out, see wsaes_keyslot_t
+static uint64_t wsaes_initns = 0;          // when wsaes_init() ran, for utilization
+
+// calls below this many bytes are cheaper in software than a device round trip
+static size_t wsaes_swthreshold = WSAES_SW_THRESHOLD_DEFAULT;
+// write()/read() transfers kept in flight on devices that queue them
+static uint32_t wsaes_pipedepth = WSAES_PIPEDEPTH_DEFAULT;
+// largest device transfer used, 0 for the device's own largest
+static uint32_t wsaes_chunk = 0;
+// the three above are calibrated at init if set, see WSAES_CMD_AUTOTUNE, and kept in wsaes_tunecache. Ctrls
+// change them while other threads cipher, so they are only read and written with relaxed __atomic_*
+static int wsaes_autotune = 0;
+static char wsaes_tunecache[PATH_MAX] = "";
+static wsaes_tuning_t wsaes_tuning = { 0 }; // source and calibrate_ns of the last tuning
+// requests go through the devices' schedulers, which hold them back this long to coalesce them
+static int wsaes_schedon = 0;
+static uint64_t wsaes_schedlatency_ns = WSAES_SCHED_LATENCY_DEFAULT * 1000;
+static int wsaes_swoverflow = 0;
+
+static int wsaesengine_aescbc_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
+static int wsaesengine_aescbc_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
+static int wsaesengine_aescbc_cleanup(EVP_CIPHER_CTX *ctx);
+static int wsaesengine_aescbc_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr);
+static int wsaesengine_hmac_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
+static int wsaesengine_hmac_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
+static int wsaesengine_hmac_cleanup(EVP_CIPHER_CTX *ctx);
+static int wsaesengine_hmac_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr);
+static int wsaesengine_ctr_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
+static int wsaesengine_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
+static int wsaesengine_ctr_cleanup(EVP_CIPHER_CTX *ctx);
+static int wsaesengine_ctr_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr);
+static int wsaesengine_xts_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
+static int wsaesengine_xts_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
+static int wsaesengine_xts_cleanup(EVP_CIPHER_CTX *ctx);
+static int wsaesengine_xts_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr);
+
+#ifdef WSAES_PIPELINE
+#define WSAES_AESCBC_FLAGS (EVP_CIPH_CBC_MODE | EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CTRL_INIT | EVP_CIPH_CUSTOM_COPY | \
+                            EVP_CIPH_FLAG_PIPELINE)
+#else
+#define WSAES_AESCBC_FLAGS (EVP_CIPH_CBC_MODE | EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CTRL_INIT | EVP_CIPH_CUSTOM_COPY)
+#endif
+#define WSAES_HMAC_FLAGS (EVP_CIPH_CBC_MODE | EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CTRL_INIT | EVP_CIPH_CUSTOM_COPY | \
+                          EVP_CIPH_FLAG_DEFAULT_ASN1 | EVP_CIPH_FLAG_AEAD_CIPHER)
+#define WSAES_CTR_FLAGS (EVP_CIPH_CTR_MODE | EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CTRL_INIT | EVP_CIPH_CUSTOM_COPY | \
+                         EVP_CIPH_FLAG_DEFAULT_ASN1)
+#define WSAES_XTS_FLAGS (EVP_CIPH_XTS_MODE | EVP_CIPH_CUSTOM_IV | EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CTRL_INIT | \
+                         EVP_CIPH_CUSTOM_COPY | EVP_CIPH_FLAG_DEFAULT_ASN1)
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/*
+ * Since OpenSSL 1.1.0 EVP_CIPHER is opaque, so the method is built through the 
+ * EVP_CIPHER_meth_* functions when the engine is bound (wsaes_create_ciphers)
+ */
+static EVP_CIPHER *wsaesengine_aescbc_method = NULL;
+static EVP_CIPHER *wsaesengine_hmac_method = NULL;
+static EVP_CIPHER *wsaesengine_ctr_method = NULL;
+static EVP_CIPHER *wsaesengine_xts_method = NULL;
+#define WSAES_AESCBC wsaesengine_aescbc_method
+#define WSAES_HMACSHA256 wsaesengine_hmac_method
+#define WSAES_AESCTR wsaesengine_ctr_method
+#define WSAES_AESXTS wsaesengine_xts_method
+
+static int wsaes_create_ciphers(void)
+{
+    EVP_CIPHER *m = EVP_CIPHER_meth_new(NID_aes_256_cbc, AESBLKSIZE, AESKEYSIZE);
+    EVP_CIPHER *h = EVP_CIPHER_meth_new(NID_aes_256_cbc_hmac_sha256, AESBLKSIZE, AESKEYSIZE);
+    EVP_CIPHER *t = EVP_CIPHER_meth_new(NID_aes_256_ctr, 1, AESKEYSIZE);
+    EVP_CIPHER *x = EVP_CIPHER_meth_new(NID_aes_256_xts, 1, AESXTSKEYSIZE);
+
+    if (NULL == m || !EVP_CIPHER_meth_set_iv_length(m, AESIVSIZE) ||
+        !EVP_CIPHER_meth_set_flags(m, WSAES_AESCBC_FLAGS) ||
+        !EVP_CIPHER_meth_set_init(m, wsaesengine_aescbc_init_key) ||
+        !EVP_CIPHER_meth_set_do_cipher(m, wsaesengine_aescbc_do_cipher) ||
+        !EVP_CIPHER_meth_set_cleanup(m, wsaesengine_aescbc_cleanup) ||
+        !EVP_CIPHER_meth_set_impl_ctx_size(m, sizeof(wsaes_cipher_ctx_t)) ||
+        !EVP_CIPHER_meth_set_set_asn1_params(m, EVP_CIPHER_set_asn1_iv) ||
+        !EVP_CIPHER_meth_set_get_asn1_params(m, EVP_CIPHER_get_asn1_iv) ||
+        !EVP_CIPHER_meth_set_ctrl(m, wsaesengine_aescbc_ctrl) ||
+        NULL == h || !EVP_CIPHER_meth_set_iv_length(h, AESIVSIZE) ||
+        !EVP_CIPHER_meth_set_flags(h, WSAES_HMAC_FLAGS) ||
+        !EVP_CIPHER_meth_set_init(h, wsaesengine_hmac_init_key) ||
+        !EVP_CIPHER_meth_set_do_cipher(h, wsaesengine_hmac_do_cipher) ||
+        !EVP_CIPHER_meth_set_cleanup(h, wsaesengine_hmac_cleanup) ||
+        !EVP_CIPHER_meth_set_impl_ctx_size(h, sizeof(wsaes_hmac_ctx_t)) ||
+        !EVP_CIPHER_meth_set_ctrl(h, wsaesengine_hmac_ctrl) ||
+        NULL == t || !EVP_CIPHER_meth_set_iv_length(t, AESIVSIZE) ||
+        !EVP_CIPHER_meth_set_flags(t, WSAES_CTR_FLAGS) ||
+        !EVP_CIPHER_meth_set_init(t, wsaesengine_ctr_init_key) ||
+        !EVP_CIPHER_meth_set_do_cipher(t, wsaesengine_ctr_do_cipher) ||
+        !EVP_CIPHER_meth_set_cleanup(t, wsaesengine_ctr_cleanup) ||
+        !EVP_CIPHER_meth_set_impl_ctx_size(t, sizeof(wsaes_ctr_ctx_t)) ||
+        !EVP_CIPHER_meth_set_ctrl(t, wsaesengine_ctr_ctrl) ||
+        NULL == x || !EVP_CIPHER_meth_set_iv_length(x, AESIVSIZE) ||
+        !EVP_CIPHER_meth_set_flags(x, WSAES_XTS_FLAGS) ||
+        !EVP_CIPHER_meth_set_init(x, wsaesengine_xts_init_key) ||
+        !EVP_CIPHER_meth_set_do_cipher(x, wsaesengine_xts_do_cipher) ||
+        !EVP_CIPHER_meth_set_cleanup(x, wsaesengine_xts_cleanup) ||
+        !EVP_CIPHER_meth_set_impl_ctx_size(x, sizeof(wsaes_xts_ctx_t)) ||
+        !EVP_CIPHER_meth_set_ctrl(x, wsaesengine_xts_ctrl))
+    {
+        EVP_CIPHER_meth_free(m);
+        EVP_CIPHER_meth_free(h);
+        EVP_CIPHER_meth_free(t);
+        EVP_CIPHER_meth_free(x);
+        return FAIL;
+    }
+    wsaesengine_aescbc_method = m;
+    wsaesengine_hmac_method = h;
+    wsaesengine_ctr_method = t;
+    wsaesengine_xts_method = x;
+    return SUCCESS;
+}
+
+static void wsaes_destroy_ciphers(void)
+{
+    EVP_CIPHER_meth_free(wsaesengine_aescbc_method);
+    EVP_CIPHER_meth_free(wsaesengine_hmac_method);
+    EVP_CIPHER_meth_free(wsaesengine_ctr_method);
+    EVP_CIPHER_meth_free(wsaesengine_xts_method);
+    wsaesengine_aescbc_method = NULL;
+    wsaesengine_hmac_method = NULL;
+    wsaesengine_ctr_method = NULL;
+    wsaesengine_xts_method = NULL;
+}
+#else
+/*
+ * Create our own evp cipher declaration matching that of the generic cipher 
+ * structure (struct evp_cipher_st), as defined in openssl/include/internal/evp_int.h
+ *
+ * struct evp_cipher_st {
+ *    int nid;
+ *    int block_size;
+ *    // Default value for variable length ciphers 
+ *    int key_len;
+ *    int iv_len;
+ *    // Various flags 
+ *    unsigned long flags; 
+ *    // init key 
+ *    int (*init) (EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
+ *    // encrypt/decrypt data 
+ *    int (*do_cipher) (EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
+ *    // cleanup ctx 
+ *    int (*cleanup) (EVP_CIPHER_CTX *);
+ *    // how big ctx->cipher_data needs to be 
+ *    int ctx_size;
+ *    // Populate a ASN1_TYPE with parameters 
+ *    int (*set_asn1_parameters) (EVP_CIPHER_CTX *, ASN1_TYPE *);
+ *    // Get parameters from a ASN1_TYPE 
+ *    int (*get_asn1_parameters) (EVP_CIPHER_CTX *, ASN1_TYPE *);
+ *    // Miscellaneous operations 
+ *    int (*ctrl) (EVP_CIPHER_CTX *, int type, int arg, void *ptr);
+ *    // Application data 
+ *    void *app_data;
+ * }  // EVP_CIPHER  ;
+ */
+static const EVP_CIPHER wsaesengine_aescbc_method = 
+{
+	NID_aes_256_cbc, // openSSL algorithm numerical ID
+	AESBLKSIZE, // block size
+	AESKEYSIZE, // key length
+	AESIVSIZE,  // iv length 
+	WSAES_AESCBC_FLAGS, // flags
+	wsaesengine_aescbc_init_key, // key initialization function pointer
+	wsaesengine_aescbc_do_cipher, // do_cipher (encrypt/decrypt data)
+	wsaesengine_aescbc_cleanup, // cleanup (cleanup ctx)
+	sizeof(wsaes_cipher_ctx_t), // ctx_size (how large cipher data needs to be)
+	EVP_CIPHER_set_asn1_iv, // set_asn1_parameters Pupulate a ASN1_type with parameters
+	EVP_CIPHER_get_asn1_iv, // get_asn1_parameters get ASN1_TYPE parameters
+	wsaesengine_aescbc_ctrl, // ctrl: misc. operations
+	NULL // pointer to application data to encrypt
+}; 
+#define WSAES_AESCBC (&wsaesengine_aescbc_method)
+
+static const EVP_CIPHER wsaesengine_hmac_method = 
+{
+	NID_aes_256_cbc_hmac_sha256,
+	AESBLKSIZE,
+	AESKEYSIZE,
+	AESIVSIZE,
+	WSAES_HMAC_FLAGS,
+	wsaesengine_hmac_init_key,
+	wsaesengine_hmac_do_cipher,
+	wsaesengine_hmac_cleanup,
+	sizeof(wsaes_hmac_ctx_t),
+	NULL, // ASN1 parameters as for the other CBC ciphers, see EVP_CIPH_FLAG_DEFAULT_ASN1
+	NULL,
+	wsaesengine_hmac_ctrl,
+	NULL
+}; 
+#define WSAES_HMACSHA256 (&wsaesengine_hmac_method)
+
+static const EVP_CIPHER wsaesengine_ctr_method = 
+{
+	NID_aes_256_ctr,
+	1, // a stream cipher to EVP
+	AESKEYSIZE,
+	AESIVSIZE,
+	WSAES_CTR_FLAGS,
+	wsaesengine_ctr_init_key,
+	wsaesengine_ctr_do_cipher,
+	wsaesengine_ctr_cleanup,
+	sizeof(wsaes_ctr_ctx_t),
+	NULL,
+	NULL,
+	wsaesengine_ctr_ctrl,
+	NULL
+}; 
+#define WSAES_AESCTR (&wsaesengine_ctr_method)
+
+static const EVP_CIPHER wsaesengine_xts_method = 
+{
+	NID_aes_256_xts,
+	1,
+	AESXTSKEYSIZE,
+	AESIVSIZE,
+	WSAES_XTS_FLAGS,
+	wsaesengine_xts_init_key,
+	wsaesengine_xts_do_cipher,
+	wsaesengine_xts_cleanup,
+	sizeof(wsaes_xts_ctx_t),
+	NULL,
+	NULL,
+	wsaesengine_xts_ctrl,
+	NULL
+}; 
+#define WSAES_AESXTS (&wsaesengine_xts_method)
+
+static int wsaes_create_ciphers(void)
+{
+    return SUCCESS;
+}
+
+static void wsaes_destroy_ciphers(void)
+{
+}
+#endif
+
+
+static uint64_t wsaes_nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Performance counters (WSAES_CMD_GET_PERF_STATS), sharded so that counting costs
+ * neither a lock nor a shared cache line: a thread claims a shard of its own the
+ * first time it counts and, being its only writer, adds with plain loads and 
+ * stores; readers sum the shards. A thread's shard is given back when it exits,
+ * counts and all, for the next thread to carry on. Threads that find no free 
+ * shard count in the shared one, with atomic adds. Counters are never written 
+ * by anyone else: a reset only moves the base that reads subtract
+ */
+typedef struct {
+    wsaes_perfstats_t s;
+    int owned;           // claimed by a thread
+} __attribute__((aligned(64))) wsaes_shard_t;
+
+static wsaes_shard_t wsaes_shards[WSAES_NSHARDS + 1]; // the last one is shared
+static wsaes_perfstats_t wsaes_statbase;             // the sums at the last reset, under wsaes_statlock
+static pthread_mutex_t wsaes_statlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t wsaes_shardkey;                 // gives a thread's shard back when it exits
+static int wsaes_shardkeyset = 0;
+static __thread wsaes_shard_t *wsaes_myshard = NULL;
+// 0: no counting, 1: counters, 2: counters and latency histograms
+static int wsaes_statlevel = WSAES_STATS_DEFAULT;
+
+static void wsaes_shardexit(void *arg)
+{
+    __atomic_store_n(&((wsaes_shard_t*)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static wsaes_shard_t *wsaes_shard(void)
+{
+    wsaes_shard_t *sh = wsaes_myshard;
+
+    if (NULL != sh)
+        return sh;
+    sh = &wsaes_shards[WSAES_NSHARDS];
+    for (int n=0; n<WSAES_NSHARDS && wsaes_shardkeyset; n++)
+    {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&wsaes_shards[n].owned, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            sh = &wsaes_shards[n];
+            pthread_setspecific(wsaes_shardkey, sh);
+            break;
+        }
+    }
+    wsaes_myshard = sh;
+    return sh;
+}
+
+static void wsaes_add(wsaes_shard_t *sh, uint64_t *v, uint64_t n)
+{
+    if (&wsaes_shards[WSAES_NSHARDS] == sh)
+        __atomic_add_fetch(v, n, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* A do_cipher call (or part of one) run in software */
+static void wsaes_countsw(size_t n)
+{
+    wsaes_shard_t *sh;
+
+    if (wsaes_statlevel > 0)
+    {
+        sh = wsaes_shard();
+        wsaes_add(sh, &sh->s.sw_ops, 1);
+        wsaes_add(sh, &sh->s.sw_bytes, n);
+    }
+}
+
+/* n failed device requests */
+static void wsaes_counterr(uint64_t n)
+{
+    wsaes_shard_t *sh;
+
+    if (wsaes_statlevel > 0)
+    {
+        sh = wsaes_shard();
+        wsaes_add(sh, &sh->s.dev_errors, n);
+    }
+}
+
+/* Add a latency of ns to h, in shard sh */
+static void wsaes_histadd(wsaes_shard_t *sh, wsaes_hist_t *h, uint64_t ns)
+{
+    int b = 63 - __builtin_clzll(ns | 1);
+
+    wsaes_add(sh, &h->count, 1);
+    wsaes_add(sh, &h->sum_ns, ns);
+    wsaes_add(sh, &h->bucket[(b < WSAES_HISTBUCKETS) ? b : WSAES_HISTBUCKETS - 1], 1);
+}
+
+
+/*
+ * Place a new context on the device with the fewest bytes outstanding, breaking
+ * ties by the number of contexts already there. Called with wsaes_ctxlock held
+ */
+static wsaes_device_t *wsaes_pickdevice(void)
+{
+    wsaes_device_t *best = &wsaes_devs[0];
+    uint64_t bestout = __atomic_load_n(&best->outstanding, __ATOMIC_RELAXED), out;
+
+    for (int i=1; i<wsaes_ndevs; i++)
+    {
+        out = __atomic_load_n(&wsaes_devs[i].outstanding, __ATOMIC_RELAXED);
+        if (out < bestout || (out == bestout && wsaes_devs[i].stat.contexts < best->stat.contexts))
+        {
+            best = &wsaes_devs[i];
+            bestout = out;
+        }
+    }
+    best->stat.contexts++;
+    return best;
+}
+
+
+/*
+ * Key initialization function. This function is called by the OpenSSL EVP API 
+ * through the EVP_[En/De]cryptInit_ex(..) function
+ */
+static int wsaes_initkey(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc)
+{
+    wsaes_cipher_ctx_t *c = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    if (0 == wsaes_ndevs)
+	{
+		fprintf(stderr,"ERROR: AES block not initialized in engine init_key\n");
+		return FAIL;
+	}
+
+    // a NULL key keeps the current one (e.g. when only the IV is reset). For CBC, 
+    // OpenSSL has already set up the IV in the EVP context, from iv or the original IV
+    if (key)
+    {
+        memcpy(c->key, key, AESKEYSIZE);
+        c->keyset = 1;
+        c->softkeyset = 0;
+        c->keygen = 0;
+    }
+    memcpy(c->iv, EVP_CIPHER_CTX_iv_noconst(ctx), AESIVSIZE);
+    c->enc = enc;
+
+    // the device isn't touched until the first do_cipher, see wsaes_takedevice()
+    pthread_mutex_lock(&wsaes_ctxlock);
+    c->id = ++wsaes_nextid;
+    if (NULL == c->dev)
+        c->dev = wsaes_pickdevice();
+    pthread_mutex_unlock(&wsaes_ctxlock);
+
+	return SUCCESS;
+}
+
+/* The other ciphers' init_key functions end here too, so every init_key is timed once */
+static int wsaesengine_aescbc_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, 
+										  const unsigned char *iv, int enc)
+{
+    int level = wsaes_statlevel, ret;
+    uint64_t start = (level > 1) ? wsaes_nowns() : 0;
+    wsaes_shard_t *sh;
+
+    WSAES_TRACE_BEGIN(initkey, enc);
+    ret = wsaes_initkey(ctx, key, iv, enc);
+    WSAES_TRACE_END(initkey, ret);
+    if (level > 0)
+    {
+        sh = wsaes_shard();
+        if (key)
+            wsaes_add(sh, &sh->s.key_inits, 1);
+        if (level > 1)
+            wsaes_histadd(sh, &sh->s.init_key, wsaes_nowns() - start);
+    }
+    return ret;
+}
+
+
+/*
+ * do_cipher of every cipher goes through here: fn is the cipher's own, and the 
+ * call is counted by direction and timed
+ */
+static int wsaes_timedcipher(int (*fn)(EVP_CIPHER_CTX*, unsigned char*, const unsigned char*, size_t),
+                             EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    wsaes_cipher_ctx_t *c = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    int level = wsaes_statlevel, ret;
+    uint64_t start;
+    size_t bytes = inl;
+    wsaes_shard_t *sh;
+
+    WSAES_TRACE_BEGIN(cipher, inl);
+    if (0 == level)
+    {
+        ret = fn(ctx, out, in, inl);
+        WSAES_TRACE_END(cipher, ret);
+        return ret;
+    }
+    start = (level > 1) ? wsaes_nowns() : 0;
+#ifdef WSAES_PIPELINE
+    // a pipelined call runs the records alone, inl is only the first one's (libssl passes reclen[0]),
+    // and the records are gone once fn has run them
+    if (c->numpipes > 0)
+        bytes = 0;
+    for (int i=0; i<c->numpipes && NULL != c->pipelens; i++)
+        bytes += c->pipelens[i];
+#endif
+    ret = fn(ctx, out, in, inl);
+    sh = wsaes_shard();
+    wsaes_add(sh, c->enc ? &sh->s.enc_ops : &sh->s.dec_ops, 1);
+    wsaes_add(sh, c->enc ? &sh->s.enc_bytes : &sh->s.dec_bytes, bytes);
+    if (level > 1)
+        wsaes_histadd(sh, &sh->s.do_cipher, wsaes_nowns() - start);
+    WSAES_TRACE_END(cipher, ret);
+    return ret;
+}
+
+
+/*
+ * Forget the keys loaded on device d, whose state is unknown after a failure, so
+ * they are uploaded again. Called with the device lock held
+ */
+static void wsaes_dropkeys(wsaes_device_t *d)
+{
+    for (uint32_t s=0; s<d->nslots; s++)
+        d->slots[s].gen = 0;
+    d->curslot = d->nslots;
+}
+
+
+/*
+ * Make c's key the selected one on device d. If c's handle still names a slot of
+ * d holding its key, or another context has loaded the same key, that slot is
+ * selected (if it isn't already); otherwise the key is uploaded into an empty 
+ * slot or the least recently used one. Called with the device lock held
+ */
+static int wsaes_loadkey(wsaes_device_t *d, wsaes_cipher_ctx_t *c)
+{
+    uint32_t s = c->keyslot;
+
+    if (c->dev != d || s >= d->nslots || 0 == c->keygen || d->slots[s].gen != c->keygen)
+    {
+        for (s=0; s<d->nslots; s++)
+            if (0 != d->slots[s].gen && 0 == CRYPTO_memcmp(d->slots[s].key, c->key, AESKEYSIZE))
+                break;
+    }
+
+    if (s < d->nslots)
+    {
+        if (s != d->curslot)
+        {
+            if (0 != aes256usekeyslot_sess(d->sess, s))
+            {
+                fprintf(stderr,"ERROR: failed to select key slot in engine do_cipher()\n");
+                wsaes_dropkeys(d);
+                return FAIL;
+            }
+            d->curslot = s;
+            d->keystats.keyslot_switches++;
+        }
+        d->keystats.keyloads_avoided++;
+    }
+    else
+    {
+        s = 0;
+        for (uint32_t t=1; t<d->nslots && 0 != d->slots[s].gen; t++)
+            if (0 == d->slots[t].gen || d->slots[t].lastuse < d->slots[s].lastuse)
+                s = t;
+        if (0 != d->slots[s].gen)
+            d->keystats.keyslot_evictions++;
+        d->slots[s].gen = 0;
+        d->curslot = d->nslots;
+        if (0 != ((d->nslots > 1) ? aes256setkeyslot_sess(d->sess, s, c->key) : aes256setkey_sess(d->sess, c->key)))
+        {
+            fprintf(stderr,"ERROR: failed to set key in engine do_cipher()\n");
+            return FAIL;
+        }
+        memcpy(d->slots[s].key, c->key, AESKEYSIZE);
+        d->slots[s].gen = __atomic_add_fetch(&wsaes_keygen, 1, __ATOMIC_RELAXED);
+        d->curslot = s;
+        d->keystats.keyloads++;
+    }
+
+    d->slots[s].lastuse = ++d->keyclock;
+    // CTR ranges load c's key on other devices at the same time, which leave its handle alone
+    if (c->dev == d)
+    {
+        c->keyslot = s;
+        c->keygen = d->slots[s].gen;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Make c the owner of its device, programming its key and IV. The key upload is
+ * skipped when the device already holds the same key. Called with the device lock held
+ */
+static int wsaes_takedevice(wsaes_cipher_ctx_t *c)
+{
+    wsaes_device_t *d = c->dev;
+    int ret;
+
+    WSAES_TRACE_BEGIN(takedevice, c->id);
+    if (SUCCESS != wsaes_loadkey(d, c))
+    {
+        WSAES_TRACE_END(takedevice, FAIL);
+        return FAIL;
+    }
+
+    ret = aes256setiv_sess(d->sess, c->iv);
+    if (0 != ret)
+    {
+        fprintf(stderr,"ERROR: failed to set iv in engine do_cipher()\n");
+        WSAES_TRACE_END(takedevice, FAIL);
+        return FAIL;
+    }
+    d->keystats.ivloads++;
+
+    ret = aes256reset_sess(d->sess);
+    if (0 != ret)
+    {
+        fprintf(stderr,"ERROR: failed to reset in engine do_cipher()\n");
+        WSAES_TRACE_END(takedevice, FAIL);
+        return FAIL;
+    }
+
+    d->owner = c->id;
+    WSAES_TRACE_END(takedevice, SUCCESS);
+    return SUCCESS;
+}
+
+
+/*
+ * c's key schedules for the software path, expanded on first use; NULL if they
+ * couldn't be
+ */
+static const wsaes_softkey_t *wsaes_softkey(wsaes_cipher_ctx_t *c)
+{
+    if (!c->softkeyset)
+    {
+        if (0 != wsaes_soft_setkey(&c->sk, c->key))
+            return NULL;
+        c->softkeyset = 1;
+    }
+    return &c->sk;
+}
+
+
+/*
+ * Software path for small inputs. The working IV carries the CBC chain across
+ * both paths; if c owns the device, the chain held there is now stale, so c gives
+ * up ownership and reloads its IV the next time it uses the device.
+ */
+static int wsaes_softcipher(EVP_CIPHER_CTX *ctx, wsaes_cipher_ctx_t *c, unsigned char *out, 
+                            const unsigned char *in, size_t inl)
+{
+    const wsaes_softkey_t *k = wsaes_softkey(c);
+
+    if (NULL == k)
+        return FAIL;
+    WSAES_TRACE_BEGIN(soft, inl);
+    wsaes_soft_cbc(k, c->enc, c->iv, in, out, inl);
+    WSAES_TRACE_END(soft, inl);
+    memcpy(EVP_CIPHER_CTX_iv_noconst(ctx), c->iv, AESIVSIZE);
+
+    // only c itself can make c the owner, so this unlocked check can't miss it
+    if (NULL != c->dev && __atomic_load_n(&c->dev->owner, __ATOMIC_RELAXED) == c->id)
+    {
+        pthread_mutex_lock(&c->dev->lock);
+        if (c->dev->owner == c->id)
+            c->dev->owner = 0;
+        pthread_mutex_unlock(&c->dev->lock);
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Run the buffers of iov, inl bytes in all, through c's device in one transaction,
+ * taking the device over first if c doesn't own it, and showing tap (if any) the
+ * plaintext. Returns 0 on success like the wsaes API calls
+ */
+static int wsaes_devcipher(wsaes_cipher_ctx_t *c, ciphermode_t mode, const wsaes_iov_t *iov, int niov, size_t inl,
+                           const wsaes_tap_t *tap)
+{
+    wsaes_device_t *d = c->dev;
+    int status;
+    uint64_t start;
+
+    WSAES_TRACE_BEGIN(devlock, d - wsaes_devs);
+    pthread_mutex_lock(&d->lock);
+    WSAES_TRACE_END(devlock, d - wsaes_devs);
+    start = wsaes_nowns();
+    if (d->owner != c->id && SUCCESS != wsaes_takedevice(c))
+        status = -1;
+    else
+        status = aes256streamtap_sess(d->sess, mode, iov, niov, tap);
+    if (0 != status)
+    {
+        // the device state is unknown after a failure, so reprogram it next time
+        d->owner = 0;
+        wsaes_dropkeys(d);
+        wsaes_counterr(1);
+    }
+    else
+    {
+        d->stat.bytes += inl;
+        d->stat.requests++;
+    }
+    d->stat.busy_ns += wsaes_nowns() - start;
+    pthread_mutex_unlock(&d->lock);
+    return status;
+}
+
+
+/*
+ * Run one range of a CTR request, the whole blocks of iov from counter block ctr,
+ * on device d. Unlike a CBC chain, the counter is loaded for every range, so no
+ * context owns the device afterwards. Returns 0 on success
+ */
+static int wsaes_ctrdev(wsaes_device_t *d, wsaes_cipher_ctx_t *c, const uint8_t *ctr, const wsaes_iov_t *iov)
+{
+    uint8_t ctrblk[AESBLKSIZE];
+    int status = -1;
+    uint64_t start;
+
+    memcpy(ctrblk, ctr, AESBLKSIZE);
+    WSAES_TRACE_BEGIN(devlock, d - wsaes_devs);
+    pthread_mutex_lock(&d->lock);
+    WSAES_TRACE_END(devlock, d - wsaes_devs);
+    start = wsaes_nowns();
+    d->owner = 0;
+    if (SUCCESS == wsaes_loadkey(d, c) && 0 == aes256setiv_sess(d->sess, ctrblk) && 0 == aes256reset_sess(d->sess))
+    {
+        d->keystats.ivloads++;
+        status = aes256streamv_sess(d->sess, CTR, iov, 1);
+    }
+    if (0 != status)
+    {
+        wsaes_dropkeys(d);
+        wsaes_counterr(1);
+    }
+    else
+    {
+        d->stat.bytes += iov->len;
+        d->stat.requests++;
+    }
+    d->stat.busy_ns += wsaes_nowns() - start;
+    pthread_mutex_unlock(&d->lock);
+    return status;
+}
+
+
+/* Add n to the 128-bit big-endian counter block ctr */
+static void wsaes_ctradd(uint8_t *ctr, uint64_t n)
+{
+    for (int i=AESBLKSIZE-1; i>=0 && 0 != n; i--)
+    {
+        n += ctr[i];
+        ctr[i] = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+
+#ifdef WSAES_ASYNC
+/*
+ * Device requests from inside an ASYNC_JOB are handed to the worker thread of the
+ * context's device, and the job pauses until the worker signals an eventfd 
+ * registered as the job's wait fd. The application can meanwhile run other jobs
+ * on the same thread (SSL_MODE_ASYNC, openssl speed -async_jobs N). A request 
+ * lives on the paused job's stack.
+ */
+struct wsaes_asyncreq {
+    wsaes_cipher_ctx_t *c;
+    wsaes_device_t *d;           // device the request runs on
+    ciphermode_t mode;
+    const wsaes_iov_t *iov;
+    int niov;
+    size_t inl;
+    const wsaes_tap_t *tap;
+    const uint8_t *ctr;          // CTR range: its first counter block, see wsaes_ctrdev()
+    int waitfd;                  // eventfd the job waits on, -1 if the waiter isn't a job
+    int status;                  // wsaes_devcipher() result
+    int done;                    // set by the worker once it is finished with the request
+    struct wsaes_asyncreq *next;
+};
+
+static void *wsaes_asyncworker(void *arg)
+{
+    wsaes_device_t *d = (wsaes_device_t*)arg;
+    wsaes_asyncreq_t *req;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&d->asynclock);
+    for (;;)
+    {
+        while (NULL == d->asynchead && !d->asyncstop)
+            pthread_cond_wait(&d->asynccond, &d->asynclock);
+        if (NULL == (req = d->asynchead))
+            break;
+        if (NULL == (d->asynchead = req->next))
+            d->asynctail = NULL;
+        pthread_mutex_unlock(&d->asynclock);
+
+        if (NULL != req->ctr)
+            req->status = wsaes_ctrdev(d, req->c, req->ctr, req->iov);
+        else
+            req->status = wsaes_devcipher(req->c, req->mode, req->iov, req->niov, req->inl, req->tap);
+
+        // once the job sees done it may return and free req (and close its wait fd), so it checks done 
+        // under the lock, and the worker doesn't touch req after setting it
+        pthread_mutex_lock(&d->asynclock);
+        if (req->waitfd >= 0 && write(req->waitfd, &one, sizeof(one)) < 0)
+            perror("ERROR: could not signal async job");
+        req->done = 1;
+        pthread_cond_broadcast(&d->asyncdonecond);
+    }
+    pthread_mutex_unlock(&d->asynclock);
+    return NULL;
+}
+
+static void wsaes_waitfd_cleanup(ASYNC_WAIT_CTX *waitctx, const void *key, OSSL_ASYNC_FD fd, void *custom)
+{
+    close(fd);
+}
+
+/* The eventfd of the job's wait context, created on its first device request */
+static int wsaes_getwaitfd(ASYNC_JOB *job)
+{
+    ASYNC_WAIT_CTX *waitctx = ASYNC_get_wait_ctx(job);
+    OSSL_ASYNC_FD fd;
+    void *custom;
+
+    if (NULL == waitctx)
+        return -1;
+    if (ASYNC_WAIT_CTX_get_fd(waitctx, engine_id, &fd, &custom))
+        return fd;
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, engine_id, fd, NULL, wsaes_waitfd_cleanup))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int wsaes_asyncdone(wsaes_asyncreq_t *req)
+{
+    wsaes_device_t *d = req->d;
+    int done;
+    pthread_mutex_lock(&d->asynclock);
+    done = req->done;
+    pthread_mutex_unlock(&d->asynclock);
+    return done;
+}
+
+/* Hand req to the worker thread of its device */
+static void wsaes_asyncqueue(wsaes_asyncreq_t *req)
+{
+    wsaes_device_t *d = req->d;
+
+    pthread_mutex_lock(&d->asynclock);
+    if (NULL == d->asynctail)
+        d->asynchead = req;
+    else
+        d->asynctail->next = req;
+    d->asynctail = req;
+    pthread_cond_signal(&d->asynccond);
+    pthread_mutex_unlock(&d->asynclock);
+}
+
+/*
+ * wsaes_devcipher() for a caller inside an ASYNC_JOB: queue the request for the
+ * worker and pause the job until it is done. Falls back to running it directly
+ */
+static int wsaes_asynccipher(ASYNC_JOB *job, wsaes_cipher_ctx_t *c, ciphermode_t mode, const wsaes_iov_t *iov,
+                             int niov, size_t inl, const wsaes_tap_t *tap)
+{
+    wsaes_device_t *d = c->dev;
+    wsaes_asyncreq_t req = { c, d, mode, iov, niov, inl, tap, NULL, -1, -1, 0, NULL };
+    uint64_t count;
+
+    if (!d->asyncrunning || (req.waitfd = wsaes_getwaitfd(job)) < 0)
+        return wsaes_devcipher(c, mode, iov, niov, inl, tap);
+    wsaes_asyncqueue(&req);
+
+    // always yield to the application once; it may resume the job before the worker is done, so pause until it is
+    do
+    {
+        if (!ASYNC_pause_job())
+            sched_yield();
+    }
+    while (!wsaes_asyncdone(&req));
+    if (read(req.waitfd, &count, sizeof(count)) < 0 && EAGAIN != errno)
+        perror("ERROR: could not clear async wait fd");
+    return req.status;
+}
+
+/*
+ * Run the CTR ranges iov[0..n) on devices devs[0..n) at the same time, through the
+ * devices' worker threads. The calling thread runs the first range itself and then
+ * waits for the others, unless it is an ASYNC_JOB, which instead hands all of them
+ * to the workers and pauses until they are done. Returns 0 on success
+ */
+static int wsaes_ctrparallel(wsaes_device_t **devs, wsaes_cipher_ctx_t *c, uint8_t (*ctrs)[AESBLKSIZE],
+                             const wsaes_iov_t *iov, int n)
+{
+    wsaes_asyncreq_t reqs[WSAES_MAXDEVS];
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    int waitfd = (NULL != job) ? wsaes_getwaitfd(job) : -1, first = (waitfd < 0) ? 1 : 0, status = 0;
+    uint64_t count;
+
+    for (int k=first; k<n; k++)
+    {
+        reqs[k] = (wsaes_asyncreq_t){ c, devs[k], CTR, &iov[k], 1, iov[k].len, NULL, ctrs[k], waitfd, -1, 0, NULL };
+        if (devs[k]->asyncrunning)
+            wsaes_asyncqueue(&reqs[k]);
+        else
+        {
+            reqs[k].status = wsaes_ctrdev(devs[k], c, ctrs[k], &iov[k]);
+            reqs[k].done = 1;
+        }
+    }
+    if (first)
+        status = wsaes_ctrdev(devs[0], c, ctrs[0], &iov[0]);
+
+    for (int k=first; k<n; k++)
+    {
+        if (NULL != job && waitfd >= 0)
+        {
+            while (!wsaes_asyncdone(&reqs[k]))
+            {
+                if (!ASYNC_pause_job())
+                    sched_yield();
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&devs[k]->asynclock);
+            while (!reqs[k].done)
+                pthread_cond_wait(&devs[k]->asyncdonecond, &devs[k]->asynclock);
+            pthread_mutex_unlock(&devs[k]->asynclock);
+        }
+        status |= reqs[k].status;
+    }
+    if (waitfd >= 0 && read(waitfd, &count, sizeof(count)) < 0 && EAGAIN != errno)
+        perror("ERROR: could not clear async wait fd");
+    return status;
+}
+
+static int wsaes_async_start(wsaes_device_t *d)
+{
+    d->asyncstop = 0;
+    if (0 != pthread_create(&d->asyncthread, NULL, wsaes_asyncworker, d))
+    {
+        // not fatal: jobs then wait for the device synchronously
+        fprintf(stderr,"ERROR: could not start the async worker thread\n");
+        return FAIL;
+    }
+    d->asyncrunning = 1;
+    return SUCCESS;
+}
+
+static void wsaes_async_stop(wsaes_device_t *d)
+{
+    if (!d->asyncrunning)
+        return;
+    pthread_mutex_lock(&d->asynclock);
+    d->asyncstop = 1;
+    pthread_cond_signal(&d->asynccond);
+    pthread_mutex_unlock(&d->asynclock);
+    pthread_join(d->asyncthread, NULL);
+    d->asyncrunning = 0;
+}
+#endif
+
+
+/*
+ * Coalescing scheduler (SCHEDULER). Rather than every application thread taking
+ * the device lock in turn for its own key, IV and data transfers, threads queue 
+ * their requests on a lock-free multi-producer, single-consumer queue and sleep;
+ * the device's submitter thread drains it, holds the batch open until 
+ * SCHED_LATENCY_US after its oldest request (or until it is full) so that more
+ * can join, sorts it by key and runs each key's requests through the device in
+ * one aes256batch_sess() call, after a single key selection. With rings, that is
+ * one pass through them per key, every request's IV loaded by its first entry.
+ * The queue is Vyukov's intrusive MPSC queue: a producer swaps itself in as the
+ * tail and then links the old tail to itself, so the consumer may briefly see a 
+ * request counted in schedqueued but not yet linked.
+ */
+static void wsaes_schedpush(wsaes_device_t *d, wsaes_schedreq_t *r)
+{
+    wsaes_schedreq_t *prev;
+
+    __atomic_store_n(&r->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&d->schedtail, r, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, r, __ATOMIC_RELEASE);
+}
+
+/* The oldest request, NULL if there is none or it isn't linked yet. Submitter only */
+static wsaes_schedreq_t *wsaes_schedpop(wsaes_device_t *d)
+{
+    wsaes_schedreq_t *head = d->schedhead, *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (&d->schedstub == head)
+    {
+        if (NULL == next)
+            return NULL;
+        d->schedhead = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (NULL == next)
+    {
+        // head is the last request: put the stub behind it so it can be taken
+        if (head != __atomic_load_n(&d->schedtail, __ATOMIC_ACQUIRE))
+            return NULL;
+        wsaes_schedpush(d, &d->schedstub);
+        if (NULL == (next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE)))
+            return NULL;
+    }
+    d->schedhead = next;
+    __atomic_sub_fetch(&d->schedqueued, 1, __ATOMIC_SEQ_CST);
+    return head;
+}
+
+/*
+ * Sleep until a request is queued, or until deadline (in wsaes_nowns() time) if 
+ * not 0. A thread that queues after the submitter has set schedidle signals it; 
+ * one that queued before is seen in schedqueued, so no wakeup is lost
+ */
+static void wsaes_schedsleep(wsaes_device_t *d, uint64_t deadline)
+{
+    struct timespec ts = { (time_t)(deadline / 1000000000), (long)(deadline % 1000000000) };
+
+    pthread_mutex_lock(&d->schedlock);
+    __atomic_store_n(&d->schedidle, 1, __ATOMIC_SEQ_CST);
+    if (0 == __atomic_load_n(&d->schedqueued, __ATOMIC_SEQ_CST) && !d->schedstop)
+    {
+        if (0 == deadline)
+            pthread_cond_wait(&d->schedcond, &d->schedlock);
+        else
+            pthread_cond_timedwait(&d->schedcond, &d->schedlock, &ts);
+    }
+    __atomic_store_n(&d->schedidle, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&d->schedlock);
+}
+
+/* Order requests by key, then by age */
+static int wsaes_schedcmp(const void *a, const void *b)
+{
+    const wsaes_schedreq_t *x = *(wsaes_schedreq_t* const*)a, *y = *(wsaes_schedreq_t* const*)b;
+    int c = memcmp(x->c->key, y->c->key, AESKEYSIZE);
+
+    if (0 != c)
+        return c;
+    return (x->queuedns > y->queuedns) - (x->queuedns < y->queuedns);
+}
+
+/* Add b bytes done in t ns to a decaying sum of bytes and ns */
+static void wsaes_ovrate(uint64_t *bytes, uint64_t *ns, uint64_t b, uint64_t t)
+{
+    *bytes += b - (*bytes >> WSAES_OVDECAY);
+    *ns += t - (*ns >> WSAES_OVDECAY);
+}
+
+/*
+ * SW_OVERFLOW: how many of the n requests of a batch, sorted by key, go to device
+ * d; the rest run in software. The device's share of the bytes is its rate over
+ * the sum of its own and the software's, as measured over recent batches, so that
+ * both parts finish together. A request alone stays on the device, and none go to
+ * it for a while after a failure
+ */
+static int wsaes_schedsplit(wsaes_device_t *d, wsaes_schedreq_t **reqs, int n)
+{
+    double devrate, softrate, soft;
+    uint64_t total = 0;
+    int ndev;
+
+    if (wsaes_nowns() < d->ovdownuntil)
+        return 0;
+    if (n < 2 || 0 == d->ovdevbytes)
+        return n;
+    devrate = (double)d->ovdevbytes / d->ovdevns;
+    pthread_mutex_lock(&d->schedlock);
+    // until software has run, take it to be as fast as the device
+    softrate = (0 == d->ovsoftns) ? devrate : (double)d->ovsoftbytes / d->ovsoftns;
+    pthread_mutex_unlock(&d->schedlock);
+
+    for (int k=0; k<n; k++)
+        total += reqs[k]->inl;
+    soft = total * softrate / (softrate + devrate);
+    for (ndev=n; ndev>1 && soft >= reqs[ndev-1]->inl; ndev--)
+        soft -= reqs[ndev-1]->inl;
+    return ndev;
+}
+
+/*
+ * Run a software group handed over by wsaes_schedrun() on the thread of r, which
+ * leads it: all of its requests at once through the multi-buffer CBC, each with its
+ * context's key and IV, then wake their threads
+ */
+static void wsaes_schedsoft(wsaes_device_t *d, wsaes_schedreq_t *r)
+{
+    wsaes_softstream_t s[WSAES_SCHEDBATCH];
+    wsaes_schedreq_t *q, *next;
+    uint64_t start = wsaes_nowns();
+    size_t bytes = 0;
+    int n = 0;
+
+    for (q=r; NULL != q; q=q->softnext)
+    {
+        const wsaes_softkey_t *k = wsaes_softkey(q->c);
+
+        q->status = (NULL == k) ? -1 : 0;
+        if (NULL == k)
+            continue;
+        s[n++] = (wsaes_softstream_t){ k, ENCRYPT == q->mode, q->c->iv, q->iov, q->niov };
+        bytes += q->inl;
+        wsaes_countsw(q->inl);
+    }
+    WSAES_TRACE_BEGIN(soft, bytes);
+    wsaes_soft_cbc_multi(s, n);
+    WSAES_TRACE_END(soft, bytes);
+
+    pthread_mutex_lock(&d->schedlock);
+    wsaes_ovrate(&d->ovsoftbytes, &d->ovsoftns, bytes, wsaes_nowns() - start);
+    for (q=r; NULL != q; q=next)
+    {
+        next = q->softnext;
+        q->done = 1;
+    }
+    pthread_cond_broadcast(&d->scheddonecond);
+    pthread_mutex_unlock(&d->schedlock);
+}
+
+/* Count request r, started at start, into the scheduler counters. Under schedlock */
+static void wsaes_schedcount(wsaes_device_t *d, const wsaes_schedreq_t *r, uint64_t start)
+{
+    uint64_t wait = start - r->queuedns;
+
+    d->schedstats.depth_sum += r->depth;
+    if (r->depth > d->schedstats.maxdepth)
+        d->schedstats.maxdepth = r->depth;
+    d->schedstats.wait_ns += wait;
+    if (wait > d->schedstats.maxwait_ns)
+        d->schedstats.maxwait_ns = wait;
+}
+
+/*
+ * Run a batch of n requests on device d, grouped by key, and wake their threads.
+ * With SW_OVERFLOW, the requests beyond the device's share are handed to software
+ * first, so that they run while the device does the rest
+ */
+static void wsaes_schedrun(wsaes_device_t *d, wsaes_schedreq_t **reqs, int n)
+{
+    wsaes_job_t jobs[WSAES_SCHEDBATCH];
+    uint64_t start, busy, bytes = 0;
+    int groups = 0, end, ndev = n, failed = 0;
+
+    qsort(reqs, n, sizeof(*reqs), wsaes_schedcmp);
+    if (wsaes_swoverflow)
+        ndev = wsaes_schedsplit(d, reqs, n);
+    if (ndev < n)
+    {
+        // its leader's thread may return as soon as the group is done, so nothing touches it after this
+        start = wsaes_nowns();
+        pthread_mutex_lock(&d->schedlock);
+        for (int k=ndev; k<n; k++)
+        {
+            wsaes_schedcount(d, reqs[k], start);
+            d->schedstats.overflow_requests++;
+            d->schedstats.overflow_bytes += reqs[k]->inl;
+            reqs[k]->softnext = (k + 1 < n) ? reqs[k + 1] : NULL;
+        }
+        reqs[ndev]->done = WSAES_SCHED_SOFT;
+        pthread_cond_broadcast(&d->scheddonecond);
+        pthread_mutex_unlock(&d->schedlock);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    start = wsaes_nowns();
+    // every request loads its own IV (or runs in software), so the chain left on the device is nobody's
+    d->owner = 0;
+    for (int g=0; g<ndev; g=end)
+    {
+        for (end=g+1; end<ndev && 0 == memcmp(reqs[end]->c->key, reqs[g]->c->key, AESKEYSIZE); end++)
+            ;
+        groups++;
+        if (SUCCESS != wsaes_loadkey(d, reqs[g]->c))
+        {
+            for (int k=g; k<end; k++)
+                reqs[k]->status = -1;
+            wsaes_counterr(end - g);
+            failed = 1;
+            continue;
+        }
+        for (int k=g; k<end; k++)
+            jobs[k - g] = (wsaes_job_t){ reqs[k]->mode, NULL, reqs[k]->c->iv, reqs[k]->iov, reqs[k]->niov, 0 };
+        if (0 != aes256batch_sess(d->sess, jobs, end - g))
+            wsaes_dropkeys(d);
+        d->keystats.ivloads += end - g;
+        for (int k=g; k<end; k++)
+        {
+            reqs[k]->status = jobs[k - g].status;
+            if (0 == reqs[k]->status)
+            {
+                d->stat.bytes += reqs[k]->inl;
+                d->stat.requests++;
+                bytes += reqs[k]->inl;
+            }
+            else
+            {
+                wsaes_counterr(1);
+                failed = 1;
+            }
+        }
+    }
+    busy = wsaes_nowns() - start;
+    d->stat.busy_ns += busy;
+    pthread_mutex_unlock(&d->lock);
+    if (wsaes_swoverflow && ndev > 0)
+    {
+        wsaes_ovrate(&d->ovdevbytes, &d->ovdevns, bytes, busy);
+        if (failed)
+            d->ovdownuntil = wsaes_nowns() + WSAES_OVDOWN_NS;
+    }
+
+    // a thread may return as soon as it sees its request done, so nothing touches a request after that
+    pthread_mutex_lock(&d->schedlock);
+    d->schedstats.batches++;
+    d->schedstats.requests += n;
+    d->schedstats.keygroups += groups;
+    if ((uint64_t)n > d->schedstats.maxbatch)
+        d->schedstats.maxbatch = n;
+    for (int k=0; k<ndev; k++)
+    {
+        wsaes_schedcount(d, reqs[k], start);
+        reqs[k]->done = 1;
+    }
+    pthread_cond_broadcast(&d->scheddonecond);
+    pthread_mutex_unlock(&d->schedlock);
+}
+
+/* The submitter thread of a device */
+static void *wsaes_schedmain(void *arg)
+{
+    wsaes_device_t *d = (wsaes_device_t*)arg;
+    wsaes_schedreq_t *reqs[WSAES_SCHEDBATCH], *r;
+
+    for (;;)
+    {
+        int n = 0;
+        size_t bytes = 0;
+
+        while (n < WSAES_SCHEDBATCH && bytes < WSAES_SCHEDBYTES)
+        {
+            if (NULL != (r = wsaes_schedpop(d)))
+            {
+                reqs[n++] = r;
+                bytes += r->inl;
+            }
+            else if (0 != __atomic_load_n(&d->schedqueued, __ATOMIC_SEQ_CST))
+                sched_yield(); // a request that isn't linked in yet
+            else if (n > 0 && !__atomic_load_n(&d->schedstop, __ATOMIC_ACQUIRE) &&
+                     wsaes_nowns() < reqs[0]->queuedns + wsaes_schedlatency_ns)
+                wsaes_schedsleep(d, reqs[0]->queuedns + wsaes_schedlatency_ns);
+            else if (n > 0)
+                break;
+            else if (__atomic_load_n(&d->schedstop, __ATOMIC_ACQUIRE))
+                return NULL;
+            else
+                wsaes_schedsleep(d, 0);
+        }
+        wsaes_schedrun(d, reqs, n);
+    }
+}
+
+/*
+ * wsaes_devcipher() through the scheduler of c's device: queue the request and 
+ * sleep until the submitter has run it, or has made it the leader of a software
+ * group, which it then runs
+ */
+static int wsaes_schedcipher(wsaes_cipher_ctx_t *c, ciphermode_t mode, const wsaes_iov_t *iov, int niov, size_t inl)
+{
+    wsaes_device_t *d = c->dev;
+    wsaes_schedreq_t req = { NULL, c, mode, iov, niov, inl, 0, wsaes_nowns(), -1, 0 };
+
+    WSAES_TRACE_BEGIN(schedwait, inl);
+    req.depth = __atomic_add_fetch(&d->schedqueued, 1, __ATOMIC_SEQ_CST);
+    wsaes_schedpush(d, &req);
+    if (__atomic_load_n(&d->schedidle, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&d->schedlock);
+        pthread_cond_signal(&d->schedcond);
+        pthread_mutex_unlock(&d->schedlock);
+    }
+
+    pthread_mutex_lock(&d->schedlock);
+    while (!req.done)
+        pthread_cond_wait(&d->scheddonecond, &d->schedlock);
+    pthread_mutex_unlock(&d->schedlock);
+    if (WSAES_SCHED_SOFT == req.done)
+        wsaes_schedsoft(d, &req);
+    WSAES_TRACE_END(schedwait, req.status);
+    return req.status;
+}
+
+static int wsaes_sched_start(wsaes_device_t *d)
+{
+    if (d->schedrunning)
+        return SUCCESS;
+    d->schedstub.next = NULL;
+    d->schedhead = d->schedtail = &d->schedstub;
+    d->schedqueued = 0;
+    d->schedidle = 0;
+    d->schedstop = 0;
+    if (0 != pthread_create(&d->schedthread, NULL, wsaes_schedmain, d))
+    {
+        // not fatal: threads then take the device themselves
+        fprintf(stderr,"ERROR: could not start the scheduler thread\n");
+        return FAIL;
+    }
+    __atomic_store_n(&d->schedrunning, 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+/* Stop the submitter once it has run what is queued; no thread may be queueing any more */
+static void wsaes_sched_stop(wsaes_device_t *d)
+{
+    if (!d->schedrunning)
+        return;
+    __atomic_store_n(&d->schedrunning, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&d->schedlock);
+    __atomic_store_n(&d->schedstop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&d->schedcond);
+    pthread_mutex_unlock(&d->schedlock);
+    pthread_join(d->schedthread, NULL);
+}
+
+
+/*
+ * Run the buffers of iov through the device as one CBC stream, from an ASYNC_JOB
+ * if there is one, and carry the working IV on past the last of them. The last
+ * buffer must not be empty. tap, if not NULL, is shown the plaintext
+ */
+static int wsaes_cipheriov(EVP_CIPHER_CTX *ctx, wsaes_cipher_ctx_t *c, const wsaes_iov_t *iov, int niov, size_t inl,
+                           const wsaes_tap_t *tap)
+{
+    const wsaes_iov_t *last = &iov[niov - 1];
+    uint8_t lastblk[AESBLKSIZE];
+    int status;
+    ciphermode_t mode = (!c->enc) ? DECRYPT : ENCRYPT; 
+
+    // when decrypting, the next IV is the last input block, which may be overwritten in place
+    if (!c->enc)
+        memcpy(lastblk, last->in + last->len - AESBLKSIZE, AESBLKSIZE);
+
+    __atomic_add_fetch(&c->dev->outstanding, inl, __ATOMIC_RELAXED);
+#ifdef WSAES_ASYNC
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    if (NULL != job)
+        status = wsaes_asynccipher(job, c, mode, iov, niov, inl, tap);
+    else
+#endif
+    // the scheduler's batches have no tap
+    if (NULL == tap && __atomic_load_n(&c->dev->schedrunning, __ATOMIC_ACQUIRE))
+        status = wsaes_schedcipher(c, mode, iov, niov, inl);
+    else
+        status = wsaes_devcipher(c, mode, iov, niov, inl, tap);
+    __atomic_sub_fetch(&c->dev->outstanding, inl, __ATOMIC_RELAXED);
+    if (0 != status)
+        return FAIL;
+
+    // keep the working IV in step with the device, and mirror it in the EVP context as OpenSSL's own CBC does
+    memcpy(c->iv, c->enc ? last->out + last->len - AESBLKSIZE : lastblk, AESBLKSIZE);
+    memcpy(EVP_CIPHER_CTX_iv_noconst(ctx), c->iv, AESIVSIZE);
+    return SUCCESS;
+}
+
+
+#ifdef WSAES_PIPELINE
+/*
+ * do_cipher for the records set up by the EVP_CTRL_SET_PIPELINE_* ctrls, e.g. by 
+ * libssl with SSL_CTX_set_max_pipelines(). They are chained in order as if they 
+ * had been passed one call at a time, but go to the device in one transaction
+ */
+static int wsaes_pipecipher(EVP_CIPHER_CTX *ctx, wsaes_cipher_ctx_t *c)
+{
+    wsaes_iov_t iov[WSAES_MAXPIPES];
+    int niov = 0, n = c->numpipes;
+    size_t inl = 0;
+
+    // the buffers are only good for this call
+    c->numpipes = 0;
+    if (NULL == c->pipeout || NULL == c->pipein || NULL == c->pipelens)
+    {
+        fprintf(stderr,"ERROR: incomplete pipeline buffers in engine do_cipher()\n");
+        return FAIL;
+    }
+    for (int i=0; i<n; i++)
+    {
+        if (0 != c->pipelens[i] % AESBLKSIZE)
+        {
+            fprintf(stderr,"ERROR: pipeline record length %zu is not a multiple of the block size\n", c->pipelens[i]);
+            return FAIL;
+        }
+        if (0 == c->pipelens[i])
+            continue;
+        iov[niov].in = c->pipein[i];
+        iov[niov].out = c->pipeout[i];
+        iov[niov++].len = c->pipelens[i];
+        inl += c->pipelens[i];
+    }
+    if (0 == inl)
+        return SUCCESS;
+
+    if (inl < __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED))
+    {
+        wsaes_countsw(inl);
+        for (int i=0; i<niov; i++)
+            wsaes_softcipher(ctx, c, iov[i].out, iov[i].in, iov[i].len);
+        return SUCCESS;
+    }
+    return wsaes_cipheriov(ctx, c, iov, niov, inl, NULL);
+}
+#endif
+
+
+/*
+ * Cipher computation function. This function is called by the OpenSSL EVP API in the 
+ * EVP_[En/De]cryptUpdate(..) and (potentially) in the EVP_[En/De]cryptFinal_ex(..) functions
+ */
+static int wsaes_aescbc_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    wsaes_cipher_ctx_t *c = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    wsaes_iov_t iov = { in, out, inl };
+
+    if (0 == inl && 0 == WSAES_NUMPIPES(c))
+        return SUCCESS;
+    if (!c->keyset)
+    {
+        fprintf(stderr,"ERROR: no key set in engine do_cipher()\n");
+        return FAIL;
+    }
+#ifdef WSAES_PIPELINE
+    if (c->numpipes > 0)
+        return wsaes_pipecipher(ctx, c);
+#endif
+
+    if (inl < __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED))
+    {
+        wsaes_countsw(inl);
+        return wsaes_softcipher(ctx, c, out, in, inl);
+    }
+    return wsaes_cipheriov(ctx, c, &iov, 1, inl, NULL);
+}
+
+static int wsaesengine_aescbc_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    return wsaes_timedcipher(wsaes_aescbc_cipher, ctx, out, in, inl);
+}
+
+
+
+/*
+ * AES EVP_CIPHER_CTX cleanup function: takes the context off its device and wipes
+ * the key material in the context state
+ */
+static int wsaesengine_aescbc_cleanup(EVP_CIPHER_CTX *ctx) 
+{
+	wsaes_cipher_ctx_t *c = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+	if (c)
+	{
+		if (c->dev)
+		{
+			pthread_mutex_lock(&wsaes_ctxlock);
+			c->dev->stat.contexts--;
+			pthread_mutex_unlock(&wsaes_ctxlock);
+		}
+		wsaes_soft_freekey(&c->sk);
+		OPENSSL_cleanse(c, sizeof(wsaes_cipher_ctx_t));
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Cipher control function. EVP_CTRL_INIT is issued when OpenSSL allocates the
+ * context state, which it does not zero, and EVP_CTRL_COPY after it has copied 
+ * the state into a new context
+ */
+static int wsaesengine_aescbc_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
+{
+    wsaes_cipher_ctx_t *c = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    wsaes_cipher_ctx_t *dst;
+
+    switch (type)
+    {
+        case EVP_CTRL_INIT:
+            memset(EVP_CIPHER_CTX_get_cipher_data(ctx), 0, sizeof(wsaes_cipher_ctx_t));
+            return SUCCESS;
+        case EVP_CTRL_COPY:
+            // the copy has its own CBC chain, so it must not share the original's device ownership;
+            // it does stay on the same device
+            dst = (wsaes_cipher_ctx_t*)EVP_CIPHER_CTX_get_cipher_data((EVP_CIPHER_CTX*)ptr);
+            // nor its software key schedules, which may hold OpenSSL contexts of their own
+            memset(&dst->sk, 0, sizeof(dst->sk));
+            dst->softkeyset = 0;
+            pthread_mutex_lock(&wsaes_ctxlock);
+            dst->id = ++wsaes_nextid;
+            if (NULL != dst->dev)
+                dst->dev->stat.contexts++;
+            pthread_mutex_unlock(&wsaes_ctxlock);
+            return SUCCESS;
+#ifdef WSAES_PIPELINE
+        // up to arg records, all three set before the do_cipher call that processes them
+        case EVP_CTRL_SET_PIPELINE_OUTPUT_BUFS:
+            if (arg < 1 || arg > WSAES_MAXPIPES)
+                return 0;
+            c->numpipes = arg;
+            c->pipeout = (unsigned char**)ptr;
+            return SUCCESS;
+        case EVP_CTRL_SET_PIPELINE_INPUT_BUFS:
+            if (arg < 1 || arg > WSAES_MAXPIPES)
+                return 0;
+            c->numpipes = arg;
+            c->pipein = (const unsigned char**)ptr;
+            return SUCCESS;
+        case EVP_CTRL_SET_PIPELINE_INPUT_LENS:
+            if (arg < 1 || arg > WSAES_MAXPIPES)
+                return 0;
+            c->numpipes = arg;
+            c->pipelens = (const size_t*)ptr;
+            return SUCCESS;
+#endif
+        default:
+            return -1;
+    }
+}
+
+
+/*
+ * The MAC runs on OpenSSL's low-level SHA-256 calls, deprecated in OpenSSL 3: the
+ * state is a plain struct, so every record starts from the HMAC head and tail
+ * states with a struct copy, where EVP_MD_CTX_copy_ex() would duplicate a provider
+ * context, allocating, twice per record. OpenSSL's own stitched ciphers keep the
+ * low-level calls too. The deprecation warnings are silenced for these wrappers
+ * only, so anything else deprecated still shows
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+static inline void wsaes_sha256_init(SHA256_CTX *md)
+{
+    SHA256_Init(md);
+}
+
+static inline void wsaes_sha256_update(SHA256_CTX *md, const void *data, size_t len)
+{
+    SHA256_Update(md, data, len);
+}
+
+static inline void wsaes_sha256_final(uint8_t *digest, SHA256_CTX *md)
+{
+    SHA256_Final(digest, md);
+}
+#pragma GCC diagnostic pop
+
+
+/*
+ * The stitched cipher's tap: adds the part of each chunk of plaintext that falls
+ * in [macfrom, macto) of the stream to the MAC
+ */
+static void wsaes_mactap(void *arg, const uint8_t *data, size_t len)
+{
+    wsaes_hmac_ctx_t *h = (wsaes_hmac_ctx_t*)arg;
+    size_t from = (h->pos > h->macfrom) ? h->pos : h->macfrom;
+    size_t to = (h->pos + len < h->macto) ? h->pos + len : h->macto;
+
+    if (from < to)
+        wsaes_sha256_update(&h->md, data + (from - h->pos), to - from);
+    h->pos += len;
+}
+
+
+/*
+ * Run inl bytes of whole blocks through AES-256-CBC, on the device or in software
+ * as do_cipher would, showing tap the plaintext as it goes. In software, the data
+ * is ciphered and tapped a chunk at a time, so the tap reads it from L1
+ */
+static int wsaes_tapcipher(EVP_CIPHER_CTX *ctx, wsaes_cipher_ctx_t *c, unsigned char *out, const unsigned char *in,
+                           size_t inl, const wsaes_tap_t *tap)
+{
+    wsaes_iov_t iov = { in, out, inl };
+    size_t n;
+
+    if (0 == inl)
+        return SUCCESS;
+    if (inl >= __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED))
+        return wsaes_cipheriov(ctx, c, &iov, 1, inl, tap);
+    wsaes_countsw(inl);
+
+    for (size_t i=0; i<inl; i+=n)
+    {
+        n = (inl - i < WSAES_TAPCHUNK) ? inl - i : WSAES_TAPCHUNK;
+        if (c->enc)
+            tap->fn(tap->arg, in + i, n);
+        wsaes_softcipher(ctx, c, out + i, in + i, n);
+        if (!c->enc)
+            tap->fn(tap->arg, out + i, n);
+    }
+    return SUCCESS;
+}
+
+
+/* All ones if a >= b, else 0, without branching on either */
+static size_t wsaes_ct_ge(size_t a, size_t b)
+{
+    return ((a ^ ((a ^ b) | ((a - b) ^ b))) >> (sizeof(size_t) * 8 - 1)) - 1;
+}
+
+
+/*
+ * Encrypt a TLS record of len bytes: the explicit IV (TLS 1.1 and later) and 
+ * payload, plen bytes of in, followed in out by their MAC and the CBC padding.
+ * The payload's whole blocks go to the device and are MACed on the way; the rest
+ * of the payload, the MAC and the padding are at most four blocks, which are 
+ * finished in software
+ */
+static int wsaes_hmac_encrypt(EVP_CIPHER_CTX *ctx, wsaes_hmac_ctx_t *h, unsigned char *out, const unsigned char *in,
+                              size_t len, size_t plen)
+{
+    wsaes_tap_t tap = { wsaes_mactap, h };
+    size_t whole = plen - plen % AESBLKSIZE;
+
+    if (len != ((plen + SHA256_DIGEST_LENGTH + AESBLKSIZE) & ~(size_t)(AESBLKSIZE - 1)))
+    {
+        fprintf(stderr,"ERROR: TLS record length %zu doesn't match its payload length %zu\n", len, plen);
+        return FAIL;
+    }
+
+    // the MAC covers the payload after the explicit IV; the header was added by the AAD ctrl
+    h->pos = 0;
+    h->macfrom = (h->tlsver >= TLS1_1_VERSION) ? AESBLKSIZE : 0;
+    h->macto = plen;
+    if (SUCCESS != wsaes_tapcipher(ctx, &h->aes, out, in, whole, &tap))
+        return FAIL;
+
+    if (in != out)
+        memcpy(out + whole, in + whole, plen - whole);
+    wsaes_mactap(h, out + whole, plen - whole);
+    wsaes_sha256_final(out + plen, &h->md);
+    h->md = h->tail;
+    wsaes_sha256_update(&h->md, out + plen, SHA256_DIGEST_LENGTH);
+    wsaes_sha256_final(out + plen, &h->md);
+    for (size_t i=plen+SHA256_DIGEST_LENGTH; i<len; i++)
+        out[i] = (unsigned char)(len - plen - SHA256_DIGEST_LENGTH - 1);
+    return wsaes_softcipher(ctx, &h->aes, out + whole, out + whole, len - whole);
+}
+
+
+/*
+ * Decrypt a TLS record of len bytes and check its MAC and padding, in constant
+ * time with respect to the padding length. The MAC starts with the record header,
+ * which holds the payload length, so the last block is decrypted first, in 
+ * software, for the padding length; the MAC can then be computed as the record 
+ * comes back from the device. Returns FAIL for a bad record, as OpenSSL's does
+ */
+static int wsaes_hmac_decrypt(EVP_CIPHER_CTX *ctx, wsaes_hmac_ctx_t *h, unsigned char *out, const unsigned char *in,
+                              size_t len)
+{
+    wsaes_tap_t tap = { wsaes_mactap, h };
+    wsaes_cipher_ctx_t *c = &h->aes;
+    size_t iv = (h->tlsver >= TLS1_1_VERSION) ? AESBLKSIZE : 0;
+    size_t maxpad, pad, good, paylen, macpos, res = 0;
+    uint8_t chain[AESBLKSIZE], last[AESBLKSIZE], mac[SHA256_DIGEST_LENGTH];
+    SHA256_CTX dummy;
+
+    if (len < iv + SHA256_DIGEST_LENGTH + 1)
+        return FAIL;
+
+    if (NULL == wsaes_softkey(c))
+        return FAIL;
+    memcpy(chain, (len > AESBLKSIZE) ? in + len - 2 * AESBLKSIZE : c->iv, AESBLKSIZE);
+    wsaes_soft_cbc(&c->sk, 0, chain, in + len - AESBLKSIZE, last, AESBLKSIZE);
+
+    // a padding length that doesn't fit is replaced by the largest that does, and the record fails
+    pad = last[AESBLKSIZE - 1];
+    maxpad = len - iv - (SHA256_DIGEST_LENGTH + 1);
+    maxpad = (maxpad > 255) ? 255 : maxpad;
+    good = wsaes_ct_ge(maxpad, pad);
+    pad = (good & pad) | (~good & maxpad);
+    paylen = len - iv - (SHA256_DIGEST_LENGTH + pad + 1);
+
+    h->aad[EVP_AEAD_TLS1_AAD_LEN - 2] = (uint8_t)(paylen >> 8);
+    h->aad[EVP_AEAD_TLS1_AAD_LEN - 1] = (uint8_t)paylen;
+    h->md = h->head;
+    wsaes_sha256_update(&h->md, h->aad, EVP_AEAD_TLS1_AAD_LEN);
+    h->pos = 0;
+    h->macfrom = iv;
+    h->macto = iv + paylen;
+    if (SUCCESS != wsaes_tapcipher(ctx, c, out, in, len, &tap))
+        return FAIL;
+
+    // hash as many bytes again as the padding took from the payload, so the work 
+    // done doesn't depend on the padding length (Lucky Thirteen)
+    dummy = h->md;
+    wsaes_sha256_update(&dummy, out + iv, pad);
+    OPENSSL_cleanse(&dummy, sizeof(dummy));
+
+    wsaes_sha256_final(mac, &h->md);
+    h->md = h->tail;
+    wsaes_sha256_update(&h->md, mac, SHA256_DIGEST_LENGTH);
+    wsaes_sha256_final(mac, &h->md);
+
+    // compare the MAC and padding bytes over every position either could be at
+    macpos = iv + paylen;
+    for (size_t j=(len - iv > 256 + SHA256_DIGEST_LENGTH) ? len - 256 - SHA256_DIGEST_LENGTH : iv; j<len; j++)
+    {
+        size_t inpad = wsaes_ct_ge(j, macpos + SHA256_DIGEST_LENGTH);
+        size_t inmac = wsaes_ct_ge(j, macpos) & ~inpad;
+        res |= (out[j] ^ mac[(j - macpos) & (SHA256_DIGEST_LENGTH - 1)]) & inmac;
+        res |= (out[j] ^ pad) & inpad;
+    }
+    OPENSSL_cleanse(last, sizeof(last));
+    return (good & 1) && 0 == res ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Stitched cipher init: as for AES-256-CBC. A new key also clears the MAC key
+ */
+static int wsaesengine_hmac_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc)
+{
+    wsaes_hmac_ctx_t *h = (wsaes_hmac_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    if (key)
+    {
+        wsaes_sha256_init(&h->head);
+        h->tail = h->md = h->head;
+    }
+    h->payload_length = WSAES_NO_PAYLOAD;
+    return wsaesengine_aescbc_init_key(ctx, key, iv, enc);
+}
+
+
+/*
+ * Stitched cipher computation. After EVP_CTRL_AEAD_TLS1_AAD, in is one TLS record
+ * (see wsaes_hmac_encrypt() and wsaes_hmac_decrypt()); otherwise the data is just
+ * ciphered, and its plaintext added to the running MAC
+ */
+static int wsaes_hmac_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    wsaes_hmac_ctx_t *h = (wsaes_hmac_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    wsaes_tap_t tap = { wsaes_mactap, h };
+    size_t plen = h->payload_length;
+
+    // the AAD is only good for one record
+    h->payload_length = WSAES_NO_PAYLOAD;
+    if (0 != inl % AESBLKSIZE)
+        return FAIL;
+    if (!h->aes.keyset)
+    {
+        fprintf(stderr,"ERROR: no key set in engine do_cipher()\n");
+        return FAIL;
+    }
+
+    if (WSAES_NO_PAYLOAD == plen)
+    {
+        h->pos = h->macfrom = 0;
+        h->macto = inl;
+        return wsaes_tapcipher(ctx, &h->aes, out, in, inl, &tap);
+    }
+    if (h->aes.enc)
+        return wsaes_hmac_encrypt(ctx, h, out, in, inl, plen);
+    return wsaes_hmac_decrypt(ctx, h, out, in, inl);
+}
+
+static int wsaesengine_hmac_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    return wsaes_timedcipher(wsaes_hmac_cipher, ctx, out, in, inl);
+}
+
+
+/*
+ * Stitched cipher cleanup: as for AES-256-CBC, and the MAC state is wiped too
+ */
+static int wsaesengine_hmac_cleanup(EVP_CIPHER_CTX *ctx)
+{
+    wsaes_hmac_ctx_t *h = (wsaes_hmac_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    wsaesengine_aescbc_cleanup(ctx);
+    if (h)
+        OPENSSL_cleanse(h, sizeof(wsaes_hmac_ctx_t));
+    return SUCCESS;
+}
+
+
+/*
+ * Stitched cipher control function: the MAC key and the TLS record header, as 
+ * libssl sets them, on top of the AES-256-CBC ctrls
+ */
+static int wsaesengine_hmac_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
+{
+    wsaes_hmac_ctx_t *h = (wsaes_hmac_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    uint8_t hmackey[SHA256_CBLOCK], *p = (uint8_t*)ptr;
+    unsigned int len;
+
+    switch (type)
+    {
+        case EVP_CTRL_INIT:
+            memset(h, 0, sizeof(wsaes_hmac_ctx_t));
+            h->payload_length = WSAES_NO_PAYLOAD;
+            return SUCCESS;
+        case EVP_CTRL_AEAD_SET_MAC_KEY:
+            if (arg < 0)
+                return 0;
+            // the HMAC inner and outer states after the padded key, as the start of every record's MAC
+            memset(hmackey, 0, sizeof(hmackey));
+            if (arg > SHA256_CBLOCK)
+                SHA256(p, arg, hmackey);
+            else
+                memcpy(hmackey, p, arg);
+            for (int i=0; i<SHA256_CBLOCK; i++)
+                hmackey[i] ^= 0x36;
+            wsaes_sha256_init(&h->head);
+            wsaes_sha256_update(&h->head, hmackey, SHA256_CBLOCK);
+            for (int i=0; i<SHA256_CBLOCK; i++)
+                hmackey[i] ^= 0x36 ^ 0x5c;
+            wsaes_sha256_init(&h->tail);
+            wsaes_sha256_update(&h->tail, hmackey, SHA256_CBLOCK);
+            OPENSSL_cleanse(hmackey, sizeof(hmackey));
+            h->md = h->head;
+            return SUCCESS;
+        case EVP_CTRL_AEAD_TLS1_AAD:
+            // the record header: sequence number, type, version and length
+            if (EVP_AEAD_TLS1_AAD_LEN != arg)
+                return -1;
+            len = p[arg - 2] << 8 | p[arg - 1];
+            h->tlsver = p[arg - 4] << 8 | p[arg - 3];
+            if (!h->aes.enc)
+            {
+                // the length is fixed up once the padding is known
+                memcpy(h->aad, p, arg);
+                h->payload_length = arg;
+                return SHA256_DIGEST_LENGTH;
+            }
+            // the length includes the explicit IV, which the MAC doesn't cover
+            h->payload_length = len;
+            if (h->tlsver >= TLS1_1_VERSION)
+            {
+                if (len < AESBLKSIZE)
+                    return 0;
+                len -= AESBLKSIZE;
+                p[arg - 2] = len >> 8;
+                p[arg - 1] = len;
+            }
+            h->md = h->head;
+            wsaes_sha256_update(&h->md, p, arg);
+            // the number of bytes the MAC and padding add to the record
+            return (int)(((len + SHA256_DIGEST_LENGTH + AESBLKSIZE) & ~(AESBLKSIZE - 1)) - len);
+        default:
+            return wsaesengine_aescbc_ctrl(ctx, type, arg, ptr);
+    }
+}
+
+
+/*
+ * CTR over len bytes of whole blocks from c's counter, on the devices that run 
+ * CTR. Counter ranges don't depend on each other the way a CBC chain does, so a 
+ * long request is split into ranges of at least WSAES_CTRSPLIT bytes, one per
+ * device, each starting from its own counter block, and they run at the same time
+ * (see wsaes_ctrparallel()). c's own device takes the first range
+ */
+static int wsaes_ctrcipher(wsaes_cipher_ctx_t *c, unsigned char *out, const unsigned char *in, size_t len)
+{
+    wsaes_device_t *devs[WSAES_MAXDEVS];
+    uint8_t ctrs[WSAES_MAXDEVS][AESBLKSIZE];
+    wsaes_iov_t iov[WSAES_MAXDEVS];
+    int ndevs = 0, n = 0, status = 0;
+    size_t nparts = len / WSAES_CTRSPLIT, part, off;
+
+    for (int i=0; i<wsaes_ndevs; i++)
+    {
+        wsaes_device_t *d = &wsaes_devs[(c->dev - wsaes_devs + i) % wsaes_ndevs];
+        if (d->ctr)
+            devs[ndevs++] = d;
+    }
+    if (nparts > ndevs)
+        nparts = ndevs;
+    if (nparts < 1)
+        nparts = 1;
+    part = (len / nparts + AESBLKSIZE - 1) & ~(size_t)(AESBLKSIZE - 1);
+    for (off=0; off<len; off+=iov[n++].len)
+    {
+        iov[n].in = in + off;
+        iov[n].out = out + off;
+        iov[n].len = (len - off < part) ? len - off : part;
+        memcpy(ctrs[n], c->iv, AESBLKSIZE);
+        wsaes_ctradd(ctrs[n], off / AESBLKSIZE);
+        __atomic_add_fetch(&devs[n]->outstanding, iov[n].len, __ATOMIC_RELAXED);
+    }
+
+#ifdef WSAES_ASYNC
+    status = wsaes_ctrparallel(devs, c, ctrs, iov, n);
+#else
+    // without worker threads, the ranges run one after the other
+    for (int k=0; k<n; k++)
+        status |= wsaes_ctrdev(devs[k], c, ctrs[k], &iov[k]);
+#endif
+    for (int k=0; k<n; k++)
+        __atomic_sub_fetch(&devs[k]->outstanding, iov[k].len, __ATOMIC_RELAXED);
+    if (0 != status)
+        return FAIL;
+
+    wsaes_ctradd(c->iv, len / AESBLKSIZE);
+    return SUCCESS;
+}
+
+
+/*
+ * AES-256-CTR init: as for AES-256-CBC, with OpenSSL's IV as the first counter 
+ * block, and any keystream left over from before dropped
+ */
+static int wsaesengine_ctr_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc)
+{
+    wsaes_ctr_ctx_t *t = (wsaes_ctr_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    t->num = 0;
+    return wsaesengine_aescbc_init_key(ctx, key, iv, enc);
+}
+
+
+/*
+ * AES-256-CTR computation, for any number of bytes. Whole blocks go to the devices
+ * from SW_THRESHOLD bytes, if any of them run CTR, and are done in software otherwise
+ */
+static int wsaes_ctr_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    wsaes_ctr_ctx_t *t = (wsaes_ctr_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    wsaes_cipher_ctx_t *c = &t->aes;
+    size_t whole;
+
+    if (0 == inl)
+        return SUCCESS;
+    if (!c->keyset)
+    {
+        fprintf(stderr,"ERROR: no key set in engine do_cipher()\n");
+        return FAIL;
+    }
+
+    // first the rest of the keystream block the last call stopped in
+    for (; 0 != t->num && inl > 0; inl--)
+    {
+        *out++ = *in++ ^ t->ecount[t->num];
+        t->num = (t->num + 1) % AESBLKSIZE;
+    }
+
+    whole = inl - inl % AESBLKSIZE;
+    if (whole > 0 && whole >= __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED) && wsaes_nctrdevs > 0)
+    {
+        if (SUCCESS != wsaes_ctrcipher(c, out, in, whole))
+            return FAIL;
+    }
+    else if (whole > 0)
+    {
+        if (NULL == wsaes_softkey(c))
+            return FAIL;
+        wsaes_countsw(whole);
+        WSAES_TRACE_BEGIN(soft, whole);
+        wsaes_soft_ctr(&c->sk, c->iv, in, out, whole);
+        WSAES_TRACE_END(soft, whole);
+    }
+
+    // a partial block at the end takes the next keystream block, and keeps what it doesn't use
+    if (inl > whole)
+    {
+        if (NULL == wsaes_softkey(c))
+            return FAIL;
+        memset(t->ecount, 0, AESBLKSIZE);
+        wsaes_soft_ctr(&c->sk, c->iv, t->ecount, t->ecount, AESBLKSIZE);
+        for (; t->num < inl - whole; t->num++)
+            out[whole + t->num] = in[whole + t->num] ^ t->ecount[t->num];
+    }
+    memcpy(EVP_CIPHER_CTX_iv_noconst(ctx), c->iv, AESIVSIZE);
+    return SUCCESS;
+}
+
+static int wsaesengine_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    return wsaes_timedcipher(wsaes_ctr_cipher, ctx, out, in, inl);
+}
+
+
+/*
+ * AES-256-CTR cleanup: as for AES-256-CBC, and the keystream is wiped too
+ */
+static int wsaesengine_ctr_cleanup(EVP_CIPHER_CTX *ctx)
+{
+    wsaes_ctr_ctx_t *t = (wsaes_ctr_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    wsaesengine_aescbc_cleanup(ctx);
+    if (t)
+        OPENSSL_cleanse(t, sizeof(wsaes_ctr_ctx_t));
+    return SUCCESS;
+}
+
+
+/*
+ * AES-256-CTR control function: EVP_CTRL_INIT and EVP_CTRL_COPY as for AES-256-CBC
+ */
+static int wsaesengine_ctr_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
+{
+    switch (type)
+    {
+        case EVP_CTRL_INIT:
+            memset(EVP_CIPHER_CTX_get_cipher_data(ctx), 0, sizeof(wsaes_ctr_ctx_t));
+            return SUCCESS;
+        case EVP_CTRL_COPY:
+            return wsaesengine_aescbc_ctrl(ctx, type, arg, ptr);
+        default:
+            return -1;
+    }
+}
+
 
-static const char *engine_id = "wsaes";
-static const char *engine_name = "A test engine for the ws aescbc hardware encryption module, on the Xilinx ZYNQ7000";
-static int wsaes_nids[] = {NID_aes_256_cbc};
+/*
+ * AES-256-XTS init. EVP leaves the IV to ciphers with EVP_CIPH_CUSTOM_IV, so it
+ * is copied into the EVP context here. Like OpenSSL, encryption with the same key
+ * in both halves is refused, since that defeats XTS
+ */
+static int wsaesengine_xts_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc)
+{
+    wsaes_xts_ctx_t *x = (wsaes_xts_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    if (key)
+    {
+        if (enc && 0 == CRYPTO_memcmp(key, key + AESKEYSIZE, AESKEYSIZE))
+        {
+            fprintf(stderr,"ERROR: XTS data and tweak keys are the same\n");
+            return FAIL;
+        }
+        memcpy(x->tweakkey, key + AESKEYSIZE, AESKEYSIZE);
+        x->tweaksoftkeyset = 0;
+    }
+    if (iv)
+        memcpy(EVP_CIPHER_CTX_iv_noconst(ctx), iv, AESIVSIZE);
+    return wsaesengine_aescbc_init_key(ctx, key, iv, enc);
+}
 
-static int wsaesengine_aescbc_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
-static int wsaesengine_aescbc_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
-static int wsaesengine_aescbc_cleanup(EVP_CIPHER_CTX *ctx);
 
 /*
- * Create our own evp cipher declaration matching that of the generic cipher 
- * structure (struct evp_cipher_st), as defined in openssl/include/internal/evp_int.h
- *
- * struct evp_cipher_st {
- *    int nid;
- *    int block_size;
- *    // Default value for variable length ciphers 
- *    int key_len;
- *    int iv_len;
- *    // Various flags 
- *    unsigned long flags; 
- *    // init key 
- *    int (*init) (EVP_CIPHER_CTX *ctx, const unsigned char *key, const unsigned char *iv, int enc);
- *    // encrypt/decrypt data 
- *    int (*do_cipher) (EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl);
- *    // cleanup ctx 
- *    int (*cleanup) (EVP_CIPHER_CTX *);
- *    // how big ctx->cipher_data needs to be 
- *    int ctx_size;
- *    // Populate a ASN1_TYPE with parameters 
- *    int (*set_asn1_parameters) (EVP_CIPHER_CTX *, ASN1_TYPE *);
- *    // Get parameters from a ASN1_TYPE 
- *    int (*get_asn1_parameters) (EVP_CIPHER_CTX *, ASN1_TYPE *);
- *    // Miscellaneous operations 
- *    int (*ctrl) (EVP_CIPHER_CTX *, int type, int arg, void *ptr);
- *    // Application data 
- *    void *app_data;
- * }  // EVP_CIPHER  ;
+ * One data unit of whole blocks on device d, the unit's tweak loaded for it, so 
+ * no context owns the device afterwards. Returns 0 on success
  */
-static const EVP_CIPHER wsaesengine_aescbc_method = 
+static int wsaes_xtsdev(wsaes_device_t *d, wsaes_xts_ctx_t *x, unsigned char *out, const unsigned char *in, size_t inl)
 {
-	NID_aes_256_cbc, // openSSL algorithm numerical ID
-	AESBLKSIZE, // block size
-	AESKEYSIZE, // key length
-	AESIVSIZE,  // iv length 
-	0 | EVP_CIPH_CBC_MODE, // flags...TODO this should not be hardcoded
-	wsaesengine_aescbc_init_key, // key initialization function pointer
-	wsaesengine_aescbc_do_cipher, // do_cipher (encrypt/decrypt data)
-	wsaesengine_aescbc_cleanup, // cleanup (cleanup ctx)
-	AESMAXDATASIZE, // ctx_size (how large cipher data needs to be)
-	EVP_CIPHER_set_asn1_iv, // set_asn1_parameters Pupulate a ASN1_type with parameters
-	EVP_CIPHER_set_asn1_iv, // get_asn1_parameters get ASN1_TYPE parameters
-	NULL,//wsaesengine_aescbc_ctrl, // ctrl: misc. operations
-	NULL // pointer to application data to encrypt
-}; 
+    wsaes_cipher_ctx_t *c = &x->aes;
+    int status = -1;
+    uint64_t start;
+
+    WSAES_TRACE_BEGIN(devlock, d - wsaes_devs);
+    pthread_mutex_lock(&d->lock);
+    WSAES_TRACE_END(devlock, d - wsaes_devs);
+    start = wsaes_nowns();
+    d->owner = 0;
+    if (SUCCESS == wsaes_loadkey(d, c))
+    {
+        if (d->tweakkeyvalid && 0 == CRYPTO_memcmp(d->tweakkey, x->tweakkey, AESKEYSIZE))
+            d->keystats.keyloads_avoided++;
+        else if (0 == aes256settweakkey_sess(d->sess, x->tweakkey))
+        {
+            memcpy(d->tweakkey, x->tweakkey, AESKEYSIZE);
+            d->tweakkeyvalid = 1;
+            d->keystats.keyloads++;
+        }
+        if (d->tweakkeyvalid)
+            status = aes256xtstweak_sess(d->sess, c->enc ? ENCRYPT : DECRYPT, c->iv, (uint32_t)inl, in, out, 1);
+    }
+    if (0 != status)
+    {
+        wsaes_dropkeys(d);
+        d->tweakkeyvalid = 0;
+        wsaes_counterr(1);
+    }
+    else
+    {
+        d->keystats.ivloads++;
+        d->stat.bytes += inl;
+        d->stat.requests++;
+    }
+    d->stat.busy_ns += wsaes_nowns() - start;
+    pthread_mutex_unlock(&d->lock);
+    return status;
+}
 
 
 /*
- * Key initialization function. This function is called by the OpenSSL EVP API 
- * through the EVP_[En/De]cryptInit_ex(..) function
+ * AES-256-XTS computation over one data unit of at least a block. Units of whole
+ * blocks from SW_THRESHOLD bytes go to the context's device if it runs XTS and 
+ * takes units that long; the rest, including units that end in a partial block
+ * (ciphertext stealing), are done in software
  */
-static int wsaesengine_aescbc_init_key(EVP_CIPHER_CTX *ctx, const unsigned char *key, 
-										  const unsigned char *iv, int enc)
+static int wsaes_xts_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
 {
-    int ret; 
+    wsaes_xts_ctx_t *x = (wsaes_xts_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
+    wsaes_cipher_ctx_t *c = &x->aes;
+    wsaes_device_t *d = c->dev;
+    int status;
 
-    ret = aes256init();
-	if (0 != ret)
-	{
-		fprintf(stderr,"ERROR: AES block could not be initialized in ngine init_key\n");
-		return FAIL;
-	}
-    
-    ret = aes256setkey((uint8_t*)key);
-    if (0 != ret)
-	{
-		fprintf(stderr,"ERROR: failed to set key in engine init_key()\n");
+    if (!c->keyset)
+    {
+        fprintf(stderr,"ERROR: no key set in engine do_cipher()\n");
         return FAIL;
-	}
-    
-    ret = aes256setiv((uint8_t*)iv);
-    if (0 != ret)
-	{
-		fprintf(stderr,"ERROR: failed to set iv in engine init_key\n");
+    }
+    if (inl < AESBLKSIZE)
+    {
+        fprintf(stderr,"ERROR: XTS data unit of %zu bytes is shorter than a block\n", inl);
         return FAIL;
-	}
+    }
 
-    ret = aes256reset();
-    if (0 != ret)
-	{
-		fprintf(stderr,"ERROR: failed to reset in engine init_key()\n");
+    if (0 == inl % AESBLKSIZE && inl >= __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED) && inl <= d->xtsmax)
+    {
+        __atomic_add_fetch(&d->outstanding, inl, __ATOMIC_RELAXED);
+        status = wsaes_xtsdev(d, x, out, in, inl);
+        __atomic_sub_fetch(&d->outstanding, inl, __ATOMIC_RELAXED);
+        return (0 == status) ? SUCCESS : FAIL;
+    }
+
+    if ((!x->tweaksoftkeyset && 0 != wsaes_soft_setkey(&x->tsk, x->tweakkey)) || NULL == wsaes_softkey(c))
         return FAIL;
-	}
+    x->tweaksoftkeyset = 1;
+    wsaes_countsw(inl);
+    WSAES_TRACE_BEGIN(soft, inl);
+    wsaes_soft_xts(&c->sk, &x->tsk, c->enc, c->iv, in, out, inl);
+    WSAES_TRACE_END(soft, inl);
+    return SUCCESS;
+}
 
-	return SUCCESS;
+static int wsaesengine_xts_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+{
+    return wsaes_timedcipher(wsaes_xts_cipher, ctx, out, in, inl);
 }
 
 
 /*
- * Cipher computation function. This function is called by the OpenSSL EVP API in the 
- * EVP_[En/De]cryptUpdate(..) and (potentially) in the EVP_[En/De]cryptFinal_ex(..) functions
+ * AES-256-XTS cleanup: as for AES-256-CBC, and the tweak key is wiped too
  */
-static int wsaesengine_aescbc_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out, const unsigned char *in, size_t inl)
+static int wsaesengine_xts_cleanup(EVP_CIPHER_CTX *ctx)
 {
-    int status;
-    uint32_t outlen;
-    ciphermode_t mode = (!ctx->encrypt) ? DECRYPT : ENCRYPT; 
-    status = aes256(mode, (uint8_t*)in, (uint32_t)inl, (uint8_t*)out, &outlen);
-    return (0 != status) ? FAIL : SUCCESS;
-}
+    wsaes_xts_ctx_t *x = (wsaes_xts_ctx_t*)EVP_CIPHER_CTX_get_cipher_data(ctx);
 
+    if (x)
+        wsaes_soft_freekey(&x->tsk);
+    wsaesengine_aescbc_cleanup(ctx);
+    if (x)
+        OPENSSL_cleanse(x, sizeof(wsaes_xts_ctx_t));
+    return SUCCESS;
+}
 
 
 /*
- * AES EVP_CIPHER_CTX cleanup function: sets all fields to zero. 
- * TODO: there is probably a lot more that should be happening in this function.
- *  - use a code profiler to determine if there are any memory leaks
+ * AES-256-XTS control function: EVP_CTRL_INIT and EVP_CTRL_COPY as for AES-256-CBC
  */
-static int wsaesengine_aescbc_cleanup(EVP_CIPHER_CTX *ctx) 
+static int wsaesengine_xts_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
 {
-	if (ctx->cipher_data)
-		memset(ctx->cipher_data, 0, 32);
-	return SUCCESS;
+    wsaes_xts_ctx_t *dst;
+
+    switch (type)
+    {
+        case EVP_CTRL_INIT:
+            memset(EVP_CIPHER_CTX_get_cipher_data(ctx), 0, sizeof(wsaes_xts_ctx_t));
+            return SUCCESS;
+        case EVP_CTRL_COPY:
+            // the copy expands its own tweak key schedules, as it does the data key's
+            dst = (wsaes_xts_ctx_t*)EVP_CIPHER_CTX_get_cipher_data((EVP_CIPHER_CTX*)ptr);
+            memset(&dst->tsk, 0, sizeof(dst->tsk));
+            dst->tweaksoftkeyset = 0;
+            return wsaesengine_aescbc_ctrl(ctx, type, arg, ptr);
+        default:
+            return -1;
+    }
 }
 
 
@@ -196,14 +2406,23 @@ static int wsaesengine_cipher_selector(ENGINE *e, const EVP_CIPHER**cipher, cons
     if (!cipher)
     {
         *nids = wsaes_nids;
-        int retnids = sizeof(wsaes_nids - 1) / sizeof(wsaes_nids[0]);
+        int retnids = sizeof(wsaes_nids) / sizeof(wsaes_nids[0]);
         return retnids;
     }
     // if cipher is supported, select our implementation, otherwise set to null and fail 
     switch (nid) 
     {
         case NID_aes_256_cbc:
-            *cipher = &wsaesengine_aescbc_method; 
+            *cipher = WSAES_AESCBC; 
+            break;
+        case NID_aes_256_cbc_hmac_sha256:
+            *cipher = WSAES_HMACSHA256; 
+            break;
+        case NID_aes_256_ctr:
+            *cipher = WSAES_AESCTR; 
+            break;
+        case NID_aes_256_xts:
+            *cipher = WSAES_AESXTS; 
             break;
         // other cases tdb
        default:
@@ -215,25 +2434,736 @@ static int wsaesengine_cipher_selector(ENGINE *e, const EVP_CIPHER**cipher, cons
 
 
 /*
- * Engine Initialization:
+ * Startup calibration, see WSAES_CMD_AUTOTUNE. The pipeline depth and chunk size
+ * are picked on a long stream first, then the crossover is looked for from the
+ * longest payload down: SW_THRESHOLD becomes the shortest payload from which on
+ * the device beats software at every size measured, or never if it loses at the
+ * longest. Devices are taken to be alike, so only device 0 is measured
+ */
+#define WSAES_TUNE_NS 1000000            // time each measurement runs for
+#define WSAES_TUNE_MAXLEN 65536          // longest payload measured (longer ones go in chunks), the shortest is a block
+#define WSAES_TUNE_STREAM 262144         // stream the pipeline depth and chunk size are measured on
+#define WSAES_TUNE_MINCHUNK 4096         // smallest chunk size tried
+#define WSAES_TUNE_MAXDEPTH 16           // deepest pipeline tried
+#define WSAES_TUNE_MARGIN 1.05           // a deeper pipeline or smaller chunk must be this much faster
+
+/* Nanoseconds to encrypt and decrypt len bytes in software */
+static double wsaes_tunesoft(const wsaes_softkey_t *k, uint8_t *buf, size_t len)
+{
+    uint8_t iv[AESIVSIZE] = { 0 };
+    uint64_t start, t, calls = 0;
+
+    wsaes_soft_cbc(k, 1, iv, buf, buf, len); // warm up
+    start = wsaes_nowns();
+    do
+    {
+        wsaes_soft_cbc(k, 1, iv, buf, buf, len);
+        wsaes_soft_cbc(k, 0, iv, buf, buf, len);
+        calls++;
+    } while ((t = wsaes_nowns() - start) < WSAES_TUNE_NS);
+    return (double)t / calls;
+}
+
+/* The same on the device of sess, with a key loaded; negative if the device failed */
+static double wsaes_tunedev(wsaes_session_t *sess, uint8_t *buf, size_t len)
+{
+    uint64_t start, t, calls = 0;
+
+    if (0 != aes256stream_sess(sess, ENCRYPT, buf, len, buf))
+        return -1;
+    start = wsaes_nowns();
+    do
+    {
+        if (0 != aes256stream_sess(sess, ENCRYPT, buf, len, buf) ||
+            0 != aes256stream_sess(sess, DECRYPT, buf, len, buf))
+            return -1;
+        calls++;
+    } while ((t = wsaes_nowns() - start) < WSAES_TUNE_NS);
+    return (double)t / calls;
+}
+
+/* Measure device 0 and pick the tuning parameters into t */
+static int wsaes_calibrate(wsaes_tuning_t *t)
+{
+    wsaes_device_t *d = &wsaes_devs[0];
+    uint8_t key[AESKEYSIZE] = { 0 }, iv[AESIVSIZE] = { 0 };
+    uint32_t caps = aes256caps_sess(d->sess), maxxfer = aes256maxxfer_sess(d->sess);
+    uint64_t start = wsaes_nowns();
+    uint8_t *buf = malloc(WSAES_TUNE_STREAM);
+    double sw, dev, best;
+    wsaes_softkey_t sk = { 0 };
+    int ret = FAIL;
+
+    if (NULL == buf || 0 != wsaes_soft_setkey(&sk, key))
+    {
+        fprintf(stderr,"ERROR: could not allocate the calibration buffer or key\n");
+        free(buf);
+        return FAIL;
+    }
+    memset(buf, 0x5a, WSAES_TUNE_STREAM);
+    t->pipeline_depth = __atomic_load_n(&wsaes_pipedepth, __ATOMIC_RELAXED);
+    t->chunk = __atomic_load_n(&wsaes_chunk, __ATOMIC_RELAXED);
+    t->sw_threshold = UINT64_MAX;
+
+    // the calibration key replaces whatever the contexts had loaded
+    pthread_mutex_lock(&d->lock);
+    d->owner = 0;
+    wsaes_dropkeys(d);
+    if (0 != aes256setkey_sess(d->sess, key) || 0 != aes256setiv_sess(d->sess, iv) || 0 != aes256reset_sess(d->sess))
+        goto done;
+
+    // deeper pipelines only pay where write()/read() transfers are queued, rings overlap on their own
+    if ((caps & WSAES_CAP_QUEUE) && !(caps & WSAES_CAP_RING))
+    {
+        best = 0;
+        for (uint32_t depth=1; depth<=WSAES_TUNE_MAXDEPTH && aes256setdepth_sess(d->sess, depth) == depth; depth*=2)
+        {
+            if ((dev = wsaes_tunedev(d->sess, buf, WSAES_TUNE_STREAM)) < 0)
+                goto done;
+            if (0 == best || dev * WSAES_TUNE_MARGIN < best)
+            {
+                best = dev;
+                t->pipeline_depth = depth;
+            }
+        }
+        aes256setdepth_sess(d->sess, t->pipeline_depth);
+    }
+    if (maxxfer > WSAES_TUNE_MINCHUNK)
+    {
+        best = 0;
+        for (uint32_t chunk=maxxfer; chunk>=WSAES_TUNE_MINCHUNK; chunk/=2)
+        {
+            aes256setchunk_sess(d->sess, chunk);
+            if ((dev = wsaes_tunedev(d->sess, buf, WSAES_TUNE_STREAM)) < 0)
+                goto done;
+            if (0 == best || dev * WSAES_TUNE_MARGIN < best)
+            {
+                best = dev;
+                t->chunk = (chunk == maxxfer) ? 0 : chunk;
+            }
+        }
+        aes256setchunk_sess(d->sess, t->chunk);
+    }
+
+    for (size_t len=WSAES_TUNE_MAXLEN; len>=AESBLKSIZE; len/=2)
+    {
+        sw = wsaes_tunesoft(&sk, buf, len);
+        if ((dev = wsaes_tunedev(d->sess, buf, len)) < 0)
+            goto done;
+        if (dev > sw)
+            break;
+        t->sw_threshold = len;
+    }
+    ret = SUCCESS;
+
+done:
+    if (SUCCESS != ret)
+    {
+        fprintf(stderr,"ERROR: device failed during calibration\n");
+        aes256setdepth_sess(d->sess, __atomic_load_n(&wsaes_pipedepth, __ATOMIC_RELAXED));
+        aes256setchunk_sess(d->sess, __atomic_load_n(&wsaes_chunk, __ATOMIC_RELAXED));
+    }
+    d->owner = 0;
+    wsaes_dropkeys(d);
+    pthread_mutex_unlock(&d->lock);
+    wsaes_soft_freekey(&sk);
+    free(buf);
+    t->source = WSAES_TUNE_CALIBRATED;
+    t->calibrate_ns = wsaes_nowns() - start;
+    return ret;
+}
+
+/* Put the parameters of t in use on every device */
+static void wsaes_applytuning(const wsaes_tuning_t *t)
+{
+    __atomic_store_n(&wsaes_swthreshold, (t->sw_threshold >= SIZE_MAX) ? SIZE_MAX : (size_t)t->sw_threshold,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&wsaes_pipedepth, t->pipeline_depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&wsaes_chunk, t->chunk, __ATOMIC_RELAXED);
+    for (int n=0; n<wsaes_ndevs; n++)
+    {
+        pthread_mutex_lock(&wsaes_devs[n].lock);
+        aes256setdepth_sess(wsaes_devs[n].sess, t->pipeline_depth);
+        aes256setchunk_sess(wsaes_devs[n].sess, t->chunk);
+        pthread_mutex_unlock(&wsaes_devs[n].lock);
+    }
+    wsaes_tuning.source = t->source;
+    wsaes_tuning.calibrate_ns = t->calibrate_ns;
+}
+
+/* What a calibration holds for: the backend, the devices and whether the CPU has AES-NI */
+static void wsaes_tunesig(char *buf, size_t len)
+{
+    const char *backend = getenv("WSAES_BACKEND");
+    wsaes_session_t *sess = wsaes_devs[0].sess;
+    uint8_t key[AESKEYSIZE] = { 0 };
+    wsaes_softkey_t sk = { 0 };
+
+    wsaes_soft_setkey(&sk, key);
+    snprintf(buf, len, "%s %d %#x %u %u %d", (NULL != backend) ? backend : "kernel", wsaes_ndevs,
+             aes256caps_sess(sess), aes256maxxfer_sess(sess), aes256keyslots_sess(sess), sk.aesni);
+    wsaes_soft_freekey(&sk);
+}
+
+/*
+ * Read the calibration kept in wsaes_tunecache into t; fails if there is none, or
+ * if it was made for other devices
+ */
+static int wsaes_loadtuning(wsaes_tuning_t *t)
+{
+    char line[256], sig[200];
+    unsigned long long v;
+    int found = 0;
+    FILE *f;
+
+    if ('\0' == wsaes_tunecache[0] || NULL == (f = fopen(wsaes_tunecache, "r")))
+        return FAIL;
+    wsaes_tunesig(sig, sizeof(sig));
+    memset(t, 0, sizeof(*t));
+    while (NULL != fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (0 == strncmp(line, "signature ", 10))
+            found |= (0 == strcmp(line + 10, sig)) ? 1 : 0;
+        else if (1 == sscanf(line, "sw_threshold %llu", &v))
+        {
+            t->sw_threshold = v;
+            found |= 2;
+        }
+        else if (1 == sscanf(line, "pipeline_depth %llu", &v) && v > 0 && v <= UINT32_MAX)
+        {
+            t->pipeline_depth = (uint32_t)v;
+            found |= 4;
+        }
+        else if (1 == sscanf(line, "chunk %llu", &v) && v <= UINT32_MAX)
+        {
+            t->chunk = (uint32_t)v;
+            found |= 8;
+        }
+    }
+    fclose(f);
+    t->source = WSAES_TUNE_CACHED;
+    return (15 == found) ? SUCCESS : FAIL;
+}
+
+/* Keep t in wsaes_tunecache, replacing the file in one go */
+static int wsaes_savetuning(const wsaes_tuning_t *t)
+{
+    char tmp[PATH_MAX + 8], sig[200];
+    FILE *f;
+
+    wsaes_tunesig(sig, sizeof(sig));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", wsaes_tunecache);
+    if (NULL == (f = fopen(tmp, "w")))
+    {
+        perror("ERROR: could not write the tuning cache");
+        return FAIL;
+    }
+    fprintf(f, "# wsaesengine calibration, remove to calibrate again\nsignature %s\nsw_threshold %llu\n"
+            "pipeline_depth %u\nchunk %u\n", sig, (unsigned long long)t->sw_threshold, t->pipeline_depth, t->chunk);
+    if (0 != fclose(f) || 0 != rename(tmp, wsaes_tunecache))
+    {
+        perror("ERROR: could not write the tuning cache");
+        unlink(tmp);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/* Tune from the cache if it was made for these devices, and by calibrating otherwise or if force */
+static int wsaes_tune(int force)
+{
+    wsaes_tuning_t t;
+
+    if (0 == wsaes_ndevs)
+        return FAIL;
+    if (!force && SUCCESS == wsaes_loadtuning(&t))
+    {
+        wsaes_applytuning(&t);
+        return SUCCESS;
+    }
+    if (SUCCESS != wsaes_calibrate(&t))
+        return FAIL;
+    wsaes_applytuning(&t);
+    if ('\0' != wsaes_tunecache[0])
+        wsaes_savetuning(&t);
+    return SUCCESS;
+}
+
+
+/*
+ * Engine Initialization: opens a session on every device present, and starts the
+ * worker threads that serve requests from ASYNC_JOBs
  */
 int wsaes_init(ENGINE *e)
 {
-    return (aes256init() < 0) ? FAIL : SUCCESS;
+    int ndevs;
+
+    if (aes256init() < 0)
+        return FAIL;
+    if (wsaes_ndevs > 0)
+        return SUCCESS;
+
+    // devices are numbered from 0 without gaps, so stop at the first that won't open
+    ndevs = aes256devcount();
+    wsaes_nctrdevs = 0;
+    for (wsaes_ndevs=0; wsaes_ndevs<ndevs; wsaes_ndevs++)
+    {
+        wsaes_device_t *d = &wsaes_devs[wsaes_ndevs];
+        if (0 != aes256open_dev(&d->sess, wsaes_ndevs))
+            break;
+        aes256setdepth_sess(d->sess, __atomic_load_n(&wsaes_pipedepth, __ATOMIC_RELAXED));
+        aes256setchunk_sess(d->sess, __atomic_load_n(&wsaes_chunk, __ATOMIC_RELAXED));
+        d->ctr = 0 != (aes256caps_sess(d->sess) & WSAES_CAP_CTR);
+        wsaes_nctrdevs += d->ctr;
+        d->xtsmax = (aes256caps_sess(d->sess) & WSAES_CAP_XTS) ? aes256maxxfer_sess(d->sess) : 0;
+        d->tweakkeyvalid = 0;
+        d->owner = 0;
+        // one key slot stands for the single key register of devices without them
+        d->nslots = (aes256caps_sess(d->sess) & WSAES_CAP_KEYSLOTS) ? aes256keyslots_sess(d->sess) : 1;
+        if (d->nslots > WSAES_MAXKEYSLOTS)
+            d->nslots = WSAES_MAXKEYSLOTS;
+        d->keyclock = 0;
+        wsaes_dropkeys(d);
+        // utilization is measured from here, see WSAES_CMD_GET_DEV_STATS
+        d->stat.bytes = d->stat.requests = d->stat.busy_ns = 0;
+#ifdef WSAES_ASYNC
+        wsaes_async_start(d);
+#endif
+        if (wsaes_schedon)
+            wsaes_sched_start(d);
+    }
+    if (0 == wsaes_ndevs)
+    {
+        fprintf(stderr,"ERROR: failed to open device session in engine init\n");
+        return FAIL;
+    }
+    // not fatal: the engine runs on the values it has
+    if (wsaes_autotune && SUCCESS != wsaes_tune(2 == wsaes_autotune))
+        fprintf(stderr,"ERROR: calibration failed, keeping the tuning parameters\n");
+    wsaes_initns = wsaes_nowns();
+    return SUCCESS;
 }
 
 
 
 /*
- * Engine finish function
- * TODO: should we be doing something else here? 
+ * Engine finish function: stops the async workers and closes the device sessions
  */
 int wsaes_finish(ENGINE *e)
 {
+    for (int i=0; i<wsaes_ndevs; i++)
+    {
+        wsaes_device_t *d = &wsaes_devs[i];
+#ifdef WSAES_ASYNC
+        wsaes_async_stop(d);
+#endif
+        wsaes_sched_stop(d);
+        aes256close(d->sess);
+        d->sess = NULL;
+        d->owner = 0;
+        wsaes_dropkeys(d);
+        d->tweakkeyvalid = 0;
+    }
+    wsaes_ndevs = 0;
+    return SUCCESS;
+}
+
+
+/*
+ * Engine control commands, see wsaesengine.h
+ */
+static const ENGINE_CMD_DEFN wsaes_cmd_defns[] = {
+    {WSAES_CMD_GET_KEY_STATS, "GET_KEY_STATS", "Copy the device key/IV load counters into a wsaes_keystats_t", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_SW_THRESHOLD, "SW_THRESHOLD", "Run do_cipher calls smaller than this many bytes in software (0 = never)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_PIPELINE_DEPTH, "PIPELINE_DEPTH", "Device transfers kept in flight (1 = wait for each)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_GET_DEV_STATS, "GET_DEV_STATS", "Copy the per-device utilization counters into a wsaes_devstats_t", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_SCHEDULER, "SCHEDULER", "Queue device requests for a submitter thread per device (1) or not (0)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_SCHED_LATENCY, "SCHED_LATENCY_US", "How long the scheduler holds a request for others to join it", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_GET_SCHED_STATS, "GET_SCHED_STATS", "Copy the scheduler counters into a wsaes_schedstats_t", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_GET_PERF_STATS, "GET_PERF_STATS", "Copy the performance counters into a wsaes_perfstats_t", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_RESET_STATS, "RESET_STATS", "Zero all the counters", 
+        ENGINE_CMD_FLAG_NO_INPUT},
+    {WSAES_CMD_STATS, "STATS", "Count nothing (0), counters (1), counters and latency histograms (2)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_GET_STATS_TEXT, "GET_STATS_TEXT", "Write all the counters as text into a buffer of i bytes", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_GET_STATS_JSON, "GET_STATS_JSON", "Write all the counters as JSON into a buffer of i bytes", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_TRACE, "TRACE", "Record every request's stages into the trace ring (1) or not (0)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_TRACE_DUMP, "TRACE_DUMP", "Write the trace ring to a file as Chrome trace events", 
+        ENGINE_CMD_FLAG_STRING},
+    {WSAES_CMD_CHUNK_SIZE, "CHUNK_SIZE", "Largest device transfer in bytes (0 = the device's largest)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_AUTOTUNE, "AUTOTUNE", "Tune at init from the cache or by calibrating (1), calibrate now (2), or not (0)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {WSAES_CMD_TUNE_CACHE, "TUNE_CACHE", "File the calibration is kept in", 
+        ENGINE_CMD_FLAG_STRING},
+    {WSAES_CMD_GET_TUNING, "GET_TUNING", "Copy the tuning parameters in use into a wsaes_tuning_t", 
+        ENGINE_CMD_FLAG_INTERNAL},
+    {WSAES_CMD_SW_OVERFLOW, "SW_OVERFLOW", "Run the scheduler's backlog beyond the device's share in software (1)", 
+        ENGINE_CMD_FLAG_NUMERIC},
+    {0, NULL, NULL, 0}
+};
+
+static int wsaes_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f)(void));
+
+/* Output of wsaes_snapshot(): pos runs on past len, so an overflow shows */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t pos;
+} wsaes_out_t;
+
+static void wsaes_print(wsaes_out_t *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + ((o->pos < o->len) ? o->pos : o->len - 1), (o->pos < o->len) ? o->len - o->pos : 1,
+                  fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        o->pos += n;
+}
+
+static void wsaes_printhist(wsaes_out_t *o, const char *name, const wsaes_hist_t *h, int json)
+{
+    if (json)
+    {
+        wsaes_print(o, ",\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"buckets\":[", name, (unsigned long long)h->count,
+                    (unsigned long long)h->sum_ns);
+        for (int b=0; b<WSAES_HISTBUCKETS; b++)
+            wsaes_print(o, "%s%llu", b ? "," : "", (unsigned long long)h->bucket[b]);
+        wsaes_print(o, "]}");
+        return;
+    }
+    // only the buckets in use, each named by the shortest latency it holds
+    wsaes_print(o, "%s_count %llu\n%s_sum_ns %llu\n", name, (unsigned long long)h->count, name,
+                (unsigned long long)h->sum_ns);
+    for (int b=0; b<WSAES_HISTBUCKETS; b++)
+        if (0 != h->bucket[b])
+            wsaes_print(o, "%s_ns_%llu %llu\n", name, b ? 1ULL << b : 0ULL, (unsigned long long)h->bucket[b]);
+}
+
+/* All the counters into buf, as text or JSON; see WSAES_CMD_GET_STATS_TEXT */
+static int wsaes_snapshot(ENGINE *e, char *buf, size_t len, int json)
+{
+    wsaes_out_t o = { buf, len, 0 };
+    wsaes_perfstats_t ps;
+    wsaes_keystats_t ks;
+    wsaes_devstats_t ds;
+    wsaes_schedstats_t ss;
+    wsaes_tuning_t tu;
+
+    if (NULL == buf || 0 == len || SUCCESS != wsaes_ctrl(e, WSAES_CMD_GET_PERF_STATS, 0, &ps, NULL) ||
+        SUCCESS != wsaes_ctrl(e, WSAES_CMD_GET_TUNING, 0, &tu, NULL) ||
+        SUCCESS != wsaes_ctrl(e, WSAES_CMD_GET_KEY_STATS, 0, &ks, NULL) ||
+        SUCCESS != wsaes_ctrl(e, WSAES_CMD_GET_DEV_STATS, 0, &ds, NULL) ||
+        SUCCESS != wsaes_ctrl(e, WSAES_CMD_GET_SCHED_STATS, 0, &ss, NULL))
+        return 0;
+
+    const struct { const char *name; uint64_t value; } vals[] = {
+        {"enc_ops", ps.enc_ops}, {"enc_bytes", ps.enc_bytes}, {"dec_ops", ps.dec_ops}, {"dec_bytes", ps.dec_bytes},
+        {"sw_ops", ps.sw_ops}, {"sw_bytes", ps.sw_bytes}, {"key_inits", ps.key_inits},
+        {"dev_errors", ps.dev_errors}, {"keyloads", ks.keyloads}, {"keyloads_avoided", ks.keyloads_avoided},
+        {"ivloads", ks.ivloads}, {"keyslot_switches", ks.keyslot_switches},
+        {"keyslot_evictions", ks.keyslot_evictions}, {"sched_requests", ss.requests},
+        {"sched_batches", ss.batches}, {"sched_maxbatch", ss.maxbatch}, {"sched_keygroups", ss.keygroups},
+        {"sched_depth_sum", ss.depth_sum}, {"sched_maxdepth", ss.maxdepth}, {"sched_wait_ns", ss.wait_ns},
+        {"sched_maxwait_ns", ss.maxwait_ns}, {"sched_overflow_requests", ss.overflow_requests},
+        {"sched_overflow_bytes", ss.overflow_bytes}, {"elapsed_ns", ds.elapsed_ns}, {"ndevs", ds.ndevs},
+        {"sw_threshold", tu.sw_threshold}, {"pipeline_depth", tu.pipeline_depth}, {"chunk", tu.chunk},
+        {"tune_source", tu.source}, {"calibrate_ns", tu.calibrate_ns},
+    };
+
+    for (size_t v=0; v<sizeof(vals)/sizeof(vals[0]); v++)
+        wsaes_print(&o, json ? "%s\"%s\":%llu" : "%s%s %llu\n", (json && 0 == v) ? "{" : (json ? "," : ""),
+                    vals[v].name, (unsigned long long)vals[v].value);
+    if (json)
+        wsaes_print(&o, ",\"devices\":[");
+    for (uint32_t n=0; n<ds.ndevs; n++)
+    {
+        const wsaes_devstat_t *d = &ds.dev[n];
+        if (json)
+            wsaes_print(&o, "%s{\"bytes\":%llu,\"requests\":%llu,\"busy_ns\":%llu,\"contexts\":%llu}", n ? "," : "",
+                        (unsigned long long)d->bytes, (unsigned long long)d->requests,
+                        (unsigned long long)d->busy_ns, (unsigned long long)d->contexts);
+        else
+            wsaes_print(&o, "dev%u_bytes %llu\ndev%u_requests %llu\ndev%u_busy_ns %llu\ndev%u_contexts %llu\n",
+                        n, (unsigned long long)d->bytes, n, (unsigned long long)d->requests,
+                        n, (unsigned long long)d->busy_ns, n, (unsigned long long)d->contexts);
+    }
+    if (json)
+        wsaes_print(&o, "]");
+    wsaes_printhist(&o, "init_key", &ps.init_key, json);
+    wsaes_printhist(&o, "do_cipher", &ps.do_cipher, json);
+    if (json)
+        wsaes_print(&o, "}\n");
+    return (o.pos < len) ? SUCCESS : 0;
+}
+
+/* The performance counters of all the shards added up; the struct is all counters */
+static void wsaes_sumshards(wsaes_perfstats_t *ps)
+{
+    memset(ps, 0, sizeof(*ps));
+    for (int n=0; n<=WSAES_NSHARDS; n++)
+    {
+        uint64_t *from = (uint64_t*)&wsaes_shards[n].s, *to = (uint64_t*)ps;
+        for (size_t k=0; k<sizeof(*ps)/sizeof(uint64_t); k++)
+            to[k] += __atomic_load_n(&from[k], __ATOMIC_RELAXED);
+    }
+}
+
+/* Zero every counter; see WSAES_CMD_RESET_STATS */
+static void wsaes_resetstats(void)
+{
+    wsaes_perfstats_t base;
+
+    wsaes_sumshards(&base);
+    pthread_mutex_lock(&wsaes_statlock);
+    wsaes_statbase = base;
+    pthread_mutex_unlock(&wsaes_statlock);
+    for (int n=0; n<wsaes_ndevs; n++)
+    {
+        wsaes_device_t *d = &wsaes_devs[n];
+        pthread_mutex_lock(&d->lock);
+        memset(&d->keystats, 0, sizeof(d->keystats));
+        d->stat.bytes = d->stat.requests = d->stat.busy_ns = 0;
+        pthread_mutex_unlock(&d->lock);
+        pthread_mutex_lock(&d->schedlock);
+        memset(&d->schedstats, 0, sizeof(d->schedstats));
+        pthread_mutex_unlock(&d->schedlock);
+    }
+    wsaes_initns = wsaes_nowns();
+}
+
+static int wsaes_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f)(void))
+{
+    wsaes_keystats_t *ks = (wsaes_keystats_t*)p;
+    wsaes_devstats_t *ds = (wsaes_devstats_t*)p;
+    wsaes_schedstats_t *ss = (wsaes_schedstats_t*)p;
+    wsaes_perfstats_t *ps = (wsaes_perfstats_t*)p;
+
+    switch (cmd)
+    {
+        case WSAES_CMD_GET_KEY_STATS:
+            // summed over the devices
+            if (NULL == p)
+                return 0;
+            memset(ks, 0, sizeof(*ks));
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                pthread_mutex_lock(&wsaes_devs[n].lock);
+                ks->keyloads += wsaes_devs[n].keystats.keyloads;
+                ks->keyloads_avoided += wsaes_devs[n].keystats.keyloads_avoided;
+                ks->ivloads += wsaes_devs[n].keystats.ivloads;
+                ks->keyslot_switches += wsaes_devs[n].keystats.keyslot_switches;
+                ks->keyslot_evictions += wsaes_devs[n].keystats.keyslot_evictions;
+                pthread_mutex_unlock(&wsaes_devs[n].lock);
+            }
+            return SUCCESS;
+        case WSAES_CMD_GET_DEV_STATS:
+            if (NULL == p)
+                return 0;
+            memset(ds, 0, sizeof(*ds));
+            ds->ndevs = wsaes_ndevs;
+            ds->elapsed_ns = (wsaes_ndevs > 0) ? wsaes_nowns() - wsaes_initns : 0;
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                pthread_mutex_lock(&wsaes_ctxlock);
+                pthread_mutex_lock(&wsaes_devs[n].lock);
+                ds->dev[n] = wsaes_devs[n].stat;
+                pthread_mutex_unlock(&wsaes_devs[n].lock);
+                pthread_mutex_unlock(&wsaes_ctxlock);
+            }
+            return SUCCESS;
+        case WSAES_CMD_SW_THRESHOLD:
+            if (i < 0)
+                return 0;
+            __atomic_store_n(&wsaes_swthreshold, (size_t)i, __ATOMIC_RELAXED);
+            return SUCCESS;
+        case WSAES_CMD_PIPELINE_DEPTH:
+            if (i < 1)
+                return 0;
+            __atomic_store_n(&wsaes_pipedepth, (uint32_t)i, __ATOMIC_RELAXED);
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                pthread_mutex_lock(&wsaes_devs[n].lock);
+                aes256setdepth_sess(wsaes_devs[n].sess, (uint32_t)i);
+                pthread_mutex_unlock(&wsaes_devs[n].lock);
+            }
+            return SUCCESS;
+        case WSAES_CMD_SCHEDULER:
+            // only while no other thread is using the engine
+            if (i < 0 || i > 1)
+                return 0;
+            wsaes_schedon = (int)i;
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                if (wsaes_schedon)
+                    wsaes_sched_start(&wsaes_devs[n]);
+                else
+                    wsaes_sched_stop(&wsaes_devs[n]);
+            }
+            return SUCCESS;
+        case WSAES_CMD_SCHED_LATENCY:
+            if (i < 0)
+                return 0;
+            wsaes_schedlatency_ns = (uint64_t)i * 1000;
+            return SUCCESS;
+        case WSAES_CMD_SW_OVERFLOW:
+            if (i < 0 || i > 1)
+                return 0;
+            wsaes_swoverflow = (int)i;
+            return SUCCESS;
+        case WSAES_CMD_GET_SCHED_STATS:
+            // summed over the devices, the maxima over all of them
+            if (NULL == p)
+                return 0;
+            memset(ss, 0, sizeof(*ss));
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                wsaes_schedstats_t *t = &wsaes_devs[n].schedstats;
+                pthread_mutex_lock(&wsaes_devs[n].schedlock);
+                ss->requests += t->requests;
+                ss->batches += t->batches;
+                ss->keygroups += t->keygroups;
+                ss->depth_sum += t->depth_sum;
+                ss->wait_ns += t->wait_ns;
+                ss->overflow_requests += t->overflow_requests;
+                ss->overflow_bytes += t->overflow_bytes;
+                ss->maxbatch = (t->maxbatch > ss->maxbatch) ? t->maxbatch : ss->maxbatch;
+                ss->maxdepth = (t->maxdepth > ss->maxdepth) ? t->maxdepth : ss->maxdepth;
+                ss->maxwait_ns = (t->maxwait_ns > ss->maxwait_ns) ? t->maxwait_ns : ss->maxwait_ns;
+                pthread_mutex_unlock(&wsaes_devs[n].schedlock);
+            }
+            return SUCCESS;
+        case WSAES_CMD_GET_PERF_STATS:
+            // since the last reset
+            if (NULL == p)
+                return 0;
+            wsaes_sumshards(ps);
+            pthread_mutex_lock(&wsaes_statlock);
+            for (size_t k=0; k<sizeof(*ps)/sizeof(uint64_t); k++)
+                ((uint64_t*)ps)[k] -= ((uint64_t*)&wsaes_statbase)[k];
+            pthread_mutex_unlock(&wsaes_statlock);
+            return SUCCESS;
+        case WSAES_CMD_STATS:
+            if (i < 0 || i > 2)
+                return 0;
+            wsaes_statlevel = (int)i;
+            return SUCCESS;
+        case WSAES_CMD_RESET_STATS:
+            wsaes_resetstats();
+            return SUCCESS;
+        case WSAES_CMD_GET_STATS_TEXT:
+        case WSAES_CMD_GET_STATS_JSON:
+            if (i <= 0)
+                return 0;
+            return wsaes_snapshot(e, (char*)p, (size_t)i, WSAES_CMD_GET_STATS_JSON == cmd);
+        case WSAES_CMD_TRACE:
+            return (0 == aes256trace(0 != i)) ? SUCCESS : 0;
+        case WSAES_CMD_TRACE_DUMP:
+            return (NULL != p && 0 == aes256tracedump((const char*)p)) ? SUCCESS : 0;
+        case WSAES_CMD_CHUNK_SIZE:
+            if (i < 0 || i > UINT32_MAX)
+                return 0;
+            __atomic_store_n(&wsaes_chunk, (uint32_t)i, __ATOMIC_RELAXED);
+            for (int n=0; n<wsaes_ndevs; n++)
+            {
+                pthread_mutex_lock(&wsaes_devs[n].lock);
+                aes256setchunk_sess(wsaes_devs[n].sess, (uint32_t)i);
+                pthread_mutex_unlock(&wsaes_devs[n].lock);
+            }
+            return SUCCESS;
+        case WSAES_CMD_AUTOTUNE:
+            // only while no other thread is using the engine
+            if (i < 0 || i > 2)
+                return 0;
+            wsaes_autotune = (int)i;
+            if (0 != i && wsaes_ndevs > 0)
+                return wsaes_tune(2 == i);
+            return SUCCESS;
+        case WSAES_CMD_TUNE_CACHE:
+            if (NULL == p || strlen((const char*)p) >= sizeof(wsaes_tunecache))
+                return 0;
+            strcpy(wsaes_tunecache, (const char*)p);
+            return SUCCESS;
+        case WSAES_CMD_GET_TUNING:
+            {
+                wsaes_tuning_t *t = (wsaes_tuning_t*)p;
+                if (NULL == t)
+                    return 0;
+                *t = wsaes_tuning;
+                size_t threshold = __atomic_load_n(&wsaes_swthreshold, __ATOMIC_RELAXED);
+                t->sw_threshold = (SIZE_MAX == threshold) ? UINT64_MAX : threshold;
+                t->pipeline_depth = __atomic_load_n(&wsaes_pipedepth, __ATOMIC_RELAXED);
+                t->chunk = __atomic_load_n(&wsaes_chunk, __ATOMIC_RELAXED);
+            }
+            return SUCCESS;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * Engine destroy function: frees the cipher methods built in bind()
+ */
+static int wsaes_destroy(ENGINE *e)
+{
+    wsaes_destroy_ciphers();
+    // no thread may call into the library once it is unloaded, not even to give back its shard
+    if (wsaes_shardkeyset)
+    {
+        wsaes_shardkeyset = 0;
+        pthread_key_delete(wsaes_shardkey);
+    }
     return SUCCESS;
 }
 
 
+/*
+ * Initialise the devices' locks and condition variables, once per process: bind()
+ * runs again whenever the engine is loaded again, possibly while another ENGINE
+ * handle of it is still in use
+ */
+static pthread_once_t wsaes_devsonce = PTHREAD_ONCE_INIT;
+
+static void wsaes_initdevs(void)
+{
+	pthread_condattr_t monotonic; // the scheduler's deadlines are CLOCK_MONOTONIC, see wsaes_nowns()
+
+	pthread_condattr_init(&monotonic);
+	pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+	for (int i=0; i<WSAES_MAXDEVS; i++)
+	{
+		pthread_mutex_init(&wsaes_devs[i].lock, NULL);
+		pthread_mutex_init(&wsaes_devs[i].schedlock, NULL);
+		pthread_cond_init(&wsaes_devs[i].schedcond, &monotonic);
+		pthread_cond_init(&wsaes_devs[i].scheddonecond, NULL);
+#ifdef WSAES_ASYNC
+		pthread_mutex_init(&wsaes_devs[i].asynclock, NULL);
+		pthread_cond_init(&wsaes_devs[i].asynccond, NULL);
+		pthread_cond_init(&wsaes_devs[i].asyncdonecond, NULL);
+#endif
+	}
+	pthread_condattr_destroy(&monotonic);
+}
+
+
 /*
  *  Engine binding function
  */
@@ -241,6 +3171,10 @@ static int bind(ENGINE *e, const char *id)
 {
 	int ret = FAIL;
 
+	pthread_once(&wsaes_devsonce, wsaes_initdevs);
+	if (!wsaes_shardkeyset && 0 == pthread_key_create(&wsaes_shardkey, wsaes_shardexit))
+		wsaes_shardkeyset = 1;
+
 	if (!ENGINE_set_id(e, engine_id))
 	{
 		fprintf(stderr, "ENGINE_set_id failed\n");
@@ -261,11 +3195,21 @@ static int bind(ENGINE *e, const char *id)
 		fprintf(stderr,"ENGINE_set_finish_function failed\n"); 
 		goto end;
 	}
+	if (!wsaes_create_ciphers() || !ENGINE_set_destroy_function(e, wsaes_destroy))
+	{
+		fprintf(stderr,"failed to create the cipher methods\n");
+		goto end;
+	}
 	if (!ENGINE_set_ciphers(e, wsaesengine_cipher_selector)) 
 	{
 		fprintf(stderr,"ENGINE_set_digests failed\n");
 		goto end;
 	}
+	if (!ENGINE_set_ctrl_function(e, wsaes_ctrl) || !ENGINE_set_cmd_defns(e, wsaes_cmd_defns))
+	{
+		fprintf(stderr,"ENGINE_set_ctrl_function failed\n");
+		goto end;
+	}
 	ret = SUCCESS; 
 end: 
 	return ret; 
@@ -6,6 +6,28 @@ bindir="$projdir/bin"
 so_path="$bindir/libwsaesengine.so"
 test_exec="$bindir/wsaesenginetest"
 
+# Without the accelerator, run against the software model of the device
+if [ -z "$WSAES_BACKEND" ] && [ ! -e /dev/wsaeschar ] && [ ! -e /dev/wsaeschar0 ]; then
+    export WSAES_BACKEND=emu
+fi
+
+# Through the broker, start one on the device (or the software model) for the run,
+# unless WSAES_BROKER names one that is already running
+if [ "$WSAES_BACKEND" = "broker" ] && [ -z "$WSAES_BROKER" ]; then
+    devbackend=kernel
+    if [ ! -e /dev/wsaeschar ] && [ ! -e /dev/wsaeschar0 ]; then
+        devbackend=emu
+    fi
+    export WSAES_BROKER="${TMPDIR:-/tmp}/wsaesbroker.$$.sock"
+    WSAES_BACKEND=$devbackend "$bindir/wsaesbrokerd" -s "$WSAES_BROKER" &
+    broker_pid=$!
+    trap 'kill $broker_pid; wait $broker_pid' EXIT
+    for i in $(seq 50); do
+        [ -S "$WSAES_BROKER" ] && break
+        sleep 0.1
+    done
+fi
+
 echo "*******************************************"
 echo "Running test script:"
 echo "  $projdir/test/runtest.sh"
@@ -13,6 +35,10 @@ echo "From project directory:"
 echo "  $projdir"
 echo "With the following command and arguments:"
 echo "  $test_exec $so_path"
+echo "Using the ${WSAES_BACKEND:-kernel} device backend"
+if [ -n "$broker_pid" ]; then
+    echo "Through the broker at $WSAES_BROKER, on the $devbackend device backend"
+fi
 echo ""
 
 $test_exec $so_path
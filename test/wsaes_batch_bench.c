@@ -0,0 +1,197 @@
+/*
+ * Batch benchmark for the wsaes device API
+ *
+ * Encrypts a batch of independent jobs, like the pending records of many flows
+ * that share a handful of keys, each with its own IV and a length between one
+ * block and 16KB split over two buffers. The jobs run once as a loop of single
+ * calls (set the key, set the IV, reset, stream), and once through
+ * aes256batch_sess(), which loads every distinct key once and on a device with
+ * rings runs all the jobs under a key in one pass. Reports jobs per second, MB/s
+ * and device syscalls per batch for both. The first batch is checked against
+ * OpenSSL's software AES-256-CBC and AES-256-CTR.
+ *
+ * usage: wsaes_batch_bench [options]
+ *   --jobs n    jobs per batch (default 256)
+ *   --keys n    distinct keys among them (default 8)
+ *   --time ms   duration of every measurement (default 300)
+ */
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaeskern.h"
+
+#define MAXJOBLEN 16384
+
+static uint64_t total_syscalls(void)
+{
+    aes256syscalls_t cnt;
+    aes256getsyscalls(&cnt);
+    return cnt.open + cnt.close + cnt.ioctl + cnt.write + cnt.read;
+}
+
+/* The jobs one at a time, as a caller without the batch call runs them */
+static int32_t singles(wsaes_session_t *sess, wsaes_job_t *jobs, int njobs)
+{
+    int32_t ret;
+
+    for (int j=0; j<njobs; j++)
+    {
+        if (0 != (ret = aes256setkey_sess(sess, (uint8_t*)jobs[j].key)) ||
+            0 != (ret = aes256setiv_sess(sess, (uint8_t*)jobs[j].iv)) || 0 != (ret = aes256reset_sess(sess)) ||
+            0 != (ret = aes256streamv_sess(sess, jobs[j].mode, jobs[j].iov, jobs[j].niov)))
+            return ret;
+    }
+    return 0;
+}
+
+/* Encrypt every job's input with OpenSSL into ref, laid out like the jobs' buffers */
+static int softjobs(const wsaes_job_t *jobs, int njobs, const uint8_t *in, uint8_t *ref, const uint8_t *base)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len, ok = (NULL != ctx);
+
+    for (int j=0; j<njobs && ok; j++)
+    {
+        size_t off = jobs[j].iov[0].out - base;
+        size_t n = jobs[j].iov[0].len + jobs[j].iov[1].len;
+        ok = 1 == EVP_EncryptInit_ex(ctx, (CTR == jobs[j].mode) ? EVP_aes_256_ctr() : EVP_aes_256_cbc(), NULL,
+                                     jobs[j].key, jobs[j].iv) &&
+             1 == EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+             1 == EVP_EncryptUpdate(ctx, ref + off, &len, in + off, (int)n);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+/* Run batches with fn for duration_ns; prints jobs/s, MB/s and syscalls per batch */
+static int measure(const char *name, int32_t (*fn)(wsaes_session_t*, wsaes_job_t*, int), wsaes_session_t *sess,
+                   wsaes_job_t *jobs, int njobs, size_t bytes, uint64_t duration_ns)
+{
+    uint64_t t0, t1, batches = 0;
+    double secs;
+
+    aes256resetsyscalls();
+    t0 = t1 = now_ns();
+    for (; t1 - t0 < duration_ns; batches++)
+    {
+        if (0 != fn(sess, jobs, njobs))
+            return -1;
+        t1 = now_ns();
+    }
+    secs = (t1 - t0) / 1e9;
+    printf("%-8s %12.0f %10.1f %18.1f\n", name, batches * njobs / secs, batches * bytes / secs / 1e6,
+           (double)total_syscalls() / batches);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int njobs = 256, nkeys = 8;
+    uint64_t duration_ns = 300 * 1000000ULL;
+    size_t total = 0;
+    wsaes_session_t *sess;
+    wsaes_job_t *jobs;
+    wsaes_iov_t *iovs;
+    uint8_t *keys, *ivs, *in, *out, *ref;
+    int ctr;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--jobs") && i+1 < argc)
+            njobs = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "--keys") && i+1 < argc)
+            nkeys = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "--time") && i+1 < argc)
+            duration_ns = strtoull(argv[++i], NULL, 0) * 1000000ULL;
+        else
+            njobs = -1;
+    }
+    if (njobs <= 0 || nkeys <= 0 || 0 == duration_ns)
+    {
+        fprintf(stderr, "usage: %s [--jobs n] [--keys n] [--time ms]\n", argv[0]);
+        return 1;
+    }
+
+    if (0 != aes256init() || 0 != aes256open(&sess))
+        return 1;
+    ctr = 0 != (aes256caps_sess(sess) & WSAES_CAP_CTR);
+    jobs = calloc(njobs, sizeof(*jobs));
+    iovs = calloc(2 * (size_t)njobs, sizeof(*iovs));
+    keys = malloc((size_t)nkeys * AESKEYSIZE);
+    ivs = malloc((size_t)njobs * AESIVSIZE);
+    in = malloc((size_t)njobs * MAXJOBLEN);
+    out = malloc((size_t)njobs * MAXJOBLEN);
+    ref = malloc((size_t)njobs * MAXJOBLEN);
+    if (NULL == jobs || NULL == iovs || NULL == keys || NULL == ivs || NULL == in || NULL == out || NULL == ref)
+    {
+        fprintf(stderr, "ERROR: could not allocate %d jobs\n", njobs);
+        return 1;
+    }
+    for (size_t j=0; j<(size_t)nkeys * AESKEYSIZE; j++)
+        keys[j] = (uint8_t)(j * 7 + 1);
+    for (size_t j=0; j<(size_t)njobs * AESIVSIZE; j++)
+        ivs[j] = (uint8_t)(j * 11 + 3);
+    for (size_t j=0; j<(size_t)njobs * MAXJOBLEN; j++)
+        in[j] = (uint8_t)(j * 13 + 5);
+
+    // flows take turns with the keys, so consecutive jobs rarely share one
+    srand(1);
+    for (int j=0; j<njobs; j++)
+    {
+        size_t len = AESBLKSIZE * (1 + rand() % (MAXJOBLEN / AESBLKSIZE));
+        size_t first = AESBLKSIZE * (rand() % (len / AESBLKSIZE + 1));
+        uint8_t *buf = out + (size_t)j * MAXJOBLEN;
+
+        memcpy(buf, in + (size_t)j * MAXJOBLEN, len);
+        iovs[2 * j] = (wsaes_iov_t){ buf, buf, first };
+        iovs[2 * j + 1] = (wsaes_iov_t){ buf + first, buf + first, len - first };
+        jobs[j] = (wsaes_job_t){ (ctr && (j & 1)) ? CTR : ENCRYPT, keys + (j % nkeys) * AESKEYSIZE,
+                                 ivs + j * AESIVSIZE, &iovs[2 * j], 2, 0 };
+        total += len;
+    }
+
+    // the first batch is checked against the software result
+    if (0 != aes256batch_sess(sess, jobs, njobs) || 0 != softjobs(jobs, njobs, in, ref, out))
+    {
+        fprintf(stderr, "ERROR: the first batch failed\n");
+        return 1;
+    }
+    for (int j=0; j<njobs; j++)
+    {
+        size_t off = (size_t)j * MAXJOBLEN, n = jobs[j].iov[0].len + jobs[j].iov[1].len;
+        if (0 != memcmp(out + off, ref + off, n))
+        {
+            fprintf(stderr, "ERROR: job %d differs from software\n", j);
+            return 1;
+        }
+    }
+
+    printf("%d jobs of %.0f bytes on average under %d keys, %s, rings %s\n", njobs, (double)total / njobs, nkeys,
+           ctr ? "CBC and CTR" : "CBC", (aes256caps_sess(sess) & WSAES_CAP_RING) ? "on" : "off");
+    printf("           jobs/s       MB/s   syscalls/batch\n");
+    // the buffers are encrypted in place over and over, the data doesn't matter any more
+    if (0 != measure("single", singles, sess, jobs, njobs, total, duration_ns) ||
+        0 != measure("batch", aes256batch_sess, sess, jobs, njobs, total, duration_ns))
+    {
+        fprintf(stderr, "ERROR: a batch failed\n");
+        return 1;
+    }
+
+    free(jobs);
+    free(iovs);
+    free(keys);
+    free(ivs);
+    free(in);
+    free(out);
+    free(ref);
+    aes256close(sess);
+    return 0;
+}
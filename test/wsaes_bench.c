@@ -0,0 +1,335 @@
+/*
+ * Throughput/latency benchmark for the wsaes engine
+ *
+ * Sweeps payload sizes and thread counts, for encryption and decryption, through
+ * the engine and through OpenSSL's software AES-256-CBC. Each thread has its own
+ * context and times every EVP_CipherUpdate call. Results (ops/s, MB/s and
+ * p50/p99/p999 latency) are written as JSON, one result object per line.
+ *
+ * With --baseline, results are compared against a file written by an earlier run
+ * and the program exits non-zero if any engine throughput has dropped by more
+ * than the tolerance. `make bench` runs it this way against test/bench_baseline.json.
+ *
+ * usage: wsaes_bench [options] /path/to/libwsaesengine.so
+ *   --sizes a,b,...     payload sizes in bytes (default 16 B to 1 MB, powers of 4)
+ *   --threads a,b,...   thread counts (default 1,2,4)
+ *   --time ms           measuring time per point (default 200)
+ *   --json file         write the results here instead of stdout
+ *   --baseline file     fail on regressions against this earlier output
+ *   --tolerance frac    allowed throughput drop, e.g. 0.15 for 15% (default 0.15)
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+#define MAXPOINTS 32
+#define MAXSAMPLES 65536 // latency samples kept per thread
+#define MAXRESULTS 1024
+
+typedef struct {
+    char impl[16];
+    char dir[16];
+    size_t size;
+    int threads;
+    uint64_t ops;
+    double ops_per_sec;
+    double mb_per_sec;
+    double p50_us, p99_us, p999_us;
+} result_t;
+
+/* One measuring thread */
+typedef struct {
+    ENGINE *eng;
+    int enc;
+    size_t size;
+    uint64_t duration_ns;
+    pthread_barrier_t *start;
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    uint32_t nsamples;
+    uint64_t *samples;
+    int failed;
+} worker_t;
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint8_t *in = malloc(w->size), *out = malloc(w->size + AESBLKSIZE);
+    uint64_t t0, t1, end;
+    int len;
+
+    w->failed = (NULL == ctx || NULL == in || NULL == out ||
+                 1 != EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), w->eng, key, iv, w->enc));
+    if (!w->failed)
+    {
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        memset(in, 0xA5, w->size);
+    }
+
+    pthread_barrier_wait(w->start);
+    t0 = now_ns();
+    end = t0 + w->duration_ns;
+    for (t1 = t0; !w->failed && (t1 < end || w->ops < 4); w->ops++)
+    {
+        uint64_t t = t1;
+        if (1 != EVP_CipherUpdate(ctx, out, &len, in, (int)w->size))
+            w->failed = 1;
+        t1 = now_ns();
+        if (w->nsamples < MAXSAMPLES)
+            w->samples[w->nsamples++] = t1 - t;
+    }
+    w->elapsed_ns = t1 - t0;
+
+    EVP_CIPHER_CTX_free(ctx);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t n, double p)
+{
+    uint64_t i = (uint64_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+/* Run one point of the sweep with nthreads threads */
+static int run_point(ENGINE *eng, const char *impl, int enc, size_t size, int nthreads, uint64_t duration_ns,
+                     result_t *res)
+{
+    worker_t w[nthreads];
+    pthread_t tid[nthreads];
+    pthread_barrier_t start;
+    uint64_t *samples, nsamples = 0, ops = 0, elapsed = 0;
+    int failed = 0;
+
+    samples = malloc((size_t)nthreads * MAXSAMPLES * sizeof(uint64_t));
+    if (NULL == samples)
+        return -1;
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (int i=0; i<nthreads; i++)
+    {
+        w[i] = (worker_t){ .eng = eng, .enc = enc, .size = size, .duration_ns = duration_ns, .start = &start,
+                           .samples = samples + (size_t)i * MAXSAMPLES };
+        pthread_create(&tid[i], NULL, worker_main, &w[i]);
+    }
+
+    // pack all threads' samples together, then sort them for the percentiles
+    for (int i=0; i<nthreads; i++)
+    {
+        pthread_join(tid[i], NULL);
+        failed |= w[i].failed;
+        ops += w[i].ops;
+        if (w[i].elapsed_ns > elapsed)
+            elapsed = w[i].elapsed_ns;
+        memmove(samples + nsamples, w[i].samples, w[i].nsamples * sizeof(uint64_t));
+        nsamples += w[i].nsamples;
+    }
+    pthread_barrier_destroy(&start);
+    if (failed)
+    {
+        fprintf(stderr, "ERROR: %s %s of %zu bytes failed\n", impl, enc ? "encrypt" : "decrypt", size);
+        free(samples);
+        return -1;
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+
+    snprintf(res->impl, sizeof(res->impl), "%s", impl);
+    snprintf(res->dir, sizeof(res->dir), "%s", enc ? "encrypt" : "decrypt");
+    res->size = size;
+    res->threads = nthreads;
+    res->ops = ops;
+    res->ops_per_sec = ops * 1e9 / elapsed;
+    res->mb_per_sec = res->ops_per_sec * size / 1e6;
+    res->p50_us = percentile_us(samples, nsamples, 0.50);
+    res->p99_us = percentile_us(samples, nsamples, 0.99);
+    res->p999_us = percentile_us(samples, nsamples, 0.999);
+    free(samples);
+    return 0;
+}
+
+/* Keep the field order fixed: read_results() relies on it */
+static void write_result(FILE *f, const result_t *r, int last)
+{
+    fprintf(f, "    {\"impl\": \"%s\", \"dir\": \"%s\", \"size\": %zu, \"threads\": %d, \"ops\": %llu, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}%s\n",
+            r->impl, r->dir, r->size, r->threads, (unsigned long long)r->ops, r->ops_per_sec, r->mb_per_sec,
+            r->p50_us, r->p99_us, r->p999_us, last ? "" : ",");
+}
+
+static int read_results(const char *path, result_t *res, int maxres)
+{
+    char line[512];
+    unsigned long long ops;
+    int n = 0;
+    FILE *f = fopen(path, "r");
+
+    if (NULL == f)
+    {
+        perror("ERROR: could not open baseline");
+        return -1;
+    }
+    while (n < maxres && NULL != fgets(line, sizeof(line), f))
+    {
+        result_t *r = &res[n];
+        if (10 == sscanf(line, " {\"impl\": \"%15[^\"]\", \"dir\": \"%15[^\"]\", \"size\": %zu, \"threads\": %d, "
+                         "\"ops\": %llu, \"ops_per_sec\": %lf, \"mb_per_sec\": %lf, \"p50_us\": %lf, \"p99_us\": %lf, "
+                         "\"p999_us\": %lf", r->impl, r->dir, &r->size, &r->threads, &ops, &r->ops_per_sec,
+                         &r->mb_per_sec, &r->p50_us, &r->p99_us, &r->p999_us))
+        {
+            r->ops = ops;
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+/* Compare engine results against the baseline, returning the number of regressions */
+static int check_regressions(const result_t *res, int nres, const result_t *base, int nbase, double tolerance)
+{
+    int regressions = 0, compared = 0;
+
+    for (int i=0; i<nres; i++)
+    {
+        if (0 != strcmp(res[i].impl, "engine"))
+            continue;
+        for (int j=0; j<nbase; j++)
+        {
+            if (0 != strcmp(res[i].impl, base[j].impl) || 0 != strcmp(res[i].dir, base[j].dir) ||
+                res[i].size != base[j].size || res[i].threads != base[j].threads)
+                continue;
+            compared++;
+            if (res[i].mb_per_sec < base[j].mb_per_sec * (1.0 - tolerance))
+            {
+                regressions++;
+                fprintf(stderr, "REGRESSION: %s %s %zu B x%d: %.3f MB/s, baseline %.3f MB/s\n", res[i].impl,
+                        res[i].dir, res[i].size, res[i].threads, res[i].mb_per_sec, base[j].mb_per_sec);
+            }
+        }
+    }
+    fprintf(stderr, "%d results compared against the baseline, %d regressions (tolerance %.0f%%)\n",
+            compared, regressions, tolerance * 100);
+    return regressions;
+}
+
+static int parse_list(const char *s, long *vals, int maxvals)
+{
+    int n = 0;
+    char *end;
+    while (n < maxvals && '\0' != *s)
+    {
+        vals[n] = strtol(s, &end, 0);
+        if (end == s || vals[n] <= 0)
+            return -1;
+        n++;
+        s = (',' == *end) ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[])
+{
+    long sizes[MAXPOINTS] = { 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+    long threads[MAXPOINTS] = { 1, 2, 4 };
+    int nsizes = 9, nthreads = 3;
+    uint64_t duration_ns = 200 * 1000000ULL;
+    const char *jsonpath = NULL, *basepath = NULL, *so_path = NULL;
+    double tolerance = 0.15;
+    static result_t res[MAXRESULTS], base[MAXRESULTS];
+    int nres = 0, nbase;
+    ENGINE *eng;
+    FILE *out = stdout;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--sizes") && i+1 < argc)
+            nsizes = parse_list(argv[++i], sizes, MAXPOINTS);
+        else if (0 == strcmp(argv[i], "--threads") && i+1 < argc)
+            nthreads = parse_list(argv[++i], threads, MAXPOINTS);
+        else if (0 == strcmp(argv[i], "--time") && i+1 < argc)
+            duration_ns = strtoull(argv[++i], NULL, 0) * 1000000ULL;
+        else if (0 == strcmp(argv[i], "--json") && i+1 < argc)
+            jsonpath = argv[++i];
+        else if (0 == strcmp(argv[i], "--baseline") && i+1 < argc)
+            basepath = argv[++i];
+        else if (0 == strcmp(argv[i], "--tolerance") && i+1 < argc)
+            tolerance = strtod(argv[++i], NULL);
+        else if ('-' != argv[i][0])
+            so_path = argv[i];
+        else
+            so_path = NULL, i = argc;
+    }
+    if (NULL == so_path || nsizes <= 0 || nthreads <= 0)
+    {
+        fprintf(stderr, "usage: %s [--sizes a,b,..] [--threads a,b,..] [--time ms] [--json file] "
+                "[--baseline file] [--tolerance frac] /path/to/libwsaesengine.so\n", argv[0]);
+        return 2;
+    }
+
+    OpenSSL_add_all_algorithms();
+    ERR_load_crypto_strings();
+    if (NULL == (eng = load_engine(so_path)))
+        return 2;
+
+    for (int s=0; s<nsizes; s++)
+    {
+        if (sizes[s] % AESBLKSIZE != 0)
+        {
+            fprintf(stderr, "ERROR: size %ld is not a multiple of %d\n", sizes[s], AESBLKSIZE);
+            return 2;
+        }
+        for (int t=0; t<nthreads; t++)
+            for (int enc=1; enc>=0; enc--)
+                for (int impl=0; impl<2 && nres<MAXRESULTS; impl++)
+                {
+                    if (0 != run_point(impl ? NULL : eng, impl ? "software" : "engine", enc, sizes[s],
+                                       (int)threads[t], duration_ns, &res[nres]))
+                        return 1;
+                    fprintf(stderr, "%-8s %-7s %8ld B x%-2ld %12.1f ops/s %10.2f MB/s  p50 %9.2f us  p99 %9.2f us\n",
+                            res[nres].impl, res[nres].dir, sizes[s], threads[t], res[nres].ops_per_sec,
+                            res[nres].mb_per_sec, res[nres].p50_us, res[nres].p99_us);
+                    nres++;
+                }
+    }
+
+    if (NULL != jsonpath && NULL == (out = fopen(jsonpath, "w")))
+    {
+        perror("ERROR: could not write results");
+        return 1;
+    }
+    fprintf(out, "{\n  \"benchmark\": \"wsaes_bench\",\n  \"backend\": \"%s\",\n  \"results\": [\n",
+            getenv("WSAES_BACKEND") ? getenv("WSAES_BACKEND") : "kernel");
+    for (int i=0; i<nres; i++)
+        write_result(out, &res[i], i == nres-1);
+    fprintf(out, "  ]\n}\n");
+    if (stdout != out)
+        fclose(out);
+
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+
+    if (NULL != basepath)
+    {
+        if ((nbase = read_results(basepath, base, MAXRESULTS)) < 0)
+            return 1;
+        if (0 != check_regressions(res, nres, base, nbase, tolerance))
+            return 1;
+    }
+    return 0;
+}
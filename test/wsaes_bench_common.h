@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * What the benchmarks, test/wsaes_*_bench.c, share: the engine id and how to
+ * load the engine, the clock they measure with, and the key and IV they encrypt
+ * with unless they need several. Whatever a benchmark doesn't use costs nothing.
+ */
+#include <openssl/engine.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+
+static const char* engine_id __attribute__((unused)) = "wsaesengine";
+
+static const uint8_t key[AESKEYSIZE] __attribute__((unused)) = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F };
+static const uint8_t iv[AESIVSIZE] __attribute__((unused)) = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline ENGINE *load_engine(const char *so_path)
+{
+    ENGINE *eng;
+
+    // load the engine through the dynamic engine, see wsaesengine_test.c
+    ENGINE_load_dynamic();
+    eng = ENGINE_by_id("dynamic");
+    if (NULL == eng || !ENGINE_ctrl_cmd_string(eng, "SO_PATH", so_path, 0) ||
+        !ENGINE_ctrl_cmd_string(eng, "ID", engine_id, 0) || !ENGINE_ctrl_cmd_string(eng, "LOAD", NULL, 0) ||
+        !ENGINE_init(eng))
+    {
+        fprintf(stderr, "ERROR: could not load engine %s\n", so_path);
+        return NULL;
+    }
+    return eng;
+}
@@ -0,0 +1,240 @@
+/*
+ * Broker benchmark for the wsaes engine
+ *
+ * N worker processes, each loading the engine with its own key and encrypting
+ * fixed-size records on the device for a fixed time, like the workers of a server.
+ * Runs every process count with each process using the device directly and with
+ * all of them going through the broker daemon (bin/wsaesbrokerd, next to the
+ * engine), and reports the aggregate throughput and how many transfers the broker
+ * ran per batch. The first record of every process is checked against OpenSSL.
+ *
+ * Without the accelerator the devices are the emulator's. For direct access its
+ * devices are shared between the processes (WSAES_EMU_SHARED), so they take the
+ * device's processing time in turn as they would on one board, though unlike the
+ * board they keep registers of their own; on the hardware, processes using the
+ * device directly at the same time overwrite each other's key and IV.
+ *
+ * usage: wsaes_broker_bench /path/to/libwsaesengine.so [record bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaesengine.h"
+
+#define MAXPROCS 8
+
+/* What a worker process reports, in memory shared with the parent */
+typedef struct {
+    uint64_t bytes;
+    int failed;
+} result_t;
+
+/*
+ * A worker process: load the engine, wait for the start (the parent closing the
+ * other end of startfd), then encrypt records until the time is up
+ */
+static void worker(const char *so_path, int id, int startfd, size_t size, uint64_t duration_ns, result_t *res)
+{
+    uint8_t key[AESKEYSIZE], iv[AESIVSIZE] = { 0 }, *in = malloc(size), *out = malloc(size + AESBLKSIZE),
+            *ref = malloc(size + AESBLKSIZE);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new(), *refctx = EVP_CIPHER_CTX_new();
+    ENGINE *eng = load_engine(so_path);
+    uint64_t end;
+    char c;
+    int len, reflen;
+
+    res->failed = 1;
+    for (int i=0; i<AESKEYSIZE; i++)
+        key[i] = (uint8_t)(id * 31 + i);
+    for (size_t i=0; NULL != in && i<size; i++)
+        in[i] = (uint8_t)(i + id);
+    if (NULL == eng || NULL == ctx || NULL == refctx || NULL == in || NULL == out || NULL == ref)
+        return;
+    // send every record to the device, however small
+    ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0);
+    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, key, iv) ||
+        1 != EVP_EncryptInit_ex(refctx, EVP_aes_256_cbc(), NULL, key, iv))
+        return;
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    EVP_CIPHER_CTX_set_padding(refctx, 0);
+
+    if (read(startfd, &c, 1) < 0)
+        return;
+    end = now_ns() + duration_ns;
+    if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)size) ||
+        1 != EVP_EncryptUpdate(refctx, ref, &reflen, in, (int)size) || len != reflen || 0 != memcmp(out, ref, len))
+    {
+        fprintf(stderr, "ERROR: process %d got the wrong ciphertext\n", id);
+        return;
+    }
+    res->bytes = len;
+    while (now_ns() < end)
+    {
+        if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)size))
+            return;
+        res->bytes += len;
+    }
+    // the process exits right away, without unloading the engine under the emulator's threads
+    res->failed = 0;
+}
+
+/* Run nprocs workers together, returning their throughput in MB/s, or -1 */
+static double run(const char *so_path, int nprocs, size_t size, uint64_t duration_ns, result_t *res)
+{
+    uint64_t bytes = 0;
+    int start[2], status, failed = 0;
+    pid_t pids[MAXPROCS];
+
+    if (pipe(start) < 0)
+        return -1;
+    memset(res, 0, nprocs * sizeof(*res));
+    for (int i=0; i<nprocs; i++)
+    {
+        if ((pids[i] = fork()) < 0)
+        {
+            perror("ERROR: fork failed");
+            return -1;
+        }
+        if (0 == pids[i])
+        {
+            close(start[1]);
+            worker(so_path, i, start[0], size, duration_ns, &res[i]);
+            _exit(res[i].failed);
+        }
+    }
+    // closing the write end lets them all go at once
+    close(start[0]);
+    close(start[1]);
+    for (int i=0; i<nprocs; i++)
+    {
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status) || res[i].failed)
+            failed = 1;
+        bytes += res[i].bytes;
+    }
+    return failed ? -1 : bytes / (duration_ns / 1e9) / 1e6;
+}
+
+/* Start the broker on the device backend, with its summary going into *summaryfd */
+static pid_t startbroker(const char *daemon, const char *sock, const char *devbackend, int *summaryfd)
+{
+    struct stat st;
+    int out[2];
+    pid_t pid;
+
+    if (pipe(out) < 0 || (pid = fork()) < 0)
+        return -1;
+    if (0 == pid)
+    {
+        close(out[0]);
+        dup2(out[1], STDOUT_FILENO);
+        setenv("WSAES_BACKEND", devbackend, 1);
+        execl(daemon, daemon, "-s", sock, (char*)NULL);
+        perror("ERROR: could not run the broker");
+        _exit(1);
+    }
+    close(out[1]);
+    *summaryfd = out[0];
+    for (int i=0; i<100 && (0 != stat(sock, &st) || !S_ISSOCK(st.st_mode)); i++)
+        usleep(20000);
+    return pid;
+}
+
+/* Stop the broker, returning the transfers it ran per batch */
+static double stopbroker(pid_t pid, int summaryfd)
+{
+    char buf[256];
+    const char *p;
+    double perbatch = 0;
+    ssize_t n;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    n = read(summaryfd, buf, sizeof(buf) - 1);
+    close(summaryfd);
+    buf[(n > 0) ? n : 0] = '\0';
+    if (NULL != (p = strchr(buf, '(')))
+        perbatch = strtod(p + 1, NULL);
+    return perbatch;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int proccounts[] = { 1, 2, 4, MAXPROCS };
+    const char *devbackend = getenv("WSAES_BACKEND");
+    char daemon[PATH_MAX], sock[64], dir[PATH_MAX];
+    uint64_t duration_ns = 500 * 1000000ULL;
+    size_t size = 16384;
+    result_t *res;
+    int failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [record bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        size = strtoul(argv[2], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 3)
+        duration_ns = strtoull(argv[3], NULL, 0) * 1000000ULL;
+    if (size < AESBLKSIZE)
+    {
+        fprintf(stderr, "ERROR: need at least one block per record\n");
+        return 1;
+    }
+    if (NULL == devbackend || 0 == strcmp(devbackend, "broker"))
+        devbackend = (0 == access("/dev/wsaeschar", F_OK) || 0 == access("/dev/wsaeschar0", F_OK)) ? "kernel" : "emu";
+    snprintf(dir, sizeof(dir), "%s", argv[1]);
+    snprintf(daemon, sizeof(daemon), "%s/wsaesbrokerd", dirname(dir));
+    snprintf(sock, sizeof(sock), "/tmp/wsaes_broker_bench.%d.sock", (int)getpid());
+    res = mmap(NULL, MAXPROCS * sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == res)
+    {
+        perror("ERROR: could not map the results");
+        return 1;
+    }
+
+    printf("%zu byte records, one key per process, %s device backend\n", size, devbackend);
+    printf("processes  direct MB/s  broker MB/s transfers/batch\n");
+    fflush(stdout);
+    for (size_t i=0; i<sizeof(proccounts)/sizeof(proccounts[0]); i++)
+    {
+        double direct, brokered, perbatch;
+        int summaryfd;
+        pid_t broker;
+
+        setenv("WSAES_BACKEND", devbackend, 1);
+        setenv("WSAES_EMU_SHARED", "1", 1);
+        direct = run(argv[1], proccounts[i], size, duration_ns, res);
+        unsetenv("WSAES_EMU_SHARED");
+
+        if ((broker = startbroker(daemon, sock, devbackend, &summaryfd)) < 0)
+        {
+            perror("ERROR: could not start the broker");
+            return 1;
+        }
+        setenv("WSAES_BACKEND", "broker", 1);
+        setenv("WSAES_BROKER", sock, 1);
+        brokered = run(argv[1], proccounts[i], size, duration_ns, res);
+        perbatch = stopbroker(broker, summaryfd);
+
+        failed |= (direct < 0 || brokered < 0);
+        printf("%9d %12.1f %12.1f %15.2f\n", proccounts[i], direct, brokered, perbatch);
+        fflush(stdout);
+    }
+    return failed;
+}
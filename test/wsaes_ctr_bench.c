@@ -0,0 +1,123 @@
+/*
+ * AES-256-CTR scaling benchmark for the wsaes engine
+ *
+ * One thread encrypts large updates through a single context, with AES-256-CTR
+ * and then with AES-256-CBC, against the emulator with 1, 2, 4 and 8 devices.
+ * The engine splits every CTR update into counter ranges that run on all the
+ * devices at once, so CTR should scale with the device count; a CBC stream is
+ * serial and stays on one device. Every device count runs in a fresh child
+ * process, since the emulator and the engine pick it up when they are initialised.
+ *
+ * usage: wsaes_ctr_bench /path/to/libwsaesengine.so [update bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+/* Encryption throughput in MB/s of updates of size bytes for duration_ns, -1 on failure */
+static double run(ENGINE *eng, const EVP_CIPHER *cipher, uint8_t *in, uint8_t *out, size_t size, uint64_t duration_ns)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint64_t t0, t1, bytes = 0;
+    int len;
+
+    if (NULL == ctx || 1 != EVP_EncryptInit_ex(ctx, cipher, eng, key, iv))
+        return -1;
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    t0 = t1 = now_ns();
+    while (t1 - t0 < duration_ns)
+    {
+        if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)size))
+        {
+            EVP_CIPHER_CTX_free(ctx);
+            return -1;
+        }
+        bytes += len;
+        t1 = now_ns();
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return bytes / ((t1 - t0) / 1e9) / 1e6;
+}
+
+/* Run both ciphers against ndevs emulated devices; called in a child process */
+static int run_devs(const char *so_path, int ndevs, size_t size, uint64_t duration_ns)
+{
+    char devs[16];
+    double ctr, cbc;
+    uint8_t *in = calloc(1, size), *out = malloc(size + AESBLKSIZE);
+    ENGINE *eng;
+
+    snprintf(devs, sizeof(devs), "%d", ndevs);
+    setenv("WSAES_BACKEND", "emu", 1);
+    setenv("WSAES_EMU_DEVICES", devs, 1);
+    if (NULL == in || NULL == out || NULL == (eng = load_engine(so_path)))
+        return -1;
+
+    if ((ctr = run(eng, EVP_aes_256_ctr(), in, out, size, duration_ns)) < 0 ||
+        (cbc = run(eng, EVP_aes_256_cbc(), in, out, size, duration_ns)) < 0)
+    {
+        fprintf(stderr, "ERROR: encryption failed with %d devices\n", ndevs);
+        return -1;
+    }
+    printf("%7d %14.1f %14.1f\n", ndevs, ctr, cbc);
+    fflush(stdout);
+
+    free(in);
+    free(out);
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int devcounts[] = { 1, 2, 4, 8 };
+    size_t size = 4 * AESMAXDATASIZE;
+    uint64_t duration_ns = 500 * 1000000ULL;
+    int status, failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [update bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        size = strtoul(argv[2], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 3)
+        duration_ns = strtoull(argv[3], NULL, 0) * 1000000ULL;
+    if (size < AESBLKSIZE || size > 0x7FFFFFF0)
+    {
+        fprintf(stderr, "ERROR: update size must be at least one block and fit an int\n");
+        return 1;
+    }
+
+    printf("%zu byte updates through one context, emulated devices at %s MB/s each\n", size,
+           getenv("WSAES_EMU_MBPS") ? getenv("WSAES_EMU_MBPS") : "200");
+    printf("devices   CTR MB/s       CBC MB/s\n");
+    fflush(stdout);
+    for (size_t i=0; i<sizeof(devcounts)/sizeof(devcounts[0]); i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("ERROR: fork failed");
+            return 1;
+        }
+        if (0 == pid)
+            _exit(0 == run_devs(argv[1], devcounts[i], size, duration_ns) ? 0 : 1);
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+            failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,105 @@
+/*
+ * Per-context memory benchmark for the wsaes engine
+ *
+ * Creates N AES-256-CBC EVP_CIPHER_CTXs, initialises each one for encryption,
+ * and reports the heap and resident memory used per context, first with
+ * OpenSSL's own software implementation and then with the engine.
+ *
+ * usage: wsaes_ctxmem_bench /path/to/libwsaesengine.so [contexts]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+#define DEFAULT_NCTX 10000
+
+/* Heap bytes currently allocated */
+static size_t heap_bytes(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+/* Resident set size in bytes */
+static size_t rss_bytes(void)
+{
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (NULL != f)
+    {
+        if (2 != fscanf(f, "%lu %lu", &size, &resident))
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Create and initialise nctx contexts, report memory per context, then free them */
+static int measure(const char *label, ENGINE *eng, int nctx)
+{
+    EVP_CIPHER_CTX **ctxs;
+    size_t heap0, rss0, heap1, rss1;
+    int ret = -1;
+
+    ctxs = calloc(nctx, sizeof(*ctxs));
+    if (NULL == ctxs)
+        return -1;
+
+    heap0 = heap_bytes();
+    rss0 = rss_bytes();
+    for (int i=0; i<nctx; i++)
+    {
+        ctxs[i] = EVP_CIPHER_CTX_new();
+        if (NULL == ctxs[i] ||
+            1 != EVP_EncryptInit_ex(ctxs[i], EVP_aes_256_cbc(), eng, (unsigned char*)key, (unsigned char*)iv))
+        {
+            fprintf(stderr, "ERROR: failed to initialise context %d (%s)\n", i, label);
+            goto end;
+        }
+    }
+    heap1 = heap_bytes();
+    rss1 = rss_bytes();
+
+    printf("%-10s %10d %16.1f %16.1f\n", label, nctx,
+           (double)(heap1 - heap0) / nctx, (double)(rss1 - rss0) / nctx);
+    ret = 0;
+end:
+    for (int i=0; i<nctx; i++)
+        EVP_CIPHER_CTX_free(ctxs[i]);
+    free(ctxs);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int nctx = (argc > 2) ? atoi(argv[2]) : DEFAULT_NCTX;
+    ENGINE *eng;
+
+    if (argc < 2 || nctx <= 0)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [contexts]\n", argv[0]);
+        return 1;
+    }
+
+    OpenSSL_add_all_algorithms();
+    ERR_load_crypto_strings();
+
+    if (NULL == (eng = load_engine(argv[1])))
+        return 1;
+
+    printf("%-10s %10s %16s %16s\n", "impl", "contexts", "heap B/ctx", "rss B/ctx");
+    if (0 != measure("software", NULL, nctx) || 0 != measure("engine", eng, nctx))
+        return 1;
+
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Multi-device scaling benchmark for the wsaes engine
+ *
+ * Runs the same load against the emulator with 1, 2, 4 and 8 devices: a number of
+ * threads, each with its own context, encrypting fixed-size records through the
+ * engine for a fixed time. Every device count runs in a fresh child process, since
+ * the emulator and the engine pick up the device count when they are initialised.
+ * Prints the aggregate throughput and the utilization of every device, as reported
+ * by the engine's GET_DEV_STATS control command.
+ *
+ * usage: wsaes_devscale_bench /path/to/libwsaesengine.so [threads] [record bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaesengine.h"
+
+/* One encrypting thread */
+typedef struct {
+    ENGINE *eng;
+    size_t size;
+    uint64_t duration_ns;
+    pthread_barrier_t *start;
+    uint64_t bytes;
+    int failed;
+} worker_t;
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint8_t *in = calloc(1, w->size), *out = malloc(w->size + AESBLKSIZE);
+    uint64_t end;
+    int len;
+
+    w->failed = (NULL == ctx || NULL == in || NULL == out ||
+                 1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), w->eng, key, iv));
+    if (!w->failed)
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    pthread_barrier_wait(w->start);
+    end = now_ns() + w->duration_ns;
+    while (!w->failed && now_ns() < end)
+    {
+        if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)w->size))
+            w->failed = 1;
+        w->bytes += len;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/* Run the load against ndevs emulated devices; called in a child process */
+static int run(const char *so_path, int ndevs, int nthreads, size_t size, uint64_t duration_ns)
+{
+    char devs[16];
+    worker_t w[nthreads];
+    pthread_t tid[nthreads];
+    pthread_barrier_t start;
+    wsaes_devstats_t stats;
+    uint64_t bytes = 0, t0, elapsed;
+    int failed = 0;
+    ENGINE *eng;
+
+    snprintf(devs, sizeof(devs), "%d", ndevs);
+    setenv("WSAES_BACKEND", "emu", 1);
+    setenv("WSAES_EMU_DEVICES", devs, 1);
+    if (NULL == (eng = load_engine(so_path)))
+        return -1;
+    // send every record to the device, however small
+    ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0);
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int i=0; i<nthreads; i++)
+    {
+        w[i] = (worker_t){ .eng = eng, .size = size, .duration_ns = duration_ns, .start = &start };
+        pthread_create(&tid[i], NULL, worker_main, &w[i]);
+    }
+    pthread_barrier_wait(&start);
+    t0 = now_ns();
+    for (int i=0; i<nthreads; i++)
+    {
+        pthread_join(tid[i], NULL);
+        failed |= w[i].failed;
+        bytes += w[i].bytes;
+    }
+    elapsed = now_ns() - t0;
+    pthread_barrier_destroy(&start);
+    if (failed)
+    {
+        fprintf(stderr, "ERROR: encryption failed with %d devices\n", ndevs);
+        return -1;
+    }
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_DEV_STATS, 0, &stats, NULL))
+    {
+        fprintf(stderr, "ERROR: could not read the device counters\n");
+        return -1;
+    }
+
+    printf("%7d %10.1f   ", ndevs, bytes / (elapsed / 1e9) / 1e6);
+    for (uint32_t d=0; d<stats.ndevs; d++)
+        printf(" %3.0f%%", 100.0 * stats.dev[d].busy_ns / stats.elapsed_ns);
+    printf("\n");
+    fflush(stdout);
+
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int devcounts[] = { 1, 2, 4, 8 };
+    int nthreads = 8, status, failed = 0;
+    size_t size = 65536;
+    uint64_t duration_ns = 500 * 1000000ULL;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [threads] [record bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        nthreads = atoi(argv[2]);
+    if (argc > 3)
+        size = strtoul(argv[3], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 4)
+        duration_ns = strtoull(argv[4], NULL, 0) * 1000000ULL;
+    if (nthreads < 1 || size < AESBLKSIZE)
+    {
+        fprintf(stderr, "ERROR: need at least one thread and one block per record\n");
+        return 1;
+    }
+
+    printf("%d threads, %zu byte records, emulated devices at %s MB/s each\n", nthreads, size,
+           getenv("WSAES_EMU_MBPS") ? getenv("WSAES_EMU_MBPS") : "200");
+    printf("devices       MB/s    utilization per device\n");
+    fflush(stdout);
+    for (size_t i=0; i<sizeof(devcounts)/sizeof(devcounts[0]); i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("ERROR: fork failed");
+            return 1;
+        }
+        if (0 == pid)
+            _exit(0 == run(argv[1], devcounts[i], nthreads, size, duration_ns) ? 0 : 1);
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+            failed = 1;
+    }
+    return failed;
+}
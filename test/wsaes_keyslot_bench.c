@@ -0,0 +1,128 @@
+/*
+ * Key slot benchmark for the wsaes engine
+ *
+ * Models a handshake-heavy server: every "connection" keys a fresh AES-256-CBC
+ * context with one of a small set of session keys (picked at random, as resumed
+ * sessions and shared ticket keys come back), encrypts two 1 KB records on the
+ * device and is freed, while another connection's context is used in between, so
+ * the device switches keys all the time. Runs against the emulator with a single
+ * key register and with key slots, for several sizes of the key set, and reports
+ * connections per second with the key cache's hits, misses and evictions per
+ * connection. Every setting runs in a fresh child process, since the emulator and
+ * the engine pick it up when they are initialised.
+ *
+ * usage: wsaes_keyslot_bench /path/to/libwsaesengine.so [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaesengine.h"
+
+#define RECORDLEN 1024
+#define NRECORDS 2
+
+/* Run connections keyed from nkeys keys for duration_ns; called in a child process */
+static int run_keys(const char *so_path, const char *slots, int nkeys, uint64_t duration_ns)
+{
+    static uint8_t in[RECORDLEN], out[RECORDLEN + AESBLKSIZE];
+    uint8_t *keys = malloc((size_t)nkeys * AESKEYSIZE), iv[AESIVSIZE] = { 0 };
+    EVP_CIPHER_CTX *prev = NULL;
+    wsaes_keystats_t ks;
+    uint64_t t0, t1, conns = 0;
+    double secs;
+    int len;
+    ENGINE *eng;
+
+    setenv("WSAES_BACKEND", "emu", 1);
+    setenv("WSAES_EMU_KEYSLOTS", slots, 1);
+    if (NULL == keys || NULL == (eng = load_engine(so_path)) ||
+        1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0))
+        return -1;
+    for (size_t j=0; j<(size_t)nkeys * AESKEYSIZE; j++)
+        keys[j] = (uint8_t)(j * 7 + 1);
+    for (int k=0; k<nkeys; k++)
+        keys[k * AESKEYSIZE] = (uint8_t)k; // the pattern above repeats every 8 keys
+
+    srand(1);
+    t0 = t1 = now_ns();
+    for (; t1 - t0 < duration_ns; conns++)
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        memcpy(iv, &conns, sizeof(conns));
+        if (NULL == ctx ||
+            1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, keys + (rand() % nkeys) * AESKEYSIZE, iv))
+            return -1;
+        for (int r=0; r<NRECORDS; r++)
+        {
+            // the previous connection sends a record too, taking the device back in between
+            if (1 != EVP_EncryptUpdate(ctx, out, &len, in, RECORDLEN) ||
+                (NULL != prev && 1 != EVP_EncryptUpdate(prev, out, &len, in, RECORDLEN)))
+                return -1;
+        }
+        EVP_CIPHER_CTX_free(prev);
+        prev = ctx;
+        t1 = now_ns();
+    }
+    secs = (t1 - t0) / 1e9;
+    EVP_CIPHER_CTX_free(prev);
+
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_KEY_STATS, 0, &ks, NULL))
+        return -1;
+    printf("%9s %6d %12.0f %10.2f %10.2f %10.2f %10.2f\n", slots, nkeys, conns / secs,
+           (double)ks.keyloads_avoided / conns, (double)ks.keyloads / conns, (double)ks.keyslot_evictions / conns,
+           (double)ks.keyslot_switches / conns);
+    fflush(stdout);
+
+    free(keys);
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const char *slotcounts[] = { "0", "16" };
+    static const int keycounts[] = { 1, 4, 16, 64 };
+    uint64_t duration_ns = 500 * 1000000ULL;
+    int status, failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        duration_ns = strtoull(argv[2], NULL, 0) * 1000000ULL;
+
+    printf("connections of %d %d byte records, emulated device with %s us per syscall\n", NRECORDS, RECORDLEN,
+           getenv("WSAES_EMU_LATENCY_US") ? getenv("WSAES_EMU_LATENCY_US") : "5");
+    printf("key slots   keys    conns/s   hits/conn  miss/conn evict/conn switch/conn\n");
+    fflush(stdout);
+    for (size_t s=0; s<sizeof(slotcounts)/sizeof(slotcounts[0]); s++)
+    {
+        for (size_t k=0; k<sizeof(keycounts)/sizeof(keycounts[0]); k++)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("ERROR: fork failed");
+                return 1;
+            }
+            if (0 == pid)
+                _exit(0 == run_keys(argv[1], slotcounts[s], keycounts[k], duration_ns) ? 0 : 1);
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+                failed = 1;
+        }
+    }
+    return failed;
+}
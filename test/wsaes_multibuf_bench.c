@@ -0,0 +1,228 @@
+/*
+ * Multi-buffer software AES-CBC benchmark for the wsaes engine
+ *
+ * First, on one core: N independent streams, each with its own key and IV, are
+ * CBC-encrypted record by record one stream at a time (wsaes_soft_cbc(), and
+ * OpenSSL's EVP for reference) and all together with wsaes_soft_cbc_multi(),
+ * which interleaves up to WSAES_SOFT_LANES of them. The output of the two is
+ * compared, and the aggregate MB/s of each is reported.
+ *
+ * Then through the engine: threads encrypting records through the coalescing
+ * scheduler on the emulated device, without and with SW_OVERFLOW, which runs the
+ * part of each batch that the device can't take as soon as the rest through the
+ * multi-buffer code. Every setting runs in a fresh child process.
+ *
+ * usage: wsaes_multibuf_bench /path/to/libwsaesengine.so [record bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaes_soft.h"
+#include "wsaesengine.h"
+
+#define MAXSTREAMS 16
+#define MAXTHREADS 16
+
+typedef struct {
+    ENGINE *eng;
+    int id;
+    size_t size;
+    uint64_t deadline;
+    uint64_t bytes;
+    int ok;
+} worker_t;
+
+/*
+ * Encrypt a record of each of n streams per round for duration_ns, one stream at
+ * a time and all at once, and with OpenSSL; returns -1 if the outputs differ
+ */
+static int run_streams(int n, size_t size, uint64_t duration_ns)
+{
+    static wsaes_softkey_t keys[MAXSTREAMS];
+    uint8_t key[AESKEYSIZE], ivs[2][MAXSTREAMS][AESIVSIZE] = { { { 0 } } }, *in = malloc(size),
+            *out[2] = { malloc(n * size), malloc(n * size) };
+    wsaes_iov_t iov[MAXSTREAMS];
+    wsaes_softstream_t s[MAXSTREAMS];
+    EVP_CIPHER_CTX *ctx[MAXSTREAMS];
+    double mbps[3];
+    int len;
+
+    if (NULL == in || NULL == out[0] || NULL == out[1])
+        return -1;
+    memset(in, 0x5a, size);
+    for (int i=0; i<n; i++)
+    {
+        for (int j=0; j<AESKEYSIZE; j++)
+            key[j] = (uint8_t)(i * 13 + j);
+        wsaes_soft_setkey(&keys[i], key);
+        ivs[0][i][0] = ivs[1][i][0] = (uint8_t)i;
+        iov[i] = (wsaes_iov_t){ in, out[1] + i * size, size };
+        s[i] = (wsaes_softstream_t){ &keys[i], 1, ivs[1][i], &iov[i], 1 };
+        ctx[i] = EVP_CIPHER_CTX_new();
+        if (NULL == ctx[i] || 1 != EVP_EncryptInit_ex(ctx[i], EVP_aes_256_cbc(), NULL, key, ivs[0][i]))
+            return -1;
+        EVP_CIPHER_CTX_set_padding(ctx[i], 0);
+    }
+
+    // one round of each, from the same IVs, must agree
+    for (int i=0; i<n; i++)
+        wsaes_soft_cbc(&keys[i], 1, ivs[0][i], in, out[0] + i * size, size);
+    wsaes_soft_cbc_multi(s, n);
+    if (0 != memcmp(out[0], out[1], n * size) || 0 != memcmp(ivs[0], ivs[1], n * AESIVSIZE))
+    {
+        fprintf(stderr, "ERROR: multi-buffer output differs for %d streams\n", n);
+        return -1;
+    }
+
+    for (int m=0; m<3; m++)
+    {
+        uint64_t t0 = now_ns(), rounds = 0, t;
+        do
+        {
+            for (int i=0; 0 == m && i<n; i++)
+                wsaes_soft_cbc(&keys[i], 1, ivs[0][i], in, out[0] + i * size, size);
+            if (1 == m)
+                wsaes_soft_cbc_multi(s, n);
+            for (int i=0; 2 == m && i<n; i++)
+                EVP_EncryptUpdate(ctx[i], out[0] + i * size, &len, in, (int)size);
+            rounds++;
+        } while ((t = now_ns() - t0) < duration_ns);
+        mbps[m] = rounds * n * size / (t / 1e9) / 1e6;
+    }
+    printf("%7d %15.1f %15.1f %15.1f %8.2fx\n", n, mbps[0], mbps[1], mbps[2], mbps[1] / mbps[0]);
+    fflush(stdout);
+
+    for (int i=0; i<n; i++)
+        EVP_CIPHER_CTX_free(ctx[i]);
+    free(in);
+    free(out[0]);
+    free(out[1]);
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    uint8_t *in = calloc(1, w->size), *out = malloc(w->size + AESBLKSIZE), key[AESKEYSIZE], iv[AESIVSIZE] = { 0 };
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+
+    for (int j=0; j<AESKEYSIZE; j++)
+        key[j] = (uint8_t)(j * 7 + w->id);
+    w->ok = NULL != in && NULL != out && NULL != ctx &&
+            1 == EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), w->eng, key, iv);
+    while (w->ok && now_ns() < w->deadline)
+    {
+        w->ok = 1 == EVP_EncryptUpdate(ctx, out, &len, in, (int)w->size);
+        w->bytes += len;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/* Run nthreads workers through the scheduler for duration_ns; called in a child process */
+static int run_threads(const char *so_path, int nthreads, int overflow, size_t size, uint64_t duration_ns)
+{
+    worker_t w[MAXTHREADS];
+    pthread_t thread[MAXTHREADS];
+    wsaes_schedstats_t ss;
+    uint64_t t0, bytes = 0;
+    double secs;
+    ENGINE *eng;
+
+    if (NULL == (eng = load_engine(so_path)) || 1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SCHEDULER", 1, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SW_OVERFLOW", overflow, NULL, NULL, 0))
+        return -1;
+
+    t0 = now_ns();
+    for (int t=0; t<nthreads; t++)
+    {
+        w[t] = (worker_t){ eng, t, size, t0 + duration_ns, 0, 0 };
+        if (0 != pthread_create(&thread[t], NULL, worker, &w[t]))
+            return -1;
+    }
+    for (int t=0; t<nthreads; t++)
+    {
+        pthread_join(thread[t], NULL);
+        if (!w[t].ok)
+            return -1;
+        bytes += w[t].bytes;
+    }
+    secs = (now_ns() - t0) / 1e9;
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_SCHED_STATS, 0, &ss, NULL))
+        return -1;
+    printf("%7d %9s %12.1f %15.1f %14.2f\n", nthreads, overflow ? "on" : "off", bytes / secs / 1e6,
+           bytes ? 100.0 * ss.overflow_bytes / bytes : 0.0, ss.batches ? (double)ss.requests / ss.batches : 0.0);
+    fflush(stdout);
+
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int streamcounts[] = { 1, 2, 4, 8, MAXSTREAMS };
+    static const int threadcounts[] = { 1, 2, 4, 8, MAXTHREADS };
+    uint64_t duration_ns = 300 * 1000000ULL;
+    size_t size = 16384;
+    int status, failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [record bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        size = strtoul(argv[2], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 3)
+        duration_ns = strtoull(argv[3], NULL, 0) * 1000000ULL;
+    if (size < AESBLKSIZE)
+    {
+        fprintf(stderr, "ERROR: need at least one block per record\n");
+        return 1;
+    }
+
+    printf("%zu byte records, one key per stream, encrypting on one core\n", size);
+    printf("streams one at a time MB/s  multi-buffer MB/s  OpenSSL EVP MB/s  speedup\n");
+    fflush(stdout);
+    for (size_t i=0; i<sizeof(streamcounts)/sizeof(streamcounts[0]); i++)
+        failed |= 0 != run_streams(streamcounts[i], size, duration_ns);
+
+    setenv("WSAES_BACKEND", "emu", 1);
+    printf("\n%zu byte records, one key per thread, scheduler on the emulated device at %s MB/s\n", size,
+           getenv("WSAES_EMU_MBPS") ? getenv("WSAES_EMU_MBPS") : "200");
+    printf("threads  overflow         MB/s  %% in software mean batch\n");
+    fflush(stdout);
+    for (size_t t=0; t<sizeof(threadcounts)/sizeof(threadcounts[0]); t++)
+    {
+        for (int overflow=0; overflow<2; overflow++)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("ERROR: fork failed");
+                return 1;
+            }
+            if (0 == pid)
+                _exit(0 == run_threads(argv[1], threadcounts[t], overflow, size, duration_ns) ? 0 : 1);
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+                failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,112 @@
+/*
+ * Pipeline depth benchmark for the wsaes engine
+ *
+ * Measures encryption and decryption throughput through the device's write()/read()
+ * path with 1, 2, 4 and 8 transfers in flight (the engine's PIPELINE_DEPTH), one
+ * context doing large updates. Depth 1 waits for every transfer before sending the
+ * next. On the emulator the rings are turned off, since they would otherwise take
+ * the place of write()/read(); WSAES_EMU_QDEPTH limits how many transfers the
+ * emulated device queues.
+ *
+ * usage: wsaes_pipeline_bench /path/to/libwsaesengine.so [update bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+/* Throughput in MB/s of updates of size bytes for duration_ns, -1 on failure */
+static double run(ENGINE *eng, int enc, uint8_t *in, uint8_t *out, size_t size, uint64_t duration_ns)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint64_t t0, t1, bytes = 0;
+    int len;
+
+    if (NULL == ctx || 1 != EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), eng, key, iv, enc))
+        return -1;
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    t0 = t1 = now_ns();
+    while (t1 - t0 < duration_ns)
+    {
+        if (1 != EVP_CipherUpdate(ctx, out, &len, in, (int)size))
+        {
+            EVP_CIPHER_CTX_free(ctx);
+            return -1;
+        }
+        bytes += len;
+        t1 = now_ns();
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return bytes / ((t1 - t0) / 1e9) / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    static const long depths[] = { 1, 2, 4, 8 };
+    size_t size = AESMAXDATASIZE;
+    uint64_t duration_ns = 500 * 1000000ULL;
+    double mbps[2];
+    uint8_t *in, *out;
+    ENGINE *eng;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [update bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        size = strtoul(argv[2], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 3)
+        duration_ns = strtoull(argv[3], NULL, 0) * 1000000ULL;
+    if (size < AESBLKSIZE || size > 0x7FFFFFF0)
+    {
+        fprintf(stderr, "ERROR: update size must be at least one block and fit an int\n");
+        return 1;
+    }
+
+    setenv("WSAES_EMU_RING", "0", 0);
+    if (NULL == (eng = load_engine(argv[1])))
+        return 1;
+    ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0);
+
+    in = malloc(size);
+    out = malloc(size + AESBLKSIZE);
+    if (NULL == in || NULL == out)
+        return 1;
+    memset(in, 0xA5, size);
+
+    printf("%zu byte updates\n", size);
+    printf("  depth   encrypt MB/s   decrypt MB/s\n");
+    for (size_t d=0; d<sizeof(depths)/sizeof(depths[0]); d++)
+    {
+        if (1 != ENGINE_ctrl_cmd(eng, "PIPELINE_DEPTH", depths[d], NULL, NULL, 0))
+        {
+            fprintf(stderr, "ERROR: could not set the pipeline depth to %ld\n", depths[d]);
+            return 1;
+        }
+        for (int enc=1; enc>=0; enc--)
+        {
+            if ((mbps[enc] = run(eng, enc, in, out, size, duration_ns)) < 0)
+            {
+                fprintf(stderr, "ERROR: %s failed at depth %ld\n", enc ? "encryption" : "decryption", depths[d]);
+                return 1;
+            }
+        }
+        printf("%7ld %14.1f %14.1f\n", depths[d], mbps[1], mbps[0]);
+        fflush(stdout);
+    }
+
+    free(in);
+    free(out);
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
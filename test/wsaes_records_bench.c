@@ -0,0 +1,114 @@
+/*
+ * Record pipelining benchmark for the wsaes engine
+ *
+ * Encrypts TLS-sized records through the engine with 1 to 32 records per call,
+ * handed over with the EVP_CTRL_SET_PIPELINE_* ctrls the way libssl does when
+ * SSL_CTX_set_max_pipelines() is set, and reports the time and the number of
+ * device syscalls per record. Every call is one device transaction, so the fixed
+ * cost of a round trip is shared by all the records in it.
+ *
+ * usage: wsaes_records_bench /path/to/libwsaesengine.so [record bytes] [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+#define MAXPIPES 32
+
+static uint64_t syscalls(void)
+{
+    aes256syscalls_t cnt;
+    aes256getsyscalls(&cnt);
+    return cnt.open + cnt.close + cnt.ioctl + cnt.write + cnt.read;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int pipes[] = { 1, 2, 4, 8, 16, 32 };
+    unsigned char *inbufs[MAXPIPES], *outbufs[MAXPIPES];
+    size_t lens[MAXPIPES], reclen = 1024;
+    uint64_t duration_ns = 300 * 1000000ULL;
+    ENGINE *eng;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [record bytes] [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        reclen = strtoul(argv[2], NULL, 0) & ~(size_t)(AESBLKSIZE - 1);
+    if (argc > 3)
+        duration_ns = strtoull(argv[3], NULL, 0) * 1000000ULL;
+    if (reclen < AESBLKSIZE || reclen > 65536)
+    {
+        fprintf(stderr, "ERROR: records must be between one block and 64 KB\n");
+        return 1;
+    }
+    if (NULL == (eng = load_engine(argv[1])))
+        return 1;
+    // every call to the device, to measure what pipelining saves there
+    ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0);
+
+    for (int r=0; r<MAXPIPES; r++)
+    {
+        inbufs[r] = malloc(reclen);
+        outbufs[r] = malloc(reclen);
+        if (NULL == inbufs[r] || NULL == outbufs[r])
+            return 1;
+        memset(inbufs[r], r, reclen);
+        lens[r] = reclen;
+    }
+
+    printf("%zu byte records\n", reclen);
+    printf("pipelines   records/s   us/record    MB/s   syscalls/record\n");
+    for (size_t p=0; p<sizeof(pipes)/sizeof(pipes[0]); p++)
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        uint64_t t0, t1, records = 0, calls0;
+        int n = pipes[p];
+
+        if (NULL == ctx || 1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, key, iv))
+        {
+            fprintf(stderr, "ERROR: could not set up the cipher context\n");
+            return 1;
+        }
+
+        calls0 = syscalls();
+        t0 = t1 = now_ns();
+        while (t1 - t0 < duration_ns)
+        {
+            if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_OUTPUT_BUFS, n, outbufs) <= 0 ||
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_INPUT_BUFS, n, inbufs) <= 0 ||
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_INPUT_LENS, n, lens) <= 0 ||
+                1 != EVP_Cipher(ctx, outbufs[0], inbufs[0], (unsigned int)lens[0]))
+            {
+                fprintf(stderr, "ERROR: pipelined encryption of %d records failed\n", n);
+                return 1;
+            }
+            records += n;
+            t1 = now_ns();
+        }
+        EVP_CIPHER_CTX_free(ctx);
+
+        printf("%9d %11.0f %11.2f %7.1f %17.2f\n", n, records * 1e9 / (t1 - t0), (t1 - t0) / 1e3 / records,
+               records * reclen * 1e3 / (t1 - t0), (double)(syscalls() - calls0) / records);
+        fflush(stdout);
+    }
+
+    for (int r=0; r<MAXPIPES; r++)
+    {
+        free(inbufs[r]);
+        free(outbufs[r]);
+    }
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
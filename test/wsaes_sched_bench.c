@@ -0,0 +1,148 @@
+/*
+ * Scheduler benchmark for the wsaes engine
+ *
+ * Many threads, each with its own AES-256-CBC context keyed from a small set of
+ * keys, encrypt 1 KB records on the device as fast as they can, like the worker
+ * threads of a server. Runs every thread count with the threads taking the device
+ * in turn, and with the coalescing scheduler at a latency budget of 0 and 50 us,
+ * and reports records per second with the scheduler's mean batch size, mean
+ * queue depth and mean and largest added latency. Every setting runs in a fresh
+ * child process, so that each starts from a newly initialised engine.
+ *
+ * usage: wsaes_sched_bench /path/to/libwsaesengine.so [ms]
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaesengine.h"
+
+#define RECORDLEN 1024
+#define NKEYS 4
+#define MAXTHREADS 16
+
+typedef struct {
+    ENGINE *eng;
+    int id;
+    uint64_t deadline;
+    uint64_t records;
+    int ok;
+} worker_t;
+
+static void *worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    uint8_t in[RECORDLEN] = { 0 }, out[RECORDLEN + AESBLKSIZE], key[AESKEYSIZE], iv[AESIVSIZE] = { 0 };
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+
+    for (int j=0; j<AESKEYSIZE; j++)
+        key[j] = (uint8_t)(j * 7 + 1 + w->id % NKEYS);
+    w->ok = NULL != ctx && 1 == EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), w->eng, key, iv);
+    while (w->ok && now_ns() < w->deadline)
+    {
+        w->ok = 1 == EVP_EncryptUpdate(ctx, out, &len, in, RECORDLEN);
+        w->records++;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+}
+
+/* Run nthreads workers for duration_ns, through the scheduler if latency_us >= 0; called in a child process */
+static int run_threads(const char *so_path, int nthreads, long latency_us, uint64_t duration_ns)
+{
+    worker_t w[MAXTHREADS];
+    pthread_t thread[MAXTHREADS];
+    wsaes_schedstats_t ss = { 0 };
+    uint64_t t0, records = 0;
+    double secs, batch = 0, depth = 0, wait = 0;
+    char mode[24] = "off";
+    ENGINE *eng;
+
+    if (NULL == (eng = load_engine(so_path)) || 1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) ||
+        (latency_us >= 0 && (1 != ENGINE_ctrl_cmd(eng, "SCHED_LATENCY_US", latency_us, NULL, NULL, 0) ||
+                             1 != ENGINE_ctrl_cmd(eng, "SCHEDULER", 1, NULL, NULL, 0))))
+        return -1;
+
+    t0 = now_ns();
+    for (int t=0; t<nthreads; t++)
+    {
+        w[t] = (worker_t){ eng, t, t0 + duration_ns, 0, 0 };
+        if (0 != pthread_create(&thread[t], NULL, worker, &w[t]))
+            return -1;
+    }
+    for (int t=0; t<nthreads; t++)
+    {
+        pthread_join(thread[t], NULL);
+        if (!w[t].ok)
+            return -1;
+        records += w[t].records;
+    }
+    secs = (now_ns() - t0) / 1e9;
+
+    if (latency_us >= 0)
+    {
+        if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_SCHED_STATS, 0, &ss, NULL) || 0 == ss.batches)
+            return -1;
+        batch = (double)ss.requests / ss.batches;
+        depth = (double)ss.depth_sum / ss.requests;
+        wait = ss.wait_ns / 1e3 / ss.requests;
+        snprintf(mode, sizeof(mode), "%ld us", latency_us);
+    }
+    printf("%7d %9s %12.0f %10.2f %10.2f %10.1f %10.1f\n", nthreads, mode, records / secs, batch, depth, wait,
+           ss.maxwait_ns / 1e3);
+    fflush(stdout);
+
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int threadcounts[] = { 1, 2, 4, 8, MAXTHREADS };
+    static const long latencies[] = { -1, 0, 50 }; // -1: scheduler off
+    uint64_t duration_ns = 500 * 1000000ULL;
+    int status, failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s /path/to/libwsaesengine.so [ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        duration_ns = strtoull(argv[2], NULL, 0) * 1000000ULL;
+
+    setenv("WSAES_BACKEND", "emu", 1);
+    printf("%d byte records under %d keys, emulated device with %s us per syscall\n", RECORDLEN, NKEYS,
+           getenv("WSAES_EMU_LATENCY_US") ? getenv("WSAES_EMU_LATENCY_US") : "5");
+    printf("threads scheduler    records/s mean batch mean depth  mean wait   max wait (us)\n");
+    fflush(stdout);
+    for (size_t t=0; t<sizeof(threadcounts)/sizeof(threadcounts[0]); t++)
+    {
+        for (size_t l=0; l<sizeof(latencies)/sizeof(latencies[0]); l++)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("ERROR: fork failed");
+                return 1;
+            }
+            if (0 == pid)
+                _exit(0 == run_threads(argv[1], threadcounts[t], latencies[l], duration_ns) ? 0 : 1);
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+                failed = 1;
+        }
+    }
+    return failed;
+}
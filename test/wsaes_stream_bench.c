@@ -0,0 +1,138 @@
+/*
+ * Streaming benchmark for the wsaes engine
+ *
+ * Encrypts inputs of 1 to 8 GB through one context, as a sequence of large
+ * EVP_EncryptUpdate calls (64 MB each by default, well past the device's 1 MB
+ * data region) over the same buffers, and reports the sustained throughput and
+ * the process's resident memory after each size. The engine streams every update
+ * through the device in chunks, so resident memory should stay flat however much
+ * data goes through.
+ *
+ * usage: wsaes_stream_bench [options] /path/to/libwsaesengine.so
+ *   --sizes a,b,...   total input sizes in MB (default 1024,2048,4096,8192)
+ *   --update MB       bytes per EVP_EncryptUpdate call, in MB (default 64)
+ */
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+#define MAXPOINTS 16
+#define MB (1024UL*1024UL)
+
+/* Resident set size in MB, from /proc/self/statm */
+static double rss_mb(void)
+{
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (NULL != f)
+    {
+        if (2 != fscanf(f, "%lu %lu", &size, &resident))
+            resident = 0;
+        fclose(f);
+    }
+    return (double)resident * sysconf(_SC_PAGESIZE) / MB;
+}
+
+static int parse_list(const char *s, long *vals, int maxvals)
+{
+    char *end;
+    int n = 0;
+
+    while (*s && n < maxvals)
+    {
+        vals[n] = strtol(s, &end, 0);
+        if (end == s || vals[n] <= 0)
+            return -1;
+        n++;
+        s = (',' == *end) ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[])
+{
+    long sizes[MAXPOINTS] = { 1024, 2048, 4096, 8192 };
+    int nsizes = 4, len;
+    size_t update = 64 * MB;
+    const char *so_path = NULL;
+    uint8_t *in, *out;
+    ENGINE *eng;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--sizes") && i+1 < argc)
+            nsizes = parse_list(argv[++i], sizes, MAXPOINTS);
+        else if (0 == strcmp(argv[i], "--update") && i+1 < argc)
+            update = strtoul(argv[++i], NULL, 0) * MB;
+        else if ('-' != argv[i][0])
+            so_path = argv[i];
+        else
+            nsizes = -1;
+    }
+    if (NULL == so_path || nsizes <= 0 || 0 == update || update > 1024 * MB)
+    {
+        fprintf(stderr, "usage: %s [--sizes MB,MB,...] [--update MB (at most 1024)] /path/to/libwsaesengine.so\n",
+                argv[0]);
+        return 1;
+    }
+    if (NULL == (eng = load_engine(so_path)))
+        return 1;
+
+    in = malloc(update);
+    out = malloc(update + AESBLKSIZE);
+    if (NULL == in || NULL == out)
+    {
+        fprintf(stderr, "ERROR: could not allocate %zu MB buffers\n", update / MB);
+        return 1;
+    }
+    memset(in, 0xA5, update);
+    memset(out, 0, update + AESBLKSIZE);
+
+    printf("%zu MB updates, resident before the first run %.1f MB\n", update / MB, rss_mb());
+    printf("    input MB       MB/s     seconds    resident MB\n");
+    for (int p=0; p<nsizes; p++)
+    {
+        size_t total = (size_t)sizes[p] * MB, done;
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        uint64_t t0, elapsed;
+
+        if (NULL == ctx || 1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, key, iv))
+        {
+            fprintf(stderr, "ERROR: could not set up the cipher context\n");
+            return 1;
+        }
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+        t0 = now_ns();
+        for (done=0; done<total; done+=update)
+        {
+            size_t n = (total - done < update) ? total - done : update;
+            if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)n))
+            {
+                fprintf(stderr, "ERROR: encryption failed after %zu MB\n", done / MB);
+                return 1;
+            }
+        }
+        elapsed = now_ns() - t0;
+        EVP_CIPHER_CTX_free(ctx);
+
+        printf("%12ld %10.1f %11.2f %14.1f\n", sizes[p], total / (elapsed / 1e9) / 1e6, elapsed / 1e9, rss_mb());
+        fflush(stdout);
+    }
+
+    free(in);
+    free(out);
+    ENGINE_finish(eng);
+    ENGINE_free(eng);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Syscall benchmark for the wsaes device API
+ *
+ * Runs the sequence of device operations the engine performs for one
+ * EVP_CIPHER_CTX -- init_key (set key, set IV, reset) followed by do_cipher over
+ * a short record -- once through the one-shot calls, which open and close the
+ * device every time, and once through a persistent session. Reports the number
+ * of device syscalls and the wall time per operation for both. Sessions on
+ * bitstreams with bulk transfer support move the whole record in one
+ * write()/read() pair, older ones in one pair per 16-byte block. Sessions on
+ * bitstreams with rings post the record to the submission ring instead, which
+ * costs at most a doorbell and a wait ioctl.
+ *
+ * usage: wsaes_syscall_bench [iterations] [record bytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaeskern.h"
+
+#define DEFAULT_ITERS 10000
+#define DEFAULT_RECLEN 256
+
+typedef struct {
+    const char *name;
+    uint64_t syscalls;
+    double usecs;
+} result_t;
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static uint64_t total_syscalls(void)
+{
+    aes256syscalls_t cnt;
+    aes256getsyscalls(&cnt);
+    return cnt.open + cnt.close + cnt.ioctl + cnt.write + cnt.read;
+}
+
+/* Start/stop a measurement, leaving per-iteration averages in res */
+static double bench_start(void)
+{
+    aes256resetsyscalls();
+    return now_usecs();
+}
+
+static void bench_stop(result_t *res, double start, int iters)
+{
+    res->usecs = (now_usecs() - start) / iters;
+    res->syscalls = total_syscalls() / iters;
+}
+
+static int run_oneshot(int iters, uint8_t *in, uint8_t *out, uint32_t reclen, result_t *initres, result_t *cipherres)
+{
+    uint32_t outlen;
+    double start;
+
+    start = bench_start();
+    for (int i=0; i<iters; i++)
+    {
+        if (0 != aes256setkey((uint8_t*)key) || 0 != aes256setiv((uint8_t*)iv) || 0 != aes256reset())
+            return -1;
+    }
+    bench_stop(initres, start, iters);
+
+    start = bench_start();
+    for (int i=0; i<iters; i++)
+    {
+        if (0 != aes256(ENCRYPT, in, reclen, out, &outlen))
+            return -1;
+    }
+    bench_stop(cipherres, start, iters);
+    return 0;
+}
+
+static int run_session(int iters, uint8_t *in, uint8_t *out, uint32_t reclen, result_t *initres, result_t *cipherres,
+                       uint32_t *capsp)
+{
+    wsaes_session_t *sess;
+    uint32_t outlen;
+    double start;
+    int ret = -1;
+
+    if (0 != aes256open(&sess))
+        return -1;
+    *capsp = aes256caps_sess(sess);
+
+    start = bench_start();
+    for (int i=0; i<iters; i++)
+    {
+        if (0 != aes256setkey_sess(sess, (uint8_t*)key) || 0 != aes256setiv_sess(sess, (uint8_t*)iv) ||
+            0 != aes256reset_sess(sess))
+            goto end;
+    }
+    bench_stop(initres, start, iters);
+
+    start = bench_start();
+    for (int i=0; i<iters; i++)
+    {
+        if (0 != aes256_sess(sess, ENCRYPT, in, reclen, out, &outlen))
+            goto end;
+    }
+    bench_stop(cipherres, start, iters);
+    ret = 0;
+end:
+    aes256close(sess);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERS;
+    uint32_t reclen = (argc > 2) ? (uint32_t)atoi(argv[2]) : DEFAULT_RECLEN;
+    result_t before[2] = { { "init_key" }, { "do_cipher" } };
+    result_t after[2] = { { "init_key" }, { "do_cipher" } };
+    uint8_t *in, *out;
+    uint32_t caps = 0;
+
+    if (iters <= 0 || reclen == 0 || reclen % AESBLKSIZE != 0 || reclen > AESMAXDATASIZE)
+    {
+        fprintf(stderr, "usage: %s [iterations] [record bytes, multiple of %d]\n", argv[0], AESBLKSIZE);
+        return 1;
+    }
+    if (0 != aes256init())
+        return 1;
+
+    in = calloc(1, reclen);
+    out = malloc(reclen);
+    if (NULL == in || NULL == out)
+        return 1;
+
+    if (0 != run_oneshot(iters, in, out, reclen, &before[0], &before[1]))
+    {
+        fprintf(stderr, "ERROR: one-shot run failed\n");
+        return 1;
+    }
+    if (0 != run_session(iters, in, out, reclen, &after[0], &after[1], &caps))
+    {
+        fprintf(stderr, "ERROR: session run failed\n");
+        return 1;
+    }
+
+    printf("%d iterations, %u byte records, bulk transfer %s, rings %s\n\n", iters, reclen,
+           (caps & WSAES_CAP_BULK) ? "supported" : "not supported",
+           (caps & WSAES_CAP_RING) ? "supported" : "not supported");
+    printf("%-10s %18s %18s %14s %14s\n", "operation", "syscalls (before)", "syscalls (after)",
+           "us (before)", "us (after)");
+    for (int i=0; i<2; i++)
+        printf("%-10s %18llu %18llu %14.2f %14.2f\n", before[i].name,
+               (unsigned long long)before[i].syscalls, (unsigned long long)after[i].syscalls,
+               before[i].usecs, after[i].usecs);
+
+    free(in);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Thread stress benchmark for the wsaes device API
+ *
+ * 1 up to N threads each encrypt a buffer over and over under a key and IV of
+ * their own, every thread with its own session, spread over the devices present.
+ * Each round is either the sequence set key, set IV, reset, stream, held together
+ * with aes256lock_sess(), or a single aes256batch_sess() job carrying mode, key
+ * and IV. Every output is checked against the thread's OpenSSL AES-256-CBC result,
+ * so a key or IV from another thread landing in the middle of a round shows up as
+ * a mismatch. Reports rounds per second, MB/s and mismatches for every thread
+ * count; exits non-zero if any output was wrong.
+ *
+ * usage: wsaes_threads_bench [options]
+ *   --threads n  most threads (default 16), run in powers of two up to it
+ *   --len n      bytes per round, whole blocks (default 4096)
+ *   --time ms    duration of every measurement (default 300)
+ */
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+
+#define MAXTHREADS 256
+
+typedef struct {
+    int id;
+    int batch;              // one aes256batch_sess() job per round, else the locked sequence
+    size_t len;
+    uint64_t deadline;
+    uint8_t key[AESKEYSIZE];
+    uint8_t iv[AESIVSIZE];
+    uint8_t *in, *out, *ref;
+    uint64_t rounds;
+    uint64_t mismatches;
+    int failed;
+} worker_t;
+
+static int ndevs;
+
+/* One round as separate calls, which only the device lock keeps together */
+static int32_t lockedround(wsaes_session_t *sess, worker_t *w)
+{
+    int32_t ret;
+
+    aes256lock_sess(sess);
+    if (0 == (ret = aes256setkey_sess(sess, w->key)) && 0 == (ret = aes256setiv_sess(sess, w->iv)) &&
+        0 == (ret = aes256reset_sess(sess)))
+        ret = aes256stream_sess(sess, ENCRYPT, w->in, w->len, w->out);
+    aes256unlock_sess(sess);
+    return ret;
+}
+
+static int32_t batchround(wsaes_session_t *sess, worker_t *w)
+{
+    wsaes_iov_t iov = { w->in, w->out, w->len };
+    wsaes_job_t job = { ENCRYPT, w->key, w->iv, &iov, 1, 0 };
+
+    return aes256batch_sess(sess, &job, 1);
+}
+
+static void *worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    wsaes_session_t *sess;
+
+    if (0 != aes256open_dev(&sess, w->id % ndevs))
+    {
+        w->failed = 1;
+        return NULL;
+    }
+    while (now_ns() < w->deadline)
+    {
+        memset(w->out, 0, w->len);
+        if (0 != (w->batch ? batchround(sess, w) : lockedround(sess, w)))
+        {
+            w->failed = 1;
+            break;
+        }
+        if (0 != memcmp(w->out, w->ref, w->len))
+            w->mismatches++;
+        w->rounds++;
+    }
+    aes256close(sess);
+    return NULL;
+}
+
+/* The thread's expected output, from OpenSSL */
+static int softref(worker_t *w)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len, ok;
+
+    ok = NULL != ctx && 1 == EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, w->key, w->iv) &&
+         1 == EVP_CIPHER_CTX_set_padding(ctx, 0) && 1 == EVP_EncryptUpdate(ctx, w->ref, &len, w->in, (int)w->len);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    static worker_t w[MAXTHREADS];
+    pthread_t thread[MAXTHREADS];
+    int maxthreads = 16, failed = 0;
+    size_t len = 4096;
+    uint64_t duration_ns = 300 * 1000000ULL;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--threads") && i+1 < argc)
+            maxthreads = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "--len") && i+1 < argc)
+            len = strtoull(argv[++i], NULL, 0);
+        else if (0 == strcmp(argv[i], "--time") && i+1 < argc)
+            duration_ns = strtoull(argv[++i], NULL, 0) * 1000000ULL;
+        else
+            maxthreads = -1;
+    }
+    if (maxthreads <= 0 || maxthreads > MAXTHREADS || 0 == len || 0 != len % AESBLKSIZE || 0 == duration_ns)
+    {
+        fprintf(stderr, "usage: %s [--threads n] [--len n] [--time ms]\n", argv[0]);
+        return 1;
+    }
+    if (0 != aes256init())
+        return 1;
+    ndevs = aes256devcount();
+
+    for (int t=0; t<maxthreads; t++)
+    {
+        w[t].id = t;
+        w[t].len = len;
+        w[t].in = malloc(len);
+        w[t].out = malloc(len);
+        w[t].ref = malloc(len);
+        if (NULL == w[t].in || NULL == w[t].out || NULL == w[t].ref)
+        {
+            fprintf(stderr, "ERROR: could not allocate %d buffers of %zu bytes\n", maxthreads, len);
+            return 1;
+        }
+        for (int j=0; j<AESKEYSIZE; j++)
+            w[t].key[j] = (uint8_t)(j * 7 + 1 + t);
+        for (int j=0; j<AESIVSIZE; j++)
+            w[t].iv[j] = (uint8_t)(j * 11 + 3 + t);
+        for (size_t j=0; j<len; j++)
+            w[t].in[j] = (uint8_t)(j * 13 + 5 + t);
+        if (0 != softref(&w[t]))
+        {
+            fprintf(stderr, "ERROR: software AES-256-CBC failed\n");
+            return 1;
+        }
+    }
+
+    printf("%zu byte rounds, a key and IV per thread, %d device%s\n", len, ndevs, (1 == ndevs) ? "" : "s");
+    printf("threads  round       rounds/s       MB/s  mismatches\n");
+    fflush(stdout);
+    for (int n=1; n<=maxthreads; n=(n < maxthreads && 2*n > maxthreads) ? maxthreads : 2*n)
+    {
+        for (int batch=0; batch<2; batch++)
+        {
+            uint64_t t0 = now_ns(), rounds = 0, mismatches = 0;
+            double secs;
+
+            for (int t=0; t<n; t++)
+            {
+                w[t].batch = batch;
+                w[t].deadline = t0 + duration_ns;
+                w[t].rounds = w[t].mismatches = 0;
+                w[t].failed = 0;
+                if (0 != pthread_create(&thread[t], NULL, worker, &w[t]))
+                {
+                    fprintf(stderr, "ERROR: could not start thread %d\n", t);
+                    return 1;
+                }
+            }
+            for (int t=0; t<n; t++)
+            {
+                pthread_join(thread[t], NULL);
+                rounds += w[t].rounds;
+                mismatches += w[t].mismatches;
+                failed |= w[t].failed;
+            }
+            secs = (now_ns() - t0) / 1e9;
+            printf("%7d %6s %14.0f %10.1f %11llu\n", n, batch ? "batch" : "locked", rounds / secs,
+                   rounds * len / secs / 1e6, (unsigned long long)mismatches);
+            fflush(stdout);
+            if (0 != mismatches)
+                failed = 1;
+        }
+    }
+
+    for (int t=0; t<maxthreads; t++)
+    {
+        free(w[t].in);
+        free(w[t].out);
+        free(w[t].ref);
+    }
+    if (failed)
+        fprintf(stderr, "ERROR: a round failed or an output differs from software\n");
+    return failed;
+}
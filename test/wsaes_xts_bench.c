@@ -0,0 +1,186 @@
+/*
+ * AES-256-XTS sector benchmark for the wsaes device API
+ *
+ * Encrypts runs of consecutive sectors, as a storage encryption layer does for
+ * each I/O, through aes256xts_sess(), which hands a whole run to the device in
+ * one transaction, and reports sectors per second (IOPS), MB/s and device
+ * syscalls per run for each sector size and run length (batch). For comparison
+ * the same sectors go through OpenSSL's software AES-256-XTS one sector at a
+ * time, re-keyed with each sector's tweak as the EVP interface requires. The
+ * first run of every size is checked against the software result.
+ *
+ * usage: wsaes_xts_bench [options]
+ *   --sectors a,b,...   sector sizes in bytes (default 512,4096)
+ *   --batch a,b,...     sectors per call (default 1,8,64,256)
+ *   --time ms           duration of every measurement (default 300)
+ */
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wsaes_api.h"
+#include "wsaes_bench_common.h"
+#include "wsaeskern.h"
+
+#define MAXPOINTS 16
+
+static const uint8_t xtskey[AESXTSKEYSIZE] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x5C, 0x5D, 0x5E, 0x5F, 0x58, 0x59, 0x5A, 0x5B,
+    0x54, 0x55, 0x56, 0x57, 0x50, 0x51, 0x52, 0x53,
+    0x4C, 0x4D, 0x4E, 0x4F, 0x48, 0x49, 0x4A, 0x4B,
+    0x44, 0x45, 0x46, 0x47, 0x40, 0x41, 0x42, 0x43 };
+
+static uint64_t total_syscalls(void)
+{
+    aes256syscalls_t cnt;
+    aes256getsyscalls(&cnt);
+    return cnt.open + cnt.close + cnt.ioctl + cnt.write + cnt.read;
+}
+
+static int parse_list(const char *s, long *vals, int maxvals)
+{
+    char *end;
+    int n = 0;
+
+    while (*s && n < maxvals)
+    {
+        vals[n] = strtol(s, &end, 0);
+        if (end == s || vals[n] <= 0)
+            return -1;
+        n++;
+        s = (',' == *end) ? end + 1 : end;
+    }
+    return n;
+}
+
+/* Software XTS of nsectors sectors from sector number sector, one EVP call per sector */
+static int softxts(EVP_CIPHER_CTX *ctx, uint64_t sector, uint32_t sectorsize, const uint8_t *in, uint8_t *out,
+                   size_t nsectors)
+{
+    uint8_t tweak[AESIVSIZE] = { 0 };
+    int len;
+
+    for (size_t i=0; i<nsectors; i++, sector++)
+    {
+        for (int j=0; j<8; j++)
+            tweak[j] = (uint8_t)(sector >> (8 * j));
+        if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, tweak) ||
+            1 != EVP_EncryptUpdate(ctx, out + i * sectorsize, &len, in + i * sectorsize, (int)sectorsize))
+            return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    long sectors[MAXPOINTS] = { 512, 4096 }, batches[MAXPOINTS] = { 1, 8, 64, 256 };
+    int nsizes = 2, nbatches = 4;
+    uint64_t duration_ns = 300 * 1000000ULL;
+    size_t maxlen = 0;
+    wsaes_session_t *sess;
+    EVP_CIPHER_CTX *ctx;
+    uint8_t *in, *out, *ref;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--sectors") && i+1 < argc)
+            nsizes = parse_list(argv[++i], sectors, MAXPOINTS);
+        else if (0 == strcmp(argv[i], "--batch") && i+1 < argc)
+            nbatches = parse_list(argv[++i], batches, MAXPOINTS);
+        else if (0 == strcmp(argv[i], "--time") && i+1 < argc)
+            duration_ns = strtoull(argv[++i], NULL, 0) * 1000000ULL;
+        else
+            nsizes = -1;
+    }
+    if (nsizes <= 0 || nbatches <= 0 || 0 == duration_ns)
+    {
+        fprintf(stderr, "usage: %s [--sectors bytes,...] [--batch sectors,...] [--time ms]\n", argv[0]);
+        return 1;
+    }
+    for (int s=0; s<nsizes; s++)
+        for (int b=0; b<nbatches; b++)
+            if ((size_t)sectors[s] * batches[b] > maxlen)
+                maxlen = (size_t)sectors[s] * batches[b];
+
+    if (0 != aes256init() || 0 != aes256open(&sess))
+        return 1;
+    if (!(aes256caps_sess(sess) & WSAES_CAP_XTS))
+    {
+        fprintf(stderr, "ERROR: the device doesn't support XTS\n");
+        return 1;
+    }
+    in = malloc(maxlen);
+    out = malloc(maxlen);
+    ref = malloc(maxlen);
+    ctx = EVP_CIPHER_CTX_new();
+    if (NULL == in || NULL == out || NULL == ref || NULL == ctx ||
+        1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_xts(), NULL, xtskey, NULL))
+    {
+        fprintf(stderr, "ERROR: could not set up the buffers or the software cipher\n");
+        return 1;
+    }
+    for (size_t j=0; j<maxlen; j++)
+        in[j] = (uint8_t)(j * 13 + 5);
+    if (0 != aes256setkey_sess(sess, (uint8_t*)xtskey) ||
+        0 != aes256settweakkey_sess(sess, (uint8_t*)xtskey + AESKEYSIZE))
+        return 1;
+
+    printf("largest device transfer %u bytes\n", aes256maxxfer_sess(sess));
+    printf(" sector   batch    device IOPS     MB/s  syscalls/batch   software IOPS\n");
+    for (int s=0; s<nsizes; s++)
+    {
+        uint32_t sectorsize = (uint32_t)sectors[s];
+        for (int b=0; b<nbatches; b++)
+        {
+            size_t n = (size_t)batches[b];
+            uint64_t t0, t1, sector = 0, calls = 0, syscalls;
+            double devsecs, swsecs;
+
+            // the first run is checked against the software result
+            if (0 != aes256xts_sess(sess, ENCRYPT, sector, sectorsize, in, out, n) ||
+                0 != softxts(ctx, sector, sectorsize, in, ref, n) || 0 != memcmp(out, ref, n * sectorsize))
+            {
+                fprintf(stderr, "ERROR: %u byte sectors in batches of %zu failed or differ from software\n",
+                        sectorsize, n);
+                return 1;
+            }
+
+            aes256resetsyscalls();
+            t0 = t1 = now_ns();
+            for (; t1 - t0 < duration_ns; calls++, sector += n)
+            {
+                if (0 != aes256xts_sess(sess, ENCRYPT, sector, sectorsize, in, out, n))
+                    return 1;
+                t1 = now_ns();
+            }
+            syscalls = total_syscalls();
+            devsecs = (t1 - t0) / 1e9;
+
+            t0 = t1 = now_ns();
+            for (sector=0; t1 - t0 < duration_ns; sector += n)
+            {
+                softxts(ctx, sector, sectorsize, in, ref, n);
+                t1 = now_ns();
+            }
+            swsecs = (t1 - t0) / 1e9;
+
+            printf("%7u %7zu %14.0f %8.1f %15.1f %15.0f\n", sectorsize, n, calls * n / devsecs,
+                   calls * n * sectorsize / devsecs / 1e6, (double)syscalls / calls, sector / swsecs);
+            fflush(stdout);
+        }
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    free(in);
+    free(out);
+    free(ref);
+    aes256close(sess);
+    return 0;
+}
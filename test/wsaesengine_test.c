@@ -1,18 +1,64 @@
 #include <openssl/engine.h>
 #include <openssl/ossl_typ.h>
 #include <openssl/evp.h>
+#include <openssl/tls1.h>
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "wsaes_api.h"
+#include "wsaesengine.h"
 
 #define LOAD_ENGINE 1
 
 #define HWSUCCESS 0
 #define MAXBYTES 1048576
 
+#define NINTERLEAVE 16 // contexts used by wsinterleave()
+#define NROUNDS 8      // updates per context
+#define NKEYS 4        // distinct keys, so that contexts share keys on the device
+#define MAXCHUNK 256   // largest single update
+
+#define PARTIALLEN (2*AESBLKSIZE + 5) // stream in wspartial(), ending in a partial block
+
+#define LARGELEN (3*AESMAXDATASIZE + 5*AESBLKSIZE) // single update in wslarge(), past the ring data region
+
+#define NHANDSHAKES 160 // short-lived contexts in wskeyslots(), each keyed once
+#define NSLOTKEYS 40    // distinct keys among them, more than the emulator's key slots
+#define NHOTKEYS 6      // keys of the first half of them, which fit the key slots
+#define NLONGLIVED 4    // contexts that run alongside all of them
+
+#define NPIPES 8       // records per call in wspipeline()
+#define MAXRECORD 2048 // largest of them
+
+#define CTRLEN (LARGELEN + 7) // longest update in wsctr(), split across devices
+
+#define XTSLEN 65552   // longest data unit in wsxts(), past the largest device transfer
+#define NSECTORS 4     // data units of each length in wsxts()
+
+#define NRECORDS 3     // TLS records per context in wsstitched()
+#define MAXPAYLOAD 16384 // largest of them, a full TLS record
+
+#define NASYNC 8       // concurrent jobs in wsasync()
+#define ASYNCLEN 4096  // bytes encrypted by each job
+
+#define NSCHEDTHREADS 8  // threads in wssched(), each with its own context
+#define NSCHEDUPDATES 64 // updates per thread
+#define SCHEDLATENCY 50  // SCHED_LATENCY_US in wssched()
+
+#define STATSHWLEN 8192 // update in wsstats() run on the device, above SW_THRESHOLD
+#define STATSSWLEN 64   // and one run in software, below it
+#define STATSBUFLEN 16384 // text and JSON snapshots
+
+#define TRACELEN 8192   // update traced in wstrace(), on the device
+
+#define TUNELEN 262144  // update run in wstune() with the calibrated chunk size
+
 static const char* engine_id = "wsaesengine";
 const char* devstr = "/dev/wsaeschar";
 
@@ -150,6 +196,1109 @@ static int32_t wsdecrypt(uint8_t *ciphertext,uint32_t ciphertext_len,
 }
 
 
+/*
+ * Runs NINTERLEAVE encrypt and decrypt contexts through the engine, interleaving
+ * their updates so that they keep taking the device over from each other, and
+ * checks every context's output against OpenSSL's software AES-256-CBC
+ */
+static int32_t wsinterleave(ENGINE* eng)
+{
+    static uint8_t in[NINTERLEAVE][NROUNDS*MAXCHUNK];
+    static uint8_t hwout[NINTERLEAVE][NROUNDS*MAXCHUNK+AESBLKSIZE];
+    static uint8_t swout[NINTERLEAVE][NROUNDS*MAXCHUNK+AESBLKSIZE];
+    EVP_CIPHER_CTX *hw[NINTERLEAVE], *sw[NINTERLEAVE];
+    int inoff[NINTERLEAVE] = {0}, hwlen[NINTERLEAVE] = {0}, swlen[NINTERLEAVE] = {0};
+    uint8_t ctxkey[AESKEYSIZE], ctxiv[AESIVSIZE];
+    wsaes_keystats_t stats;
+    wsaes_devstats_t devstats;
+    int len, errcnt = 0;
+
+    for (int i=0; i<NINTERLEAVE; i++)
+    {
+        memcpy(ctxkey, key, AESKEYSIZE);
+        memcpy(ctxiv, iv, AESIVSIZE);
+        ctxkey[0] ^= i % NKEYS;
+        ctxiv[0] ^= i;
+        for (int j=0; j<NROUNDS*MAXCHUNK; j++)
+            in[i][j] = (uint8_t)(i*31 + j);
+
+        // even contexts encrypt, odd ones decrypt; no padding so decrypting arbitrary data succeeds
+        hw[i] = EVP_CIPHER_CTX_new();
+        sw[i] = EVP_CIPHER_CTX_new();
+        if (NULL == hw[i] || NULL == sw[i] ||
+            1 != EVP_CipherInit_ex(hw[i], EVP_aes_256_cbc(), eng, ctxkey, ctxiv, i % 2 == 0) ||
+            1 != EVP_CipherInit_ex(sw[i], EVP_aes_256_cbc(), NULL, ctxkey, ctxiv, i % 2 == 0))
+        {
+            aesErr("wsinterleave init");
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_padding(hw[i], 0);
+        EVP_CIPHER_CTX_set_padding(sw[i], 0);
+    }
+
+    for (int r=0; r<NROUNDS; r++)
+    {
+        for (int i=0; i<NINTERLEAVE; i++)
+        {
+            int chunk = AESBLKSIZE * (1 + (i*7 + r*3) % (MAXCHUNK/AESBLKSIZE));
+            if (1 != EVP_CipherUpdate(hw[i], hwout[i] + hwlen[i], &len, in[i] + inoff[i], chunk))
+            {
+                aesErr("wsinterleave engine update");
+                return -1;
+            }
+            hwlen[i] += len;
+            if (1 != EVP_CipherUpdate(sw[i], swout[i] + swlen[i], &len, in[i] + inoff[i], chunk))
+            {
+                aesErr("wsinterleave software update");
+                return -1;
+            }
+            swlen[i] += len;
+            inoff[i] += chunk;
+        }
+    }
+
+    for (int i=0; i<NINTERLEAVE; i++)
+    {
+        if (1 != EVP_CipherFinal_ex(hw[i], hwout[i] + hwlen[i], &len))
+            aesErr("wsinterleave engine final");
+        hwlen[i] += len;
+        if (1 != EVP_CipherFinal_ex(sw[i], swout[i] + swlen[i], &len))
+            aesErr("wsinterleave software final");
+        swlen[i] += len;
+
+        if (hwlen[i] != swlen[i] || 0 != memcmp(hwout[i], swout[i], swlen[i]))
+        {
+            errcnt++;
+            printf("\t****Error, context %d (%s) output differs from software AES-256-CBC\n", i,
+                   (i % 2 == 0) ? "encrypt" : "decrypt");
+        }
+        EVP_CIPHER_CTX_free(hw[i]);
+        EVP_CIPHER_CTX_free(sw[i]);
+    }
+
+    if (1 == ENGINE_ctrl(eng, WSAES_CMD_GET_KEY_STATS, 0, &stats, NULL))
+        printf("TEST: key loads = %llu, key loads avoided = %llu, iv loads = %llu, key slot switches = %llu, "
+               "evictions = %llu\n", (unsigned long long)stats.keyloads, (unsigned long long)stats.keyloads_avoided,
+               (unsigned long long)stats.ivloads, (unsigned long long)stats.keyslot_switches,
+               (unsigned long long)stats.keyslot_evictions);
+    else
+        printf("TEST: could not read key load counters\n");
+
+    // every context has been freed, so none may still be placed on a device
+    if (1 == ENGINE_ctrl(eng, WSAES_CMD_GET_DEV_STATS, 0, &devstats, NULL))
+    {
+        for (uint32_t d=0; d<devstats.ndevs; d++)
+        {
+            printf("TEST: device %u: requests = %llu, bytes = %llu\n", d,
+                   (unsigned long long)devstats.dev[d].requests, (unsigned long long)devstats.dev[d].bytes);
+            if (0 != devstats.dev[d].contexts)
+            {
+                errcnt++;
+                printf("\t****Error, device %u still has %llu contexts placed on it\n", d,
+                       (unsigned long long)devstats.dev[d].contexts);
+            }
+        }
+    }
+    else
+        printf("TEST: could not read device counters\n");
+
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Encrypt and decrypt inputs larger than the device takes at once in single
+ * updates, twice in a row so the CBC chain must carry over between them as well
+ * as between the device's chunks, and compare against software AES-256-CBC
+ */
+static int32_t wslarge(ENGINE* eng)
+{
+    uint8_t *in = malloc(2*LARGELEN), *hwout = malloc(2*LARGELEN), *swout = malloc(2*LARGELEN);
+    int len, errcnt = 0;
+
+    if (NULL == in || NULL == hwout || NULL == swout)
+        return -1;
+    for (int i=0; i<2*LARGELEN; i++)
+        in[i] = (uint8_t)(i*7 + (i >> 12));
+
+    for (int enc=1; enc>=0; enc--)
+    {
+        EVP_CIPHER_CTX *hw = EVP_CIPHER_CTX_new(), *sw = EVP_CIPHER_CTX_new();
+        if (NULL == hw || NULL == sw ||
+            1 != EVP_CipherInit_ex(hw, EVP_aes_256_cbc(), eng, key, iv, enc) ||
+            1 != EVP_CipherInit_ex(sw, EVP_aes_256_cbc(), NULL, key, iv, enc))
+        {
+            aesErr("wslarge init");
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_padding(hw, 0);
+        EVP_CIPHER_CTX_set_padding(sw, 0);
+        for (int half=0; half<2; half++)
+        {
+            if (1 != EVP_CipherUpdate(hw, hwout + half*LARGELEN, &len, in + half*LARGELEN, LARGELEN) ||
+                1 != EVP_CipherUpdate(sw, swout + half*LARGELEN, &len, in + half*LARGELEN, LARGELEN))
+            {
+                aesErr("wslarge update");
+                return -1;
+            }
+        }
+        if (0 != memcmp(hwout, swout, 2*LARGELEN))
+        {
+            errcnt++;
+            printf("\t****Error, %d byte %s differs from software AES-256-CBC\n", LARGELEN,
+                   enc ? "encryption" : "decryption");
+        }
+        EVP_CIPHER_CTX_free(hw);
+        EVP_CIPHER_CTX_free(sw);
+    }
+
+    free(in);
+    free(hwout);
+    free(swout);
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Stream PARTIALLEN bytes straight through wsaes_api.h, from an input buffer of
+ * exactly that length into an output buffer followed by a guard block. The device
+ * pads the last block with zeros, so the output must match software AES-256-CBC
+ * of the zero-padded input, cut to PARTIALLEN, and the guard must be untouched
+ */
+static int32_t wspartial(void)
+{
+    uint8_t *in = malloc(PARTIALLEN), *out = malloc(PARTIALLEN + AESBLKSIZE), padded[PARTIALLEN + AESBLKSIZE] = { 0 },
+            swout[sizeof(padded)], guard[AESBLKSIZE];
+    size_t swlen = (PARTIALLEN + AESBLKSIZE - 1) / AESBLKSIZE * AESBLKSIZE; // whole blocks of padded
+    wsaes_session_t *sess = NULL;
+    EVP_CIPHER_CTX *sw = EVP_CIPHER_CTX_new();
+    int len, errcnt = 0;
+
+    if (NULL == in || NULL == out || NULL == sw)
+        return -1;
+    for (int i=0; i<PARTIALLEN; i++)
+        in[i] = padded[i] = (uint8_t)(i*11 + 3);
+    memset(guard, 0xa5, AESBLKSIZE);
+    memcpy(out + PARTIALLEN, guard, AESBLKSIZE);
+
+    if (1 != EVP_EncryptInit_ex(sw, EVP_aes_256_cbc(), NULL, key, iv))
+    {
+        aesErr("wspartial init");
+        return -1;
+    }
+    EVP_CIPHER_CTX_set_padding(sw, 0);
+    if (1 != EVP_EncryptUpdate(sw, swout, &len, padded, (int)swlen))
+    {
+        aesErr("wspartial update");
+        return -1;
+    }
+    EVP_CIPHER_CTX_free(sw);
+
+    if (0 != aes256open_dev(&sess, 0) || 0 != aes256setkey_sess(sess, (uint8_t*)key) ||
+        0 != aes256setiv_sess(sess, (uint8_t*)iv) || 0 != aes256stream_sess(sess, ENCRYPT, in, PARTIALLEN, out))
+    {
+        printf("\t****Error, could not stream %d bytes through the device\n", PARTIALLEN);
+        errcnt++;
+    }
+    else if (0 != memcmp(out, swout, PARTIALLEN))
+    {
+        printf("\t****Error, %d byte stream differs from software AES-256-CBC\n", PARTIALLEN);
+        errcnt++;
+    }
+    if (0 != memcmp(out + PARTIALLEN, guard, AESBLKSIZE))
+    {
+        printf("\t****Error, %d byte stream wrote past the end of its output\n", PARTIALLEN);
+        errcnt++;
+    }
+    if (NULL != sess)
+        aes256close(sess);
+
+    free(in);
+    free(out);
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Key each of NHANDSHAKES contexts, like the connections of a busy server, for a
+ * couple of updates: the first half with a few keys that fit the device's key 
+ * slots, the rest with NSLOTKEYS keys that don't, so keys are evicted. Meanwhile
+ * NLONGLIVED contexts keyed at the start carry on with an update per handshake,
+ * their keys evicted and reloaded under them. Everything is compared against 
+ * software AES-256-CBC
+ */
+static int32_t wskeyslots(ENGINE* eng)
+{
+    static uint8_t in[MAXCHUNK], hwout[MAXCHUNK+AESBLKSIZE], swout[MAXCHUNK+AESBLKSIZE];
+    EVP_CIPHER_CTX *longhw[NLONGLIVED], *longsw[NLONGLIVED];
+    uint8_t ctxkey[AESKEYSIZE], ctxiv[AESIVSIZE];
+    wsaes_keystats_t before, after;
+    int hwlen, swlen, errcnt = 0;
+
+    for (int j=0; j<MAXCHUNK; j++)
+        in[j] = (uint8_t)(j*5 + 1);
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_KEY_STATS, 0, &before, NULL))
+        return -1;
+
+    for (int i=0; i<NLONGLIVED; i++)
+    {
+        memcpy(ctxkey, key, AESKEYSIZE);
+        ctxkey[1] ^= 0x80 | i;
+        longhw[i] = EVP_CIPHER_CTX_new();
+        longsw[i] = EVP_CIPHER_CTX_new();
+        if (NULL == longhw[i] || NULL == longsw[i] ||
+            1 != EVP_EncryptInit_ex(longhw[i], EVP_aes_256_cbc(), eng, ctxkey, iv) ||
+            1 != EVP_EncryptInit_ex(longsw[i], EVP_aes_256_cbc(), NULL, ctxkey, iv))
+        {
+            aesErr("wskeyslots init");
+            return -1;
+        }
+    }
+
+    for (int h=0; h<NHANDSHAKES; h++)
+    {
+        EVP_CIPHER_CTX *hw = EVP_CIPHER_CTX_new(), *sw = EVP_CIPHER_CTX_new();
+        EVP_CIPHER_CTX *lhw = longhw[h % NLONGLIVED], *lsw = longsw[h % NLONGLIVED];
+        int len = AESBLKSIZE * (1 + h % (MAXCHUNK/AESBLKSIZE));
+
+        memcpy(ctxkey, key, AESKEYSIZE);
+        memcpy(ctxiv, iv, AESIVSIZE);
+        ctxkey[0] ^= (h < NHANDSHAKES/2) ? h % NHOTKEYS : (h*7) % NSLOTKEYS;
+        ctxiv[0] ^= h;
+        if (NULL == hw || NULL == sw ||
+            1 != EVP_CipherInit_ex(hw, EVP_aes_256_cbc(), eng, ctxkey, ctxiv, h % 2) ||
+            1 != EVP_CipherInit_ex(sw, EVP_aes_256_cbc(), NULL, ctxkey, ctxiv, h % 2))
+        {
+            aesErr("wskeyslots init");
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_padding(hw, 0);
+        EVP_CIPHER_CTX_set_padding(sw, 0);
+        for (int u=0; u<2; u++)
+        {
+            if (1 != EVP_CipherUpdate(hw, hwout, &hwlen, in, len) || 1 != EVP_CipherUpdate(sw, swout, &swlen, in, len))
+            {
+                aesErr("wskeyslots update");
+                return -1;
+            }
+            if (hwlen != swlen || 0 != memcmp(hwout, swout, swlen))
+            {
+                errcnt++;
+                printf("\t****Error, handshake %d update %d differs from software AES-256-CBC\n", h, u);
+            }
+        }
+        EVP_CIPHER_CTX_free(hw);
+        EVP_CIPHER_CTX_free(sw);
+
+        if (1 != EVP_EncryptUpdate(lhw, hwout, &hwlen, in, AESBLKSIZE * 4) ||
+            1 != EVP_EncryptUpdate(lsw, swout, &swlen, in, AESBLKSIZE * 4))
+        {
+            aesErr("wskeyslots long-lived update");
+            return -1;
+        }
+        if (hwlen != swlen || 0 != memcmp(hwout, swout, swlen))
+        {
+            errcnt++;
+            printf("\t****Error, long-lived context %d differs from software AES-256-CBC at handshake %d\n",
+                   h % NLONGLIVED, h);
+        }
+    }
+    for (int i=0; i<NLONGLIVED; i++)
+    {
+        EVP_CIPHER_CTX_free(longhw[i]);
+        EVP_CIPHER_CTX_free(longsw[i]);
+    }
+
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_KEY_STATS, 0, &after, NULL))
+        return -1;
+    printf("TEST: key loads = %llu, key loads avoided = %llu, key slot switches = %llu, evictions = %llu\n",
+           (unsigned long long)(after.keyloads - before.keyloads),
+           (unsigned long long)(after.keyloads_avoided - before.keyloads_avoided),
+           (unsigned long long)(after.keyslot_switches - before.keyslot_switches),
+           (unsigned long long)(after.keyslot_evictions - before.keyslot_evictions));
+    // a key is only evicted by the upload of another
+    if (after.keyslot_evictions - before.keyslot_evictions > after.keyloads - before.keyloads)
+    {
+        errcnt++;
+        printf("\t****Error, more key evictions than key loads\n");
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/*
+ * Hand the engine NPIPES records per call through the pipeline ctrls, the way 
+ * libssl does with SSL_CTX_set_max_pipelines(), for two calls in a row, and compare
+ * against software AES-256-CBC run over the same records one at a time
+ */
+static int32_t wspipeline(ENGINE* eng)
+{
+    static uint8_t in[2][NPIPES][MAXRECORD], hwout[2][NPIPES][MAXRECORD], swout[2][NPIPES][MAXRECORD];
+    unsigned char *inbufs[NPIPES], *outbufs[NPIPES];
+    size_t lens[NPIPES];
+    int len, errcnt = 0;
+
+    for (int enc=1; enc>=0; enc--)
+    {
+        EVP_CIPHER_CTX *hw = EVP_CIPHER_CTX_new(), *sw = EVP_CIPHER_CTX_new();
+        if (NULL == hw || NULL == sw ||
+            1 != EVP_CipherInit_ex(hw, EVP_aes_256_cbc(), eng, key, iv, enc) ||
+            1 != EVP_CipherInit_ex(sw, EVP_aes_256_cbc(), NULL, key, iv, enc))
+        {
+            aesErr("wspipeline init");
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_padding(sw, 0);
+
+        for (int call=0; call<2; call++)
+        {
+            for (int r=0; r<NPIPES; r++)
+            {
+                lens[r] = AESBLKSIZE * (1 + (r*37 + call*11) % (MAXRECORD/AESBLKSIZE));
+                for (size_t j=0; j<lens[r]; j++)
+                    in[call][r][j] = (uint8_t)(r*13 + j + call);
+                inbufs[r] = in[call][r];
+                outbufs[r] = hwout[call][r];
+                if (1 != EVP_CipherUpdate(sw, swout[call][r], &len, in[call][r], (int)lens[r]))
+                {
+                    aesErr("wspipeline software update");
+                    return -1;
+                }
+            }
+            if (EVP_CIPHER_CTX_ctrl(hw, EVP_CTRL_SET_PIPELINE_OUTPUT_BUFS, NPIPES, outbufs) <= 0 ||
+                EVP_CIPHER_CTX_ctrl(hw, EVP_CTRL_SET_PIPELINE_INPUT_BUFS, NPIPES, inbufs) <= 0 ||
+                EVP_CIPHER_CTX_ctrl(hw, EVP_CTRL_SET_PIPELINE_INPUT_LENS, NPIPES, lens) <= 0 ||
+                1 != EVP_Cipher(hw, outbufs[0], inbufs[0], (unsigned int)lens[0]))
+            {
+                aesErr("wspipeline engine cipher");
+                return -1;
+            }
+            for (int r=0; r<NPIPES; r++)
+            {
+                if (0 != memcmp(hwout[call][r], swout[call][r], lens[r]))
+                {
+                    errcnt++;
+                    printf("\t****Error, %s of record %d in call %d differs from software AES-256-CBC\n",
+                           enc ? "encryption" : "decryption", r, call);
+                }
+            }
+        }
+        EVP_CIPHER_CTX_free(hw);
+        EVP_CIPHER_CTX_free(sw);
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+#endif
+
+
+/*
+ * Encrypt and decrypt a run of AES-256-CTR updates of awkward lengths through one
+ * context each, from a counter that carries into its upper 64 bits, and compare
+ * against OpenSSL's software AES-256-CTR. The longest update is split into counter
+ * ranges across the devices, if there are several
+ */
+static int32_t wsctr(ENGINE* eng)
+{
+    static const size_t lens[] = { 1, 15, 17, 100, 4096, 5000, 70000, 300007, CTRLEN };
+    static uint8_t in[CTRLEN], hwout[CTRLEN], swout[CTRLEN];
+    uint8_t ctr[AESIVSIZE];
+    int hwlen, swlen, errcnt = 0;
+
+    memcpy(ctr, iv, 8);
+    memset(ctr + 8, 0xff, 8);
+    ctr[15] = 0xf0;
+    for (size_t j=0; j<CTRLEN; j++)
+        in[j] = (uint8_t)(j * 31 + 7);
+
+    for (int enc=1; enc>=0; enc--)
+    {
+        EVP_CIPHER_CTX *hw = EVP_CIPHER_CTX_new(), *sw = EVP_CIPHER_CTX_new();
+        if (NULL == hw || NULL == sw ||
+            1 != EVP_CipherInit_ex(hw, EVP_aes_256_ctr(), eng, key, ctr, enc) ||
+            1 != EVP_CipherInit_ex(sw, EVP_aes_256_ctr(), NULL, key, ctr, enc))
+        {
+            aesErr("wsctr init");
+            return -1;
+        }
+        for (int u=0; u<sizeof(lens)/sizeof(lens[0]); u++)
+        {
+            if (1 != EVP_CipherUpdate(hw, hwout, &hwlen, in, (int)lens[u]) ||
+                1 != EVP_CipherUpdate(sw, swout, &swlen, in, (int)lens[u]))
+            {
+                aesErr("wsctr update");
+                return -1;
+            }
+            if (hwlen != swlen || 0 != memcmp(hwout, swout, swlen))
+            {
+                errcnt++;
+                printf("\t****Error, %s update %d of %zu bytes differs from software AES-256-CTR\n",
+                       enc ? "encryption" : "decryption", u, lens[u]);
+            }
+        }
+        EVP_CIPHER_CTX_free(hw);
+        EVP_CIPHER_CTX_free(sw);
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Encrypt, then decrypt, NSECTORS data units of each of several lengths through
+ * one AES-256-XTS context, a sector number as each unit's tweak, and compare 
+ * against OpenSSL's software AES-256-XTS. Units of whole blocks go to the device;
+ * the others need ciphertext stealing and run in software
+ */
+static int32_t wsxts(ENGINE* eng)
+{
+    static const size_t lens[] = { 16, 17, 512, 520, 4096, 4111, 65536, XTSLEN };
+    static uint8_t in[XTSLEN], hwout[XTSLEN], swout[XTSLEN];
+    uint8_t xtskey[AESXTSKEYSIZE], tweak[AESIVSIZE] = { 0 };
+    int hwlen, swlen, errcnt = 0;
+
+    memcpy(xtskey, key, AESKEYSIZE);
+    for (int j=0; j<AESKEYSIZE; j++)
+        xtskey[AESKEYSIZE + j] = key[j] ^ 0x5c;
+    for (size_t j=0; j<XTSLEN; j++)
+        in[j] = (uint8_t)(j * 13 + 5);
+
+    for (int enc=1; enc>=0; enc--)
+    {
+        EVP_CIPHER_CTX *hw = EVP_CIPHER_CTX_new(), *sw = EVP_CIPHER_CTX_new();
+        for (int u=0; u<sizeof(lens)/sizeof(lens[0]); u++)
+        {
+            for (uint64_t sector=0xfffe; sector < 0xfffe + NSECTORS; sector++)
+            {
+                // the tweak carries across a byte boundary from one sector to the next
+                tweak[0] = (uint8_t)sector;
+                tweak[1] = (uint8_t)(sector >> 8);
+                tweak[2] = (uint8_t)(sector >> 16);
+                if (NULL == hw || NULL == sw ||
+                    1 != EVP_CipherInit_ex(hw, EVP_aes_256_xts(), eng, xtskey, tweak, enc) ||
+                    1 != EVP_CipherInit_ex(sw, EVP_aes_256_xts(), NULL, xtskey, tweak, enc) ||
+                    1 != EVP_CipherUpdate(hw, hwout, &hwlen, in, (int)lens[u]) ||
+                    1 != EVP_CipherUpdate(sw, swout, &swlen, in, (int)lens[u]))
+                {
+                    aesErr("wsxts");
+                    return -1;
+                }
+                if (hwlen != swlen || 0 != memcmp(hwout, swout, swlen))
+                {
+                    errcnt++;
+                    printf("\t****Error, %s of a %zu byte unit differs from software AES-256-XTS\n",
+                           enc ? "encryption" : "decryption", lens[u]);
+                }
+            }
+        }
+        EVP_CIPHER_CTX_free(hw);
+        EVP_CIPHER_CTX_free(sw);
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Run one TLS record through a stitched AES-256-CBC-HMAC-SHA256 context the way 
+ * libssl does: the record header through EVP_CTRL_AEAD_TLS1_AAD, then the record.
+ * len is the explicit IV and payload when encrypting, the whole record when 
+ * decrypting. Returns the record length, or -1 if it failed (or didn't verify)
+ */
+static int tlsrecord(EVP_CIPHER_CTX *ctx, int enc, int ver, uint64_t seq, const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t aad[EVP_AEAD_TLS1_AAD_LEN];
+    int pad;
+
+    for (int i=0; i<8; i++)
+        aad[i] = (uint8_t)(seq >> (56 - 8*i));
+    aad[8] = 23; // application data
+    aad[9] = (uint8_t)(ver >> 8);
+    aad[10] = (uint8_t)ver;
+    aad[11] = (uint8_t)(len >> 8);
+    aad[12] = (uint8_t)len;
+    if ((pad = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_TLS1_AAD, EVP_AEAD_TLS1_AAD_LEN, aad)) <= 0)
+        return -1;
+    if (enc)
+        len += pad;
+    // OpenSSL 3's own ciphers return the output length rather than 1
+    return (EVP_Cipher(ctx, out, in, (unsigned int)len) > 0) ? (int)len : -1;
+}
+
+
+/*
+ * Encrypt NRECORDS TLS records per context with the engine's stitched cipher and
+ * with OpenSSL's own, for TLS 1.0 (chained IVs) and 1.2 (explicit IVs) and payloads
+ * on both sides of the software threshold, and compare; then decrypt OpenSSL's 
+ * records with the engine, and check that a corrupted one fails
+ */
+static int32_t wsstitched(ENGINE* eng)
+{
+    static const size_t payloads[] = { 0, 1, 15, 16, 31, 100, 1000, 4097, MAXPAYLOAD };
+    static const int versions[] = { TLS1_VERSION, TLS1_2_VERSION };
+    static uint8_t rec[MAXPAYLOAD + AESBLKSIZE], hwct[MAXPAYLOAD + 4*AESBLKSIZE], swct[MAXPAYLOAD + 4*AESBLKSIZE],
+                   pt[MAXPAYLOAD + 4*AESBLKSIZE];
+    uint8_t mackey[32];
+    int errcnt = 0;
+
+    for (int i=0; i<sizeof(mackey); i++)
+        mackey[i] = (uint8_t)(0xA0 + i);
+
+    for (int v=0; v<sizeof(versions)/sizeof(versions[0]); v++)
+    for (int p=0; p<sizeof(payloads)/sizeof(payloads[0]); p++)
+    {
+        EVP_CIPHER_CTX *ctx[4]; // engine encrypt, OpenSSL encrypt, engine decrypt, OpenSSL decrypt
+        size_t ivlen = (versions[v] >= TLS1_1_VERSION) ? AESBLKSIZE : 0, reclen = ivlen + payloads[p];
+        int hwlen, swlen;
+
+        for (int k=0; k<4; k++)
+        {
+            ctx[k] = EVP_CIPHER_CTX_new();
+            if (NULL == ctx[k] || 1 != EVP_CipherInit_ex(ctx[k], EVP_aes_256_cbc_hmac_sha256(), (k % 2) ? NULL : eng,
+                                                         key, iv, k < 2) ||
+                EVP_CIPHER_CTX_ctrl(ctx[k], EVP_CTRL_AEAD_SET_MAC_KEY, sizeof(mackey), mackey) <= 0)
+            {
+                if (1 == k % 2)
+                {
+                    // OpenSSL only has the stitched cipher on CPUs with AES-NI
+                    printf("\tOpenSSL has no AES-256-CBC-HMAC-SHA256 here, skipping\n");
+                    return HWSUCCESS;
+                }
+                aesErr("wsstitched init");
+                return -1;
+            }
+        }
+
+        for (uint64_t seq=0; seq<NRECORDS; seq++)
+        {
+            for (size_t j=0; j<reclen; j++)
+                rec[j] = (uint8_t)(j*7 + seq*3 + p);
+            hwlen = tlsrecord(ctx[0], 1, versions[v], seq, rec, hwct, reclen);
+            swlen = tlsrecord(ctx[1], 1, versions[v], seq, rec, swct, reclen);
+            if (hwlen < 0 || hwlen != swlen || 0 != memcmp(hwct, swct, swlen))
+            {
+                errcnt++;
+                printf("\t****Error, TLS 0x%04x record %d with a %zu byte payload differs from OpenSSL's (%d/%d bytes)\n",
+                       versions[v], (int)seq, payloads[p], hwlen, swlen);
+                continue;
+            }
+
+            // the last record is corrupted, and must fail on both
+            if (NRECORDS - 1 == seq)
+                swct[swlen / 2] ^= 0x01;
+            hwlen = tlsrecord(ctx[2], 0, versions[v], seq, swct, pt, swlen);
+            if ((hwlen < 0) != (NRECORDS - 1 == seq) ||
+                (tlsrecord(ctx[3], 0, versions[v], seq, swct, swct, swlen) < 0) != (hwlen < 0) ||
+                (hwlen >= 0 && 0 != memcmp(pt + ivlen, rec + ivlen, payloads[p])))
+            {
+                errcnt++;
+                printf("\t****Error, decrypting TLS 0x%04x record %d with a %zu byte payload: %s\n",
+                       versions[v], (int)seq, payloads[p], (hwlen < 0) ? "rejected" : "wrong result");
+            }
+        }
+        for (int k=0; k<4; k++)
+            EVP_CIPHER_CTX_free(ctx[k]);
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#include <openssl/async.h>
+
+typedef struct {
+    ENGINE *eng;
+    uint8_t *in;
+    uint8_t *out;
+} asyncarg_t;
+
+static int asyncjob(void *arg)
+{
+    asyncarg_t *a = *(asyncarg_t**)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len, ok;
+
+    ok = NULL != ctx && 1 == EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), a->eng, key, iv) &&
+         1 == EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+         1 == EVP_EncryptUpdate(ctx, a->out, &len, a->in, ASYNCLEN) && ASYNCLEN == len;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+/*
+ * Runs NASYNC encryptions through the engine as ASYNC_JOBs on this one thread,
+ * resuming each job when its wait fd becomes readable, and checks the results
+ * against OpenSSL's software AES-256-CBC. The jobs must pause on the device
+ */
+static int32_t wsasync(ENGINE* eng)
+{
+    static uint8_t in[NASYNC][ASYNCLEN], hwout[NASYNC][ASYNCLEN], swout[NASYNC][ASYNCLEN];
+    ASYNC_JOB *job[NASYNC] = { NULL };
+    ASYNC_WAIT_CTX *waitctx[NASYNC];
+    asyncarg_t args[NASYNC], *argp;
+    int running[NASYNC], nrunning = NASYNC, pauses = 0, errcnt = 0, jobret, len;
+
+    for (int i=0; i<NASYNC; i++)
+    {
+        for (int j=0; j<ASYNCLEN; j++)
+            in[i][j] = (uint8_t)(i*17 + j);
+        args[i] = (asyncarg_t){ eng, in[i], hwout[i] };
+        running[i] = 1;
+        if (NULL == (waitctx[i] = ASYNC_WAIT_CTX_new()))
+            return -1;
+    }
+
+    while (nrunning > 0)
+    {
+        struct pollfd pfd[NASYNC];
+        OSSL_ASYNC_FD fd;
+        size_t nfds;
+
+        for (int i=0; i<NASYNC; i++)
+        {
+            // start the job on the first pass, afterwards resume it only when its fd is readable
+            if (!running[i] || (NULL != job[i] && !(pfd[i].revents & POLLIN)))
+                continue;
+            argp = &args[i];
+            switch (ASYNC_start_job(&job[i], waitctx[i], &jobret, asyncjob, &argp, sizeof(argp)))
+            {
+                case ASYNC_PAUSE:
+                    pauses++;
+                    break;
+                case ASYNC_FINISH:
+                    running[i] = 0;
+                    nrunning--;
+                    if (!jobret)
+                    {
+                        errcnt++;
+                        printf("\t****Error, async job %d failed\n", i);
+                    }
+                    break;
+                default:
+                    printf("\t****Error, could not run async job %d\n", i);
+                    return -1;
+            }
+        }
+
+        for (int i=0; i<NASYNC; i++)
+        {
+            pfd[i] = (struct pollfd){ -1, POLLIN, 0 };
+            nfds = 1;
+            if (running[i] && ASYNC_WAIT_CTX_get_all_fds(waitctx[i], &fd, &nfds) && 1 == nfds)
+                pfd[i].fd = fd;
+        }
+        if (nrunning > 0 && poll(pfd, NASYNC, 5000) <= 0)
+        {
+            printf("\t****Error, async jobs never woke up\n");
+            return -1;
+        }
+    }
+
+    for (int i=0; i<NASYNC; i++)
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        if (NULL == ctx || 1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) ||
+            1 != EVP_CIPHER_CTX_set_padding(ctx, 0) || 1 != EVP_EncryptUpdate(ctx, swout[i], &len, in[i], ASYNCLEN))
+            aesErr("wsasync software encrypt");
+        EVP_CIPHER_CTX_free(ctx);
+        if (0 != memcmp(hwout[i], swout[i], ASYNCLEN))
+        {
+            errcnt++;
+            printf("\t****Error, async job %d output differs from software AES-256-CBC\n", i);
+        }
+        ASYNC_WAIT_CTX_free(waitctx[i]);
+    }
+
+    printf("TEST: %d async jobs paused %d times\n", NASYNC, pauses);
+    if (0 == pauses)
+    {
+        errcnt++;
+        printf("\t****Error, no async job paused for the device\n");
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+#endif
+
+
+typedef struct {
+    ENGINE *eng;
+    int id;
+    uint8_t in[NSCHEDUPDATES*MAXCHUNK];
+    uint8_t out[NSCHEDUPDATES*MAXCHUNK];
+    int ok;
+} schedarg_t;
+
+static void schedctx(int id, uint8_t *ctxkey, uint8_t *ctxiv)
+{
+    memcpy(ctxkey, key, AESKEYSIZE);
+    memcpy(ctxiv, iv, AESIVSIZE);
+    ctxkey[0] ^= id % NKEYS;
+    ctxiv[0] ^= id;
+}
+
+static void *schedthread(void *arg)
+{
+    schedarg_t *a = (schedarg_t*)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint8_t ctxkey[AESKEYSIZE], ctxiv[AESIVSIZE];
+    int len, off = 0;
+
+    // even threads encrypt, odd ones decrypt
+    schedctx(a->id, ctxkey, ctxiv);
+    a->ok = NULL != ctx && 1 == EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), a->eng, ctxkey, ctxiv, a->id % 2 == 0) &&
+            1 == EVP_CIPHER_CTX_set_padding(ctx, 0);
+    for (int r=0; r<NSCHEDUPDATES && a->ok; r++)
+    {
+        int chunk = AESBLKSIZE * (1 + (a->id*5 + r*3) % (MAXCHUNK/AESBLKSIZE));
+        a->ok = 1 == EVP_CipherUpdate(ctx, a->out + off, &len, a->in + off, chunk) && chunk == len;
+        off += chunk;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+}
+
+/*
+ * Runs NSCHEDTHREADS threads through the engine at once with the coalescing 
+ * scheduler on, their contexts over NKEYS keys, and checks every thread's result
+ * against software AES-256-CBC. The scheduler must have run the requests in 
+ * batches of more than one. With overflow, SW_OVERFLOW is on, and the part of
+ * each batch run by the multi-buffer software must match too
+ */
+static int32_t wssched(ENGINE* eng, int overflow)
+{
+    static schedarg_t args[NSCHEDTHREADS];
+    pthread_t thread[NSCHEDTHREADS];
+    uint8_t ctxkey[AESKEYSIZE], ctxiv[AESIVSIZE];
+    static uint8_t swout[NSCHEDUPDATES*MAXCHUNK];
+    wsaes_schedstats_t stats;
+    int len, errcnt = 0;
+
+    if (1 != ENGINE_ctrl_cmd(eng, "SCHED_LATENCY_US", SCHEDLATENCY, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SW_OVERFLOW", overflow, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "RESET_STATS", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SCHEDULER", 1, NULL, NULL, 0))
+    {
+        aesErr("wssched enable");
+        return -1;
+    }
+    for (int t=0; t<NSCHEDTHREADS; t++)
+    {
+        args[t].eng = eng;
+        args[t].id = t;
+        for (int j=0; j<NSCHEDUPDATES*MAXCHUNK; j++)
+            args[t].in[j] = (uint8_t)(t*29 + j);
+        if (0 != pthread_create(&thread[t], NULL, schedthread, &args[t]))
+        {
+            printf("\t****Error, could not start thread %d\n", t);
+            return -1;
+        }
+    }
+    for (int t=0; t<NSCHEDTHREADS; t++)
+        pthread_join(thread[t], NULL);
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_SCHED_STATS, 0, &stats, NULL) ||
+        1 != ENGINE_ctrl_cmd(eng, "SCHEDULER", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SW_OVERFLOW", 0, NULL, NULL, 0))
+    {
+        aesErr("wssched stats");
+        return -1;
+    }
+
+    for (int t=0; t<NSCHEDTHREADS; t++)
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        int n = 0;
+        for (int r=0; r<NSCHEDUPDATES; r++)
+            n += AESBLKSIZE * (1 + (t*5 + r*3) % (MAXCHUNK/AESBLKSIZE));
+        schedctx(t, ctxkey, ctxiv);
+        if (NULL == ctx || 1 != EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, ctxkey, ctxiv, t % 2 == 0) ||
+            1 != EVP_CIPHER_CTX_set_padding(ctx, 0) || 1 != EVP_CipherUpdate(ctx, swout, &len, args[t].in, n))
+            aesErr("wssched software update");
+        EVP_CIPHER_CTX_free(ctx);
+        if (!args[t].ok || 0 != memcmp(args[t].out, swout, n))
+        {
+            errcnt++;
+            printf("\t****Error, thread %d (%s) %s\n", t, (t % 2 == 0) ? "encrypt" : "decrypt",
+                   args[t].ok ? "output differs from software AES-256-CBC" : "failed");
+        }
+    }
+
+    printf("TEST: scheduler requests = %llu, batches = %llu, largest batch = %llu, key groups = %llu, "
+           "deepest queue = %llu, mean added latency = %.1f us\n", (unsigned long long)stats.requests,
+           (unsigned long long)stats.batches, (unsigned long long)stats.maxbatch,
+           (unsigned long long)stats.keygroups, (unsigned long long)stats.maxdepth,
+           stats.requests ? stats.wait_ns / 1e3 / stats.requests : 0.0);
+    if (NSCHEDTHREADS * NSCHEDUPDATES != stats.requests || stats.batches >= stats.requests)
+    {
+        errcnt++;
+        printf("\t****Error, the scheduler did not coalesce the requests\n");
+    }
+    // how much overflows depends on the device's speed against the CPU's, but never without SW_OVERFLOW
+    if (overflow)
+        printf("TEST: run in software = %llu requests, %llu bytes\n", (unsigned long long)stats.overflow_requests,
+               (unsigned long long)stats.overflow_bytes);
+    if (stats.overflow_requests > (overflow ? stats.requests : 0))
+    {
+        errcnt++;
+        printf("\t****Error, %llu requests overflowed to software\n", (unsigned long long)stats.overflow_requests);
+    }
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+/*
+ * Resets the counters, runs an encrypt and a decrypt update on the device and one
+ * of each in software, and checks the performance counters and do_cipher histogram
+ * count them, that the text and JSON snapshots carry them, and that a reset zeroes
+ * them again
+ */
+static int32_t wsstats(ENGINE* eng)
+{
+    static uint8_t in[STATSHWLEN], out[STATSHWLEN];
+    static char buf[STATSBUFLEN];
+    uint8_t ctxkey[AESKEYSIZE], ctxiv[AESIVSIZE] = { 0 };
+    const int lens[] = { STATSHWLEN, STATSSWLEN };
+    wsaes_perfstats_t ps;
+    int len, errcnt = 0;
+
+    for (int j=0; j<AESKEYSIZE; j++)
+        ctxkey[j] = (uint8_t)(j * 5 + 9);
+    if (1 != ENGINE_ctrl_cmd(eng, "STATS", 2, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "RESET_STATS", 0, NULL, NULL, 0))
+    {
+        aesErr("wsstats reset");
+        return -1;
+    }
+    for (int enc=0; enc<2; enc++)
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        if (NULL == ctx || 1 != EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), eng, ctxkey, ctxiv, enc) ||
+            1 != EVP_CipherUpdate(ctx, out, &len, in, lens[0]) || 1 != EVP_CipherUpdate(ctx, out, &len, in, lens[1]))
+            aesErr("wsstats update");
+        EVP_CIPHER_CTX_free(ctx);
+    }
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_PERF_STATS, 0, &ps, NULL))
+    {
+        aesErr("wsstats counters");
+        return -1;
+    }
+    printf("TEST: enc ops = %llu (%llu bytes), dec ops = %llu (%llu bytes), sw ops = %llu (%llu bytes), "
+           "key inits = %llu, mean do_cipher = %.1f us\n", (unsigned long long)ps.enc_ops,
+           (unsigned long long)ps.enc_bytes, (unsigned long long)ps.dec_ops, (unsigned long long)ps.dec_bytes,
+           (unsigned long long)ps.sw_ops, (unsigned long long)ps.sw_bytes, (unsigned long long)ps.key_inits,
+           ps.do_cipher.count ? ps.do_cipher.sum_ns / 1e3 / ps.do_cipher.count : 0.0);
+    if (2 != ps.enc_ops || 2 != ps.dec_ops || STATSHWLEN + STATSSWLEN != ps.enc_bytes ||
+        STATSHWLEN + STATSSWLEN != ps.dec_bytes || 2 != ps.sw_ops || 2 * STATSSWLEN != ps.sw_bytes ||
+        2 != ps.key_inits || 0 != ps.dev_errors || 4 != ps.do_cipher.count || 2 != ps.init_key.count)
+    {
+        errcnt++;
+        printf("\t****Error, the counters don't match the updates\n");
+    }
+
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_STATS_JSON, sizeof(buf), buf, NULL) || '{' != buf[0] ||
+        NULL == strstr(buf, "\"enc_ops\":2,") ||
+        1 != ENGINE_ctrl(eng, WSAES_CMD_GET_STATS_TEXT, sizeof(buf), buf, NULL) || NULL == strstr(buf, "enc_ops 2\n"))
+    {
+        errcnt++;
+        printf("\t****Error, the snapshots don't carry the counters\n");
+    }
+    if (0 != ENGINE_ctrl(eng, WSAES_CMD_GET_STATS_TEXT, 16, buf, NULL) || strlen(buf) >= 16)
+    {
+        errcnt++;
+        printf("\t****Error, a snapshot past the buffer was not cut short\n");
+    }
+
+    if (1 != ENGINE_ctrl_cmd(eng, "RESET_STATS", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl(eng, WSAES_CMD_GET_PERF_STATS, 0, &ps, NULL) || 0 != ps.enc_ops || 0 != ps.dec_bytes ||
+        0 != ps.sw_ops || 0 != ps.key_inits || 0 != ps.do_cipher.count || 0 != ps.init_key.sum_ns)
+    {
+        errcnt++;
+        printf("\t****Error, the counters were not reset\n");
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    // a pipelined call counts its records once each, whatever inl libssl passes along (the first record's)
+    {
+        unsigned char *inbufs[NPIPES], *outbufs[NPIPES];
+        size_t lens[NPIPES], total = 0;
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+        for (int r=0; r<NPIPES; r++)
+        {
+            lens[r] = AESBLKSIZE * 4 * (r + 1);
+            inbufs[r] = in + total;
+            outbufs[r] = out + total;
+            total += lens[r];
+        }
+        if (NULL == ctx || 1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, ctxkey, ctxiv) ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_OUTPUT_BUFS, NPIPES, outbufs) <= 0 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_INPUT_BUFS, NPIPES, inbufs) <= 0 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_SET_PIPELINE_INPUT_LENS, NPIPES, lens) <= 0 ||
+            1 != EVP_Cipher(ctx, outbufs[0], inbufs[0], (unsigned int)lens[0]) ||
+            1 != ENGINE_ctrl(eng, WSAES_CMD_GET_PERF_STATS, 0, &ps, NULL))
+            aesErr("wsstats pipelined call");
+        EVP_CIPHER_CTX_free(ctx);
+        printf("TEST: pipelined call of %d records: enc ops = %llu (%llu bytes of %zu)\n", NPIPES,
+               (unsigned long long)ps.enc_ops, (unsigned long long)ps.enc_bytes, total);
+        if (1 != ps.enc_ops || total != ps.enc_bytes)
+        {
+            errcnt++;
+            printf("\t****Error, the pipelined records were not counted once each\n");
+        }
+    }
+#endif
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/* Occurrences of needle in haystack */
+static int countstr(const char *haystack, const char *needle)
+{
+    int n = 0;
+
+    for (const char *p = haystack; NULL != (p = strstr(p, needle)); p += strlen(needle))
+        n++;
+    return n;
+}
+
+/*
+ * Turns the trace ring on, runs an update on the device, dumps the ring and checks
+ * the dump is a Chrome trace holding the update's stages, each begun and ended
+ */
+static int32_t wstrace(ENGINE* eng)
+{
+    static uint8_t in[TRACELEN], out[TRACELEN];
+    char path[] = "/tmp/wsaes_traceXXXXXX", *buf = NULL;
+    uint8_t ctxkey[AESKEYSIZE] = { 7 }, ctxiv[AESIVSIZE] = { 0 };
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int fd, len, errcnt = 0;
+    FILE *f;
+    long size;
+
+    if (-1 == (fd = mkstemp(path)) || 1 != ENGINE_ctrl_cmd(eng, "TRACE", 1, NULL, NULL, 0) || NULL == ctx ||
+        1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, ctxkey, ctxiv) ||
+        1 != EVP_EncryptUpdate(ctx, out, &len, in, TRACELEN) || 1 != ENGINE_ctrl_cmd(eng, "TRACE", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd_string(eng, "TRACE_DUMP", path, 0))
+    {
+        aesErr("wstrace");
+        return -1;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    close(fd);
+
+    if (NULL == (f = fopen(path, "r")) || 0 != fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0 ||
+        NULL == (buf = calloc(1, size + 1)) || 0 != fseek(f, 0, SEEK_SET) || size != (long)fread(buf, 1, size, f))
+    {
+        printf("\t****Error, could not read back %s\n", path);
+        return -1;
+    }
+    fclose(f);
+    unlink(path);
+
+    printf("TEST: %ld byte trace, %d events, %d cipher, %d request, %d write, %d copyin\n", size,
+           countstr(buf, "\"ph\""), countstr(buf, "\"name\":\"cipher\""), countstr(buf, "\"name\":\"request\""),
+           countstr(buf, "\"name\":\"write\""), countstr(buf, "\"name\":\"copyin\""));
+    if (0 != strncmp(buf, "{\"traceEvents\":[", 16) || NULL == strstr(buf, "\n],\"displayTimeUnit\""))
+    {
+        errcnt++;
+        printf("\t****Error, the dump is not a Chrome trace\n");
+    }
+    // an initkey and a cipher call (more if WSAES_TRACE traced the whole run), on the device by write() or rings
+    if (2 > countstr(buf, "\"name\":\"initkey\"") || 2 > countstr(buf, "\"name\":\"cipher\"") ||
+        0 == countstr(buf, "\"name\":\"request\"") ||
+        0 == countstr(buf, "\"name\":\"write\"") + countstr(buf, "\"name\":\"copyin\"") ||
+        countstr(buf, "\"ph\":\"B\"") != countstr(buf, "\"ph\":\"E\""))
+    {
+        errcnt++;
+        printf("\t****Error, the trace misses stages of the update\n");
+    }
+    free(buf);
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
+/*
+ * Calibrates with AUTOTUNE 2, checks the values are reported and kept in the 
+ * cache, that AUTOTUNE 1 takes them back from it and ignores a cache written for
+ * other devices, and that a long update with the calibrated chunk size matches
+ * software AES-256-CBC
+ */
+static int32_t wstune(ENGINE* eng)
+{
+    static uint8_t in[TUNELEN], out[TUNELEN], swout[TUNELEN];
+    static char buf[STATSBUFLEN];
+    char path[] = "/tmp/wsaes_tuneXXXXXX";
+    uint8_t ctxkey[AESKEYSIZE] = { 3 }, ctxiv[AESIVSIZE] = { 9 };
+    wsaes_tuning_t cal, cached, other;
+    EVP_CIPHER_CTX *ctx;
+    int fd, len, errcnt = 0;
+    FILE *f;
+
+    if (-1 == (fd = mkstemp(path)) || 1 != ENGINE_ctrl_cmd_string(eng, "TUNE_CACHE", path, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "AUTOTUNE", 2, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl(eng, WSAES_CMD_GET_TUNING, 0, &cal, NULL) ||
+        1 != ENGINE_ctrl_cmd(eng, "AUTOTUNE", 1, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl(eng, WSAES_CMD_GET_TUNING, 0, &cached, NULL))
+    {
+        aesErr("wstune");
+        return -1;
+    }
+    close(fd);
+    printf("TEST: calibrated in %.1f ms: SW_THRESHOLD %llu%s, PIPELINE_DEPTH %u, CHUNK_SIZE %u\n",
+           cal.calibrate_ns / 1e6, (unsigned long long)cal.sw_threshold,
+           (UINT64_MAX == cal.sw_threshold) ? " (never)" : "", cal.pipeline_depth, cal.chunk);
+    if (WSAES_TUNE_CALIBRATED != cal.source || 0 == cal.calibrate_ns || 0 == cal.pipeline_depth ||
+        0 != cal.chunk % AESBLKSIZE)
+    {
+        errcnt++;
+        printf("\t****Error, the calibration was not reported\n");
+    }
+    if (WSAES_TUNE_CACHED != cached.source || cal.sw_threshold != cached.sw_threshold ||
+        cal.pipeline_depth != cached.pipeline_depth || cal.chunk != cached.chunk)
+    {
+        errcnt++;
+        printf("\t****Error, the cache did not give back the calibration\n");
+    }
+    if (1 != ENGINE_ctrl(eng, WSAES_CMD_GET_STATS_TEXT, sizeof(buf), buf, NULL) ||
+        NULL == strstr(buf, "pipeline_depth "))
+    {
+        errcnt++;
+        printf("\t****Error, the snapshot misses the tuning parameters\n");
+    }
+
+    // the same values, but for devices that aren't these
+    if (NULL == (f = fopen(path, "w")) ||
+        fprintf(f, "signature none 0 0 0 0 0\nsw_threshold %llu\npipeline_depth %u\nchunk %u\n",
+                (unsigned long long)cal.sw_threshold, cal.pipeline_depth, cal.chunk) <= 0 || 0 != fclose(f) ||
+        1 != ENGINE_ctrl_cmd(eng, "AUTOTUNE", 1, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl(eng, WSAES_CMD_GET_TUNING, 0, &other, NULL) || WSAES_TUNE_CALIBRATED != other.source)
+    {
+        errcnt++;
+        printf("\t****Error, a cache for other devices was used\n");
+    }
+
+    for (int j=0; j<TUNELEN; j++)
+        in[j] = (uint8_t)(j * 31 + 7);
+    ctx = EVP_CIPHER_CTX_new();
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || NULL == ctx ||
+        1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), eng, ctxkey, ctxiv) ||
+        1 != EVP_EncryptUpdate(ctx, out, &len, in, TUNELEN) ||
+        1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, ctxkey, ctxiv) ||
+        1 != EVP_CIPHER_CTX_set_padding(ctx, 0) ||
+        1 != EVP_EncryptUpdate(ctx, swout, &len, in, TUNELEN) || 0 != memcmp(out, swout, TUNELEN))
+    {
+        errcnt++;
+        printf("\t****Error, output with the calibrated chunk size differs from software AES-256-CBC\n");
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    unlink(path);
+    if (1 != ENGINE_ctrl_cmd(eng, "AUTOTUNE", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd_string(eng, "TUNE_CACHE", "", 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "CHUNK_SIZE", 0, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "PIPELINE_DEPTH", WSAES_PIPEDEPTH_DEFAULT, NULL, NULL, 0) ||
+        1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", WSAES_SW_THRESHOLD_DEFAULT, NULL, NULL, 0))
+        aesErr("wstune restore");
+    return (0 == errcnt) ? HWSUCCESS : -1;
+}
+
+
 int main(int argc, char* argv[])
 {
     printf("Entering engine test program...\n");
@@ -286,5 +1435,144 @@ int main(int argc, char* argv[])
         return -1; 
     }  
 
+    // all on the device, then with small updates in software so that contexts switch between both paths
+    const long thresholds[] = { 0, 8*AESBLKSIZE };
+    for (int t=0; t<sizeof(thresholds)/sizeof(thresholds[0]); t++)
+    {
+        printf("\n################### INTERLEAVED CONTEXTS, SW_THRESHOLD %ld ########################\n",
+               thresholds[t]);
+        if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", thresholds[t], NULL, NULL, 0) ||
+            HWSUCCESS != wsinterleave(eng))
+        {
+            printf("****Interleave test status: FAILED\n\n");
+            return -1;
+        }
+        printf("****Interleave test status: SUCCESS\n\n");
+    }
+
+    printf("\n################### LARGE UPDATES ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wslarge(eng))
+    {
+        printf("****Large update test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Large update test status: SUCCESS\n\n");
+
+    printf("\n################### PARTIAL BLOCK ########################\n");
+    if (HWSUCCESS != wspartial())
+    {
+        printf("****Partial block test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Partial block test status: SUCCESS\n\n");
+
+    printf("\n################### KEY SLOTS ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wskeyslots(eng))
+    {
+        printf("****Key slot test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Key slot test status: SUCCESS\n\n");
+
+    // everything on the device, then the default split between device and software
+    const long ctrthresholds[] = { 0, WSAES_SW_THRESHOLD_DEFAULT };
+    for (int t=0; t<sizeof(ctrthresholds)/sizeof(ctrthresholds[0]); t++)
+    {
+        printf("\n################### AES-256-CTR, SW_THRESHOLD %ld ########################\n", ctrthresholds[t]);
+        if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", ctrthresholds[t], NULL, NULL, 0) || HWSUCCESS != wsctr(eng))
+        {
+            printf("****CTR test status: FAILED\n\n");
+            return -1;
+        }
+        printf("****CTR test status: SUCCESS\n\n");
+    }
+
+    // every whole-block unit on the device, then the default split between device and software
+    const long xtsthresholds[] = { 0, WSAES_SW_THRESHOLD_DEFAULT };
+    for (int t=0; t<sizeof(xtsthresholds)/sizeof(xtsthresholds[0]); t++)
+    {
+        printf("\n################### AES-256-XTS, SW_THRESHOLD %ld ########################\n", xtsthresholds[t]);
+        if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", xtsthresholds[t], NULL, NULL, 0) || HWSUCCESS != wsxts(eng))
+        {
+            printf("****XTS test status: FAILED\n\n");
+            return -1;
+        }
+        printf("****XTS test status: SUCCESS\n\n");
+    }
+
+    // records on the device, then the default split between device and software
+    const long stitchthresholds[] = { 0, WSAES_SW_THRESHOLD_DEFAULT };
+    for (int t=0; t<sizeof(stitchthresholds)/sizeof(stitchthresholds[0]); t++)
+    {
+        printf("\n################### STITCHED AES-256-CBC-HMAC-SHA256, SW_THRESHOLD %ld ########################\n",
+               stitchthresholds[t]);
+        if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", stitchthresholds[t], NULL, NULL, 0) ||
+            HWSUCCESS != wsstitched(eng))
+        {
+            printf("****Stitched cipher test status: FAILED\n\n");
+            return -1;
+        }
+        printf("****Stitched cipher test status: SUCCESS\n\n");
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    printf("\n################### PIPELINED RECORDS ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wspipeline(eng))
+    {
+        printf("****Pipeline test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Pipeline test status: SUCCESS\n\n");
+
+    printf("\n################### ASYNC JOBS ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wsasync(eng))
+    {
+        printf("****Async test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Async test status: SUCCESS\n\n");
+#endif
+
+    printf("\n################### COALESCING SCHEDULER ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wssched(eng, 0))
+    {
+        printf("****Scheduler test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Scheduler test status: SUCCESS\n\n");
+
+    printf("\n################### SOFTWARE OVERFLOW ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wssched(eng, 1))
+    {
+        printf("****Overflow test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Overflow test status: SUCCESS\n\n");
+
+    printf("\n################### PERFORMANCE COUNTERS ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", WSAES_SW_THRESHOLD_DEFAULT, NULL, NULL, 0) ||
+        HWSUCCESS != wsstats(eng))
+    {
+        printf("****Stats test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Stats test status: SUCCESS\n\n");
+
+    printf("\n################### TRACE RING ########################\n");
+    if (1 != ENGINE_ctrl_cmd(eng, "SW_THRESHOLD", 0, NULL, NULL, 0) || HWSUCCESS != wstrace(eng))
+    {
+        printf("****Trace test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Trace test status: SUCCESS\n\n");
+
+    printf("\n################### AUTOTUNER ########################\n");
+    if (HWSUCCESS != wstune(eng))
+    {
+        printf("****Autotune test status: FAILED\n\n");
+        return -1;
+    }
+    printf("****Autotune test status: SUCCESS\n\n");
+
     return HWSUCCESS;
 }